@@ -0,0 +1,21 @@
+#ifndef _AFFINITY_H_
+#define _AFFINITY_H_
+
+#include <pjlib.h>
+
+#include "util.h"
+
+/* Upper bound of the CPUs in a list */
+#define AFFINITY_MAX_CPUS 1024
+
+/*
+ * Pin the calling thread to a CPU list like "2" or "0-1,4" and run it
+ * with SCHED_FIFO at priority. An empty list keeps the current CPUs,
+ * priority 0 keeps the current policy.
+ */
+pj_status_t affinity_apply(const char *name, const char *cpus, int priority);
+
+/* Check a CPU list without applying it, an empty list is valid */
+pj_status_t affinity_parse(const char *cpus);
+
+#endif  // !_AFFINITY_H_
@@ -0,0 +1,150 @@
+#ifndef _ANNOUNCEMENT_H_
+#define _ANNOUNCEMENT_H_
+
+#include <pjlib.h>
+#include <pjmedia.h>
+
+#include "config.h"
+#include "prompt_cache.h"
+#include "util.h"
+
+#define ANNOUNCEMENT_NAME_LEN 32
+#define ANNOUNCEMENT_PATH_LEN 256
+#define MAX_ANNOUNCEMENTS 32
+
+#define ANNOUNCEMENT_POOL_SIZE 1024
+#define ANNOUNCEMENT_POOL_INC 1024
+
+/* Number of threads decoding announcements in parallel */
+#define ANNOUNCEMENT_LOADER_THREADS 4
+
+/*
+ * Rate every announcement is decoded to, the one of the prompts, so the
+ * segments of a playlist always play at the rate of its player
+ */
+#define ANNOUNCEMENT_CLOCK_RATE PROMPT_CLOCK_RATE
+
+/* Time a replaced version stays alive after its last call has left the bridge */
+#define ANNOUNCEMENT_RETIRE_MSEC 1000
+
+/* Creates the source port an announcement is decoded from */
+typedef pj_status_t (*announcement_create_cb)(pj_pool_t *pool, const char *path, pjmedia_port **port);
+
+/* Releases samples of a version that are owned by someone else */
+typedef void (*announcement_release_cb)(void *owner);
+
+/* Static description of an announcement */
+struct announcement_spec_t
+{
+    const char *name;
+    const char *path;
+    announcement_create_cb create;
+    unsigned length_msec;
+};
+
+/* Username routed to an announcement */
+struct route_spec_t
+{
+    const char *username;
+    const char *announcement;
+    unsigned ptime; /* 0 for MEDIA_PTIME */
+    const char *menu; /* Digits of RFC 2833 events, NULL without a menu */
+};
+
+/* One immutable, fully decoded version of an announcement */
+struct announcement_version_t
+{
+    pj_pool_t *pool;
+
+    pj_int16_t *samples; /* Decoded PCM of the whole announcement */
+    pj_size_t samples_count;
+    unsigned clock_rate;
+
+    pjmedia_port *port; /* Memory player over samples */
+    unsigned slot;      /* Conf bridge slot of the player */
+
+    void *owner; /* Owner of external samples */
+    announcement_release_cb owner_release;
+
+    pj_atomic_t *ref_cnt;
+    unsigned generation;
+
+    pj_time_val retire_time;
+    struct announcement_version_t *next_retired;
+};
+
+struct announcement_t
+{
+    char name[ANNOUNCEMENT_NAME_LEN];
+    char path[ANNOUNCEMENT_PATH_LEN]; /* Empty for generated signals */
+
+    announcement_create_cb create;
+    unsigned length_msec; /* Rendered length of endless sources */
+
+    struct announcement_version_t *current;
+    struct announcement_version_t *loaded; /* Result of the last load */
+    unsigned generation;
+};
+
+struct announcement_mgr_t
+{
+    pj_pool_factory *factory;
+    pj_pool_t *pool;
+    pjmedia_conf *conf;
+
+    pj_mutex_t *lock;
+
+    struct announcement_t items[MAX_ANNOUNCEMENTS];
+    int items_count;
+
+    pj_atomic_t *next_item; /* Work counter of the loader threads */
+
+    struct announcement_version_t *retired;
+
+    pj_pool_t *reload_pool;
+    pj_thread_t *reload_thread;
+    pj_bool_t reload_running;
+
+    struct prompt_cache_t *prompts; /* Played by name from playlists, NULL without a library */
+};
+
+pj_status_t announcement_mgr_create(pj_pool_factory *factory,
+                                    pj_pool_t *pool,
+                                    pjmedia_conf *conf,
+                                    struct announcement_mgr_t **mgr);
+
+pj_status_t announcement_add(struct announcement_mgr_t *mgr,
+                             const char *name,
+                             const char *path,
+                             announcement_create_cb create,
+                             unsigned length_msec);
+
+struct announcement_t *announcement_find(struct announcement_mgr_t *mgr, const char *name);
+
+pj_status_t announcement_load_all(struct announcement_mgr_t *mgr);
+
+pj_status_t announcement_decode(pj_pool_t *pool,
+                                announcement_create_cb create,
+                                const char *path,
+                                unsigned length_msec,
+                                pj_int16_t **samples,
+                                pj_size_t *samples_count,
+                                unsigned *clock_rate);
+
+pj_status_t announcement_publish_external(struct announcement_mgr_t *mgr,
+                                          struct announcement_t *announcement,
+                                          pj_int16_t *samples,
+                                          pj_size_t samples_count,
+                                          unsigned clock_rate,
+                                          void *owner,
+                                          announcement_release_cb release);
+
+pj_status_t announcement_reload_async(struct announcement_mgr_t *mgr);
+
+struct announcement_version_t *announcement_acquire(struct announcement_mgr_t *mgr, struct announcement_t *announcement);
+
+void announcement_release(struct announcement_mgr_t *mgr, struct announcement_version_t *version);
+
+void announcement_mgr_free(struct announcement_mgr_t *mgr);
+
+#endif  // !_ANNOUNCEMENT_H_
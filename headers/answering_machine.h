@@ -20,30 +20,52 @@
 #include <pjmedia/null_port.h>
 #include <pjmedia/sound_port.h>
 
+#include "affinity.h"
+#include "announcement.h"
+#include "arena.h"
+#include "broadcast.h"
 #include "call.h"
+#include "cdr.h"
 #include "config.h"
+#include "g711_codec.h"
+#include "handoff.h"
+#include "ivr.h"
+#include "media_clock.h"
 #include "media_socket.h"
+#include "mem_stats.h"
+#include "metrics.h"
+#include "playlist.h"
+#include "prompt_cache.h"
+#include "recorder.h"
+#include "reject.h"
+#include "route_table.h"
+#include "settings.h"
+#include "shared_store.h"
+#include "sip_peer.h"
+#include "replay.h"
+#include "soak.h"
+#include "trace.h"
 #include "util.h"
 
 #define AF pj_AF_INET()
-#define SIP_PORT 6222 
-#define RTP_PORT 4000 
 
-#define MACHINE_POOL_SIZE 4000
-#define MACHINE_POOL_INC 4000
-
-#define MEDIA_POOL_SIZE 512
-#define MEDIA_POOL_INC 512
+/* Also listen for SIP over TCP on the SIP port */
+#define SIP_TCP 1
 
 #define THIS_FILE "answering_machine.c"
-#define MAX_MEDIA_CNT 29
-
-#define MAX_CALLS 35
 
 #define LOGGING_LEVEL 5
 #define ENDPT_TIMEOUT_SEC 0
 #define ENDPT_TIMEOUT_MSEC 10 
 
+#define METRICS_INTERVAL_SEC 60
+
+/* Interval of sampling RTP statistics of all active streams */
+#define MEDIA_SWEEP_INTERVAL_SEC 5
+
+/* A draining instance waits this long past its longest call for the last ones to end */
+#define DRAIN_MARGIN_SEC 32
+
 struct answering_machine_t
 {
     pjsip_endpoint *g_endpt; /* SIP endpoint */
@@ -56,27 +78,103 @@ struct answering_machine_t
 
     struct call_t **calls;
     struct media_socket_t **med_sockets;
-    pj_hash_table_t *table;
+    int med_sockets_count;
 
-    pjmedia_sock_info g_sock_info[MAX_MEDIA_CNT];
+    /* Routes read by the SIP threads, a reload builds the next generation and swaps it in under the write lock */
+    struct route_table_t *routes;
+    struct route_table_t *routes_next;
+    pj_rwmutex_t *routes_lock;
+    unsigned routes_generation;
 
     pjmedia_conf *conf;
+
+    struct announcement_mgr_t *announcements;
+
+    struct cdr_writer_t *cdr;
+    struct recorder_t *recorder; /* Voicemails of the routes ending with a record segment */
     
     pjmedia_master_port *master_port; 
     pjmedia_port *null_port;
+    struct media_clock_probe_t *clock_probe;
+    struct broadcaster_t *broadcaster; /* NULL unless the broadcast setting is on */
+
+    /* Embedded profile only, the bridge above is not created there */
+    struct media_clock_direct_t *direct_clock;
+    struct arena_t *call_arena;
 
     pjsip_module mod_simpleua;
 
     pjsip_module msg_logger;
 
+    pjsip_module mod_shard_counter;
+
+    /* Drops requests of flooding sources before they are logged or looked at */
+    pjsip_module mod_flood_guard;
+    struct reject_t *reject;
+
+    /* Hands the SIP sockets to the instance replacing this one, NULL in workers */
+    pjsip_module mod_handoff;
+    struct handoff_t *handoff;
+    pj_bool_t takeover; /* The UDP sockets are taken over when the machine starts receiving */
+
+    /* Set by SIGUSR1 or a handoff, the calls are finished and no new ones taken */
+    pj_bool_t draining;
+    pj_time_val drain_deadline;
+
+    /* SIP listeners and the threads polling the endpoint for them */
+    pjsip_transport *sip_transports[MAX_SIP_SHARDS];
+    pj_thread_t *sip_threads[MAX_SIP_SHARDS];
+    int sip_shards_count;
+
+    int sip_port;
+    int rtp_port; /* First RTP port of the machine, workers take consecutive ranges */
+
+    pjsip_tpfactory *sip_tcp_factory;
+    struct sip_peer_pool_t *sip_peers;
+
+    /* Index of the forked worker, -1 when running standalone */
+    int worker;
+    const char *store_path; /* Shared store the worker plays from */
+
+    pj_mutex_t *calls_lock;
+    pj_timer_entry metrics_timer;
+    pj_timer_entry media_sweep_timer;
+    pj_bool_t quit;
+    int exit_code;
+
+    /* In-process soak client, NULL unless started from the command line */
+    struct soak_t *soak;
+    struct replay_t *replay;
+
     int calls_count;
     int calls_capacity;
 };
 
-pj_status_t answering_machine_create(pj_pool_t **pool);
+/* With takeover the SIP sockets of the instance running on the same port are taken over */
+pj_status_t answering_machine_create(pj_pool_t **pool, int worker, int sip_port, int rtp_port, pj_bool_t takeover);
+
+pj_status_t answering_machine_announcement_add(const char *name,
+                                              const char *path,
+                                              announcement_create_cb create,
+                                              unsigned length_msec);
+
+pj_status_t answering_machine_announcements_load(void);
+
+pj_status_t answering_machine_shared_store_load(const char *path);
+
+/* Start the next generation of routes, the signals added from here on go into it */
+pj_status_t answering_machine_routes_begin(void);
+
+pj_status_t answering_machine_signal_add(const char *signal, const char *username, unsigned ptime, const char *menu);
+
+/* Swap the next generation in, the previous one goes with its last call */
+void answering_machine_routes_commit(void);
+
+pj_status_t answering_machine_soak_start(unsigned long calls, int concurrency, unsigned flood_rate);
 
-void answering_machine_signal_add(pjmedia_port *signal, const char *username);
+/* Replay a SIP capture N times faster, the machine quits once it has been checked */
+pj_status_t answering_machine_replay_start(const char *path, unsigned scale);
 
-void answering_machine_calls_recv();
+int answering_machine_calls_recv(void);
 
 #endif  // !_ANSWERING_MACHINE_H_
@@ -0,0 +1,30 @@
+#ifndef _ARENA_H_
+#define _ARENA_H_
+
+#include <pjlib.h>
+
+#include "util.h"
+
+/*
+ * Fixed number of equal slots in one buffer taken from the owner pool,
+ * each one holding a pool created on it. Pools never grow past their
+ * slot and the arena never asks for memory after it is set up.
+ */
+struct arena_t
+{
+    char *buf;
+    pj_size_t slot_size;
+    int slots_count;
+
+    pj_mutex_t *lock;
+    int *free_slots;
+    int free_count;
+};
+
+pj_status_t arena_create(pj_pool_t *pool, pj_size_t slot_size, int slots_count, struct arena_t **arena);
+
+pj_pool_t *arena_pool_create(struct arena_t *arena, const char *name);
+
+void arena_pool_release(struct arena_t *arena, pj_pool_t *pool);
+
+#endif  // !_ARENA_H_
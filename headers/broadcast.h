@@ -0,0 +1,104 @@
+#ifndef _BROADCAST_H_
+#define _BROADCAST_H_
+
+#include <pjlib.h>
+#include <pjmedia.h>
+
+#include "announcement.h"
+#include "config.h"
+#include "g711_kernels.h"
+#include "metrics.h"
+#include "util.h"
+
+/* Versions, codecs and ptimes played at the same time, far above the routes of one machine */
+#define BROADCAST_MAX_GROUPS 64
+
+/* Only G.711 is shared, its payload is one byte per sample at 8 kHz */
+#define BROADCAST_CLOCK_RATE 8000
+#define BROADCAST_RTP_HEADER_LEN 12
+#define BROADCAST_MAX_PAYLOAD (BROADCAST_CLOCK_RATE * MEDIA_MAX_PTIME / 1000)
+
+/* Interval of the sender reports of a call, the one pjmedia streams use */
+#define BROADCAST_RTCP_INTERVAL_MSEC 5000
+
+struct broadcast_group_t;
+
+/*
+ * Subscription of one call, owned by the call and linked into its group.
+ * The stream of the call only receives, the bridge never pulls its port,
+ * so the group takes one frame out of it per packet to keep its jitter
+ * buffer draining. The stream sends no RTCP either, the sender reports
+ * of the SSRC on the wire are built here.
+ */
+struct broadcast_sub_t
+{
+    struct broadcast_group_t *group; /* NULL while not subscribed */
+    pjmedia_transport *transport;
+    pjmedia_port *stream_port;
+    pjmedia_rtp_session rtp; /* SSRC, sequence number and timestamp of the call */
+    pjmedia_rtcp_session rtcp; /* Sender statistics of the same SSRC */
+    unsigned rtcp_countdown; /* Packets until the next sender report */
+    int marker;
+
+    unsigned long packets;
+    unsigned long bytes;
+
+    struct broadcast_sub_t *prev;
+    struct broadcast_sub_t *next;
+};
+
+/*
+ * Looping announcement every call of the group hears at the same
+ * position. Once per packet the samples are encoded after the header
+ * room of packet, then only the header is written for every call
+ * before the packet is sent on its transport.
+ */
+struct broadcast_group_t
+{
+    const struct announcement_version_t *version; /* NULL while the slot is free */
+    int pt;
+    unsigned ptime;
+
+    pj_size_t position;
+    unsigned elapsed_msec;
+
+    pj_uint8_t packet[BROADCAST_RTP_HEADER_LEN + BROADCAST_MAX_PAYLOAD];
+
+    struct broadcast_sub_t *subs;
+    unsigned subs_count;
+};
+
+/* Groups of the bridge, driven by its clock instead of a bridge slot per call */
+struct broadcaster_t
+{
+    pj_mutex_t *lock;
+    const struct g711_kernels_t *kernels;
+
+    struct broadcast_group_t groups[BROADCAST_MAX_GROUPS];
+
+    pj_int16_t drained[BROADCAST_MAX_PAYLOAD]; /* Frames taken out of the streams, thrown away */
+};
+
+pj_status_t broadcaster_create(pj_pool_t *pool, struct broadcaster_t **broadcaster);
+
+/* Whether a stream of this codec and ptime can take the payload of a group of the version */
+pj_bool_t broadcast_accepts(const struct announcement_version_t *version, int pt, unsigned clock_rate, unsigned ptime);
+
+/* Joins or creates the group in constant time, the call holds the version until it unsubscribes */
+pj_status_t broadcast_subscribe(struct broadcaster_t *broadcaster,
+                                struct broadcast_sub_t *sub,
+                                const struct announcement_version_t *version,
+                                int pt,
+                                unsigned ptime,
+                                pjmedia_transport *transport,
+                                pjmedia_port *stream_port);
+
+/* The transport and the stream port are not used anymore once it returns */
+void broadcast_unsubscribe(struct broadcaster_t *broadcaster, struct broadcast_sub_t *sub);
+
+/* Called from the media clock every MEDIA_PTIME_STEP */
+void broadcaster_tick(void *user_data);
+
+void broadcaster_free(struct broadcaster_t *broadcaster);
+
+#endif  // !_BROADCAST_H_
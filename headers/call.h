@@ -10,8 +10,16 @@
 #include <pjsip_simple.h>
 #include <pjsip_ua.h>
 
+#include "announcement.h"
+#include "arena.h"
+#include "broadcast.h"
+#include "cdr.h"
 #include "config.h"
+#include "ivr.h"
 #include "media_socket.h"
+#include "recorder.h"
+#include "route_table.h"
+#include "settings.h"
 #include "util.h"
 
 struct call_t
@@ -21,16 +29,42 @@ struct call_t
     pjmedia_stream *med_stream; /* Call's audio stream.     */
     pjmedia_snd_port *snd_port; /* Sound device.            */
     pj_pool_t *pool;
+    struct arena_t *arena; /* Owner of the pool in the embedded profile */
     struct media_socket_t *socket;
 
+    pj_grp_lock_t *grp_lock; /* Keeps the call alive while its timers are running */
+    pj_bool_t terminated;
+
     pj_timer_entry *ringing_timer;
     pj_timer_entry *media_session_timer;
+    pj_timer_entry *hangup_timer; /* Scheduled by a menu digit from the media thread */
+
+    struct route_table_t *routes; /* Generation of the route, its playlists and menu stay until the call is gone */
+    struct announcement_version_t *announcement;
+    struct playlist_port_t *playlist; /* Own player of a playlist or menu route */
+    struct recording_t *recording;    /* Voicemail, cleared under the calls lock like stream_port */
+    const struct ivr_menu_t *menu;
+    int hangup_requested;
+
+    int shard; /* SIP listener the INVITE has arrived on */
+    unsigned ptime; /* Negotiated packetization time in msec */
 
     unsigned int player_port;
     unsigned int conf_port;
 
+    /* Direct playback of the embedded profile, stream_port is cleared with med_stream */
+    pjmedia_port *stream_port;
+    pj_int16_t *direct_frame;
+    unsigned direct_period; /* Clock ticks per frame of the stream */
+    unsigned direct_ticks;
+
+    /* Looping announcement sent by its broadcast group instead of the bridge */
+    struct broadcast_sub_t broadcast;
+
     pj_time_val ringing_time;
     pj_time_val media_session_time;
+
+    struct cdr_record_t cdr; /* Filled in as the call progresses */
 };
 
 pj_status_t call_create(pj_pool_t *pool, pj_str_t call_id, struct call_t **call);
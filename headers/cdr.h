@@ -0,0 +1,88 @@
+#ifndef _CDR_H_
+#define _CDR_H_
+
+#include <pjlib.h>
+#include <stdio.h>
+
+#include "metrics.h"
+#include "util.h"
+
+#define CDR_MAGIC 0x31524443 /* "CDR1" */
+
+#define CDR_CALL_ID_LEN 64
+#define CDR_USERNAME_LEN 32
+#define CDR_CODEC_LEN 16
+
+#define CDR_PATH "/tmp/answering_machine.cdr"
+
+/* Records buffered between the signaling threads and the writer, a power of two */
+#define CDR_RING_SIZE 16384
+
+/* Interval of the writer thread flushing the ring into the file */
+#define CDR_FLUSH_MSEC 100
+
+/* The file is rotated once it has grown past this size */
+#define CDR_ROTATE_BYTES (64 * 1024 * 1024)
+
+/*
+ * Fixed size on-disk record. Timestamps are milliseconds of the Unix epoch,
+ * 0 if the call has never reached that state.
+ */
+struct cdr_record_t
+{
+    pj_uint32_t magic;
+    pj_uint32_t size; /* sizeof(struct cdr_record_t) */
+
+    char call_id[CDR_CALL_ID_LEN];
+    char username[CDR_USERNAME_LEN];
+    char codec[CDR_CODEC_LEN];
+
+    pj_uint64_t invite_msec;
+    pj_uint64_t ringing_msec;
+    pj_uint64_t answer_msec;
+    pj_uint64_t bye_msec;
+
+    pj_int32_t cause;
+    pj_uint32_t rtp_port;
+
+    /* RTP statistics of the stream at teardown */
+    pj_uint32_t rx_packets;
+    pj_uint32_t tx_packets;
+    pj_uint32_t rx_lost;
+    pj_uint32_t rx_jitter_usec;
+    pj_uint32_t rtt_usec;
+    pj_uint32_t rx_discarded;
+    pj_uint32_t late_frames; /* Discarded by the jitter buffer */
+    pj_uint64_t rx_bytes;
+    pj_uint64_t tx_bytes;
+};
+
+struct cdr_writer_t
+{
+    pj_pool_t *pool;
+    pj_mutex_t *lock;
+
+    /* Producers append at head, the writer thread consumes from tail */
+    struct cdr_record_t *ring;
+    pj_uint32_t head;
+    pj_uint32_t tail;
+
+    char path[256];
+    FILE *file;
+    pj_size_t file_size;
+
+    pj_thread_t *thread;
+    pj_bool_t quit;
+};
+
+pj_status_t cdr_writer_create(pj_pool_t *pool, const char *path, struct cdr_writer_t **writer);
+
+void cdr_record_init(struct cdr_record_t *record);
+
+pj_uint64_t cdr_now_msec(void);
+
+pj_status_t cdr_write(struct cdr_writer_t *writer, const struct cdr_record_t *record);
+
+void cdr_writer_free(struct cdr_writer_t *writer);
+
+#endif  // !_CDR_H_
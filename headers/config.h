@@ -1,18 +1,108 @@
 #ifndef _CONFIG_H_
 #define _CONFIG_H_
 
+/*
+ * Profile of small boxes, built with make PROFILE=embedded: everything
+ * runs at 8 kHz, calls are played straight into their streams without
+ * the conference bridge, pools are carved from fixed arenas and SIP
+ * messages are not logged.
+ */
+#ifndef EMBEDDED_PROFILE
+#define EMBEDDED_PROFILE 0
+#endif
+
+/*
+ * Defaults of the runtime settings, a config file given with -f and
+ * the command line override them, see settings.h
+ */
+#define SIP_PORT 6222
+#define RTP_PORT 4000
+
+/* Number of UDP listeners bound to the SIP port with SO_REUSEPORT */
+#define SIP_SHARDS 1
+
+#define MAX_CALLS 35
+#define MAX_MEDIA_CNT 29
+
+/* Buckets of the table of routes */
+#define ROUTE_BUCKETS 1000
+
 #define RINGING_TIME 3
 #define MEDIA_SESSION_TIME 10
 
+#if EMBEDDED_PROFILE
+#define MACHINE_POOL_SIZE (192 * 1024)
+#else
+#define MACHINE_POOL_SIZE 4000
+#endif
+#define MEDIA_POOL_SIZE 512
+
+/* Bytes of decoded prompts kept in memory, about 17 minutes of 8 kHz audio by default */
+#if EMBEDDED_PROFILE
+#define PROMPT_CACHE_SIZE (512 * 1024)
+#else
+#define PROMPT_CACHE_SIZE (16 * 1024 * 1024)
+#endif
+
+/* Limits of one voicemail, whichever is reached first ends the recording */
+#define RECORD_MAX_SEC 120
+#define RECORD_MAX_BYTES (4 * 1024 * 1024)
+
+/* SDES-SRTP of the calls: 0 off, 1 when the offer has crypto, 2 for every call */
+#define SRTP_MODE 0
+
+/* Calls of a looping announcement share one encoded payload per packet, bridge only */
+#define BROADCAST 1
+
 #define PORT_COUNT 255
 #define MAX_URI 16
 #define PORTS 16
 #define CALLS 255
 
+/* Bridge slots of a call: its player, its stream and the sink of its recording */
+#define BRIDGE_PORTS_PER_CALL 3
+
+/* Upper bound of SO_REUSEPORT SIP listeners */
+#define MAX_SIP_SHARDS 16
+
+/*
+ * Packetization time of the streams in msec. Every allowed value is a
+ * multiple of the bridge tick, so frames of a stream are whole ticks.
+ */
+#define MEDIA_PTIME 40
+#define MEDIA_PTIME_STEP 20
+#define MEDIA_MAX_PTIME 60
+
+/*
+ * Default CPUs of the media clock thread and of the SIP threads as a list
+ * like "2" or "0-1,4", empty leaves them to the scheduler. A priority above
+ * 0 runs them with SCHED_FIFO, which needs CAP_SYS_NICE or RLIMIT_RTPRIO.
+ */
+#define MEDIA_CLOCK_CPUS ""
+#define MEDIA_CLOCK_PRIORITY 0
+#define SIP_THREAD_CPUS ""
+#define SIP_THREAD_PRIORITY 0
+
 /* Constants */
-#define NSAMPLES (CLOCK_RATE * 20 / 1000)
 #define NCHANNELS 1
 #define NBITS 16
+#if EMBEDDED_PROFILE
+#define CLOCK_RATE 8000
+#else
 #define CLOCK_RATE 44100
+#endif
+
+/*
+ * The embedded machine pool never grows, it is allocated once with a
+ * slot of this size per call, a call that does not fit is rejected
+ */
+#define EMBEDDED_CALL_ARENA_SIZE (6 * 1024)
+
+/* Free pools kept by the caching pool of the embedded profile */
+#define EMBEDDED_CP_CAPACITY (64 * 1024)
+
+/* A soak of the embedded profile fails above these */
+#define EMBEDDED_RSS_TARGET_KB 12288
+#define EMBEDDED_CPU_TARGET_USEC_PER_CALL 3000
 
 #endif  // !_CONFIG_H_
@@ -0,0 +1,96 @@
+#ifndef _DISPATCHER_H_
+#define _DISPATCHER_H_
+
+#include <pjlib-util.h>
+#include <pjlib.h>
+#include <pjsip.h>
+
+#include "affinity.h"
+#include "config.h"
+#include "mem_stats.h"
+#include "metrics.h"
+#include "soak.h"
+#include "util.h"
+
+#define DISPATCHER_MAX_BACKENDS 16
+
+/* Points of every backend on the hash ring, more points spread Call-IDs more evenly */
+#define DISPATCHER_RING_POINTS 64
+
+/* Backends are probed with OPTIONS, any response keeps them in the ring */
+#define DISPATCHER_CHECK_INTERVAL_SEC 2
+#define DISPATCHER_CHECK_TIMEOUT_MSEC 1500
+#define DISPATCHER_MAX_FAILURES 2
+
+/* Threads polling the endpoint, the dispatcher keeps no state to share between them */
+#define DISPATCHER_THREADS 4
+
+#define DISPATCHER_POOL_SIZE 4000
+#define DISPATCHER_POOL_INC 4000
+
+/* User of the Record-Route of the dispatcher, the Route made of it is removed again */
+#define DISPATCHER_USER "dispatcher"
+
+#define DISPATCHER_HOST_LEN 64
+
+struct dispatcher_backend_t
+{
+    char host[DISPATCHER_HOST_LEN];
+    int port;
+    char uri[DISPATCHER_HOST_LEN + 16]; /* Target of the OPTIONS probes */
+
+    int alive;     /* Read by every SIP thread */
+    int failures;  /* Probes in a row without a response */
+    int checking;  /* A probe is in flight */
+
+    metrics_counter_t requests;
+};
+
+struct dispatcher_point_t
+{
+    pj_uint32_t hash;
+    int backend;
+};
+
+/*
+ * Stateless front-end of several answering machines. Every request is
+ * forwarded to the backend owning the hash of its Call-ID on the ring,
+ * so all requests of a dialog reach the same backend. A backend that
+ * stops answering OPTIONS leaves the ring, its calls move to the next
+ * point and it takes its share back once it answers again.
+ */
+struct dispatcher_t
+{
+    pj_caching_pool *cp;
+    pj_pool_t *pool;
+
+    pjsip_endpoint *endpt;
+    pjsip_module module;
+    pjsip_transport *transport;
+    int sip_port;
+
+    struct dispatcher_backend_t backends[DISPATCHER_MAX_BACKENDS];
+    int backends_count;
+
+    /* Sorted by hash, built once at start */
+    struct dispatcher_point_t ring[DISPATCHER_MAX_BACKENDS * DISPATCHER_RING_POINTS];
+    int ring_count;
+
+    pj_timer_entry check_timer;
+    pj_thread_t *threads[DISPATCHER_THREADS];
+
+    /* In-process soak client, NULL unless started from the command line */
+    struct soak_t *soak;
+
+    pj_bool_t quit;
+    int exit_code;
+};
+
+/* Backends are given as "host:port,host:port,..." */
+pj_status_t dispatcher_create(int sip_port, const char *backends);
+
+pj_status_t dispatcher_soak_start(unsigned long calls, int concurrency, unsigned flood_rate);
+
+int dispatcher_run(void);
+
+#endif  // !_DISPATCHER_H_
@@ -0,0 +1,51 @@
+#ifndef _G711_CODEC_H_
+#define _G711_CODEC_H_
+
+#include <pjlib.h>
+#include <pjmedia.h>
+#include <pjmedia-codec.h>
+
+#include "g711_kernels.h"
+#include "util.h"
+
+#define G711_CLOCK_RATE 8000
+#define G711_BPS 64000
+
+/* Duration of a frame, packets carry G711_FRM_PER_PKT frames */
+#define G711_PTIME 10
+#define G711_FRM_PER_PKT 2
+
+#define G711_SAMPLES_PER_FRAME (G711_CLOCK_RATE * G711_PTIME / 1000)
+
+#define G711_POOL_SIZE 4000
+#define G711_POOL_INC 4000
+
+/* PCMU and PCMA converted by the kernels selected for this CPU */
+struct g711_codec_t
+{
+    pjmedia_codec base;
+
+    pj_bool_t ulaw;
+    pj_bool_t plc_enabled;
+    pjmedia_plc *plc;
+};
+
+struct g711_factory_t
+{
+    pjmedia_codec_factory base;
+    pjmedia_endpt *endpt;
+
+    pj_pool_t *pool;
+    pj_mutex_t *mutex;
+
+    /* Closed codecs kept for reuse */
+    pjmedia_codec codec_list;
+
+    const struct g711_kernels_t *kernels;
+};
+
+pj_status_t g711_codec_init(pjmedia_endpt *endpt);
+
+pj_status_t g711_codec_deinit(void);
+
+#endif  // !_G711_CODEC_H_
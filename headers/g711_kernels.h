@@ -0,0 +1,36 @@
+#ifndef _G711_KERNELS_H_
+#define _G711_KERNELS_H_
+
+#include <pjlib.h>
+#include <pjmedia.h>
+
+#include "util.h"
+
+/* Samples converted by every kernel when measuring throughput, a minute of audio */
+#define G711_BENCH_SAMPLES (8000 * 60)
+
+/* Converts count samples, count needs not be a multiple of the vector width */
+typedef void (*g711_encode_fn)(const pj_int16_t *in, pj_uint8_t *out, unsigned count);
+
+typedef void (*g711_decode_fn)(const pj_uint8_t *in, pj_int16_t *out, unsigned count);
+
+/* Implementation of the four conversions for one instruction set */
+struct g711_kernels_t
+{
+    const char *name;
+
+    g711_encode_fn ulaw_encode;
+    g711_decode_fn ulaw_decode;
+    g711_encode_fn alaw_encode;
+    g711_decode_fn alaw_decode;
+};
+
+const struct g711_kernels_t *g711_kernels_scalar(void);
+
+const struct g711_kernels_t *g711_kernels_select(void);
+
+pj_status_t g711_kernels_check(const struct g711_kernels_t *kernels);
+
+void g711_kernels_benchmark(const struct g711_kernels_t *kernels);
+
+#endif  // !_G711_KERNELS_H_
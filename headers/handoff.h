@@ -0,0 +1,76 @@
+#ifndef _HANDOFF_H_
+#define _HANDOFF_H_
+
+#include <pjlib.h>
+#include <pjsip.h>
+
+#include "config.h"
+#include "metrics.h"
+#include "util.h"
+
+/* UNIX socket the running instance hands its SIP sockets over on */
+#define HANDOFF_PATH "/tmp/answering_machine.handoff"
+
+/* A new instance that does not get the sockets within this time binds its own */
+#define HANDOFF_TIMEOUT_MSEC 1000
+
+/* Relayed messages injected per turn of the SIP loop */
+#define HANDOFF_POLL_BATCH 64
+
+/* Message relayed to the other instance with the address it came from */
+struct handoff_packet_t
+{
+    pj_sockaddr src_addr;
+    int src_addr_len;
+    int len;
+    char data[PJSIP_MAX_PKT_LEN];
+};
+
+/*
+ * Zero-downtime restart. The running instance listens on a UNIX socket,
+ * a new instance connects to it and receives the UDP SIP sockets with
+ * SCM_RIGHTS, so the SIP port is never closed. Both instances read the
+ * same sockets until the old one has finished its calls, a message one
+ * of them reads for a dialog or transaction of the other is relayed over
+ * the connection and injected there as if it had been received.
+ */
+struct handoff_t
+{
+    pjsip_endpoint *endpt;
+    char path[sizeof(HANDOFF_PATH) + 8];
+
+    int listener; /* -1 once a new instance has taken the sockets */
+    int peer;     /* The other instance, kept open until the handoff is freed */
+    int connected; /* Read by every SIP thread, cleared once the other instance has gone */
+
+    /* Relayed messages are parsed here, only by the thread polling the handoff */
+    pjsip_rx_data *rdata;
+    pj_pool_t *rdata_pool;
+    struct handoff_packet_t packet;
+};
+
+pj_status_t handoff_create(pj_pool_t *pool, pjsip_endpoint *endpt, const char *path, struct handoff_t **handoff);
+
+/* Receive the SIP sockets of the running instance, fails if there is none */
+pj_status_t handoff_take(struct handoff_t *handoff, pj_sock_t *socks, int max_socks, int *socks_count);
+
+/* Wait for the next instance, a path left behind by the previous one is taken over */
+pj_status_t handoff_listen(struct handoff_t *handoff);
+
+/* Hand the sockets to a new instance that has connected, PJ_TRUE once it has them */
+pj_bool_t handoff_give(struct handoff_t *handoff, const pj_sock_t *socks, int socks_count);
+
+pj_bool_t handoff_is_connected(const struct handoff_t *handoff);
+
+/* The message has been relayed by the other instance, it is never relayed back */
+pj_bool_t handoff_is_relayed(const struct handoff_t *handoff, const pjsip_rx_data *rdata);
+
+pj_bool_t handoff_relay(struct handoff_t *handoff, const pjsip_rx_data *rdata);
+
+/* Inject the messages relayed by the other instance as received on this transport */
+void handoff_poll(struct handoff_t *handoff, pjsip_transport *transport);
+
+/* The path is left alone if a new instance has taken it over */
+void handoff_free(struct handoff_t *handoff);
+
+#endif  // !_HANDOFF_H_
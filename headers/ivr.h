@@ -0,0 +1,44 @@
+#ifndef _IVR_H_
+#define _IVR_H_
+
+#include <pjlib.h>
+
+#include "announcement.h"
+#include "playlist.h"
+
+#define IVR_SPEC_LEN 256
+
+/* Targets of one menu, the first one is the target of the route itself */
+#define IVR_MAX_TARGETS 8
+
+/* 0-9, *, # and A-D of RFC 4733 telephone events */
+#define IVR_DIGITS 16
+
+/* Target of a digit ending the call */
+#define IVR_HANGUP "hangup"
+
+/* Actions of a digit other than switching to a target */
+#define IVR_ACTION_IGNORE -1
+#define IVR_ACTION_HANGUP -2
+
+/*
+ * Menu of a route, e.g. "1=wav;2=rbt*2,silence:500,longtone;#=hangup".
+ * Digits are only taken from RFC 2833 telephone events, the inbound
+ * audio is never inspected. Every call of the route plays all targets
+ * with one player, so a digit only moves the cursor of the player.
+ */
+struct ivr_menu_t
+{
+    char spec[IVR_SPEC_LEN];
+
+    struct playlist_t targets[IVR_MAX_TARGETS];
+    int targets_count;
+
+    pj_int16_t actions[IVR_DIGITS]; /* Target index or IVR_ACTION_* */
+};
+
+pj_status_t ivr_menu_parse(struct announcement_mgr_t *mgr, const char *root, const char *spec, struct ivr_menu_t *menu);
+
+int ivr_menu_action(const struct ivr_menu_t *menu, int digit);
+
+#endif  // !_IVR_H_
@@ -0,0 +1,79 @@
+#ifndef _MEDIA_CLOCK_H_
+#define _MEDIA_CLOCK_H_
+
+#include <pjlib.h>
+#include <pjmedia.h>
+
+#include "affinity.h"
+#include "config.h"
+#include "metrics.h"
+#include "trace.h"
+#include "util.h"
+
+#define MEDIA_CLOCK_SIGNATURE PJMEDIA_SIG_CLASS_APP('C', 'K')
+
+/*
+ * Observation of the ticks of a media clock. The clock thread is
+ * created by pjmedia, it schedules itself on its first tick, later
+ * ticks are measured against one period after the previous one.
+ */
+struct media_clock_tick_t
+{
+    pj_uint64_t ticks;
+
+    unsigned period_usec;
+    pj_timestamp last_tick;
+
+    const char *cpus;
+    int priority;
+};
+
+/*
+ * Port placed between the master port and the conf bridge.
+ * Every clock tick of the bridge passes through it, so the tick
+ * can be traced and observed without touching pjmedia.
+ */
+typedef void (*media_clock_tick_cb)(void *user_data);
+
+struct media_clock_probe_t
+{
+    pjmedia_port base;
+    pjmedia_port *target;
+
+    struct media_clock_tick_t tick;
+
+    /* Work run on the thread of the bridge after every tick, NULL without */
+    media_clock_tick_cb on_tick;
+    void *user_data;
+};
+
+/* Clock of the embedded profile, it drives the calls itself instead of the bridge */
+struct media_clock_direct_t
+{
+    pjmedia_clock *clock;
+
+    media_clock_tick_cb on_tick;
+    void *user_data;
+
+    struct media_clock_tick_t tick;
+};
+
+pj_status_t media_clock_probe_create(pj_pool_t *pool, pjmedia_port *target, struct media_clock_probe_t **probe);
+
+void media_clock_probe_sched_set(struct media_clock_probe_t *probe, const char *cpus, int priority);
+
+/* Set before the master port starts */
+void media_clock_probe_tick_set(struct media_clock_probe_t *probe, media_clock_tick_cb on_tick, void *user_data);
+
+pj_status_t media_clock_direct_create(pj_pool_t *pool,
+                                      unsigned clock_rate,
+                                      unsigned samples_per_frame,
+                                      const char *cpus,
+                                      int priority,
+                                      media_clock_tick_cb on_tick,
+                                      void *user_data,
+                                      struct media_clock_direct_t **direct);
+
+void media_clock_direct_destroy(struct media_clock_direct_t *direct);
+
+#endif  // !_MEDIA_CLOCK_H_
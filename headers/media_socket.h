@@ -12,14 +12,41 @@
 #include <pjsip_ua.h>
 #include <stdio.h>
 
+#include "metrics.h"
 #include "util.h"
 
+/* SDES-SRTP of the calls, the srtp setting */
+enum media_srtp
+{
+    MEDIA_SRTP_DISABLED = 0,
+    MEDIA_SRTP_OPTIONAL = 1, /* Offers with a=crypto get SRTP, the others plain RTP */
+    MEDIA_SRTP_MANDATORY = 2 /* Offers without a=crypto are rejected with 488 */
+};
+
+/*
+ * RTP port pair of a call. The port is only bound once a call needs it,
+ * so an instance starts without binding its whole range and can start
+ * while its predecessor still holds the ports of its last calls.
+ */
 struct media_socket_t
 {
+    pjmedia_endpt *endpt;
+    pj_uint16_t af;
+    int rtp_port;
+
     pjmedia_transport_info med_tpinfo;
-    pjmedia_transport *med_transport;
+    pjmedia_transport *med_transport; /* NULL while the port is not bound */
     pjmedia_sock_info sock_info;
 
+    /*
+     * What the stream of a call uses: the UDP transport, or the SRTP
+     * transport around it. The SRTP transport lives as long as the
+     * binding, a call only keys it from the SDP and stops it again.
+     */
+    enum media_srtp srtp;
+    pjmedia_transport *transport;
+    pj_uint64_t keying_nsec; /* Of the call being set up, counted once it turns out to be SRTP */
+
     pj_bool_t occupied;
 };
 
@@ -27,8 +54,33 @@ pj_status_t media_socket_create(pj_pool_t *pool,
                                 pjmedia_endpt *endpt, 
                                 const pj_uint16_t af, 
                                 const int rtp_port, 
+                                enum media_srtp srtp,
                                 struct media_socket_t **socket);
 
+/* Bind the port, fails while another process holds it */
+pj_status_t media_socket_open(struct media_socket_t *socket);
+
+/* Unbind the port, it is bound again by the next call using it */
+void media_socket_close(struct media_socket_t *socket);
+
+/*
+ * Prepare the transport of a call for the offer, NULL for an INVITE
+ * without one, and put the crypto of SDES into the local SDP.
+ * Fails when SRTP is mandatory and the offer has no crypto.
+ */
+pj_status_t media_socket_sdp_encode(struct media_socket_t *socket,
+                                    pj_pool_t *pool,
+                                    const pjmedia_sdp_session *remote_sdp,
+                                    pjmedia_sdp_session *local_sdp);
+
+/* Key the transport from the negotiated SDP, before the stream sends */
+pj_status_t media_socket_start(struct media_socket_t *socket,
+                               pj_pool_t *pool,
+                               const pjmedia_sdp_session *local_sdp,
+                               const pjmedia_sdp_session *remote_sdp);
+
+void media_socket_stop(struct media_socket_t *socket);
+
 void media_socket_free(struct media_socket_t *socket);
 
 #endif  // !_MEDIA_SOCKET_H_
@@ -0,0 +1,25 @@
+#ifndef _MEM_STATS_H_
+#define _MEM_STATS_H_
+
+#include <pjlib.h>
+
+#include "metrics.h"
+#include "util.h"
+
+/*
+ * Memory accounting: usage and high-water marks of the long-lived pools,
+ * of the caching pool all pools come from, of per-call pools
+ * and the resident set size, all published through the metrics.
+ */
+void mem_stats_init(pj_caching_pool *cp);
+
+int mem_stats_track(pj_pool_t *pool);
+
+/* Index of a tracked pool in the metrics, -1 for a pool that is not tracked */
+int mem_stats_find(pj_pool_t *pool);
+
+void mem_stats_call_pool(pj_pool_t *pool);
+
+void mem_stats_update(void);
+
+#endif  // !_MEM_STATS_H_
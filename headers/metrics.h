@@ -0,0 +1,146 @@
+#ifndef _METRICS_H_
+#define _METRICS_H_
+
+#include <pjlib.h>
+
+#include "config.h"
+
+/* Native word counters, updated with atomic adds so they may live in shared memory */
+typedef unsigned long metrics_counter_t;
+
+#define METRICS_HIST_BUCKETS 8
+
+/* Long-lived pools accounted by mem_stats */
+#define MAX_TRACKED_POOLS 8
+
+/* RTP health of the calls received on one SIP shard */
+struct metrics_media_t
+{
+    /* Totals of finished streams */
+    metrics_counter_t streams;
+    metrics_counter_t rx_packets;
+    metrics_counter_t tx_packets;
+    metrics_counter_t rx_bytes;
+    metrics_counter_t tx_bytes;
+    metrics_counter_t rx_lost;
+    metrics_counter_t rx_discarded;
+    metrics_counter_t late_frames; /* Discarded by the jitter buffer */
+
+    /* Samples of every active stream, one per sweep */
+    metrics_counter_t loss_hist[METRICS_HIST_BUCKETS]; /* Loss in permille */
+    metrics_counter_t jitter_hist[METRICS_HIST_BUCKETS];
+    metrics_counter_t rtt_hist[METRICS_HIST_BUCKETS];
+};
+
+struct metrics_t
+{
+    metrics_counter_t calls_received;
+    metrics_counter_t calls_rejected;
+    metrics_counter_t calls_answered;
+    metrics_counter_t calls_disconnected;
+
+    /* Requests answered from a reject template, or dropped as their source is over its limit */
+    metrics_counter_t rejects_sent;
+    metrics_counter_t rejects_dropped;
+    metrics_counter_t rejects_blocked; /* Dropped before the request was looked at */
+
+    /* Time spent on rejected requests and on INVITEs up to their 180, to compare the two paths */
+    metrics_counter_t reject_nsec;
+    metrics_counter_t setup_nsec;
+    metrics_counter_t setups;
+
+    /* Messages passed between the two instances of a restart, see handoff.h */
+    metrics_counter_t handoff_relayed;
+    metrics_counter_t handoff_injected;
+
+    /* Prompt library, see prompt_cache.h */
+    metrics_counter_t prompt_hits;
+    metrics_counter_t prompt_misses; /* Played as silence until loaded */
+    metrics_counter_t prompt_loads;
+    metrics_counter_t prompt_load_failures;
+    metrics_counter_t prompt_load_nsec; /* From the first miss to ready */
+    metrics_counter_t prompt_evictions;
+
+    /* Voicemail, see recorder.h */
+    metrics_counter_t recordings;
+    metrics_counter_t record_bytes;
+    metrics_counter_t record_writes;
+    metrics_counter_t record_overruns; /* Frames lost as the writer fell a ring behind */
+    metrics_counter_t record_failures;
+
+    /* SDES-SRTP, see media_socket.h */
+    metrics_counter_t srtp_calls;
+    metrics_counter_t srtp_rejected;   /* Offers without the crypto SRTP needed */
+    metrics_counter_t srtp_setup_nsec; /* Keying of the transports from the SDP */
+
+    /* Looping announcements fanned out to their calls, see broadcast.h */
+    metrics_counter_t broadcast_calls;
+    metrics_counter_t broadcast_encodes; /* One per packet of a group, whatever its calls */
+    metrics_counter_t broadcast_packets;
+    metrics_counter_t broadcast_nsec;    /* Encoding and sending of all groups */
+
+    /* Menus driven by RFC 2833 telephone events */
+    metrics_counter_t dtmf_digits;
+    metrics_counter_t ivr_switches;
+    metrics_counter_t ivr_hangups;
+
+    /* Dispatcher front-end */
+    metrics_counter_t dispatcher_requests;
+    metrics_counter_t dispatcher_responses;
+    metrics_counter_t dispatcher_rejected; /* No backend alive */
+    metrics_counter_t dispatcher_backends_lost;
+
+    /* SIP over TCP */
+    metrics_counter_t calls_received_tcp;
+    metrics_counter_t sip_tcp_connections;  /* Peer connections taken into the pool */
+    metrics_counter_t sip_tcp_reused_calls; /* Calls arriving on a pooled connection */
+
+    /* Call detail records */
+    metrics_counter_t cdr_written;
+    metrics_counter_t cdr_batches;
+    metrics_counter_t cdr_dropped;
+
+    /* SIP packets received by every SO_REUSEPORT listener */
+    metrics_counter_t sip_rx_packets[MAX_SIP_SHARDS];
+
+    struct metrics_media_t media[MAX_SIP_SHARDS];
+
+    /* Media clock ticks and their lateness in usec */
+    metrics_counter_t clock_ticks;
+    metrics_counter_t clock_late_hist[METRICS_HIST_BUCKETS];
+
+    /* CPU time used by the process, updated by every media sweep */
+    metrics_counter_t cpu_user_msec;
+    metrics_counter_t cpu_system_msec;
+
+    /* Memory, updated by every media sweep */
+    metrics_counter_t pool_used[MAX_TRACKED_POOLS];
+    metrics_counter_t pool_capacity[MAX_TRACKED_POOLS];
+    metrics_counter_t pool_peak[MAX_TRACKED_POOLS];
+    metrics_counter_t cp_used_count; /* Pools taken from the caching pool */
+    metrics_counter_t cp_used_size;
+    metrics_counter_t cp_peak_used_size;
+    metrics_counter_t call_pool_peak;
+    metrics_counter_t rss_kb;
+    metrics_counter_t rss_peak_kb;
+};
+
+#define METRICS_ADD(field, value) __sync_fetch_and_add(&metrics_get()->field, (value))
+#define METRICS_INC(field) METRICS_ADD(field, 1)
+
+struct metrics_t *metrics_get(void);
+
+void metrics_attach(struct metrics_t *storage);
+
+/* Add all counters of src to dst */
+void metrics_sum(struct metrics_t *dst, const struct metrics_t *src);
+
+void metrics_media_sample(int shard, unsigned loss_permille, unsigned jitter_usec, unsigned rtt_usec);
+
+void metrics_clock_sample(unsigned late_usec);
+
+void metrics_cpu_update(void);
+
+void metrics_dump(const struct metrics_t *metrics, const char *title);
+
+#endif  // !_METRICS_H_
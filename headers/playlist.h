@@ -0,0 +1,107 @@
+#ifndef _PLAYLIST_H_
+#define _PLAYLIST_H_
+
+#include <pjlib.h>
+#include <pjmedia.h>
+
+#include "announcement.h"
+#include "config.h"
+#include "recorder.h"
+#include "util.h"
+
+#define PLAYLIST_SIGNATURE PJMEDIA_SIG_CLASS_APP('P', 'L')
+
+#define PLAYLIST_MAX_SEGMENTS 16
+#define PLAYLIST_SPEC_LEN 128
+#define PLAYLIST_MAX_REPEAT 100
+
+/* Clock rate of every player, the one announcements and prompts are decoded to */
+#define PLAYLIST_CLOCK_RATE ANNOUNCEMENT_CLOCK_RATE
+
+/* Segment name of a gap, written as silence:<msec> */
+#define PLAYLIST_SILENCE "silence"
+
+/* Last segment of a voicemail, e.g. "wav,beep,record" */
+#define PLAYLIST_RECORD "record"
+
+/*
+ * Route target with several segments, e.g. "rbt*2,silence:500,wav,@welcome".
+ * A segment is an announcement or a prompt of the library written as
+ * @name, played repeat times, or a silence gap. A playlist ending with
+ * a record segment stays silent there and records the caller.
+ */
+struct playlist_segment_t
+{
+    struct announcement_t *announcement; /* NULL for a silence gap or a prompt */
+    struct prompt_t *prompt;
+    unsigned repeat;
+    unsigned silence_msec;
+    pj_bool_t record;
+};
+
+/* Parsed once per route and shared read-only by all its calls */
+struct playlist_t
+{
+    char spec[PLAYLIST_SPEC_LEN];
+
+    struct playlist_segment_t segments[PLAYLIST_MAX_SEGMENTS];
+    int segments_count;
+};
+
+/* Playback position of one call */
+struct playlist_cursor_t
+{
+    pj_uint16_t segment;
+    pj_uint16_t repeat;
+    pj_uint32_t offset; /* Samples of the segment already played */
+};
+
+/*
+ * Per-call player of a playlist. It reads the samples of the versions
+ * pinned when the call starts and connects to the bridge only once,
+ * segments follow each other within the same frame. A player may hold
+ * several playlists, switching between them only moves its cursor.
+ */
+struct playlist_port_t
+{
+    pjmedia_port base;
+
+    const struct playlist_t *playlists;
+    int playlists_count;
+    struct announcement_mgr_t *mgr;
+
+    /* One per segment of every playlist, NULL for gaps */
+    struct announcement_version_t ***versions;
+
+    const struct playlist_t *playlist; /* Under the cursor */
+    struct playlist_cursor_t cursor;
+
+    int pending; /* Playlist to switch to at the next frame, -1 for none */
+
+    pj_bool_t prompts_pinned;
+
+    struct recording_t *recording; /* Started once the cursor reaches a record segment */
+};
+
+pj_bool_t playlist_is_spec(const char *spec);
+
+char *playlist_spec_trim(char *text);
+
+pj_status_t playlist_parse(struct announcement_mgr_t *mgr, const char *spec, struct playlist_t *playlist);
+
+pj_status_t playlist_port_create(pj_pool_t *pool,
+                                 struct announcement_mgr_t *mgr,
+                                 const struct playlist_t *playlists,
+                                 int playlists_count,
+                                 pj_grp_lock_t *grp_lock,
+                                 struct playlist_port_t **port);
+
+void playlist_port_switch(struct playlist_port_t *port, int playlist);
+
+pj_bool_t playlist_port_records(const struct playlist_port_t *port);
+
+void playlist_port_record(struct playlist_port_t *port, struct recording_t *recording);
+
+void playlist_port_release(struct playlist_port_t *port);
+
+#endif  // !_PLAYLIST_H_
@@ -0,0 +1,123 @@
+#ifndef _PROMPT_CACHE_H_
+#define _PROMPT_CACHE_H_
+
+#include <pjlib.h>
+#include <pjmedia.h>
+
+#include "config.h"
+#include "g711_kernels.h"
+#include "metrics.h"
+#include "util.h"
+
+/* Library of prompts, every <name>.wav in it is a prompt */
+#define PROMPT_DIR "../etc"
+#define PROMPT_EXT ".wav"
+
+#define PROMPT_NAME_LEN 64
+#define PROMPT_PATH_LEN 256
+
+/* Prompts are converted to this rate and mono once, the playlists play them as they are */
+#define PROMPT_CLOCK_RATE 8000
+
+/* Input of one resampler run, in msec of the source */
+#define PROMPT_RESAMPLE_MSEC 20
+
+/*
+ * Time a prompt stays in memory after its last player has left the
+ * bridge, which may still ask that player for the current tick. The
+ * same grace period as a replaced announcement version.
+ */
+#define PROMPT_RETIRE_MSEC 1000
+
+#define PROMPT_INDEX_BUCKETS 4096
+
+#define PROMPT_POOL_SIZE 4000
+#define PROMPT_POOL_INC 4000
+
+enum prompt_state
+{
+    PROMPT_IDLE,    /* Not in memory */
+    PROMPT_LOADING, /* Queued for the loader or being decoded */
+    PROMPT_READY,
+    PROMPT_FAILED   /* Not a WAV file the loader understands, played as silence */
+};
+
+/*
+ * One file of the library. The entry lives as long as the cache, only
+ * its samples come and go. Players read the samples without the lock,
+ * the samples of an entry with refs are never evicted.
+ */
+struct prompt_t
+{
+    char name[PROMPT_NAME_LEN];
+
+    int state; /* Set after the samples, read by the media thread */
+    pj_pool_t *pool; /* Holds the samples while the prompt is in memory */
+    pj_int16_t *samples;
+    pj_size_t samples_count;
+
+    int refs; /* Players of the prompt, under the cache lock */
+    pj_time_val release_time; /* Last player gone, not evicted before PROMPT_RETIRE_MSEC */
+    pj_timestamp requested; /* First miss, for the load latency */
+
+    /* Ready prompts nobody plays, least recently used first */
+    struct prompt_t *lru_prev;
+    struct prompt_t *lru_next;
+
+    struct prompt_t *queue_next; /* Loader queue */
+    struct prompt_t *next; /* Every prompt of the library */
+};
+
+/*
+ * Decoded prompts of a library too large to keep in memory. The files
+ * are indexed at start, a prompt is decoded from its mapped file by the
+ * loader thread the first time a call asks for it, and the prompts no
+ * call plays are evicted least recently used first once their samples
+ * take more than capacity bytes. A call never waits for the loader, it
+ * plays silence until its prompt is ready.
+ */
+struct prompt_cache_t
+{
+    pj_pool_factory *factory;
+    pj_pool_t *pool;
+    char dir[PROMPT_PATH_LEN];
+
+    pj_hash_table_t *index; /* Read-only once the library has been scanned */
+    struct prompt_t *prompts;
+    int prompts_count;
+
+    pj_mutex_t *lock;
+    struct prompt_t lru; /* Head of the ring of evictable prompts */
+    pj_size_t bytes;
+    pj_size_t capacity;
+
+    struct prompt_t *queue_head;
+    struct prompt_t *queue_tail;
+    pj_sem_t *queue_sem;
+
+    pj_thread_t *loader;
+    pj_pool_t *scratch; /* Reset after every prompt, used by the loader only */
+    const struct g711_kernels_t *kernels;
+    int quit;
+};
+
+pj_status_t prompt_cache_create(pj_pool_factory *factory,
+                                const char *dir,
+                                pj_size_t capacity,
+                                struct prompt_cache_t **cache);
+
+/* NULL if the library has no such prompt */
+struct prompt_t *prompt_cache_find(struct prompt_cache_t *cache, const char *name, int len);
+
+/* Pin the samples for a player, a miss queues the prompt for the loader */
+void prompt_cache_acquire(struct prompt_cache_t *cache, struct prompt_t *prompt);
+
+/* The last player leaves the prompt to the LRU, its samples stay readable for PROMPT_RETIRE_MSEC */
+void prompt_cache_release(struct prompt_cache_t *cache, struct prompt_t *prompt);
+
+/* Checked by the player on every frame, the samples are readable once it is */
+pj_bool_t prompt_is_ready(const struct prompt_t *prompt);
+
+void prompt_cache_free(struct prompt_cache_t *cache);
+
+#endif  // !_PROMPT_CACHE_H_
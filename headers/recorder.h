@@ -0,0 +1,124 @@
+#ifndef _RECORDER_H_
+#define _RECORDER_H_
+
+#include <pjlib.h>
+#include <pjmedia.h>
+
+#include "config.h"
+#include "g711_kernels.h"
+#include "metrics.h"
+#include "util.h"
+
+#define RECORDER_SIGNATURE PJMEDIA_SIG_CLASS_APP('R', 'C')
+
+/* Voicemails are written here as voicemail-<username>-<msec>-<pid>-<n>.wav */
+#define RECORDER_DIR "/tmp"
+
+#define RECORDER_PATH_LEN 256
+
+/* Samples buffered between the media clock and the writer, a power of two */
+#if EMBEDDED_PROFILE
+#define RECORDER_RING_SAMPLES 4096
+#else
+#define RECORDER_RING_SAMPLES 16384
+#endif
+
+/* Interval of the writer thread flushing every ring into its file */
+#define RECORDER_FLUSH_MSEC 100
+
+/* Time a stopped recording stays writable for the tick the bridge may still be running */
+#define RECORDER_RETIRE_MSEC 1000
+
+#define RECORDER_WAV_HEADER_LEN 44
+
+#define RECORDER_POOL_SIZE 1024
+#define RECORDER_POOL_INC 1024
+
+/* Format tags of the WAV files written */
+enum recorder_format
+{
+    RECORDER_PCM = 1,
+    RECORDER_ALAW = 6,
+    RECORDER_ULAW = 7
+};
+
+/*
+ * Inbound audio of one call. The media clock is the only producer and
+ * the writer thread the only consumer of the ring, so neither takes a
+ * lock. The port is a sink of the bridge, the direct playback of the
+ * embedded profile puts the frames it reads from the stream instead.
+ */
+struct recording_t
+{
+    pjmedia_port base;
+    pj_pool_t *pool;
+
+    char path[RECORDER_PATH_LEN];
+    int fd; /* Opened by the writer with the first samples, -2 if that failed */
+    enum recorder_format format;
+
+    pj_int16_t *ring;
+    pj_uint32_t head; /* Written by the media clock */
+    pj_uint32_t tail; /* Written by the writer */
+
+    pj_uint32_t samples_max; /* From the duration and size limits */
+    pj_uint32_t samples_taken;
+    pj_uint32_t data_bytes;
+
+    int started; /* Set by the player once the prompt has been played */
+    int stopped;
+    pj_timestamp stop_time;
+
+    unsigned slot; /* Bridge slot, -1 without the bridge */
+
+    struct recording_t *next;
+};
+
+/* Writer of all recordings, no file I/O happens on the SIP or media threads */
+struct recorder_t
+{
+    pj_pool_factory *factory;
+    pj_pool_t *pool;
+    pj_mutex_t *lock;
+
+    char dir[RECORDER_PATH_LEN];
+    unsigned max_sec;
+    unsigned max_bytes;
+
+    struct recording_t *recordings; /* New ones are added at the head under the lock */
+    unsigned sequence;
+
+    const struct g711_kernels_t *kernels;
+    pj_uint8_t *encoded; /* Scratch of the writer */
+
+    pj_thread_t *thread;
+    pj_bool_t quit;
+};
+
+pj_status_t recorder_create(pj_pool_factory *factory,
+                            pj_pool_t *pool,
+                            const char *dir,
+                            unsigned max_sec,
+                            unsigned max_bytes,
+                            struct recorder_t **recorder);
+
+/* G.711 calls are written as G.711, anything else as 16 bit PCM */
+pj_status_t recorder_open(struct recorder_t *recorder,
+                          const char *username,
+                          pj_uint64_t invite_msec,
+                          unsigned clock_rate,
+                          enum recorder_format format,
+                          struct recording_t **recording);
+
+/* Frames put before are dropped, called from the media clock */
+void recording_start(struct recording_t *recording);
+
+/* Called from the media clock, NULL samples are silence. Frames that do not fit are dropped */
+void recording_put(struct recording_t *recording, const pj_int16_t *samples, unsigned count);
+
+/* The writer finishes the file, the recording must not be used afterwards */
+void recorder_close(struct recorder_t *recorder, struct recording_t *recording);
+
+void recorder_free(struct recorder_t *recorder);
+
+#endif  // !_RECORDER_H_
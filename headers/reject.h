@@ -0,0 +1,53 @@
+#ifndef _REJECT_H_
+#define _REJECT_H_
+
+#include <pjlib.h>
+#include <pjsip.h>
+
+#include "metrics.h"
+#include "util.h"
+
+/* Sources tracked by the limiter, a power of two, colliding sources share a slot */
+#define REJECT_LIMITER_SLOTS 4096
+
+/* A source rejected more often than this within one second is dropped for the rest of it */
+#define REJECT_LIMIT_PER_SEC 20
+
+#define REJECT_MSG_SIZE 2048
+
+/* Rejections answered from a template */
+enum reject_reason
+{
+    REJECT_UNKNOWN_USER, /* No route for the To user */
+    REJECT_NOT_ALLOWED,  /* Anything but an INVITE outside a dialog */
+    REJECT_DRAINING,     /* New call to an instance that is finishing its calls, never limited */
+    REJECT_REASONS
+};
+
+/* Rejections of one source within the current second */
+struct reject_slot_t
+{
+    pj_uint32_t key;
+    pj_uint32_t second;
+    pj_uint32_t count;
+};
+
+/*
+ * Fast path for requests nobody is going to answer. Responses are
+ * pre-encoded up to the headers copied from the request, and sources
+ * that keep being rejected stop getting any response at all. The slots
+ * are updated without a lock, a lost update only miscounts one source.
+ */
+struct reject_t
+{
+    struct reject_slot_t slots[REJECT_LIMITER_SLOTS];
+};
+
+pj_status_t reject_create(pj_pool_t *pool, struct reject_t **reject);
+
+/* Source of a request outside a dialog is over its limit, the request is dropped without a response */
+pj_bool_t reject_is_blocked(struct reject_t *reject, const pjsip_rx_data *rdata);
+
+void reject_send(struct reject_t *reject, pjsip_rx_data *rdata, enum reject_reason reason);
+
+#endif  // !_REJECT_H_
@@ -0,0 +1,149 @@
+#ifndef _REPLAY_H_
+#define _REPLAY_H_
+
+#include <pjlib.h>
+
+#include "config.h"
+#include "mem_stats.h"
+#include "metrics.h"
+#include "soak.h"
+#include "util.h"
+
+/* Captures are read whole into memory */
+#define REPLAY_MAX_CAPTURE_BYTES (64 * 1024 * 1024)
+
+#define REPLAY_MAX_SCALE 1000
+
+/* Longest wait for responses between two messages of the capture */
+#define REPLAY_POLL_MSEC 10
+
+/* Time the responses of the last messages may take, not scaled */
+#define REPLAY_RESPONSE_TIMEOUT_MSEC 5000
+
+/* Time the calls left by the capture get to end, on top of the longest life of a call */
+#define REPLAY_SETTLE_MARGIN_SEC 3
+
+#define REPLAY_CALL_ID_LEN 128
+#define REPLAY_CSEQ_LEN 32
+#define REPLAY_TAG_LEN 64
+#define REPLAY_MSG_SIZE 8192
+
+#define REPLAY_HASH_BUCKETS 1024
+
+#define REPLAY_POOL_SIZE 4000
+#define REPLAY_POOL_INC 4000
+
+/* Text captures, messages may have LF or CRLF line ends */
+#define REPLAY_TEXT_SEND "send"
+#define REPLAY_TEXT_EXPECT "expect"
+#define REPLAY_TEXT_END "."
+
+/* Classic pcap files in either byte order, with microsecond or nanosecond timestamps */
+#define REPLAY_PCAP_MAGIC 0xa1b2c3d4
+#define REPLAY_PCAP_MAGIC_NSEC 0xa1b23c4d
+#define REPLAY_PCAP_HEADER_LEN 24
+#define REPLAY_PCAP_RECORD_LEN 16
+
+/* Link types of the pcap captures read */
+#define REPLAY_LINK_ETHERNET 1
+#define REPLAY_LINK_RAW 101
+#define REPLAY_LINK_LINUX_SLL 113
+
+/* Request of the client, the responses it got in the capture are expected of it */
+struct replay_tsx_t
+{
+    char call_id[REPLAY_CALL_ID_LEN];
+    char cseq[REPLAY_CSEQ_LEN]; /* Number and method, re-INVITEs are transactions of their own */
+
+    pj_bool_t sent;
+    pj_timestamp sent_time; /* First transmission, retransmissions do not restart the latency */
+};
+
+struct replay_expect_t
+{
+    struct replay_tsx_t *tsx;
+    int code;
+    pj_bool_t matched;
+
+    struct replay_expect_t *next;
+};
+
+/* Message of the client, sent at_msec after the first one divided by the scale */
+struct replay_msg_t
+{
+    pj_uint32_t at_msec;
+    char *data;
+    int len;
+
+    struct replay_tsx_t *tsx; /* NULL for ACK */
+    struct replay_msg_t *next;
+};
+
+/* To-tag the server has given a dialog of the capture in this run */
+struct replay_dialog_t
+{
+    char call_id[REPLAY_CALL_ID_LEN];
+    char tag[REPLAY_TAG_LEN];
+};
+
+/* Resources a finished replay must have given back */
+struct replay_usage_t
+{
+    int calls;
+    int media_sockets;
+    metrics_counter_t cp_used_count;
+    metrics_counter_t cp_used_size;
+    metrics_counter_t rss_kb;
+};
+
+typedef void (*replay_usage_cb)(struct replay_usage_t *usage);
+
+/*
+ * Replay of the client side of a SIP capture against the machine in the
+ * same process, over loopback at the pace of the capture or N times
+ * faster. The server side of the capture is what the machine is
+ * expected to answer. Via and To-tags are rewritten so the messages of
+ * a dialog reach the dialog of this run, requests of the machine such
+ * as its BYE are answered with 200 like the soak client does.
+ */
+struct replay_t
+{
+    pj_pool_t *pool;
+    pj_sock_t sock;
+    pj_sockaddr server;
+    char local[PJ_INET6_ADDRSTRLEN + 8];
+    unsigned scale;
+
+    struct replay_msg_t *msgs;
+    struct replay_msg_t *msgs_tail;
+    unsigned long msgs_count;
+
+    pj_hash_table_t *tsxs;    /* By Call-ID and CSeq */
+    pj_hash_table_t *expects; /* By Call-ID, CSeq and code */
+    pj_hash_table_t *dialogs; /* By Call-ID */
+    struct replay_expect_t *expects_list;
+    unsigned long expects_count;
+
+    unsigned long sent;
+    unsigned long matched;
+    unsigned long unexpected;
+    pj_uint32_t *latencies_usec; /* Of the matched responses */
+
+    pj_uint32_t settle_sec;
+    struct replay_usage_t baseline;
+    replay_usage_cb usage;
+
+    soak_done_cb on_done;
+    pj_thread_t *thread;
+};
+
+pj_status_t replay_start(pj_pool_factory *factory,
+                         int sip_port,
+                         const char *path,
+                         unsigned scale,
+                         pj_uint32_t settle_sec,
+                         replay_usage_cb usage,
+                         soak_done_cb on_done,
+                         struct replay_t **replay);
+
+#endif  // !_REPLAY_H_
@@ -0,0 +1,54 @@
+#ifndef _ROUTE_TABLE_H_
+#define _ROUTE_TABLE_H_
+
+#include <pjlib.h>
+
+#include "announcement.h"
+#include "config.h"
+#include "ivr.h"
+#include "playlist.h"
+#include "util.h"
+
+#define ROUTE_TABLE_POOL_SIZE 4000
+#define ROUTE_TABLE_POOL_INC 4000
+
+/* Username routed to an announcement */
+struct route_t
+{
+    struct announcement_t *announcement; /* Shared player, NULL for a playlist */
+    struct playlist_t *playlist;
+    struct ivr_menu_t *menu; /* Played by a per-call player, NULL without a menu */
+    unsigned ptime;
+};
+
+/*
+ * One generation of the routes. A reload builds the next generation
+ * aside and swaps it in whole, so the SIP threads only ever see complete
+ * tables. The routes, playlists and menus of a generation live in its
+ * own pool, released with the last call that plays one of them.
+ */
+struct route_table_t
+{
+    pj_pool_t *pool;
+    pj_hash_table_t *hash;
+    pj_atomic_t *ref_cnt; /* The machine while the table is current, and every call of its routes */
+    unsigned generation;
+};
+
+pj_status_t route_table_create(pj_pool_factory *factory,
+                               unsigned buckets,
+                               unsigned generation,
+                               struct route_table_t **table);
+
+/* NULL if the username has no route */
+struct route_t *route_table_find(const struct route_table_t *table, const char *username, int len);
+
+/* Zeroed route of the username, the key is copied into the table */
+struct route_t *route_table_add(struct route_table_t *table, const char *username);
+
+void route_table_add_ref(struct route_table_t *table);
+
+/* The last reference releases the pool with everything routed from it */
+void route_table_release(struct route_table_t *table);
+
+#endif  // !_ROUTE_TABLE_H_
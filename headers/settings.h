@@ -0,0 +1,79 @@
+#ifndef _SETTINGS_H_
+#define _SETTINGS_H_
+
+#include <pjlib.h>
+
+#include "config.h"
+#include "util.h"
+
+/* Upper bounds of the settings, far above what one host can run */
+#define SETTINGS_MAX_CALLS 65536
+#define SETTINGS_MAX_ROUTE_BUCKETS 65536
+#define SETTINGS_MAX_POOL_SIZE (64 * 1024 * 1024)
+#define SETTINGS_MAX_CACHE_SIZE (1024 * 1024 * 1024)
+
+#define SETTINGS_LINE_LEN 256
+
+/* Longest CPU list of a thread, like "0-1,4" */
+#define SETTINGS_CPUS_LEN 64
+#define SETTINGS_MAX_PRIORITY 99
+
+/*
+ * Capacity of the process, loaded once at startup from the defaults in
+ * config.h, then the config file, then the command line. Everything
+ * sized by a setting is allocated from it before the first call.
+ */
+struct settings_t
+{
+    unsigned sip_port;
+    unsigned rtp_port; /* First RTP port, every worker takes 2 * max_media ports after it */
+    unsigned workers;
+    unsigned sip_shards; /* UDP listeners on the SIP port, each with its own queue and thread */
+
+    unsigned max_calls;
+    unsigned max_media; /* Media sockets, one per call from INVITE to BYE */
+    unsigned route_buckets;
+
+    unsigned clock_rate;
+    unsigned nsamples; /* Samples of one bridge tick, derived from clock_rate */
+    unsigned bridge_ports; /* Slots of the bridge, derived from max_calls */
+
+    unsigned ringing_time;
+    unsigned media_session_time;
+
+    unsigned machine_pool_size;
+    unsigned media_pool_size;
+    unsigned prompt_cache_size;
+
+    unsigned record_max_sec;
+    unsigned record_max_bytes;
+
+    unsigned srtp; /* enum media_srtp */
+    unsigned broadcast; /* Looping announcements of G.711 calls are encoded once per group */
+
+    /* Read by every thread as it starts, see affinity_apply */
+    char media_clock_cpus[SETTINGS_CPUS_LEN];
+    unsigned media_clock_priority;
+    char sip_thread_cpus[SETTINGS_CPUS_LEN];
+    unsigned sip_thread_priority;
+};
+
+struct settings_t *settings_get(void);
+
+/* Check the built-in settings against config.h, before anything overrides them */
+pj_status_t settings_check_defaults(void);
+
+/* Set one setting by name, "key=value" pairs are split by settings_set_pair */
+pj_status_t settings_set(const char *key, const char *value);
+
+pj_status_t settings_set_pair(const char *pair);
+
+/* Lines of "key = value", blank lines and lines starting with # are skipped */
+pj_status_t settings_load(const char *path);
+
+/* Check the settings against each other and derive the rest */
+pj_status_t settings_validate(void);
+
+void settings_report(void);
+
+#endif  // !_SETTINGS_H_
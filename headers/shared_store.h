@@ -0,0 +1,85 @@
+#ifndef _SHARED_STORE_H_
+#define _SHARED_STORE_H_
+
+#include <pjlib.h>
+#include <pjmedia.h>
+
+#include "announcement.h"
+#include "config.h"
+#include "ivr.h"
+#include "playlist.h"
+#include "util.h"
+
+#define SHARED_STORE_MAGIC 0x34534d41 /* "AMS4" */
+
+#define MAX_ROUTES 64
+#define ROUTE_USERNAME_LEN 64
+
+/* Offset of the first sample block, blocks are aligned the same way */
+#define SHARED_STORE_ALIGN 64
+
+#define SHARED_STORE_POOL_SIZE 512
+#define SHARED_STORE_POOL_INC 512
+
+/*
+ * Layout of the store file: the header below followed by
+ * the decoded PCM of every announcement. The file is written once
+ * by the supervisor and mapped read-only by all workers.
+ */
+struct shared_store_entry_t
+{
+    char name[ANNOUNCEMENT_NAME_LEN];
+    pj_uint32_t clock_rate;
+    pj_uint32_t samples_count;
+    pj_uint64_t offset; /* From the start of the file */
+};
+
+struct shared_store_route_t
+{
+    char username[ROUTE_USERNAME_LEN];
+    char announcement[PLAYLIST_SPEC_LEN]; /* Announcement name or playlist */
+    pj_uint32_t ptime;
+    char menu[IVR_SPEC_LEN]; /* Empty without a menu */
+};
+
+struct shared_store_header_t
+{
+    pj_uint32_t magic;
+    pj_uint32_t generation;
+    pj_uint32_t entries_count;
+    pj_uint32_t routes_count;
+
+    struct shared_store_entry_t entries[MAX_ANNOUNCEMENTS];
+    struct shared_store_route_t routes[MAX_ROUTES];
+};
+
+/* One mapping of the store file, alive while any announcement plays from it */
+struct shared_store_t
+{
+    pj_pool_t *pool;
+
+    void *base;
+    pj_size_t size;
+    const struct shared_store_header_t *header;
+
+    pj_atomic_t *ref_cnt;
+};
+
+pj_status_t shared_store_build(pj_pool_factory *factory,
+                               const char *path,
+                               unsigned generation,
+                               const struct announcement_spec_t *specs,
+                               int specs_count,
+                               const struct route_spec_t *routes,
+                               int routes_count);
+
+pj_status_t shared_store_map(pj_pool_factory *factory, const char *path, struct shared_store_t **store);
+
+pj_int16_t *shared_store_samples(const struct shared_store_t *store, int entry);
+
+void shared_store_add_ref(struct shared_store_t *store);
+
+/* Matches announcement_release_cb, so versions can hold the mapping */
+void shared_store_dec_ref(void *store);
+
+#endif  // !_SHARED_STORE_H_
@@ -5,6 +5,7 @@
 
 /* First tone */
 #define LONG_TONE_FREQUENCY  425
+#define LONG_TONE_LENGTH_MSEC 1000
 
 /* Second audio message */
 #define WAV_FILE "../etc/example3.wav"
@@ -17,15 +18,21 @@
 #define RBT_ON_MSEC 1000
 #define RBT_OFF_MSEC 4000
 
+/* Beep before a voicemail is recorded */
+#define BEEP_FREQUENCY 1000
+#define BEEP_LENGTH_MSEC 400
+
 #define CHANNEL_COUNT 1
 #define SAMPLES_PER_FRAME 64
 #define BITS_PER_SAMPLE 16
 #define SIGNALS_CLOCK_RATE 8000 
 
-pj_status_t signals_longtone_create(pj_pool_t *pool, pjmedia_port **port);
+pj_status_t signals_longtone_create(pj_pool_t *pool, const char *path, pjmedia_port **port);
+
+pj_status_t signals_wav_create(pj_pool_t *pool, const char *path, pjmedia_port **port);
 
-pj_status_t signals_wav_create(pj_pool_t *pool, pjmedia_port **port);
+pj_status_t signals_rbt_create(pj_pool_t *pool, const char *path, pjmedia_port **port);
 
-pj_status_t signals_rbt_create(pj_pool_t *pool, pjmedia_port **port);
+pj_status_t signals_beep_create(pj_pool_t *pool, const char *path, pjmedia_port **port);
 
 #endif  // !_SIGNALS_H_
@@ -0,0 +1,46 @@
+#ifndef _SIP_PEER_H_
+#define _SIP_PEER_H_
+
+#include <pjlib.h>
+#include <pjsip.h>
+
+#include "metrics.h"
+#include "util.h"
+
+#define MAX_SIP_PEERS 64
+
+/* Pooled connections without traffic for this long are released to pjsip */
+#define SIP_PEER_IDLE_SEC 300
+#define SIP_PEER_SWEEP_SEC 10
+
+/* Interval of CRLF keep-alives on every TCP connection */
+#define SIP_TCP_KEEP_ALIVE_SEC 15
+
+/* One trunk peer connected over a reliable transport */
+struct sip_peer_t
+{
+    char name[PJ_INET6_ADDRSTRLEN + 8]; /* Remote host:port */
+    pjsip_transport *transport;         /* Referenced while the peer is pooled */
+    pj_time_val last_active;
+    unsigned calls;
+};
+
+struct sip_peer_pool_t
+{
+    pjsip_endpoint *endpt;
+    pj_mutex_t *lock;
+
+    struct sip_peer_t peers[MAX_SIP_PEERS];
+    int peers_count;
+
+    pj_timer_entry sweep_timer;
+    pjsip_tp_state_callback prev_state_cb;
+};
+
+pj_status_t sip_peer_pool_create(pj_pool_t *pool, pjsip_endpoint *endpt, struct sip_peer_pool_t **peers);
+
+void sip_peer_touch(struct sip_peer_pool_t *peers, pjsip_transport *transport, pj_bool_t new_call);
+
+void sip_peer_pool_free(struct sip_peer_pool_t *peers);
+
+#endif  // !_SIP_PEER_H_
@@ -0,0 +1,124 @@
+#ifndef _SOAK_H_
+#define _SOAK_H_
+
+#include <pjlib.h>
+
+#include "config.h"
+#include "mem_stats.h"
+#include "metrics.h"
+#include "settings.h"
+#include "util.h"
+
+#define SOAK_MAX_CONCURRENCY 64
+#define SOAK_CONCURRENCY 16
+
+/* Every Nth call is answered and hung up with BYE, the others are cancelled after 180 */
+#define SOAK_ANSWER_EVERY 100
+
+/* Memory is sampled every SOAK_SAMPLE_CALLS, growth is measured after the warmup */
+#define SOAK_SAMPLE_CALLS 10000
+#define SOAK_WARMUP_PERCENT 10
+#define SOAK_GROWTH_PERCENT 5
+#define SOAK_RSS_SLACK_KB 1024
+
+/* Time for the last calls and retired announcements to be released */
+#define SOAK_SETTLE_MSEC 3000
+
+/* A call without any progress for this long is abandoned */
+#define SOAK_CALL_TIMEOUT_SEC 30
+
+#define SOAK_USERNAME "longtone"
+
+/*
+ * Junk requests of the flood come from a loopback address of their own,
+ * so the limiter that turns them away leaves the calls of the soak alone.
+ * Every SOAK_FLOOD_OPTIONS_EVERY request is an OPTIONS, the rest are
+ * INVITEs to users without a route.
+ */
+#define SOAK_FLOOD_ADDR "127.0.0.2"
+#define SOAK_FLOOD_OPTIONS_EVERY 8
+#define SOAK_MSG_SIZE 2048
+
+enum soak_call_state
+{
+    SOAK_CALL_IDLE,
+    SOAK_CALL_INVITING,
+    SOAK_CALL_CANCELLING,
+    SOAK_CALL_BYEING
+};
+
+/* One synthetic call of the soak client */
+struct soak_call_t
+{
+    enum soak_call_state state;
+    unsigned long index;
+
+    char call_id[48];
+    char branch[48];
+    char to_tag[64];
+    unsigned offer; /* Index in the maxptime offers */
+
+    pj_time_val last_activity;
+};
+
+/* Memory sample taken every SOAK_SAMPLE_CALLS */
+struct soak_sample_t
+{
+    unsigned long calls;
+    metrics_counter_t rss_kb;
+    metrics_counter_t cp_used_size;
+    metrics_counter_t pool_used[MAX_TRACKED_POOLS];
+};
+
+/* Called from the soak thread with 0 on success and 1 on memory growth or failed calls */
+typedef void (*soak_done_cb)(int result);
+
+struct soak_t
+{
+    pj_pool_t *pool;
+    pj_sock_t sock;
+    pj_sockaddr server;
+    char local[PJ_INET6_ADDRSTRLEN + 8];
+
+    unsigned long total;
+    unsigned long started;
+    unsigned long completed;
+    unsigned long failed;
+
+    struct soak_call_t calls[SOAK_MAX_CONCURRENCY];
+    int concurrency;
+
+    struct soak_sample_t baseline;
+    pj_bool_t has_baseline;
+
+    /* Tracked pool of the machine, nothing per call may come from it */
+    int machine_pool;
+
+    /* Answers whose ptime is not the one expected for the maxptime of the offer */
+    unsigned long ptime_mismatched;
+
+    /* Junk requests per second sent next to the calls, 0 without a flood */
+    unsigned flood_rate;
+    pj_sock_t flood_sock;
+    unsigned long flood_sent;
+    unsigned long flood_answered;
+
+    soak_done_cb on_done;
+    pj_thread_t *thread;
+};
+
+pj_status_t soak_start(pj_pool_t *pool,
+                       int sip_port,
+                       unsigned long calls,
+                       int concurrency,
+                       unsigned flood_rate,
+                       soak_done_cb on_done,
+                       struct soak_t **soak);
+
+/* Value of the first header with this name, without the line break */
+pj_bool_t soak_header_get(const char *msg, const char *name, char *value, int size);
+
+/* Tag of the To header, empty without one */
+void soak_to_tag_get(const char *msg, char *tag, int size);
+
+#endif  // !_SOAK_H_
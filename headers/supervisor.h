@@ -0,0 +1,47 @@
+#ifndef _SUPERVISOR_H_
+#define _SUPERVISOR_H_
+
+#include <pjlib.h>
+#include <sys/types.h>
+
+#include "announcement.h"
+#include "metrics.h"
+#include "util.h"
+
+/*
+ * Default of the workers setting, 0 runs a single standalone process.
+ * Every worker owns its own endpoints, media engine and RTP port range.
+ */
+#define SUPERVISOR_WORKERS 0
+#define SUPERVISOR_MAX_WORKERS 64
+
+/* Announcements and routes shared read-only by all workers */
+#define SUPERVISOR_STORE_PATH "/tmp/answering_machine.store"
+
+#define SUPERVISOR_RESTART_DELAY_MSEC 1000
+#define SUPERVISOR_POLL_MSEC 100
+#define SUPERVISOR_METRICS_INTERVAL_SEC 60
+
+#define SUPERVISOR_POOL_SIZE 1024
+#define SUPERVISOR_POOL_INC 1024
+
+struct supervisor_worker_t
+{
+    pid_t pid; /* 0 while the worker is not running */
+    pj_time_val restart_time;
+    unsigned restarts;
+};
+
+/*
+ * Build the shared store, fork the workers and supervise them.
+ * Returns in every worker with its index in *worker,
+ * and in the supervisor with -1 once it has been told to terminate.
+ */
+pj_status_t supervisor_run(const struct announcement_spec_t *specs,
+                           int specs_count,
+                           const struct route_spec_t *routes,
+                           int routes_count,
+                           int workers_count,
+                           int *worker);
+
+#endif  // !_SUPERVISOR_H_
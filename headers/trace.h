@@ -0,0 +1,97 @@
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include <pjlib.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "util.h"
+
+/* Build with TRACE=1 to compile the trace zones in, they cost nothing otherwise */
+#ifndef TRACE_ENABLED
+#define TRACE_ENABLED 0
+#endif
+
+/* Events kept per thread, a power of two */
+#define TRACE_THREAD_EVENTS 16384
+#define TRACE_MAX_THREADS 64
+
+/* SIGUSR2 dumps the zones of the last TRACE_DUMP_SEC into TRACE_PATH */
+#define TRACE_DUMP_SEC 10
+#define TRACE_PATH "/tmp/answering_machine.trace.json"
+
+struct trace_event_t
+{
+    const char *name;
+    pj_uint64_t start;
+    pj_uint64_t end;
+};
+
+/* Written by its own thread only, read by the dump without locking */
+struct trace_buffer_t
+{
+    char thread_name[PJ_MAX_OBJ_NAME];
+    int tid;
+
+    pj_uint32_t head;
+    struct trace_event_t events[TRACE_THREAD_EVENTS];
+};
+
+struct trace_zone_t
+{
+    const char *name;
+    pj_uint64_t start;
+};
+
+#if TRACE_ENABLED
+#define TRACE_ZONE(name) \
+    struct trace_zone_t trace_zone __attribute__((cleanup(trace_zone_end))) = trace_zone_begin(name)
+#else
+#define TRACE_ZONE(name) \
+    do                   \
+    {                    \
+    } while (0)
+#endif
+
+/* Raw CPU timestamp counter, converted to time only when dumping */
+static inline pj_uint64_t trace_tsc(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#elif defined(__aarch64__)
+    pj_uint64_t value;
+
+    __asm__ volatile("mrs %0, cntvct_el0" : "=r"(value));
+    return value;
+#else
+    pj_timestamp ts;
+
+    pj_get_timestamp(&ts);
+    return ts.u64;
+#endif
+}
+
+void trace_record(const char *name, pj_uint64_t start, pj_uint64_t end);
+
+static inline struct trace_zone_t trace_zone_begin(const char *name)
+{
+    struct trace_zone_t zone;
+
+    zone.name = name;
+    zone.start = trace_tsc();
+
+    return zone;
+}
+
+static inline void trace_zone_end(struct trace_zone_t *zone)
+{
+    trace_record(zone->name, zone->start, trace_tsc());
+}
+
+pj_status_t trace_init(pj_pool_factory *factory);
+
+pj_status_t trace_dump(const char *path, unsigned seconds);
+
+#endif  // !_TRACE_H_
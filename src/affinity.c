@@ -0,0 +1,112 @@
+#define _GNU_SOURCE
+
+#include "../headers/affinity.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+
+#define THIS_FILE "affinity.c"
+
+static pj_status_t cpus_parse(const char *cpus, cpu_set_t *set);
+
+pj_status_t affinity_apply(const char *name, const char *cpus, int priority)
+{
+    struct sched_param param;
+    cpu_set_t set;
+    pj_status_t status;
+    int rc;
+
+    if (cpus && *cpus)
+    {
+        status = cpus_parse(cpus, &set);
+        if (status != PJ_SUCCESS)
+        {
+            PJ_LOG(2, (THIS_FILE, "Invalid CPU list %s of %s", cpus, name));
+            return status;
+        }
+
+        rc = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+        if (rc != 0)
+        {
+            app_perror(THIS_FILE, "Unable to set CPU affinity", PJ_STATUS_FROM_OS(rc));
+            return PJ_STATUS_FROM_OS(rc);
+        }
+    }
+
+    if (priority > 0)
+    {
+        pj_bzero(&param, sizeof(param));
+        param.sched_priority = PJ_MIN(priority, sched_get_priority_max(SCHED_FIFO));
+
+        /* Needs CAP_SYS_NICE or an RLIMIT_RTPRIO of at least the priority */
+        rc = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+        if (rc != 0)
+        {
+            app_perror(THIS_FILE, "Unable to set SCHED_FIFO", PJ_STATUS_FROM_OS(rc));
+            return PJ_STATUS_FROM_OS(rc);
+        }
+    }
+
+    if ((cpus && *cpus) || priority > 0)
+    {
+        PJ_LOG(4, (THIS_FILE, "Thread %s runs on CPUs %s at priority %d", name, cpus ? cpus : "", priority));
+    }
+
+    return PJ_SUCCESS;
+}
+
+pj_status_t affinity_parse(const char *cpus)
+{
+    cpu_set_t set;
+
+    return *cpus ? cpus_parse(cpus, &set) : PJ_SUCCESS;
+}
+
+static pj_status_t cpus_parse(const char *cpus, cpu_set_t *set)
+{
+    const char *p = cpus;
+    char *end;
+    long first, last;
+
+    CPU_ZERO(set);
+
+    while (*p)
+    {
+        first = strtol(p, &end, 10);
+        if (end == p || first < 0 || first >= AFFINITY_MAX_CPUS)
+        {
+            return PJ_EINVAL;
+        }
+
+        last = first;
+        p = end;
+
+        if (*p == '-')
+        {
+            last = strtol(p + 1, &end, 10);
+            if (end == p + 1 || last < first || last >= AFFINITY_MAX_CPUS)
+            {
+                return PJ_EINVAL;
+            }
+            p = end;
+        }
+
+        for (; first <= last; first++)
+        {
+            CPU_SET(first, set);
+        }
+
+        if (*p == ',')
+        {
+            p++;
+        }
+        else if (*p)
+        {
+            return PJ_EINVAL;
+        }
+    }
+
+    return CPU_COUNT(set) > 0 ? PJ_SUCCESS : PJ_EINVAL;
+}
@@ -0,0 +1,680 @@
+#include "../headers/announcement.h"
+#include "../headers/signals.h"
+
+#define THIS_FILE "announcement.c"
+
+static pj_status_t version_load(struct announcement_mgr_t *mgr,
+                                struct announcement_t *announcement,
+                                struct announcement_version_t **p_version);
+
+static pj_status_t version_create(struct announcement_mgr_t *mgr,
+                                  struct announcement_t *announcement,
+                                  pj_pool_t *pool,
+                                  pj_int16_t *samples,
+                                  pj_size_t samples_count,
+                                  unsigned clock_rate,
+                                  struct announcement_version_t **p_version);
+
+static void version_destroy(struct announcement_version_t *version);
+
+static void retired_reap(struct announcement_mgr_t *mgr, pj_bool_t force);
+
+static pj_status_t load_parallel(struct announcement_mgr_t *mgr, pj_bool_t files_only);
+
+static void loaded_publish(struct announcement_mgr_t *mgr);
+
+static int loader_thread(void *arg);
+
+static int reload_thread(void *arg);
+
+/* Arguments of one loader thread */
+struct loader_arg_t
+{
+    struct announcement_mgr_t *mgr;
+    pj_bool_t files_only;
+};
+
+pj_status_t announcement_mgr_create(pj_pool_factory *factory,
+                                    pj_pool_t *pool,
+                                    pjmedia_conf *conf,
+                                    struct announcement_mgr_t **mgr)
+{
+    pj_status_t status;
+
+    (*mgr) = PJ_POOL_ZALLOC_T(pool, struct announcement_mgr_t);
+    if (!(*mgr))
+    {
+        return PJ_ENOMEM;
+    }
+
+    (*mgr)->factory = factory;
+    (*mgr)->pool = pool;
+    (*mgr)->conf = conf;
+
+    status = pj_mutex_create_simple(pool, "announcements", &(*mgr)->lock);
+    if (status != PJ_SUCCESS)
+    {
+        return status;
+    }
+
+    return pj_atomic_create(pool, 0, &(*mgr)->next_item);
+}
+
+pj_status_t announcement_add(struct announcement_mgr_t *mgr,
+                             const char *name,
+                             const char *path,
+                             announcement_create_cb create,
+                             unsigned length_msec)
+{
+    struct announcement_t *announcement;
+
+    if (mgr->items_count == MAX_ANNOUNCEMENTS)
+    {
+        return PJ_ETOOMANY;
+    }
+
+    announcement = &mgr->items[mgr->items_count];
+
+    pj_ansi_strncpy(announcement->name, name, sizeof(announcement->name) - 1);
+    if (path)
+    {
+        pj_ansi_strncpy(announcement->path, path, sizeof(announcement->path) - 1);
+    }
+    announcement->create = create;
+    announcement->length_msec = length_msec;
+
+    mgr->items_count++;
+
+    return PJ_SUCCESS;
+}
+
+struct announcement_t *announcement_find(struct announcement_mgr_t *mgr, const char *name)
+{
+    int i;
+
+    for (i = 0; i < mgr->items_count; i++)
+    {
+        if (pj_ansi_strcmp(mgr->items[i].name, name) == 0)
+        {
+            return &mgr->items[i];
+        }
+    }
+
+    return NULL;
+}
+
+pj_status_t announcement_load_all(struct announcement_mgr_t *mgr)
+{
+    pj_status_t status;
+
+    status = load_parallel(mgr, PJ_FALSE);
+    if (status != PJ_SUCCESS)
+    {
+        return status;
+    }
+
+    loaded_publish(mgr);
+
+    return PJ_SUCCESS;
+}
+
+/*
+ * Reload every file based announcement in the background.
+ * New calls switch to the new versions as soon as they are published,
+ * calls in progress keep playing the versions they have acquired.
+ */
+pj_status_t announcement_reload_async(struct announcement_mgr_t *mgr)
+{
+    pj_status_t status;
+
+    if (mgr->reload_thread)
+    {
+        if (mgr->reload_running)
+        {
+            PJ_LOG(3, (THIS_FILE, "Announcement reload is already in progress"));
+            return PJ_EBUSY;
+        }
+
+        pj_thread_join(mgr->reload_thread);
+        pj_thread_destroy(mgr->reload_thread);
+        pj_pool_release(mgr->reload_pool);
+        mgr->reload_thread = NULL;
+    }
+
+    mgr->reload_pool = pj_pool_create(mgr->factory, "announcement_reload", 512, 512, NULL);
+    mgr->reload_running = PJ_TRUE;
+
+    status = pj_thread_create(mgr->reload_pool, "ann_reload", &reload_thread, mgr, 0, 0, &mgr->reload_thread);
+    if (status != PJ_SUCCESS)
+    {
+        app_perror(THIS_FILE, "Unable to start announcement reload thread", status);
+        mgr->reload_running = PJ_FALSE;
+        pj_pool_release(mgr->reload_pool);
+        mgr->reload_thread = NULL;
+    }
+
+    return status;
+}
+
+struct announcement_version_t *announcement_acquire(struct announcement_mgr_t *mgr, struct announcement_t *announcement)
+{
+    struct announcement_version_t *version;
+
+    pj_mutex_lock(mgr->lock);
+
+    version = announcement->current;
+    if (version)
+    {
+        pj_atomic_inc(version->ref_cnt);
+    }
+
+    pj_mutex_unlock(mgr->lock);
+
+    return version;
+}
+
+void announcement_release(struct announcement_mgr_t *mgr, struct announcement_version_t *version)
+{
+    if (version == NULL)
+    {
+        return;
+    }
+
+    if (pj_atomic_dec_and_get(version->ref_cnt) == 0)
+    {
+        /*
+         * The bridge may still be mixing the player in the current tick,
+         * so the version is destroyed only after a grace period.
+         */
+        if (mgr->conf)
+        {
+            pjmedia_conf_remove_port(mgr->conf, version->slot);
+        }
+        pj_gettickcount(&version->retire_time);
+
+        pj_mutex_lock(mgr->lock);
+        version->next_retired = mgr->retired;
+        mgr->retired = version;
+        pj_mutex_unlock(mgr->lock);
+    }
+
+    retired_reap(mgr, PJ_FALSE);
+}
+
+void announcement_mgr_free(struct announcement_mgr_t *mgr)
+{
+    int i;
+
+    if (mgr->reload_thread)
+    {
+        pj_thread_join(mgr->reload_thread);
+        pj_thread_destroy(mgr->reload_thread);
+        pj_pool_release(mgr->reload_pool);
+        mgr->reload_thread = NULL;
+    }
+
+    for (i = 0; i < mgr->items_count; i++)
+    {
+        announcement_release(mgr, mgr->items[i].current);
+        mgr->items[i].current = NULL;
+    }
+
+    retired_reap(mgr, PJ_TRUE);
+
+    pj_mutex_destroy(mgr->lock);
+}
+
+/*
+ * Decode an announcement from its source into one mono PCM buffer at
+ * ANNOUNCEMENT_CLOCK_RATE. Every frame of the source is mixed down in
+ * place and resampled on its own, the result is the only large buffer.
+ */
+pj_status_t announcement_decode(pj_pool_t *pool,
+                                announcement_create_cb create,
+                                const char *path,
+                                unsigned length_msec,
+                                pj_int16_t **samples,
+                                pj_size_t *samples_count,
+                                unsigned *clock_rate)
+{
+    pj_status_t status;
+    pjmedia_port *source;
+    pjmedia_resample *resample = NULL;
+    pjmedia_frame frame;
+    pj_size_t frames, done;
+    pj_int16_t *pcm;
+    unsigned source_rate;
+    unsigned samples_per_frame;
+    unsigned channels;
+    unsigned in_frame, out_frame;
+    unsigned i, c;
+    int sum;
+
+    status = create(pool, path, &source);
+    if (status != PJ_SUCCESS)
+    {
+        return status;
+    }
+
+    channels = PJMEDIA_PIA_CCNT(&source->info);
+    samples_per_frame = PJMEDIA_PIA_SPF(&source->info);
+    if (channels == 0 || samples_per_frame % channels != 0)
+    {
+        pjmedia_port_destroy(source);
+        return PJMEDIA_ENCCHANNEL;
+    }
+
+    source_rate = PJMEDIA_PIA_SRATE(&source->info);
+    in_frame = samples_per_frame / channels;
+    out_frame = in_frame * ANNOUNCEMENT_CLOCK_RATE / source_rate;
+    if ((pj_uint64_t)in_frame * ANNOUNCEMENT_CLOCK_RATE % source_rate != 0)
+    {
+        PJ_LOG(3, (THIS_FILE, "Clock rate %u of %s can not be converted", source_rate, path ? path : "signal"));
+        pjmedia_port_destroy(source);
+        return PJMEDIA_ENCCLOCKRATE;
+    }
+
+    /* Endless sources are rendered for a fixed length, files up to their end */
+    if (length_msec > 0)
+    {
+        frames = (pj_size_t)source_rate * length_msec / 1000;
+    }
+    else
+    {
+        pjmedia_wav_player_info info;
+
+        status = pjmedia_wav_player_get_info(source, &info);
+        if (status != PJ_SUCCESS)
+        {
+            pjmedia_port_destroy(source);
+            return status;
+        }
+        frames = info.size_samples / channels;
+    }
+
+    /* The last frame of the source is always written whole */
+    frames = (frames + in_frame - 1) / in_frame;
+
+    pcm = (pj_int16_t *)pj_pool_alloc(pool, samples_per_frame * sizeof(pj_int16_t));
+    *samples = (pj_int16_t *)pj_pool_alloc(pool, frames * out_frame * sizeof(pj_int16_t));
+    *samples_count = 0;
+    *clock_rate = ANNOUNCEMENT_CLOCK_RATE;
+
+    if (source_rate != ANNOUNCEMENT_CLOCK_RATE)
+    {
+        status = pjmedia_resample_create(
+            pool, PJ_TRUE, PJ_FALSE, 1, source_rate, ANNOUNCEMENT_CLOCK_RATE, in_frame, &resample);
+        if (status != PJ_SUCCESS)
+        {
+            pjmedia_port_destroy(source);
+            return status;
+        }
+    }
+
+    for (done = 0; done < frames; done++)
+    {
+        frame.type = PJMEDIA_FRAME_TYPE_AUDIO;
+        frame.buf = pcm;
+        frame.size = samples_per_frame * sizeof(pj_int16_t);
+
+        status = pjmedia_port_get_frame(source, &frame);
+        if (status != PJ_SUCCESS || frame.type != PJMEDIA_FRAME_TYPE_AUDIO)
+        {
+            break;
+        }
+
+        if (channels > 1)
+        {
+            for (i = 0; i < in_frame; i++)
+            {
+                sum = 0;
+                for (c = 0; c < channels; c++)
+                {
+                    sum += pcm[i * channels + c];
+                }
+                pcm[i] = (pj_int16_t)(sum / (int)channels);
+            }
+        }
+
+        if (resample)
+        {
+            pjmedia_resample_run(resample, pcm, *samples + *samples_count);
+        }
+        else
+        {
+            pj_memcpy(*samples + *samples_count, pcm, in_frame * sizeof(pj_int16_t));
+        }
+
+        *samples_count += out_frame;
+    }
+
+    if (resample)
+    {
+        pjmedia_resample_destroy(resample);
+    }
+    pjmedia_port_destroy(source);
+
+    return *samples_count > 0 ? PJ_SUCCESS : PJ_EEOF;
+}
+
+/* Publish a buffer owned by someone else, e.g. a memory mapped store */
+pj_status_t announcement_publish_external(struct announcement_mgr_t *mgr,
+                                          struct announcement_t *announcement,
+                                          pj_int16_t *samples,
+                                          pj_size_t samples_count,
+                                          unsigned clock_rate,
+                                          void *owner,
+                                          announcement_release_cb release)
+{
+    pj_status_t status;
+    pj_pool_t *pool;
+
+    pool = pj_pool_create(mgr->factory, announcement->name, ANNOUNCEMENT_POOL_SIZE, ANNOUNCEMENT_POOL_INC, NULL);
+    if (!pool)
+    {
+        return PJ_ENOMEM;
+    }
+
+    status = version_create(mgr, announcement, pool, samples, samples_count, clock_rate, &announcement->loaded);
+    if (status != PJ_SUCCESS)
+    {
+        pj_pool_release(pool);
+        return status;
+    }
+
+    announcement->loaded->owner = owner;
+    announcement->loaded->owner_release = release;
+
+    loaded_publish(mgr);
+
+    return PJ_SUCCESS;
+}
+
+/* Decode an announcement from its source into a new memory player */
+static pj_status_t version_load(struct announcement_mgr_t *mgr,
+                                struct announcement_t *announcement,
+                                struct announcement_version_t **p_version)
+{
+    pj_status_t status;
+    pj_pool_t *pool;
+    pj_int16_t *samples;
+    pj_size_t samples_count;
+    unsigned clock_rate;
+
+    pool = pj_pool_create(mgr->factory, announcement->name, ANNOUNCEMENT_POOL_SIZE, ANNOUNCEMENT_POOL_INC, NULL);
+    if (!pool)
+    {
+        return PJ_ENOMEM;
+    }
+
+    status = announcement_decode(pool,
+                                 announcement->create,
+                                 announcement->path[0] ? announcement->path : NULL,
+                                 announcement->length_msec,
+                                 &samples,
+                                 &samples_count,
+                                 &clock_rate);
+    if (status == PJ_SUCCESS)
+    {
+        status = version_create(mgr, announcement, pool, samples, samples_count, clock_rate, p_version);
+    }
+
+    if (status != PJ_SUCCESS)
+    {
+        pj_pool_release(pool);
+    }
+
+    return status;
+}
+
+/* Wrap decoded samples into a memory player on the conf bridge */
+static pj_status_t version_create(struct announcement_mgr_t *mgr,
+                                  struct announcement_t *announcement,
+                                  pj_pool_t *pool,
+                                  pj_int16_t *samples,
+                                  pj_size_t samples_count,
+                                  unsigned clock_rate,
+                                  struct announcement_version_t **p_version)
+{
+    pj_status_t status;
+    struct announcement_version_t *version;
+
+    version = PJ_POOL_ZALLOC_T(pool, struct announcement_version_t);
+    version->pool = pool;
+    version->samples = samples;
+    version->samples_count = samples_count;
+    version->clock_rate = clock_rate;
+
+    /* The manager holds the first reference until the version is replaced */
+    status = pj_atomic_create(pool, 1, &version->ref_cnt);
+    if (status != PJ_SUCCESS)
+    {
+        return status;
+    }
+
+    /* Without a bridge every call reads the samples with its own player */
+    if (mgr->conf)
+    {
+        status = pjmedia_mem_player_create(pool,
+                                           version->samples,
+                                           version->samples_count * sizeof(pj_int16_t),
+                                           version->clock_rate,
+                                           NCHANNELS,
+                                           version->clock_rate * PTIME / 1000,
+                                           NBITS,
+                                           0,
+                                           &version->port);
+        if (status == PJ_SUCCESS)
+        {
+            status = pjmedia_conf_add_port(mgr->conf, pool, version->port, NULL, &version->slot);
+            if (status != PJ_SUCCESS)
+            {
+                pjmedia_port_destroy(version->port);
+            }
+        }
+
+        if (status != PJ_SUCCESS)
+        {
+            pj_atomic_destroy(version->ref_cnt);
+            return status;
+        }
+    }
+
+    version->generation = ++announcement->generation;
+    *p_version = version;
+
+    return PJ_SUCCESS;
+}
+
+static void version_destroy(struct announcement_version_t *version)
+{
+    if (version->port)
+    {
+        pjmedia_port_destroy(version->port);
+    }
+    pj_atomic_destroy(version->ref_cnt);
+
+    if (version->owner_release)
+    {
+        version->owner_release(version->owner);
+    }
+
+    pj_pool_release(version->pool);
+}
+
+static void retired_reap(struct announcement_mgr_t *mgr, pj_bool_t force)
+{
+    struct announcement_version_t **p_version;
+    struct announcement_version_t *version;
+    pj_time_val now;
+
+    pj_gettickcount(&now);
+
+    pj_mutex_lock(mgr->lock);
+
+    p_version = &mgr->retired;
+    while (*p_version)
+    {
+        pj_time_val age = now;
+
+        version = *p_version;
+        PJ_TIME_VAL_SUB(age, version->retire_time);
+
+        if (force || PJ_TIME_VAL_MSEC(age) >= ANNOUNCEMENT_RETIRE_MSEC)
+        {
+            *p_version = version->next_retired;
+            version_destroy(version);
+        }
+        else
+        {
+            p_version = &version->next_retired;
+        }
+    }
+
+    pj_mutex_unlock(mgr->lock);
+}
+
+/* Decode all (or only the file based) announcements on several threads */
+static pj_status_t load_parallel(struct announcement_mgr_t *mgr, pj_bool_t files_only)
+{
+    pj_status_t status = PJ_SUCCESS;
+    pj_pool_t *pool;
+    pj_thread_t *threads[ANNOUNCEMENT_LOADER_THREADS];
+    struct loader_arg_t arg;
+    pj_timestamp start, end;
+    pj_size_t samples_count = 0;
+    int threads_count;
+    int loaded_count = 0;
+    int i;
+
+    pool = pj_pool_create(mgr->factory, "announcement_loader", 512, 512, NULL);
+    if (!pool)
+    {
+        return PJ_ENOMEM;
+    }
+
+    arg.mgr = mgr;
+    arg.files_only = files_only;
+    pj_atomic_set(mgr->next_item, 0);
+
+    threads_count = PJ_MIN(mgr->items_count, ANNOUNCEMENT_LOADER_THREADS);
+
+    pj_get_timestamp(&start);
+
+    /* The calling thread is the first loader */
+    for (i = 1; i < threads_count; i++)
+    {
+        status = pj_thread_create(pool, "ann_loader", &loader_thread, &arg, 0, 0, &threads[i]);
+        if (status != PJ_SUCCESS)
+        {
+            threads_count = i;
+            break;
+        }
+    }
+
+    loader_thread(&arg);
+
+    for (i = 1; i < threads_count; i++)
+    {
+        pj_thread_join(threads[i]);
+        pj_thread_destroy(threads[i]);
+    }
+
+    pj_get_timestamp(&end);
+    pj_pool_release(pool);
+
+    for (i = 0; i < mgr->items_count; i++)
+    {
+        if (mgr->items[i].loaded)
+        {
+            samples_count += mgr->items[i].loaded->samples_count;
+            loaded_count++;
+        }
+    }
+
+    PJ_LOG(3,
+           (THIS_FILE,
+            "Loaded %d announcements (%lu samples) in %u ms using %d threads",
+            loaded_count,
+            (unsigned long)samples_count,
+            pj_elapsed_msec(&start, &end),
+            PJ_MAX(threads_count, 1)));
+
+    return PJ_SUCCESS;
+}
+
+/* Switch new calls to the freshly loaded versions */
+static void loaded_publish(struct announcement_mgr_t *mgr)
+{
+    struct announcement_version_t *old;
+    struct announcement_t *announcement;
+    int i;
+
+    for (i = 0; i < mgr->items_count; i++)
+    {
+        announcement = &mgr->items[i];
+        if (announcement->loaded == NULL)
+        {
+            continue;
+        }
+
+        pj_mutex_lock(mgr->lock);
+        old = announcement->current;
+        announcement->current = announcement->loaded;
+        pj_mutex_unlock(mgr->lock);
+
+        announcement->loaded = NULL;
+
+        PJ_LOG(4,
+               (THIS_FILE,
+                "Announcement %s switched to generation %u",
+                announcement->name,
+                announcement->current->generation));
+
+        /* Drop the manager's reference, calls in progress keep theirs */
+        announcement_release(mgr, old);
+    }
+}
+
+static int loader_thread(void *arg)
+{
+    struct loader_arg_t *loader = (struct loader_arg_t *)arg;
+    struct announcement_mgr_t *mgr = loader->mgr;
+    struct announcement_t *announcement;
+    pj_status_t status;
+    int i;
+
+    while ((i = pj_atomic_inc_and_get(mgr->next_item) - 1) < mgr->items_count)
+    {
+        announcement = &mgr->items[i];
+        announcement->loaded = NULL;
+
+        /* Externally published announcements have nothing to decode */
+        if (announcement->create == NULL || (loader->files_only && announcement->path[0] == '\0'))
+        {
+            continue;
+        }
+
+        status = version_load(mgr, announcement, &announcement->loaded);
+        if (status != PJ_SUCCESS)
+        {
+            PJ_LOG(3, (THIS_FILE, "Unable to load announcement %s, keeping the old version", announcement->name));
+            app_perror(THIS_FILE, "Announcement load error", status);
+            announcement->loaded = NULL;
+        }
+    }
+
+    return 0;
+}
+
+static int reload_thread(void *arg)
+{
+    struct announcement_mgr_t *mgr = (struct announcement_mgr_t *)arg;
+
+    load_parallel(mgr, PJ_TRUE);
+    loaded_publish(mgr);
+
+    mgr->reload_running = PJ_FALSE;
+
+    return 0;
+}
@@ -1,5 +1,8 @@
 #include "../headers/answering_machine.h"
 
+#include <signal.h>
+#include <sys/socket.h>
+
 /* Definitions */
 static pj_status_t ua_module_init(pjsip_module *module);
 
@@ -7,7 +10,39 @@ static pj_status_t logger_module_init(pjsip_module *module);
 
 static pj_status_t global_endpt_init(void);
 
-static pj_status_t transport_init(void);
+static pj_status_t transport_init(pj_bool_t reuse_port, pj_bool_t takeover);
+
+static pj_status_t transport_udp_start(int af, const pj_sockaddr *addr, pj_bool_t reuse_port);
+
+static pj_status_t transport_takeover(void);
+
+static pj_status_t transport_tcp_start(int af, const pj_sockaddr *addr);
+
+static pj_status_t transport_shard_create(int af, const pj_sockaddr *addr, pjsip_transport **transport);
+
+static pj_status_t transport_attach(int af, pj_sock_t sock, pjsip_transport **transport);
+
+static pj_status_t shard_counter_module_init(pjsip_module *module);
+
+static pj_bool_t shard_counter_on_rx_msg(pjsip_rx_data *rdata);
+
+static pj_status_t flood_guard_module_init(pjsip_module *module);
+
+static pj_bool_t flood_guard_on_rx_request(pjsip_rx_data *rdata);
+
+static pj_status_t handoff_module_init(pjsip_module *module);
+
+static pj_bool_t handoff_on_rx_msg(pjsip_rx_data *rdata);
+
+static pj_bool_t handoff_owns(pjsip_rx_data *rdata);
+
+static void drain_start(void);
+
+static void drain_check(void);
+
+static void media_sockets_release(void);
+
+static int sip_worker_thread(void *arg);
 
 static pj_status_t invite_module_init(void);
 
@@ -23,6 +58,14 @@ static pj_status_t call_delete(const pj_str_t *dlg_id);
 
 static pj_status_t socket_find(struct media_socket_t **socket);
 
+static void socket_release(struct media_socket_t *socket);
+
+static unsigned ptime_negotiate(pjsip_rx_data *rdata, unsigned ptime);
+
+static pj_status_t route_player_check(const struct playlist_t *playlists, int playlists_count);
+
+static void ptime_attr_add(pj_pool_t *pool, pjmedia_sdp_session *sdp, unsigned ptime);
+
 static void answering_machine_free(struct answering_machine_t *machine_ptr);
 
 static pj_bool_t logging_on_rx_msg(pjsip_rx_data *rdata);
@@ -37,17 +80,67 @@ static void on_ringing_timer_expire_callback(pj_timer_heap_t *timer_heap, struct
 
 static void on_active_call_timer_expire_callback(pj_timer_heap_t *timer_heap, struct pj_timer_entry *entry);
 
+static void call_setup_abort(struct call_t *call, pjsip_dialog *dlg, pjsip_rx_data *rdata, int code);
+
+static void call_hangup(struct call_t *call);
+
+static void call_on_dtmf(pjmedia_stream *stream, void *user_data, int digit);
+
 static pj_bool_t on_rx_request(pjsip_rx_data *rdata);
 
+static void call_answer(pjsip_rx_data *rdata,
+                        const pjsip_sip_uri *uri,
+                        struct route_table_t *routes,
+                        struct route_t *route,
+                        struct prompt_t *prompt,
+                        const pj_timestamp *start,
+                        pj_uint64_t invite_msec);
+
+static void call_stream_stat(struct call_t *call, pjmedia_stream *stream);
+
+static int shard_find(pjsip_transport *transport);
+
+static void on_media_sweep_timer_callback(pj_timer_heap_t *timer_heap, struct pj_timer_entry *entry);
+
+static void on_reload_signal(int signo);
+
+static void on_trace_signal(int signo);
+
+static void on_drain_signal(int signo);
+
+static void on_metrics_timer_callback(pj_timer_heap_t *timer_heap, struct pj_timer_entry *entry);
+
+static void on_soak_done(int result);
+
+static void on_replay_done(int result);
+
+static void replay_usage_get(struct replay_usage_t *usage);
+
+static void on_direct_tick(void *user_data);
+
 /* Global variables */
 struct answering_machine_t *machine;
 
 pj_caching_pool cp;
 
-pj_status_t answering_machine_create(pj_pool_t **pool)
+/* Set by SIGHUP, announcements are reloaded from the SIP loop */
+static volatile sig_atomic_t reload_requested = 0;
+
+/* Set by SIGUSR2, the trace is dumped from the SIP loop */
+static volatile sig_atomic_t trace_requested = 0;
+
+/* Set by SIGUSR1, the machine finishes its calls and quits */
+static volatile sig_atomic_t drain_requested = 0;
+
+pj_status_t answering_machine_create(pj_pool_t **pool, int worker, int sip_port, int rtp_port, pj_bool_t takeover)
 {
+    const struct settings_t *settings = settings_get();
     pj_status_t status;
+#if !EMBEDDED_PROFILE
     pjmedia_port *master_port;
+#endif
+    char cdr_path[sizeof(CDR_PATH) + 8];
+    char handoff_path[sizeof(HANDOFF_PATH) + 8];
 
     /* Init PJLIB */
     status = pj_init();
@@ -55,33 +148,75 @@ pj_status_t answering_machine_create(pj_pool_t **pool)
 
     pj_log_set_level(LOGGING_LEVEL);
 
+    settings_report();
+
     /* Init PJLIB-UTIL */
     status = pjlib_util_init();
     PJ_ASSERT_RETURN(status == PJ_SUCCESS, 1);
     
     /* Create pool factory and machine pool */
-    pj_caching_pool_init(&cp, &pj_pool_factory_default_policy, 0);
+    pj_caching_pool_init(&cp, &pj_pool_factory_default_policy, EMBEDDED_PROFILE ? EMBEDDED_CP_CAPACITY : 0);
+    mem_stats_init(&cp);
+
+    status = trace_init(&cp.factory);
+    PJ_ASSERT_RETURN(status == PJ_SUCCESS, 1);
 
+#if EMBEDDED_PROFILE
+    /* Memory of the embedded profile is set aside once, the pool never grows */
+    *pool = pj_pool_create(&cp.factory, 
+                           "answering_machine_pool", 
+                           settings->machine_pool_size + settings->max_calls * EMBEDDED_CALL_ARENA_SIZE, 
+                           0, 
+                           NULL);
+#else
     *pool = pj_pool_create(&cp.factory, 
                            "answering_machine_pool", 
-                           MACHINE_POOL_SIZE, 
-                           MACHINE_POOL_INC, 
+                           settings->machine_pool_size, 
+                           settings->machine_pool_size, 
                            NULL);
+#endif
+    PJ_ASSERT_RETURN(*pool != NULL, PJ_ENOMEM);
+    mem_stats_track(*pool);
 
     /* Init machine */
-    machine = (struct answering_machine_t *)pj_pool_alloc(*pool, sizeof(*machine));
-    machine->calls = (struct call_t **)pj_pool_alloc(*pool, MAX_CALLS * sizeof(*machine->calls));
+    machine = (struct answering_machine_t *)pj_pool_zalloc(*pool, sizeof(*machine));
+    machine->calls = (struct call_t **)pj_pool_calloc(*pool, settings->max_calls, sizeof(*machine->calls));
     machine->med_sockets =
-        (struct media_socket_t **)pj_pool_alloc(*pool, MAX_MEDIA_CNT * sizeof(*machine->med_sockets));
+        (struct media_socket_t **)pj_pool_calloc(*pool, settings->max_media, sizeof(*machine->med_sockets));
 
     machine->cp = &cp;
     machine->pool = *pool;
     machine->calls_count = 0;
-    machine->calls_capacity = MAX_CALLS;
+    machine->calls_capacity = (int)settings->max_calls;
+    machine->worker = worker;
+    machine->sip_port = sip_port;
+    machine->rtp_port = rtp_port;
+
+    /* Calls are shared by all SIP threads */
+    status = pj_mutex_create_simple(machine->pool, "calls", &machine->calls_lock);
+    PJ_ASSERT_RETURN(status == PJ_SUCCESS, 1);
+
+#if EMBEDDED_PROFILE
+    /* A slot per call, a call beyond max_calls finds none */
+    status = arena_create(machine->pool, EMBEDDED_CALL_ARENA_SIZE, (int)settings->max_calls, &machine->call_arena);
+    PJ_ASSERT_RETURN(status == PJ_SUCCESS, 1);
+#endif
 
     global_endpt_init();
 
-    transport_init();
+    /* A standalone instance hands its SIP sockets to the one replacing it, one path per SIP port */
+    if (worker < 0)
+    {
+        pj_ansi_snprintf(handoff_path, sizeof(handoff_path), "%s.%d", HANDOFF_PATH, sip_port);
+
+        status = handoff_create(machine->pool, machine->g_endpt, handoff_path, &machine->handoff);
+        PJ_ASSERT_RETURN(status == PJ_SUCCESS, 1);
+    }
+
+    machine->takeover = takeover && machine->handoff;
+
+    /* Workers always share the SIP port with their siblings */
+    transport_init(worker >= 0, machine->takeover);
 
     /* Init modules */
     status = pjsip_tsx_layer_init_module(machine->g_endpt);
@@ -94,6 +229,12 @@ pj_status_t answering_machine_create(pj_pool_t **pool)
 
     ua_module_init(&machine->mod_simpleua);
     logger_module_init(&machine->msg_logger);
+    shard_counter_module_init(&machine->mod_shard_counter);
+    flood_guard_module_init(&machine->mod_flood_guard);
+    handoff_module_init(&machine->mod_handoff);
+
+    status = reject_create(machine->pool, &machine->reject);
+    PJ_ASSERT_RETURN(status == PJ_SUCCESS, 1);
 
     status = pjsip_100rel_init_module(machine->g_endpt);
     PJ_ASSERT_RETURN(status == PJ_SUCCESS, status);
@@ -102,8 +243,29 @@ pj_status_t answering_machine_create(pj_pool_t **pool)
     status = pjsip_endpt_register_module(machine->g_endpt, &machine->mod_simpleua);
     PJ_ASSERT_RETURN(status == PJ_SUCCESS, 1);
 
+#if !EMBEDDED_PROFILE
     status = pjsip_endpt_register_module(machine->g_endpt, &machine->msg_logger);
     PJ_ASSERT_RETURN(status == PJ_SUCCESS, 1);
+#endif
+
+    status = pjsip_endpt_register_module(machine->g_endpt, &machine->mod_shard_counter);
+    PJ_ASSERT_RETURN(status == PJ_SUCCESS, 1);
+
+    status = pjsip_endpt_register_module(machine->g_endpt, &machine->mod_flood_guard);
+    PJ_ASSERT_RETURN(status == PJ_SUCCESS, 1);
+
+    if (machine->handoff)
+    {
+        status = pjsip_endpt_register_module(machine->g_endpt, &machine->mod_handoff);
+        PJ_ASSERT_RETURN(status == PJ_SUCCESS, 1);
+    }
+
+    /* Keep trunk peer connections open between calls */
+    if (machine->sip_tcp_factory)
+    {
+        status = sip_peer_pool_create(machine->pool, machine->g_endpt, &machine->sip_peers);
+        PJ_ASSERT_RETURN(status == PJ_SUCCESS, 1);
+    }
 
     media_endpt_init();
 
@@ -113,23 +275,52 @@ pj_status_t answering_machine_create(pj_pool_t **pool)
 
     media_transport_create();
 
+#if EMBEDDED_PROFILE
+    /* No bridge, every tick of this clock plays the calls straight into their streams */
+    status = media_clock_direct_create(machine->pool,
+                                       settings->clock_rate,
+                                       settings->nsamples,
+                                       settings->media_clock_cpus,
+                                       (int)settings->media_clock_priority,
+                                       &on_direct_tick,
+                                       NULL,
+                                       &machine->direct_clock);
+    PJ_ASSERT_RETURN(status == PJ_SUCCESS, 1);
+#else
+    /* Calls with their players and recordings plus two versions of every announcement while it is being swapped */
     status = pjmedia_conf_create(machine->pool, 
-                                 MAX_CALLS, 
-                                 CLOCK_RATE, 
+                                 settings->bridge_ports, 
+                                 settings->clock_rate, 
                                  NCHANNELS, 
-                                 NSAMPLES, 
+                                 settings->nsamples, 
                                  NBITS, 
                                  PJMEDIA_CONF_NO_DEVICE, 
                                  &machine->conf);
     PJ_ASSERT_RETURN(status == PJ_SUCCESS, 1);
 
     master_port = pjmedia_conf_get_master_port(machine->conf);
+
+    /* Every clock tick of the bridge passes through the probe */
+    status = media_clock_probe_create(machine->pool, master_port, &machine->clock_probe);
+    PJ_ASSERT_RETURN(status == PJ_SUCCESS, 1);
+
+    media_clock_probe_sched_set(
+        machine->clock_probe, settings->media_clock_cpus, (int)settings->media_clock_priority);
+
+    /* Groups of looping announcements send on the ticks of the bridge */
+    if (settings->broadcast)
+    {
+        status = broadcaster_create(machine->pool, &machine->broadcaster);
+        PJ_ASSERT_RETURN(status == PJ_SUCCESS, 1);
+
+        media_clock_probe_tick_set(machine->clock_probe, &broadcaster_tick, machine->broadcaster);
+    }
     
     /* Create null media port */
     pjmedia_null_port_create(machine->pool,
-                             CLOCK_RATE,
+                             settings->clock_rate,
                              NCHANNELS,
-                             NSAMPLES,
+                             settings->nsamples,
                              NBITS,
                              &machine->null_port);
     
@@ -139,7 +330,7 @@ pj_status_t answering_machine_create(pj_pool_t **pool)
      */
     pjmedia_master_port_create(machine->pool,
                                machine->null_port, 
-                               master_port, 
+                               &machine->clock_probe->base, 
                                0, 
                                &machine->master_port);
     PJ_ASSERT_RETURN(status == PJ_SUCCESS, 1);
@@ -148,578 +339,2188 @@ pj_status_t answering_machine_create(pj_pool_t **pool)
      * Start the media flow 
      */
     pjmedia_master_port_start(machine->master_port);
+#endif
 
-    machine->table = pj_hash_create(machine->pool, 1000);
+    /* Calls are rejected until the first generation of routes is committed */
+    status = pj_rwmutex_create(machine->pool, "routes", &machine->routes_lock);
+    PJ_ASSERT_RETURN(status == PJ_SUCCESS, 1);
 
-    return status;
-}
+    status = route_table_create(&machine->cp->factory, settings->route_buckets, 0, &machine->routes);
+    PJ_ASSERT_RETURN(status == PJ_SUCCESS, 1);
 
-void answering_machine_calls_recv(void)
-{
-    PJ_LOG(3, (THIS_FILE, "Ready to accept incoming calls..."));
-    pj_time_val timeout = {ENDPT_TIMEOUT_SEC, ENDPT_TIMEOUT_MSEC};
+    /* Create announcement store, without the bridge it keeps no players */
+    status = announcement_mgr_create(&machine->cp->factory, machine->pool, machine->conf, &machine->announcements);
+    PJ_ASSERT_RETURN(status == PJ_SUCCESS, 1);
 
-    while (1)
+    /* Index the prompt library, prompts are decoded when a call first asks for them */
+    status = prompt_cache_create(
+        &machine->cp->factory, PROMPT_DIR, settings->prompt_cache_size, &machine->announcements->prompts);
+    if (status != PJ_SUCCESS)
     {
-        pjsip_endpt_handle_events(machine->g_endpt, &timeout);
+        app_perror(THIS_FILE, "Unable to index prompts", status);
+        return status;
     }
 
-    answering_machine_free(machine);
-}
-
-void answering_machine_signal_add(pjmedia_port *signal, const char *username)
-{
-    unsigned int *p_slot = (unsigned int *) pj_pool_alloc(machine->pool, sizeof(*p_slot));
-
-    pjmedia_conf_add_port(machine->conf, machine->pool, signal, NULL, p_slot);
-    pj_hash_set(machine->pool, machine->table, username, PJ_HASH_KEY_STRING, 0, p_slot);
-}
-
-static pj_status_t ua_module_init(pjsip_module *module)
-{
-    if (module == NULL)
+    /* Every worker writes its own CDR file */
+    if (worker >= 0)
     {
-        app_perror(THIS_FILE, "Module is NULL", 1);
+        pj_ansi_snprintf(cdr_path, sizeof(cdr_path), "%s.%d", CDR_PATH, worker);
     }
-
-    module->prev = NULL;
-    module->next = NULL;
-    module->name = pj_str("mod-simpleua");
-    module->id = -1;
-    module->priority = PJSIP_MOD_PRIORITY_APPLICATION;
-
-    module->load = NULL;
-    module->start = NULL;
-    module->stop = NULL;
-    module->unload = NULL;
-
-    module->on_rx_request = &on_rx_request;
-    module->on_rx_response = NULL;
-    module->on_tx_request = NULL;
-    module->on_tx_response = NULL;
-    module->on_tsx_state = NULL;
-
-    return PJ_SUCCESS;
-}
-
-static pj_status_t logger_module_init(pjsip_module *module)
-{
-    if (module == NULL)
+    else
     {
-        app_perror(THIS_FILE, "Logger module is NULL", 1);
+        pj_ansi_strcpy(cdr_path, CDR_PATH);
     }
 
-    module->prev = NULL;
-    module->next = NULL;
-    module->name = pj_str("mod-msg-log");
-    module->id = -1;
-    module->priority = PJSIP_MOD_PRIORITY_TRANSPORT_LAYER - 1;
-
-    module->load = NULL;
-    module->start = NULL;
-    module->stop = NULL;
-    module->unload = NULL;
-
-    module->on_rx_request = &logging_on_rx_msg;
-    module->on_rx_response = &logging_on_rx_msg;
-    module->on_tx_request = &logging_on_tx_msg;
-    module->on_tx_response = &logging_on_tx_msg;
-    module->on_tsx_state = NULL;
-
-    return PJ_SUCCESS;
-}
-
-static pj_status_t global_endpt_init(void)
-{
-    pj_status_t status;
-    const pj_str_t *hostname;
-    const char *endpt_name;
-
-    
-    hostname = pj_gethostname();
-    endpt_name = hostname->ptr;
+    status = cdr_writer_create(machine->pool, cdr_path, &machine->cdr);
+    if (status != PJ_SUCCESS)
+    {
+        app_perror(THIS_FILE, "Unable to start CDR writer", status);
+        return status;
+    }
 
-    /* Create the endpoint: */
-    status = pjsip_endpt_create(&machine->cp->factory, endpt_name, &machine->g_endpt);
+    status = recorder_create(&machine->cp->factory,
+                             machine->pool,
+                             RECORDER_DIR,
+                             settings->record_max_sec,
+                             settings->record_max_bytes,
+                             &machine->recorder);
+    if (status != PJ_SUCCESS)
+    {
+        app_perror(THIS_FILE, "Unable to start voicemail writer", status);
+        return status;
+    }
 
-    PJ_ASSERT_RETURN(status == PJ_SUCCESS, 1);
+    signal(SIGHUP, &on_reload_signal);
+    signal(SIGUSR2, &on_trace_signal);
+    signal(SIGUSR1, &on_drain_signal);
 
     return status;
 }
 
-static pj_status_t transport_init(void)
+int answering_machine_calls_recv(void)
 {
+    pj_time_val timeout = {ENDPT_TIMEOUT_SEC, ENDPT_TIMEOUT_MSEC};
+    pj_time_val metrics_interval = {METRICS_INTERVAL_SEC, 0};
+    pj_time_val sweep_interval = {MEDIA_SWEEP_INTERVAL_SEC, 0};
+    pj_sock_t sock_list[MAX_SIP_SHARDS];
     pj_status_t status;
-    pj_sockaddr addr;
-    int af = AF;
-
-    pj_sockaddr_init(af, &addr, NULL, (pj_uint16_t)SIP_PORT);
+    int exit_code;
+    int i;
 
-    if (af == pj_AF_INET())
+    /* Taken over only now, the first call the machine reads finds its routes and announcements */
+    if (machine->takeover && transport_takeover() != PJ_SUCCESS)
     {
-        status = pjsip_udp_transport_start(machine->g_endpt, &addr.ipv4, NULL, 1, NULL);
+        answering_machine_free(machine);
+        return 1;
     }
-    else if (af == pj_AF_INET6())
+
+    /* The path of the previous instance is taken over as well */
+    if (machine->handoff)
     {
-        status = pjsip_udp_transport_start6(machine->g_endpt, &addr.ipv6, NULL, 1, NULL);
+        status = handoff_listen(machine->handoff);
+        if (status != PJ_SUCCESS)
+        {
+            app_perror(THIS_FILE, "Unable to wait for a handoff", status);
+        }
     }
-    else
+
+    /* Handed over as they are, the transports keep using them */
+    for (i = 0; i < machine->sip_shards_count; i++)
     {
-        status = PJ_EAFNOTSUP;
+        sock_list[i] = pjsip_udp_transport_get_socket(machine->sip_transports[i]);
     }
 
-    if (status != PJ_SUCCESS)
+    /* The calling thread polls for the first shard */
+    for (i = 1; i < machine->sip_shards_count; i++)
     {
-        app_perror(THIS_FILE, "Unable to start UDP transport", status);
-        return FAILURE;
+        status = pj_thread_create(machine->pool, "sip_worker", &sip_worker_thread, NULL, 0, 0, &machine->sip_threads[i]);
+        if (status != PJ_SUCCESS)
+        {
+            app_perror(THIS_FILE, "Unable to start SIP worker thread", status);
+        }
     }
 
-    return status;
-}
+    pj_timer_entry_init(&machine->metrics_timer, 1, NULL, &on_metrics_timer_callback);
+    pjsip_endpt_schedule_timer(machine->g_endpt, &machine->metrics_timer, &metrics_interval);
 
-static pj_status_t invite_module_init(void)
-{
-    pjsip_inv_callback inv_cb;
-    pj_status_t status;
+    pj_timer_entry_init(&machine->media_sweep_timer, 2, NULL, &on_media_sweep_timer_callback);
+    pjsip_endpt_schedule_timer(machine->g_endpt, &machine->media_sweep_timer, &sweep_interval);
 
-    /* Init the callback for INVITE session: */
-    pj_bzero(&inv_cb, sizeof(inv_cb));
-    inv_cb.on_state_changed = &call_on_state_changed;
-    inv_cb.on_media_update = &call_on_media_update;
+    affinity_apply("sip", settings_get()->sip_thread_cpus, (int)settings_get()->sip_thread_priority);
 
-    /* Initialize invite session module:  */
-    status = pjsip_inv_usage_init(machine->g_endpt, &inv_cb);
-    PJ_ASSERT_RETURN(status == PJ_SUCCESS, 1);
+    PJ_LOG(3,
+           (THIS_FILE,
+            "Worker %d ready to accept incoming calls on %d SIP listeners...",
+            machine->worker,
+            machine->sip_shards_count));
 
-    return status;
-}
+    while (!machine->quit)
+    {
+        pjsip_endpt_handle_events(machine->g_endpt, &timeout);
 
-static pj_status_t media_endpt_init(void)
-{
-    pj_status_t status;
+        if (reload_requested)
+        {
+            reload_requested = 0;
+            if (machine->store_path)
+            {
+                answering_machine_shared_store_load(machine->store_path);
+            }
+            else
+            {
+                announcement_reload_async(machine->announcements);
+            }
+        }
 
-#if PJ_HAS_THREADS
-    status = pjmedia_endpt_create(&machine->cp->factory, NULL, 1, &machine->g_med_endpt);
-#else /* PJ_HAS_THREADS */
-    status = pjmedia_endpt_create(
-        &machine->cp->factory, pjsip_endpt_get_ioqueue(machine->g_endpt), 0, &machine->g_med_endpt);
-#endif /* PJ_HAS_THREADS */
+        if (trace_requested)
+        {
+            trace_requested = 0;
+            trace_dump(TRACE_PATH, TRACE_DUMP_SEC);
+        }
 
-    PJ_ASSERT_RETURN(status == PJ_SUCCESS, 1);
+        if (drain_requested && !machine->draining)
+        {
+            drain_requested = 0;
+            drain_start();
+        }
 
-    /* Create pool */
-    machine->media_pool = pjmedia_endpt_create_pool(machine->g_med_endpt, 
-                                                    "Media pool", 
-                                                    MEDIA_POOL_SIZE, 
-                                                    MEDIA_POOL_INC);
+        if (machine->handoff)
+        {
+            /* The new instance reads the SIP sockets from now on, new calls are relayed to it */
+            if (handoff_give(machine->handoff, sock_list, machine->sip_shards_count) && !machine->draining)
+            {
+                drain_start();
+            }
 
-    /* Add PCMA/PCMU codec to the media endpoint */
-#if defined(PJMEDIA_HAS_G711_CODEC) && PJMEDIA_HAS_G711_CODEC != 0
-    status = pjmedia_codec_g711_init(machine->g_med_endpt);
-    PJ_ASSERT_RETURN(status == PJ_SUCCESS, 1);
-#endif
+            handoff_poll(machine->handoff, machine->sip_transports[0]);
+        }
 
-    return status;
+        if (machine->draining)
+        {
+            drain_check();
+        }
+    }
+
+    exit_code = machine->exit_code;
+    answering_machine_free(machine);
+
+    return exit_code;
 }
 
-static pj_status_t media_transport_create(void)
+/* Run synthetic calls against the own SIP port, the machine quits once they are done */
+pj_status_t answering_machine_soak_start(unsigned long calls, int concurrency, unsigned flood_rate)
 {
-    int i;
     pj_status_t status;
 
-    for (i = 0; i < MAX_MEDIA_CNT; ++i)
+    status = soak_start(
+        machine->pool, machine->sip_port, calls, concurrency, flood_rate, &on_soak_done, &machine->soak);
+    if (status != PJ_SUCCESS)
     {
-        status = media_socket_create(machine->pool, 
-                                     machine->g_med_endpt, 
-                                     AF, 
-                                     RTP_PORT + i * 2, 
-                                     &machine->med_sockets[i]);
-        machine->g_sock_info[i] = machine->med_sockets[i]->sock_info;
+        app_perror(THIS_FILE, "Unable to start soak", status);
     }
 
     return status;
 }
 
-static pj_status_t call_add(struct call_t *call)
+/* Calls of the capture that are not hung up get the longest life of a call to end */
+pj_status_t answering_machine_replay_start(const char *path, unsigned scale)
 {
-    int i = machine->calls_count;
+    const struct settings_t *settings = settings_get();
+    pj_status_t status;
 
-    if (machine->calls_count == machine->calls_capacity)
+    status = replay_start(&machine->cp->factory,
+                          machine->sip_port,
+                          path,
+                          scale,
+                          settings->ringing_time + settings->media_session_time + settings->record_max_sec,
+                          &replay_usage_get,
+                          &on_replay_done,
+                          &machine->replay);
+    if (status != PJ_SUCCESS)
     {
-        return FAILURE;
+        app_perror(THIS_FILE, "Unable to start replay", status);
     }
 
-    machine->calls[i] = call;
-    machine->calls_count++;
+    return status;
+}
 
-    return PJ_SUCCESS;
+pj_status_t answering_machine_announcement_add(const char *name,
+                                              const char *path,
+                                              announcement_create_cb create,
+                                              unsigned length_msec)
+{
+    return announcement_add(machine->announcements, name, path, create, length_msec);
 }
 
-static pj_status_t call_find(const pj_str_t *dlg_id, struct call_t **call)
+pj_status_t answering_machine_announcements_load(void)
 {
-    int i = 0;
+    return announcement_load_all(machine->announcements);
+}
 
-    for (i = 0; i < machine->calls_count; i++)
-    {
-        if (pj_strcmp(&machine->calls[i]->call_id, dlg_id) == 0)
-        {
-            *call = machine->calls[i];
+/*
+ * Play announcements straight from the store mapped by all workers
+ * and add its routes. Versions keep the mapping alive until the last
+ * call playing them is gone, so a reload only has to map the new file.
+ */
+pj_status_t answering_machine_shared_store_load(const char *path)
+{
+    pj_status_t status;
+    struct shared_store_t *store;
+    const struct shared_store_entry_t *entry;
+    const struct shared_store_route_t *route;
+    struct announcement_t *announcement;
+    unsigned i;
+
+    status = shared_store_map(&machine->cp->factory, path, &store);
+    if (status != PJ_SUCCESS)
+    {
+        app_perror(THIS_FILE, "Unable to map shared store", status);
+        return status;
+    }
+
+    for (i = 0; i < store->header->entries_count; i++)
+    {
+        entry = &store->header->entries[i];
+
+        announcement = announcement_find(machine->announcements, entry->name);
+        if (announcement == NULL)
+        {
+            status = announcement_add(machine->announcements, entry->name, NULL, NULL, 0);
+            if (status != PJ_SUCCESS)
+            {
+                app_perror(THIS_FILE, "Unable to add shared announcement", status);
+                continue;
+            }
+            announcement = announcement_find(machine->announcements, entry->name);
+        }
+
+        shared_store_add_ref(store);
+        status = announcement_publish_external(machine->announcements,
+                                               announcement,
+                                               shared_store_samples(store, i),
+                                               entry->samples_count,
+                                               entry->clock_rate,
+                                               store,
+                                               &shared_store_dec_ref);
+        if (status != PJ_SUCCESS)
+        {
+            app_perror(THIS_FILE, "Unable to publish shared announcement", status);
+            shared_store_dec_ref(store);
+        }
+    }
+
+    /* Keys and targets are copied into the new generation, it does not depend on the mapping */
+    status = answering_machine_routes_begin();
+    if (status != PJ_SUCCESS)
+    {
+        app_perror(THIS_FILE, "Unable to create routes", status);
+        shared_store_dec_ref(store);
+        return status;
+    }
+
+    for (i = 0; i < store->header->routes_count; i++)
+    {
+        route = &store->header->routes[i];
+
+        status = answering_machine_signal_add(
+            route->announcement, route->username, route->ptime, route->menu[0] != '\0' ? route->menu : NULL);
+        if (status != PJ_SUCCESS)
+        {
+            app_perror(THIS_FILE, "Unable to add shared route", status);
+        }
+    }
+
+    answering_machine_routes_commit();
+
+    PJ_LOG(3,
+           (THIS_FILE,
+            "Worker %d switched to shared store generation %u",
+            machine->worker,
+            store->header->generation));
+
+    /* Drop the mapping reference, published versions hold their own */
+    shared_store_dec_ref(store);
+    machine->store_path = path;
+
+    return PJ_SUCCESS;
+}
+
+pj_status_t answering_machine_routes_begin(void)
+{
+    PJ_ASSERT_RETURN(machine->routes_next == NULL, PJ_EINVALIDOP);
+
+    return route_table_create(
+        &machine->cp->factory, settings_get()->route_buckets, machine->routes_generation + 1, &machine->routes_next);
+}
+
+/* Route a username of the next generation to an announcement or to a playlist of them, optionally behind a menu */
+pj_status_t answering_machine_signal_add(const char *signal, const char *username, unsigned ptime, const char *menu)
+{
+    struct route_table_t *routes = machine->routes_next;
+    struct announcement_t *announcement = NULL;
+    struct playlist_t *playlist = NULL;
+    struct ivr_menu_t *ivr_menu = NULL;
+    struct route_t *route;
+    pj_status_t status;
+
+    PJ_ASSERT_RETURN(routes != NULL, PJ_EINVALIDOP);
+
+    if (menu)
+    {
+        /* The route target is the first target of the menu */
+        ivr_menu = PJ_POOL_ZALLOC_T(routes->pool, struct ivr_menu_t);
+
+        status = ivr_menu_parse(machine->announcements, signal, menu, ivr_menu);
+        if (status != PJ_SUCCESS)
+        {
+            return status;
+        }
+    }
+    else if (EMBEDDED_PROFILE || playlist_is_spec(signal))
+    {
+        /* Without the bridge a plain announcement is a playlist of itself */
+        playlist = PJ_POOL_ZALLOC_T(routes->pool, struct playlist_t);
+
+        status = playlist_parse(machine->announcements, signal, playlist);
+        if (status != PJ_SUCCESS)
+        {
+            return status;
+        }
+    }
+    else
+    {
+        announcement = announcement_find(machine->announcements, signal);
+        if (announcement == NULL || announcement->current == NULL)
+        {
+            PJ_LOG(3, (THIS_FILE, "Announcement %s is not loaded", signal));
+            return PJ_ENOTFOUND;
+        }
+    }
+
+    if (ptime == 0)
+    {
+        ptime = MEDIA_PTIME;
+    }
+    if (ptime % MEDIA_PTIME_STEP != 0 || ptime > MEDIA_MAX_PTIME)
+    {
+        PJ_LOG(3, (THIS_FILE, "Unsupported ptime %u of %s", ptime, username));
+        return PJ_EINVAL;
+    }
+
+    /* A target that can not be played fails here rather than on every call */
+    if (ivr_menu || playlist)
+    {
+        status = route_player_check(ivr_menu ? ivr_menu->targets : playlist, ivr_menu ? ivr_menu->targets_count : 1);
+        if (status != PJ_SUCCESS)
+        {
+            PJ_LOG(1, (THIS_FILE, "Calls to %s can not be answered with %s", username, signal));
+            return status;
+        }
+    }
+
+    /* Nobody reads the next generation yet */
+    route = route_table_add(routes, username);
+    route->announcement = announcement;
+    route->playlist = playlist;
+    route->menu = ivr_menu;
+    route->ptime = ptime;
+
+    return PJ_SUCCESS;
+}
+
+void answering_machine_routes_commit(void)
+{
+    struct route_table_t *previous;
+
+    PJ_ASSERT_ON_FAIL(machine->routes_next != NULL, return);
+
+    pj_rwmutex_lock_write(machine->routes_lock);
+    previous = machine->routes;
+    machine->routes = machine->routes_next;
+    pj_rwmutex_unlock_write(machine->routes_lock);
+
+    machine->routes_next = NULL;
+    machine->routes_generation = machine->routes->generation;
+
+    PJ_LOG(4, (THIS_FILE, "Routes of generation %u are current", machine->routes_generation));
+
+    /* Calls still playing the previous routes hold their own references */
+    route_table_release(previous);
+}
+
+/* Create the player of a route once, its own group lock goes with it */
+static pj_status_t route_player_check(const struct playlist_t *playlists, int playlists_count)
+{
+    struct playlist_port_t *player;
+    pj_status_t status;
+    pj_pool_t *pool;
+
+    pool = pj_pool_create(&machine->cp->factory, "route_check", MEDIA_POOL_SIZE, MEDIA_POOL_SIZE, NULL);
+    if (!pool)
+    {
+        return PJ_ENOMEM;
+    }
+
+    status = playlist_port_create(pool, machine->announcements, playlists, playlists_count, NULL, &player);
+    if (status == PJ_SUCCESS)
+    {
+        playlist_port_release(player);
+    }
+
+    pj_pool_release(pool);
+
+    return status;
+}
+
+static pj_status_t ua_module_init(pjsip_module *module)
+{
+    if (module == NULL)
+    {
+        app_perror(THIS_FILE, "Module is NULL", 1);
+    }
+
+    module->prev = NULL;
+    module->next = NULL;
+    module->name = pj_str("mod-simpleua");
+    module->id = -1;
+    module->priority = PJSIP_MOD_PRIORITY_APPLICATION;
+
+    module->load = NULL;
+    module->start = NULL;
+    module->stop = NULL;
+    module->unload = NULL;
+
+    module->on_rx_request = &on_rx_request;
+    module->on_rx_response = NULL;
+    module->on_tx_request = NULL;
+    module->on_tx_response = NULL;
+    module->on_tsx_state = NULL;
+
+    return PJ_SUCCESS;
+}
+
+static pj_status_t logger_module_init(pjsip_module *module)
+{
+    if (module == NULL)
+    {
+        app_perror(THIS_FILE, "Logger module is NULL", 1);
+    }
+
+    module->prev = NULL;
+    module->next = NULL;
+    module->name = pj_str("mod-msg-log");
+    module->id = -1;
+    module->priority = PJSIP_MOD_PRIORITY_TRANSPORT_LAYER - 1;
+
+    module->load = NULL;
+    module->start = NULL;
+    module->stop = NULL;
+    module->unload = NULL;
+
+    module->on_rx_request = &logging_on_rx_msg;
+    module->on_rx_response = &logging_on_rx_msg;
+    module->on_tx_request = &logging_on_tx_msg;
+    module->on_tx_response = &logging_on_tx_msg;
+    module->on_tsx_state = NULL;
+
+    return PJ_SUCCESS;
+}
+
+static pj_status_t shard_counter_module_init(pjsip_module *module)
+{
+    if (module == NULL)
+    {
+        app_perror(THIS_FILE, "Shard counter module is NULL", 1);
+    }
+
+    module->prev = NULL;
+    module->next = NULL;
+    module->name = pj_str("mod-shard-counter");
+    module->id = -1;
+    module->priority = PJSIP_MOD_PRIORITY_TRANSPORT_LAYER - 1;
+
+    module->load = NULL;
+    module->start = NULL;
+    module->stop = NULL;
+    module->unload = NULL;
+
+    module->on_rx_request = &shard_counter_on_rx_msg;
+    module->on_rx_response = &shard_counter_on_rx_msg;
+    module->on_tx_request = NULL;
+    module->on_tx_response = NULL;
+    module->on_tsx_state = NULL;
+
+    return PJ_SUCCESS;
+}
+
+static pj_status_t flood_guard_module_init(pjsip_module *module)
+{
+    if (module == NULL)
+    {
+        app_perror(THIS_FILE, "Flood guard module is NULL", 1);
+    }
+
+    module->prev = NULL;
+    module->next = NULL;
+    module->name = pj_str("mod-flood-guard");
+    module->id = -1;
+    module->priority = PJSIP_MOD_PRIORITY_TRANSPORT_LAYER - 2;
+
+    module->load = NULL;
+    module->start = NULL;
+    module->stop = NULL;
+    module->unload = NULL;
+
+    module->on_rx_request = &flood_guard_on_rx_request;
+    module->on_rx_response = NULL;
+    module->on_tx_request = NULL;
+    module->on_tx_response = NULL;
+    module->on_tsx_state = NULL;
+
+    return PJ_SUCCESS;
+}
+
+static pj_status_t handoff_module_init(pjsip_module *module)
+{
+    if (module == NULL)
+    {
+        app_perror(THIS_FILE, "Handoff module is NULL", 1);
+    }
+
+    module->prev = NULL;
+    module->next = NULL;
+    module->name = pj_str("mod-handoff");
+    module->id = -1;
+    module->priority = PJSIP_MOD_PRIORITY_TSX_LAYER - 1;
+
+    module->load = NULL;
+    module->start = NULL;
+    module->stop = NULL;
+    module->unload = NULL;
+
+    module->on_rx_request = &handoff_on_rx_msg;
+    module->on_rx_response = &handoff_on_rx_msg;
+    module->on_tx_request = NULL;
+    module->on_tx_response = NULL;
+    module->on_tsx_state = NULL;
+
+    return PJ_SUCCESS;
+}
+
+static pj_status_t global_endpt_init(void)
+{
+    pj_status_t status;
+    const pj_str_t *hostname;
+    const char *endpt_name;
+
+    
+    hostname = pj_gethostname();
+    endpt_name = hostname->ptr;
+
+    /* Create the endpoint: */
+    status = pjsip_endpt_create(&machine->cp->factory, endpt_name, &machine->g_endpt);
+
+    PJ_ASSERT_RETURN(status == PJ_SUCCESS, 1);
+
+    return status;
+}
+
+static pj_status_t transport_init(pj_bool_t reuse_port, pj_bool_t takeover)
+{
+    pj_sockaddr addr;
+    int af = AF;
+
+    pj_sockaddr_init(af, &addr, NULL, (pj_uint16_t)machine->sip_port);
+
+    /* The UDP sockets of the running instance are taken over once the machine is ready */
+    if (!takeover && transport_udp_start(af, &addr, reuse_port) != PJ_SUCCESS)
+    {
+        return FAILURE;
+    }
+
+    return transport_tcp_start(af, &addr);
+}
+
+static pj_status_t transport_udp_start(int af, const pj_sockaddr *addr, pj_bool_t reuse_port)
+{
+    pj_status_t status;
+    int i;
+
+    if (settings_get()->sip_shards > 1 || reuse_port)
+    {
+        for (i = 0; i < (int)settings_get()->sip_shards; i++)
+        {
+            status = transport_shard_create(af, addr, &machine->sip_transports[i]);
+            if (status != PJ_SUCCESS)
+            {
+                app_perror(THIS_FILE, "Unable to start SO_REUSEPORT UDP transport", status);
+                return FAILURE;
+            }
+            machine->sip_shards_count++;
+        }
+
+        return PJ_SUCCESS;
+    }
+
+    if (af == pj_AF_INET())
+    {
+        status = pjsip_udp_transport_start(machine->g_endpt, &addr->ipv4, NULL, 1, &machine->sip_transports[0]);
+    }
+    else if (af == pj_AF_INET6())
+    {
+        status = pjsip_udp_transport_start6(machine->g_endpt, &addr->ipv6, NULL, 1, &machine->sip_transports[0]);
+    }
+    else
+    {
+        status = PJ_EAFNOTSUP;
+    }
+
+    if (status != PJ_SUCCESS)
+    {
+        app_perror(THIS_FILE, "Unable to start UDP transport", status);
+        return FAILURE;
+    }
+
+    machine->sip_shards_count = 1;
+
+    return PJ_SUCCESS;
+}
+
+/*
+ * Listen on the UDP sockets of the instance running on the SIP port,
+ * one listener each. Without such an instance the port is bound as usual.
+ */
+static pj_status_t transport_takeover(void)
+{
+    pj_sock_t socks[MAX_SIP_SHARDS];
+    int socks_count = 0;
+    pj_timestamp start, end;
+    pj_sockaddr addr;
+    pj_status_t status;
+    int af = AF;
+    int i;
+
+    pj_get_timestamp(&start);
+    status = handoff_take(machine->handoff, socks, MAX_SIP_SHARDS, &socks_count);
+    if (status != PJ_SUCCESS)
+    {
+        app_perror(THIS_FILE, "No instance to take over from, binding the SIP port", status);
+
+        pj_sockaddr_init(af, &addr, NULL, (pj_uint16_t)machine->sip_port);
+        return transport_udp_start(af, &addr, PJ_FALSE);
+    }
+
+    for (i = 0; i < socks_count; i++)
+    {
+        status = transport_attach(af, socks[i], &machine->sip_transports[i]);
+        if (status != PJ_SUCCESS)
+        {
+            app_perror(THIS_FILE, "Unable to attach handed over UDP socket", status);
+            return FAILURE;
+        }
+        machine->sip_shards_count++;
+    }
+
+    pj_get_timestamp(&end);
+
+    PJ_LOG(3,
+           (THIS_FILE,
+            "Took over %d SIP sockets in %u us",
+            socks_count,
+            (unsigned)(pj_elapsed_nanosec(&start, &end) / 1000)));
+
+    return PJ_SUCCESS;
+}
+
+/*
+ * Listen for SIP over TCP next to UDP. Responses go back over the
+ * connection a request came in on, and dialogs are bound to it as well.
+ */
+static pj_status_t transport_tcp_start(int af, const pj_sockaddr *addr)
+{
+    pj_status_t status;
+    pjsip_tcp_transport_cfg cfg;
+    int enabled = 1;
+
+    if (!SIP_TCP)
+    {
+        return PJ_SUCCESS;
+    }
+
+    /* Connections idle for longer than this are kept alive with CRLF pings */
+    pjsip_cfg()->tcp.keep_alive_interval = SIP_TCP_KEEP_ALIVE_SEC;
+
+    pjsip_tcp_transport_cfg_default(&cfg, af);
+    pj_sockaddr_cp(&cfg.bind_addr, addr);
+    cfg.async_cnt = settings_get()->sip_shards;
+    cfg.reuse_addr = PJ_TRUE;
+
+    /*
+     * Workers accept on the same port, the kernel spreads connections.
+     * The instance replacing this one listens next to it the same way,
+     * connections stay with the instance that has accepted them.
+     */
+    cfg.sockopt_params.options[0].level = pj_SOL_SOCKET();
+    cfg.sockopt_params.options[0].optname = SO_REUSEPORT;
+    cfg.sockopt_params.options[0].optval = &enabled;
+    cfg.sockopt_params.options[0].optlen = sizeof(enabled);
+    cfg.sockopt_params.cnt = 1;
+
+    status = pjsip_tcp_transport_start3(machine->g_endpt, &cfg, &machine->sip_tcp_factory);
+    if (status != PJ_SUCCESS)
+    {
+        app_perror(THIS_FILE, "Unable to start TCP transport", status);
+        return FAILURE;
+    }
+
+    return status;
+}
+
+/*
+ * Bind one more UDP socket to the SIP port with SO_REUSEPORT,
+ * the kernel spreads incoming flows between these sockets by address hash
+ */
+static pj_status_t transport_shard_create(int af, const pj_sockaddr *addr, pjsip_transport **transport)
+{
+    pj_status_t status;
+    pj_sock_t sock;
+    int enabled = 1;
+
+    status = pj_sock_socket(af, pj_SOCK_DGRAM(), 0, &sock);
+    if (status != PJ_SUCCESS)
+    {
+        return status;
+    }
+
+    status = pj_sock_setsockopt(sock, pj_SOL_SOCKET(), SO_REUSEPORT, &enabled, sizeof(enabled));
+    if (status == PJ_SUCCESS)
+    {
+        status = pj_sock_bind(sock, addr, pj_sockaddr_get_len(addr));
+    }
+    if (status != PJ_SUCCESS)
+    {
+        pj_sock_close(sock);
+        return status;
+    }
+
+    return transport_attach(af, sock, transport);
+}
+
+/* Listen on a bound UDP socket, it is closed if that fails */
+static pj_status_t transport_attach(int af, pj_sock_t sock, pjsip_transport **transport)
+{
+    pj_status_t status;
+    pj_sockaddr hostaddr;
+    pjsip_host_port a_name;
+    char hostip[PJ_INET6_ADDRSTRLEN];
+
+    /* Published address, the same for all shards */
+    status = pj_gethostip(af, &hostaddr);
+    if (status != PJ_SUCCESS)
+    {
+        pj_sock_close(sock);
+        return status;
+    }
+    pj_sockaddr_print(&hostaddr, hostip, sizeof(hostip), 0);
+
+    a_name.host = pj_str(hostip);
+    a_name.port = machine->sip_port;
+
+    status = pjsip_udp_transport_attach2(machine->g_endpt,
+                                         af == pj_AF_INET() ? PJSIP_TRANSPORT_UDP : PJSIP_TRANSPORT_UDP6,
+                                         sock,
+                                         &a_name,
+                                         1,
+                                         transport);
+    if (status != PJ_SUCCESS)
+    {
+        pj_sock_close(sock);
+    }
+
+    return status;
+}
+
+static pj_status_t invite_module_init(void)
+{
+    pjsip_inv_callback inv_cb;
+    pj_status_t status;
+
+    /* Init the callback for INVITE session: */
+    pj_bzero(&inv_cb, sizeof(inv_cb));
+    inv_cb.on_state_changed = &call_on_state_changed;
+    inv_cb.on_media_update = &call_on_media_update;
+
+    /* Initialize invite session module:  */
+    status = pjsip_inv_usage_init(machine->g_endpt, &inv_cb);
+    PJ_ASSERT_RETURN(status == PJ_SUCCESS, 1);
+
+    return status;
+}
+
+static pj_status_t media_endpt_init(void)
+{
+    pj_status_t status;
+
+#if PJ_HAS_THREADS
+    status = pjmedia_endpt_create(&machine->cp->factory, NULL, 1, &machine->g_med_endpt);
+#else /* PJ_HAS_THREADS */
+    status = pjmedia_endpt_create(
+        &machine->cp->factory, pjsip_endpt_get_ioqueue(machine->g_endpt), 0, &machine->g_med_endpt);
+#endif /* PJ_HAS_THREADS */
+
+    PJ_ASSERT_RETURN(status == PJ_SUCCESS, 1);
+
+    /* Create pool */
+    machine->media_pool = pjmedia_endpt_create_pool(machine->g_med_endpt, 
+                                                    "Media pool", 
+                                                    settings_get()->media_pool_size, 
+                                                    settings_get()->media_pool_size);
+    mem_stats_track(machine->media_pool);
+
+    /* Add PCMA/PCMU codec with the vector kernels of this CPU */
+    status = g711_codec_init(machine->g_med_endpt);
+
+    /* Fall back to the stock codec if no kernels pass the self-check */
+#if defined(PJMEDIA_HAS_G711_CODEC) && PJMEDIA_HAS_G711_CODEC != 0
+    if (status != PJ_SUCCESS)
+    {
+        app_perror(THIS_FILE, "Unable to register G.711 kernels", status);
+        status = pjmedia_codec_g711_init(machine->g_med_endpt);
+    }
+#endif
+    PJ_ASSERT_RETURN(status == PJ_SUCCESS, 1);
+
+    return status;
+}
+
+static pj_status_t media_transport_create(void)
+{
+    int i;
+    pj_status_t status;
+
+    int max_media = (int)settings_get()->max_media;
+
+    /* Nothing is bound yet, a call binds the port it gets */
+    for (i = 0; i < max_media; ++i)
+    {
+        status = media_socket_create(machine->pool, 
+                                     machine->g_med_endpt, 
+                                     AF, 
+                                     machine->rtp_port + (PJ_MAX(machine->worker, 0) * max_media + i) * 2, 
+                                     (enum media_srtp)settings_get()->srtp,
+                                     &machine->med_sockets[i]);
+        if (status != PJ_SUCCESS)
+        {
+            app_perror(THIS_FILE, "Unable to create media socket", status);
+            return status;
+        }
+        machine->med_sockets_count++;
+    }
+
+    return status;
+}
+
+static pj_status_t call_add(struct call_t *call)
+{
+    int i;
+
+    pj_mutex_lock(machine->calls_lock);
+
+    i = machine->calls_count;
+    if (machine->calls_count == machine->calls_capacity)
+    {
+        pj_mutex_unlock(machine->calls_lock);
+        return FAILURE;
+    }
+
+    machine->calls[i] = call;
+    machine->calls_count++;
+
+    pj_mutex_unlock(machine->calls_lock);
+
+    return PJ_SUCCESS;
+}
+
+static pj_status_t call_find(const pj_str_t *dlg_id, struct call_t **call)
+{
+    int i = 0;
+
+    pj_mutex_lock(machine->calls_lock);
+
+    for (i = 0; i < machine->calls_count; i++)
+    {
+        if (pj_strcmp(&machine->calls[i]->call_id, dlg_id) == 0)
+        {
+            *call = machine->calls[i];
+            pj_mutex_unlock(machine->calls_lock);
+            return PJ_SUCCESS;
+        }
+    }
+
+    pj_mutex_unlock(machine->calls_lock);
+
+    return FAILURE;
+}
+
+/* Give back a socket taken by socket_find for a call that never started */
+static void socket_release(struct media_socket_t *socket)
+{
+    pj_mutex_lock(machine->calls_lock);
+    socket_release(socket);
+    pj_mutex_unlock(machine->calls_lock);
+}
+
+static pj_status_t call_delete(const pj_str_t *dlg_id)
+{
+    int i;
+
+    pj_mutex_lock(machine->calls_lock);
+
+    /* Find call by dlg id */
+    for (i = 0; i < machine->calls_count; i++)
+    {
+        if (pj_strcmp(&machine->calls[i]->call_id, dlg_id) == 0)
+        {
+            call_free(machine->calls[i]);
+            break;
+        }
+    }
+
+    /* Shift calls by 1 to left */
+    for (i = i; i < machine->calls_count; i++)
+    {
+        machine->calls[i] = machine->calls[i + 1];
+    }
+    machine->calls_count--;
+
+    pj_mutex_unlock(machine->calls_lock);
+
+    return PJ_SUCCESS;
+}
+
+static pj_status_t socket_find(struct media_socket_t **socket)
+{
+    int i = 0;
+
+    pj_mutex_lock(machine->calls_lock);
+
+    for (i = 0; i < machine->med_sockets_count; i++)
+    {
+        if (machine->med_sockets[i]->occupied == PJ_FALSE)
+        {
+            /* Ports are bound on first use, one still held by the previous instance is skipped */
+            if (media_socket_open(machine->med_sockets[i]) != PJ_SUCCESS)
+            {
+                continue;
+            }
+
+            *socket = machine->med_sockets[i];
+            (*socket)->occupied = PJ_TRUE;
+            pj_mutex_unlock(machine->calls_lock);
             return PJ_SUCCESS;
         }
     }
 
-    return FAILURE;
+    pj_mutex_unlock(machine->calls_lock);
+
+    return FAILURE;
+}
+
+/*
+ * Largest ptime up to the one of the route the caller accepts. Its maxptime
+ * is the hard limit, without one its ptime is taken as the limit instead.
+ * An INVITE without offer gets the ptime of the route.
+ */
+static unsigned ptime_negotiate(pjsip_rx_data *rdata, unsigned ptime)
+{
+    pjsip_rdata_sdp_info *sdp_info = pjsip_rdata_get_sdp_info(rdata);
+    const pjmedia_sdp_media *media = NULL;
+    pjmedia_sdp_attr *attr;
+    unsigned limit;
+    unsigned i;
+
+    if (sdp_info == NULL || sdp_info->sdp == NULL)
+    {
+        return ptime;
+    }
+
+    for (i = 0; i < sdp_info->sdp->media_count; i++)
+    {
+        if (pj_stricmp2(&sdp_info->sdp->media[i]->desc.media, "audio") == 0)
+        {
+            media = sdp_info->sdp->media[i];
+            break;
+        }
+    }
+
+    if (media == NULL)
+    {
+        return ptime;
+    }
+
+    attr = pjmedia_sdp_media_find_attr2(media, "maxptime", NULL);
+    if (attr == NULL)
+    {
+        attr = pjmedia_sdp_media_find_attr2(media, "ptime", NULL);
+    }
+    if (attr == NULL)
+    {
+        return ptime;
+    }
+
+    /* Whole bridge ticks, at least one, a packet never carries part of a tick */
+    limit = (unsigned)pj_strtoul(&attr->value);
+    limit = PJ_MAX(limit / MEDIA_PTIME_STEP * MEDIA_PTIME_STEP, MEDIA_PTIME_STEP);
+
+    return PJ_MIN(ptime, limit);
+}
+
+/* Advertise the ptime in the answer, the negotiator keeps the attribute */
+static void ptime_attr_add(pj_pool_t *pool, pjmedia_sdp_session *sdp, unsigned ptime)
+{
+    pjmedia_sdp_attr *attr;
+    char buf[16];
+    pj_str_t value;
+    unsigned i;
+
+    pj_ansi_snprintf(buf, sizeof(buf), "%u", ptime);
+    pj_strdup2(pool, &value, buf);
+
+    for (i = 0; i < sdp->media_count; i++)
+    {
+        pjmedia_sdp_media_remove_all_attr(sdp->media[i], "ptime");
+
+        attr = pjmedia_sdp_attr_create(pool, "ptime", &value);
+        if (attr)
+        {
+            pjmedia_sdp_media_add_attr(sdp->media[i], attr);
+        }
+    }
+}
+
+static void answering_machine_free(struct answering_machine_t *machine)
+{
+    int i;
+
+    /* Stop SIP worker threads */
+    machine->quit = PJ_TRUE;
+    for (i = 1; i < machine->sip_shards_count; i++)
+    {
+        if (machine->sip_threads[i])
+        {
+            pj_thread_join(machine->sip_threads[i]);
+            pj_thread_destroy(machine->sip_threads[i]);
+        }
+    }
+
+    if (machine->sip_peers)
+    {
+        sip_peer_pool_free(machine->sip_peers);
+    }
+
+    if (machine->handoff)
+    {
+        handoff_free(machine->handoff);
+    }
+
+    /* Stop playing into the streams */
+    if (machine->direct_clock)
+    {
+        media_clock_direct_destroy(machine->direct_clock);
+    }
+
+    /* The clock of the bridge stops before the groups it sends are freed */
+    if (machine->broadcaster)
+    {
+        pjmedia_master_port_stop(machine->master_port);
+        broadcaster_free(machine->broadcaster);
+    }
+
+    /* Finish the last voicemails and flush the last CDRs */
+    recorder_free(machine->recorder);
+    cdr_writer_free(machine->cdr);
+
+    /* Routes of calls still held are released with them */
+    route_table_release(machine->routes_next);
+    route_table_release(machine->routes);
+    pj_rwmutex_destroy(machine->routes_lock);
+
+    /* Release prompts and announcements */
+    if (machine->announcements->prompts)
+    {
+        prompt_cache_free(machine->announcements->prompts);
+    }
+    announcement_mgr_free(machine->announcements);
+
+    /* Destroy media transports */
+    for (i = 0; i < machine->med_sockets_count; ++i)
+    {
+        media_socket_free(machine->med_sockets[i]);
+    }
+
+    /* Destroy event manager */
+    pjmedia_event_mgr_destroy(NULL);
+
+    /* Deinit pjmedia endpoint */
+    if (machine->g_med_endpt)
+        pjmedia_endpt_destroy(machine->g_med_endpt);
+
+    /* Deinit pjsip endpoint */
+    if (machine->g_endpt)
+        pjsip_endpt_destroy(machine->g_endpt);
+
+    /* Release media pool */
+    if (machine->media_pool)
+        pj_pool_release(machine->media_pool);
+
+    /* Release answering_machine pool */
+    if (machine->pool)
+        pj_pool_release(machine->pool);
+}
+
+/* Index of a UDP listener, calls over TCP are accounted to the first one */
+static int shard_find(pjsip_transport *transport)
+{
+    int i;
+
+    for (i = 0; i < machine->sip_shards_count; i++)
+    {
+        if (transport == machine->sip_transports[i])
+        {
+            return i;
+        }
+    }
+
+    return 0;
+}
+
+/* Count incoming messages per SO_REUSEPORT listener and keep TCP peers pooled */
+static pj_bool_t shard_counter_on_rx_msg(pjsip_rx_data *rdata)
+{
+    pjsip_msg *msg = rdata->msg_info.msg;
+    pj_bool_t new_call;
+    int i;
+
+    if (machine->sip_peers && PJSIP_TRANSPORT_IS_RELIABLE(rdata->tp_info.transport))
+    {
+        new_call = msg->type == PJSIP_REQUEST_MSG && msg->line.req.method.id == PJSIP_INVITE_METHOD &&
+                   rdata->msg_info.to->tag.slen == 0;
+        if (new_call)
+        {
+            METRICS_INC(calls_received_tcp);
+        }
+
+        sip_peer_touch(machine->sip_peers, rdata->tp_info.transport, new_call);
+        return PJ_FALSE;
+    }
+
+    for (i = 0; i < machine->sip_shards_count; i++)
+    {
+        if (rdata->tp_info.transport == machine->sip_transports[i])
+        {
+            METRICS_INC(sip_rx_packets[i]);
+            break;
+        }
+    }
+
+    return PJ_FALSE;
+}
+
+/* Notification on incoming messages */
+static pj_bool_t logging_on_rx_msg(pjsip_rx_data *rdata)
+{
+    PJ_LOG(4,
+           (THIS_FILE,
+            "RX %d bytes %s from %s %s:%d:\n"
+            "%.*s\n"
+            "--end msg--",
+            rdata->msg_info.len,
+            pjsip_rx_data_get_info(rdata),
+            rdata->tp_info.transport->type_name,
+            rdata->pkt_info.src_name,
+            rdata->pkt_info.src_port,
+            (int)rdata->msg_info.len,
+            rdata->msg_info.msg_buf));
+
+    /* Always return false, otherwise messages will not get processed! */
+    return PJ_FALSE;
+}
+
+/* A request of a source over its reject limit is consumed here and never answered */
+static pj_bool_t flood_guard_on_rx_request(pjsip_rx_data *rdata)
+{
+    if (reject_is_blocked(machine->reject, rdata))
+    {
+        METRICS_INC(rejects_blocked);
+        return PJ_TRUE;
+    }
+
+    return PJ_FALSE;
+}
+
+/*
+ * While both instances read the handed over sockets, pass on whatever
+ * belongs to the other one. Connections over TCP stay with the instance
+ * that has accepted them, their messages are never relayed.
+ */
+static pj_bool_t handoff_on_rx_msg(pjsip_rx_data *rdata)
+{
+    if (!handoff_is_connected(machine->handoff) || handoff_is_relayed(machine->handoff, rdata) ||
+        PJSIP_TRANSPORT_IS_RELIABLE(rdata->tp_info.transport) || handoff_owns(rdata))
+    {
+        return PJ_FALSE;
+    }
+
+    /* Handled here if it can not be relayed, a new call to a draining instance gets its 503 */
+    return handoff_relay(machine->handoff, rdata);
+}
+
+/*
+ * Responses belong to the instance with their client transaction, requests
+ * within a dialog to the one with the dialog. Retransmissions, CANCEL and
+ * the ACK of a failed INVITE match the INVITE server transaction. Anything
+ * new goes to the instance that is not draining.
+ */
+static pj_bool_t handoff_owns(pjsip_rx_data *rdata)
+{
+    pjsip_msg *msg = rdata->msg_info.msg;
+    pj_str_t key;
+
+    if (msg->type == PJSIP_RESPONSE_MSG)
+    {
+        pjsip_tsx_create_key(rdata->tp_info.pool, &key, PJSIP_ROLE_UAC, &rdata->msg_info.cseq->method, rdata);
+        return pjsip_tsx_layer_find_tsx(&key, PJ_FALSE) != NULL;
+    }
+
+    if (rdata->msg_info.to->tag.slen > 0)
+    {
+        return pjsip_ua_find_dialog(
+                   &rdata->msg_info.cid->id, &rdata->msg_info.to->tag, &rdata->msg_info.from->tag, PJ_FALSE) != NULL;
+    }
+
+    pjsip_tsx_create_key(rdata->tp_info.pool, &key, PJSIP_ROLE_UAS, pjsip_get_invite_method(), rdata);
+    if (pjsip_tsx_layer_find_tsx(&key, PJ_FALSE) != NULL)
+    {
+        return PJ_TRUE;
+    }
+
+    return !machine->draining;
+}
+
+/* Notification on outgoing messages */
+static pj_status_t logging_on_tx_msg(pjsip_tx_data *tdata)
+{
+    PJ_LOG(4,
+           (THIS_FILE,
+            "TX %ld bytes %s to %s %s:%d:\n"
+            "%.*s\n"
+            "--end msg--",
+            (tdata->buf.cur - tdata->buf.start),
+            pjsip_tx_data_get_info(tdata),
+            tdata->tp_info.transport->type_name,
+            tdata->tp_info.dst_name,
+            tdata->tp_info.dst_port,
+            (int)(tdata->buf.cur - tdata->buf.start),
+            tdata->buf.start));
+
+    /* Return success, otherwise message will not get sent */
+    return PJ_SUCCESS;
+}
+
+/*
+ * Callback when SDP negotiation has completed.
+ * We are interested with this callback because we want to start media
+ * as soon as SDP negotiation is completed.
+ */
+static void call_on_media_update(pjsip_inv_session *inv, pj_status_t status)
+{
+    pjmedia_stream_info stream_info;
+    const pjmedia_sdp_session *local_sdp;
+    const pjmedia_sdp_session *remote_sdp;
+    pjmedia_port *media_port;
+    struct call_t *call;
+
+    TRACE_ZONE("call_on_media_update");
+
+    if (status != PJ_SUCCESS)
+    {
+        app_perror(THIS_FILE, "SDP negotiation has failed", status);
+        return;
+    }
+
+    /* Get local and remote SDP */
+    status = pjmedia_sdp_neg_get_active_local(inv->neg, &local_sdp);
+
+    status = pjmedia_sdp_neg_get_active_remote(inv->neg, &remote_sdp);
+
+    /* Create stream info based on the media audio SDP */
+    status = pjmedia_stream_info_from_sdp(&stream_info, 
+                                          inv->dlg->pool, 
+                                          machine->g_med_endpt, 
+                                          local_sdp, 
+                                          remote_sdp, 
+                                          0);
+    if (status != PJ_SUCCESS)
+    {
+        app_perror(THIS_FILE, "Unable to create audio stream info", status);
+        return;
+    }
+
+    status = call_find(&inv->dlg->call_id->id, &call);
+    if (status != PJ_SUCCESS)
+    {
+        app_perror(THIS_FILE, "Unable to find call", status);
+        return;
+    }
+
+    pj_ansi_snprintf(call->cdr.codec,
+                     sizeof(call->cdr.codec),
+                     "%.*s",
+                     (int)stream_info.fmt.encoding_name.slen,
+                     stream_info.fmt.encoding_name.ptr);
+
+    /* Send packets of the negotiated ptime, the stream port then ticks in whole bridge frames */
+    if (stream_info.param->info.frm_ptime > 0 && call->ptime >= stream_info.param->info.frm_ptime)
+    {
+        stream_info.param->setting.frm_per_pkt = (pj_uint8_t)(call->ptime / stream_info.param->info.frm_ptime);
+    }
+
+    /* SRTP is keyed before the stream sends its first packet */
+    status = media_socket_start(call->socket, inv->dlg->pool, local_sdp, remote_sdp);
+    if (status != PJ_SUCCESS)
+    {
+        app_perror(THIS_FILE, "Unable to start media transport", status);
+        return;
+    }
+
+    /* Create new audio media stream */
+    status = pjmedia_stream_create(machine->g_med_endpt, 
+                                   inv->dlg->pool, 
+                                   &stream_info, 
+                                   call->socket->transport, 
+                                   NULL, 
+                                   &call->med_stream);
+    if (status != PJ_SUCCESS)
+    {
+        app_perror(THIS_FILE, "Unable to create audio stream", status);
+        media_socket_stop(call->socket);
+        return;
+    }
+
+    /* Menus only follow telephone events, the inbound audio is never looked at */
+    if (call->menu)
+    {
+        pjmedia_stream_set_dtmf_callback(call->med_stream, &call_on_dtmf, call);
+    }
+
+    /* Get the media port interface of the audio stream */
+    status = pjmedia_stream_get_port(call->med_stream, &media_port);
+    if (status != PJ_SUCCESS)
+    {
+        app_perror(THIS_FILE, "Unable to create media port interface of the audio stream", status);
+        return;
+    }
+
+    /* The recording takes the inbound audio at the rate of the stream, G.711 calls are written as they came */
+    if (call->playlist && playlist_port_records(call->playlist))
+    {
+        status = recorder_open(machine->recorder,
+                               call->cdr.username,
+                               call->cdr.invite_msec,
+                               PJMEDIA_PIA_SRATE(&media_port->info),
+                               stream_info.fmt.pt == PJMEDIA_RTP_PT_PCMU   ? RECORDER_ULAW
+                               : stream_info.fmt.pt == PJMEDIA_RTP_PT_PCMA ? RECORDER_ALAW
+                                                                           : RECORDER_PCM,
+                               &call->recording);
+        if (status != PJ_SUCCESS)
+        {
+            app_perror(THIS_FILE, "Unable to record voicemail", status);
+            call->recording = NULL;
+        }
+    }
+
+#if EMBEDDED_PROFILE
+    /* The clock puts a frame of the player into the stream once per packet */
+    if (call->playlist &&
+        PJMEDIA_PIA_SRATE(&media_port->info) == PJMEDIA_PIA_SRATE(&call->playlist->base.info))
+    {
+        call->direct_frame =
+            (pj_int16_t *)pj_pool_alloc(call->pool, PJMEDIA_PIA_SPF(&media_port->info) * sizeof(pj_int16_t));
+        call->direct_period = PJ_MAX(PJMEDIA_PIA_PTIME(&media_port->info) / MEDIA_PTIME_STEP, 1);
+
+        pj_mutex_lock(machine->calls_lock);
+        call->stream_port = media_port;
+        pj_mutex_unlock(machine->calls_lock);
+    }
+    else
+    {
+        PJ_LOG(3, (THIS_FILE, "Call %s can not be played at the rate of its stream", call->cdr.call_id));
+    }
+#else
+    /* A looping announcement is sent by its group, the stream of the call only receives */
+    if (machine->broadcaster && call->announcement && !call->playlist &&
+        broadcast_accepts(call->announcement, stream_info.fmt.pt, stream_info.fmt.clock_rate, call->ptime) &&
+        broadcast_subscribe(machine->broadcaster,
+                            &call->broadcast,
+                            call->announcement,
+                            stream_info.fmt.pt,
+                            call->ptime,
+                            call->socket->transport,
+                            media_port) == PJ_SUCCESS)
+    {
+        PJ_LOG(5, (THIS_FILE, "Call %s joins the broadcast of its announcement", call->cdr.call_id));
+    }
+    else
+    {
+        /* Add media port to conf bridge, a call the bridge has no room for is hung up rather than left silent */
+        status = pjmedia_conf_add_port(machine->conf, call->pool, media_port, NULL, &call->conf_port);
+        if (status != PJ_SUCCESS)
+        {
+            app_perror(THIS_FILE, "Unable to add audio stream to the bridge", status);
+            call->conf_port = -1;
+            call_hangup(call);
+            return;
+        }
+
+        /* Link call port to player port in conf bridge */
+        pjmedia_conf_connect_port(machine->conf, call->player_port, call->conf_port, 0);
+    }
+
+    /* The inbound side of the stream only goes to the recording, without a slot the call goes on unrecorded */
+    if (call->recording)
+    {
+        status = pjmedia_conf_add_port(machine->conf, call->pool, &call->recording->base, NULL, &call->recording->slot);
+        if (status == PJ_SUCCESS)
+        {
+            pjmedia_conf_connect_port(machine->conf, call->conf_port, call->recording->slot, 0);
+        }
+        else
+        {
+            app_perror(THIS_FILE, "Unable to add recording to the bridge", status);
+            call->recording->slot = (unsigned)-1;
+            recorder_close(machine->recorder, call->recording);
+
+            pj_mutex_lock(machine->calls_lock);
+            call->recording = NULL;
+            pj_mutex_unlock(machine->calls_lock);
+        }
+    }
+#endif
+
+    /* The player starts the recording once it reaches the record segment */
+    if (call->recording)
+    {
+        playlist_port_record(call->playlist, call->recording);
+    }
+
+    /* Start the audio stream */
+    status = pjmedia_stream_start(call->med_stream);
+    if (status != PJ_SUCCESS)
+    {
+        app_perror(THIS_FILE, "Unable to start audio stream", status);
+        return;
+    }
+
+    pjsip_endpt_schedule_timer_w_grp_lock(
+        machine->g_endpt, call->media_session_timer, &call->media_session_time, 1, call->grp_lock);
 }
 
-static pj_status_t call_delete(const pj_str_t *dlg_id)
+/*
+ * Telephone event received by the stream of a menu call, called from the
+ * media thread. A target only switches the player at its next frame, the
+ * hangup is left to a SIP thread since the dialog is not ours to lock here.
+ */
+static void call_on_dtmf(pjmedia_stream *stream, void *user_data, int digit)
 {
-    int i;
+    struct call_t *call = (struct call_t *)user_data;
+    pj_time_val delay = {0, 0};
+    int action;
 
-    /* Find call by dlg id */
-    for (i = 0; i < machine->calls_count; i++)
+    PJ_UNUSED_ARG(stream);
+
+    METRICS_INC(dtmf_digits);
+
+    action = ivr_menu_action(call->menu, digit);
+    if (action >= 0)
     {
-        if (pj_strcmp(&machine->calls[i]->call_id, dlg_id) == 0)
+        METRICS_INC(ivr_switches);
+        playlist_port_switch(call->playlist, action);
+    }
+    else if (action == IVR_ACTION_HANGUP && !__sync_lock_test_and_set(&call->hangup_requested, PJ_TRUE))
+    {
+        METRICS_INC(ivr_hangups);
+        pjsip_endpt_schedule_timer_w_grp_lock(machine->g_endpt, call->hangup_timer, &delay, 1, call->grp_lock);
+    }
+}
+
+/*
+ * Callback when INVITE session state has changed.
+ * This callback is registered when the invite session module is initialized.
+ * We mostly want to know when the invite session has been disconnected,
+ * so that we can quit the application.
+ */
+static void call_on_state_changed(pjsip_inv_session *inv, pjsip_event *e)
+{
+    struct call_t *call;
+    pjmedia_stream *stream;
+    struct recording_t *recording;
+    PJ_UNUSED_ARG(e);
+
+    TRACE_ZONE("call_on_state_changed");
+
+    if (inv->state == PJSIP_INV_STATE_DISCONNECTED)
+    {
+        PJ_LOG(3, 
+               (THIS_FILE, "Call DISCONNECTED [reason=%d (%s)]", inv->cause, pjsip_get_status_text(inv->cause)->ptr));
+        if (call_find(&inv->dlg->call_id->id, &call) != PJ_SUCCESS)
         {
-            call_free(machine->calls[i]);
-            break;
+            return;
+        }
+
+        METRICS_INC(calls_disconnected);
+
+        /* Timers that have already fired see the flag under the dialog lock */
+        call->terminated = PJ_TRUE;
+    
+        if (pj_timer_entry_running(call->ringing_timer) == PJ_TRUE)
+        {
+            pjsip_endpt_cancel_timer(machine->g_endpt, call->ringing_timer);
+        }
+        if (pj_timer_entry_running(call->media_session_timer) == PJ_TRUE) 
+        {
+            pjsip_endpt_cancel_timer(machine->g_endpt, call->media_session_timer);
+        }
+        if (pj_timer_entry_running(call->hangup_timer) == PJ_TRUE)
+        {
+            pjsip_endpt_cancel_timer(machine->g_endpt, call->hangup_timer);
+        }
+
+        /* The media sweep and the direct clock only look at streams under the calls lock */
+        pj_mutex_lock(machine->calls_lock);
+        stream = call->med_stream;
+        recording = call->recording;
+        call->med_stream = NULL;
+        call->stream_port = NULL;
+        call->recording = NULL;
+        pj_mutex_unlock(machine->calls_lock);
+
+        /* The group sends nothing on the transport of the call once this returns */
+        if (machine->broadcaster)
+        {
+            broadcast_unsubscribe(machine->broadcaster, &call->broadcast);
         }
+
+        /* The writer keeps the recording for the tick the bridge may still be running */
+        if (recording)
+        {
+            if (recording->slot != (unsigned)-1)
+            {
+                pjmedia_conf_disconnect_port(machine->conf, call->conf_port, recording->slot);
+                pjmedia_conf_remove_port(machine->conf, recording->slot);
+            }
+            recorder_close(machine->recorder, recording);
+        }
+
+        if (call->player_port != -1 && call->conf_port != -1) {  
+            pjmedia_conf_disconnect_port(machine->conf, call->player_port, call->conf_port);
+            pjmedia_conf_remove_port(machine->conf, call->conf_port);
+        }
+
+        /* The bridge holds the call until it has let the playlist player go */
+        if (call->playlist)
+        {
+            if (call->player_port != -1)
+            {
+                pjmedia_conf_remove_port(machine->conf, call->player_port);
+            }
+            playlist_port_release(call->playlist);
+        }
+
+        call->cdr.bye_msec = cdr_now_msec();
+        call->cdr.cause = inv->cause;
+
+        /* The bridge keeps its own reference to the stream port until it has let it go */
+        if (stream)
+        {
+            call_stream_stat(call, stream);
+            call->cdr.tx_packets += (pj_uint32_t)call->broadcast.packets;
+            call->cdr.tx_bytes += call->broadcast.bytes;
+            media_socket_stop(call->socket);
+            pjmedia_stream_destroy(stream);
+
+            PJ_LOG(3,
+                   (THIS_FILE,
+                    "Call %s media: %s rx=%u/%u lost=%u discarded=%u late=%u jitter=%u us rtt=%u us tx=%u",
+                    call->cdr.call_id,
+                    call->cdr.codec,
+                    call->cdr.rx_packets,
+                    (unsigned)call->cdr.rx_bytes,
+                    call->cdr.rx_lost,
+                    call->cdr.rx_discarded,
+                    call->cdr.late_frames,
+                    call->cdr.rx_jitter_usec,
+                    call->cdr.rtt_usec,
+                    call->cdr.tx_packets));
+
+            METRICS_INC(media[call->shard].streams);
+            METRICS_ADD(media[call->shard].rx_packets, call->cdr.rx_packets);
+            METRICS_ADD(media[call->shard].tx_packets, call->cdr.tx_packets);
+            METRICS_ADD(media[call->shard].rx_bytes, call->cdr.rx_bytes);
+            METRICS_ADD(media[call->shard].tx_bytes, call->cdr.tx_bytes);
+            METRICS_ADD(media[call->shard].rx_lost, call->cdr.rx_lost);
+            METRICS_ADD(media[call->shard].rx_discarded, call->cdr.rx_discarded);
+            METRICS_ADD(media[call->shard].late_frames, call->cdr.late_frames);
+        }
+
+        cdr_write(machine->cdr, &call->cdr);
+
+        /* The old version of the announcement is freed with its last call */
+        announcement_release(machine->announcements, call->announcement);
+        
+        call_delete(&inv->dlg->call_id->id);
+    }
+    else
+    {
+        PJ_LOG(3, (THIS_FILE, "Call state changed to %s", pjsip_inv_state_name(inv->state)));
     }
+}
 
-    /* Shift calls by 1 to left */
-    for (i = i; i < machine->calls_count; i++)
+/* Copy RTP statistics of the call into its CDR */
+static void call_stream_stat(struct call_t *call, pjmedia_stream *stream)
+{
+    pjmedia_rtcp_stat stat;
+    pjmedia_jb_state jb_state;
+
+    if (pjmedia_stream_get_stat(stream, &stat) != PJ_SUCCESS)
     {
-        machine->calls[i] = machine->calls[i + 1];
+        return;
     }
-    machine->calls_count--;
 
-    return PJ_SUCCESS;
+    call->cdr.rx_packets = stat.rx.pkt;
+    call->cdr.tx_packets = stat.tx.pkt;
+    call->cdr.rx_lost = stat.rx.loss;
+    call->cdr.rx_discarded = stat.rx.discard;
+    call->cdr.rx_jitter_usec = stat.rx.jitter.mean;
+    call->cdr.rtt_usec = stat.rtt.mean;
+    call->cdr.rx_bytes = stat.rx.bytes;
+    call->cdr.tx_bytes = stat.tx.bytes;
+
+    if (pjmedia_stream_get_stat_jbuf(stream, &jb_state) == PJ_SUCCESS)
+    {
+        call->cdr.late_frames = jb_state.discard;
+    }
 }
 
-static pj_status_t socket_find(struct media_socket_t **socket)
+/*
+ * Sample RTP health of every active stream into the histograms of its shard.
+ * One sweep over the calls table serves all streams, the lock keeps
+ * disconnecting calls from destroying a stream while it is being read.
+ */
+static void on_media_sweep_timer_callback(pj_timer_heap_t *timer_heap, struct pj_timer_entry *entry)
 {
-    int i = 0;
+    pj_time_val sweep_interval = {MEDIA_SWEEP_INTERVAL_SEC, 0};
+    pjmedia_rtcp_stat stat;
+    unsigned loss_permille;
+    unsigned received;
+    int i;
 
-    for (i = 0; i < MAX_MEDIA_CNT; i++)
+    PJ_UNUSED_ARG(timer_heap);
+
+    pj_mutex_lock(machine->calls_lock);
+
+    for (i = 0; i < machine->calls_count; i++)
     {
-        if (machine->med_sockets[i]->occupied == PJ_FALSE)
+        if (machine->calls[i]->med_stream == NULL ||
+            pjmedia_stream_get_stat(machine->calls[i]->med_stream, &stat) != PJ_SUCCESS)
         {
-            *socket = machine->med_sockets[i];
-            return PJ_SUCCESS;
+            continue;
         }
+
+        received = stat.rx.pkt + stat.rx.loss;
+        loss_permille = received ? (unsigned)((pj_uint64_t)stat.rx.loss * 1000 / received) : 0;
+
+        metrics_media_sample(machine->calls[i]->shard, loss_permille, stat.rx.jitter.mean, stat.rtt.mean);
     }
 
-    return FAILURE;
+    pj_mutex_unlock(machine->calls_lock);
+
+    metrics_cpu_update();
+    mem_stats_update();
+
+    pjsip_endpt_schedule_timer(machine->g_endpt, entry, &sweep_interval);
 }
 
-static void answering_machine_free(struct answering_machine_t *machine)
+static void on_soak_done(int result)
+{
+    metrics_dump(metrics_get(), "Soak");
+
+    machine->exit_code = result;
+    machine->quit = PJ_TRUE;
+}
+
+static void on_replay_done(int result)
+{
+    metrics_dump(metrics_get(), "Replay");
+
+    machine->exit_code = result;
+    machine->quit = PJ_TRUE;
+}
+
+/* Called from the replay thread */
+static void replay_usage_get(struct replay_usage_t *usage)
 {
     int i;
 
-    /* Destroy media transports */
-    for (i = 0; i < MAX_MEDIA_CNT; ++i)
+    pj_mutex_lock(machine->calls_lock);
+
+    usage->calls = machine->calls_count;
+    for (i = 0; i < machine->med_sockets_count; i++)
     {
-        media_socket_free(machine->med_sockets[i]);
+        if (machine->med_sockets[i]->occupied)
+        {
+            usage->media_sockets++;
+        }
     }
 
-    /* Destroy event manager */
-    pjmedia_event_mgr_destroy(NULL);
+    pj_mutex_unlock(machine->calls_lock);
+}
 
-    /* Deinit pjmedia endpoint */
-    if (machine->g_med_endpt)
-        pjmedia_endpt_destroy(machine->g_med_endpt);
+/*
+ * Tick of the clock of the embedded profile. Once per packet every call
+ * gets a frame of its player into its stream, and the stream is read in
+ * the same step so its jitter buffer does not fill up with nobody listening.
+ */
+static void on_direct_tick(void *user_data)
+{
+    struct call_t *call;
+    pjmedia_frame frame;
+    int i;
 
-    /* Deinit pjsip endpoint */
-    if (machine->g_endpt)
-        pjsip_endpt_destroy(machine->g_endpt);
+    PJ_UNUSED_ARG(user_data);
 
-    /* Release media pool */
-    if (machine->media_pool)
-        pj_pool_release(machine->media_pool);
+    pj_mutex_lock(machine->calls_lock);
 
-    /* Release answering_machine pool */
-    if (machine->pool)
-        pj_pool_release(machine->pool);
+    for (i = 0; i < machine->calls_count; i++)
+    {
+        call = machine->calls[i];
+        if (call->stream_port == NULL || ++call->direct_ticks < call->direct_period)
+        {
+            continue;
+        }
+
+        call->direct_ticks = 0;
+
+        pj_bzero(&frame, sizeof(frame));
+        frame.buf = call->direct_frame;
+        frame.size = PJMEDIA_PIA_SPF(&call->stream_port->info) * sizeof(pj_int16_t);
+
+        pjmedia_port_get_frame(&call->playlist->base, &frame);
+        pjmedia_port_put_frame(call->stream_port, &frame);
+
+        frame.size = PJMEDIA_PIA_SPF(&call->stream_port->info) * sizeof(pj_int16_t);
+        pjmedia_port_get_frame(call->stream_port, &frame);
+
+        if (call->recording)
+        {
+            recording_put(call->recording,
+                          frame.type == PJMEDIA_FRAME_TYPE_AUDIO ? call->direct_frame : NULL,
+                          PJMEDIA_PIA_SPF(&call->stream_port->info));
+        }
+    }
+
+    pj_mutex_unlock(machine->calls_lock);
 }
 
-/* Notification on incoming messages */
-static pj_bool_t logging_on_rx_msg(pjsip_rx_data *rdata)
+static void on_reload_signal(int signo)
 {
-    PJ_LOG(4,
-           (THIS_FILE,
-            "RX %d bytes %s from %s %s:%d:\n"
-            "%.*s\n"
-            "--end msg--",
-            rdata->msg_info.len,
-            pjsip_rx_data_get_info(rdata),
-            rdata->tp_info.transport->type_name,
-            rdata->pkt_info.src_name,
-            rdata->pkt_info.src_port,
-            (int)rdata->msg_info.len,
-            rdata->msg_info.msg_buf));
+    PJ_UNUSED_ARG(signo);
 
-    /* Always return false, otherwise messages will not get processed! */
-    return PJ_FALSE;
+    reload_requested = 1;
 }
 
-/* Notification on outgoing messages */
-static pj_status_t logging_on_tx_msg(pjsip_tx_data *tdata)
+static void on_trace_signal(int signo)
 {
-    PJ_LOG(4,
+    PJ_UNUSED_ARG(signo);
+
+    trace_requested = 1;
+}
+
+static void on_drain_signal(int signo)
+{
+    PJ_UNUSED_ARG(signo);
+
+    drain_requested = 1;
+}
+
+/* Calls still there after their longest possible life are left behind */
+static void drain_start(void)
+{
+    const struct settings_t *settings = settings_get();
+
+    machine->draining = PJ_TRUE;
+
+    pj_gettickcount(&machine->drain_deadline);
+    machine->drain_deadline.sec +=
+        settings->ringing_time + settings->media_session_time + settings->record_max_sec + DRAIN_MARGIN_SEC;
+
+    PJ_LOG(3,
            (THIS_FILE,
-            "TX %ld bytes %s to %s %s:%d:\n"
-            "%.*s\n"
-            "--end msg--",
-            (tdata->buf.cur - tdata->buf.start),
-            pjsip_tx_data_get_info(tdata),
-            tdata->tp_info.transport->type_name,
-            tdata->tp_info.dst_name,
-            tdata->tp_info.dst_port,
-            (int)(tdata->buf.cur - tdata->buf.start),
-            tdata->buf.start));
+            "Draining %d calls, new calls are %s",
+            machine->calls_count,
+            machine->handoff && handoff_is_connected(machine->handoff) ? "relayed to the new instance"
+                                                                       : "turned away"));
+}
+
+static void drain_check(void)
+{
+    pj_time_val now;
+    int calls_count;
+
+    /* The new instance binds the ports the calls of this one have let go */
+    media_sockets_release();
+
+    pj_mutex_lock(machine->calls_lock);
+    calls_count = machine->calls_count;
+    pj_mutex_unlock(machine->calls_lock);
+
+    pj_gettickcount(&now);
+
+    if (calls_count == 0 || PJ_TIME_VAL_GTE(now, machine->drain_deadline))
+    {
+        PJ_LOG(3, (THIS_FILE, "Drained, %d calls left behind", calls_count));
+        metrics_dump(metrics_get(), "Metrics");
+        machine->quit = PJ_TRUE;
+    }
+}
+
+/* Unbind the RTP ports no call is using */
+static void media_sockets_release(void)
+{
+    int i;
+
+    pj_mutex_lock(machine->calls_lock);
+
+    for (i = 0; i < machine->med_sockets_count; i++)
+    {
+        if (machine->med_sockets[i]->occupied == PJ_FALSE)
+        {
+            media_socket_close(machine->med_sockets[i]);
+        }
+    }
+
+    pj_mutex_unlock(machine->calls_lock);
+}
+
+static void on_metrics_timer_callback(pj_timer_heap_t *timer_heap, struct pj_timer_entry *entry)
+{
+    pj_time_val metrics_interval = {METRICS_INTERVAL_SEC, 0};
+
+    PJ_UNUSED_ARG(timer_heap);
+
+    metrics_dump(metrics_get(), "Metrics");
+
+    pjsip_endpt_schedule_timer(machine->g_endpt, entry, &metrics_interval);
+}
+
+static void on_ringing_timer_expire_callback(pj_timer_heap_t *timer_heap, struct pj_timer_entry *entry)
+{
+    pj_status_t status;
+    pjsip_tx_data *tdata;
+    struct call_t *call = entry->user_data;
+
+    PJ_UNUSED_ARG(timer_heap);
+
+    TRACE_ZONE("on_ringing_timer");
+
+    /* The timer may fire on another SIP thread while the call is being disconnected */
+    pjsip_dlg_inc_lock(call->inv->dlg);
+    if (call->terminated)
+    {
+        pjsip_dlg_dec_lock(call->inv->dlg);
+        return;
+    }
+
+    /* Create 200 response */
+    status = pjsip_inv_answer(call->inv,
+                              200,
+                              NULL, 
+                              NULL, 
+                              &tdata);
+
+    /* Send the 200 response */
+    if (status == PJ_SUCCESS)
+    {
+        status = pjsip_inv_send_msg(call->inv, tdata);
+    }
 
-    /* Return success, otherwise message will not get sent */
-    return PJ_SUCCESS;
+    if (status == PJ_SUCCESS)
+    {
+        METRICS_INC(calls_answered);
+        call->cdr.answer_msec = cdr_now_msec();
+    }
+
+    pjsip_dlg_dec_lock(call->inv->dlg);
 }
 
 /*
- * Callback when SDP negotiation has completed.
- * We are interested with this callback because we want to start media
- * as soon as SDP negotiation is completed.
+ * Undo a call that has not reached its invite session: its player or
+ * its version, the dialog and the call itself, whose socket is freed
+ * with it. The INVITE is answered statelessly with code.
  */
-static void call_on_media_update(pjsip_inv_session *inv, pj_status_t status)
+static void call_setup_abort(struct call_t *call, pjsip_dialog *dlg, pjsip_rx_data *rdata, int code)
 {
-    pjmedia_stream_info stream_info;
-    const pjmedia_sdp_session *local_sdp;
-    const pjmedia_sdp_session *remote_sdp;
-    pjmedia_port *media_port;
-    struct call_t *call;
+    METRICS_INC(calls_rejected);
 
-    if (status != PJ_SUCCESS)
+    if (call->playlist)
     {
-        app_perror(THIS_FILE, "SDP negotiation has failed", status);
-        return;
+        if (machine->conf && call->player_port != (unsigned)-1)
+        {
+            pjmedia_conf_remove_port(machine->conf, call->player_port);
+        }
+        playlist_port_release(call->playlist);
+        call->playlist = NULL;
     }
 
-    /* Get local and remote SDP */
-    status = pjmedia_sdp_neg_get_active_local(inv->neg, &local_sdp);
+    announcement_release(machine->announcements, call->announcement);
+    call->announcement = NULL;
 
-    status = pjmedia_sdp_neg_get_active_remote(inv->neg, &remote_sdp);
+    pjsip_dlg_dec_lock(dlg);
+    call_free(call);
 
-    /* Create stream info based on the media audio SDP */
-    status = pjmedia_stream_info_from_sdp(&stream_info, 
-                                          inv->dlg->pool, 
-                                          machine->g_med_endpt, 
-                                          local_sdp, 
-                                          remote_sdp, 
-                                          0);
-    if (status != PJ_SUCCESS)
+    pjsip_endpt_respond_stateless(machine->g_endpt, rdata, code, NULL, NULL, NULL);
+}
+
+/* End a call the machine can not serve, called with the dialog lock held */
+static void call_hangup(struct call_t *call)
+{
+    pj_status_t status;
+    pjsip_tx_data *tdata;
+
+    status = pjsip_inv_end_session(call->inv, PJSIP_SC_SERVICE_UNAVAILABLE, NULL, &tdata);
+    if (status == PJ_SUCCESS && tdata)
     {
-        app_perror(THIS_FILE, "Unable to create audio stream info", status);
-        return;
+        status = pjsip_inv_send_msg(call->inv, tdata);
     }
-
-    status = call_find(&inv->dlg->call_id->id, &call);
     if (status != PJ_SUCCESS)
     {
-        app_perror(THIS_FILE, "Unable to find call", status);
-        return;
+        app_perror(THIS_FILE, "Unable to hang up call", status);
     }
+}
 
-    status = socket_find(&call->socket);
-    if (status != PJ_SUCCESS)
+static void on_active_call_timer_expire_callback(pj_timer_heap_t *timer_heap, struct pj_timer_entry *entry)
+{
+    pj_status_t status;
+    pjsip_tx_data *tdata;
+    struct call_t *call = entry->user_data;
+
+    PJ_UNUSED_ARG(timer_heap);
+
+    TRACE_ZONE("on_active_call_timer");
+
+    pjsip_dlg_inc_lock(call->inv->dlg);
+    if (call->terminated)
     {
-        app_perror(THIS_FILE, "Unable to find unoccupied socket", status);
+        pjsip_dlg_dec_lock(call->inv->dlg);
         return;
     }
-    call->socket->occupied = PJ_TRUE;
 
-    /* Create new audio media stream */
-    status = pjmedia_stream_create(machine->g_med_endpt, 
-                                   inv->dlg->pool, 
-                                   &stream_info, 
-                                   call->socket->med_transport, 
+    status = pjsip_inv_end_session(call->inv,
+                                   403, 
                                    NULL, 
-                                   &call->med_stream);
-    if (status != PJ_SUCCESS)
-    {
-        app_perror(THIS_FILE, "Unable to create audio stream", status);
-        return;
-    }
+                                   &tdata);
 
-    /* Get the media port interface of the audio stream */
-    status = pjmedia_stream_get_port(call->med_stream, &media_port);
-    if (status != PJ_SUCCESS)
+    if (status == PJ_SUCCESS && tdata)
     {
-        app_perror(THIS_FILE, "Unable to create media port interface of the audio stream", status);
-        return;
+        status = pjsip_inv_send_msg(call->inv, tdata);
     }
 
-    /* Add media port to conf bridge */
-    pjmedia_conf_add_port(machine->conf, machine->pool, media_port, NULL, &call->conf_port);
+    pjsip_dlg_dec_lock(call->inv->dlg);
+}
 
-    /* Link call port to player port in conf bridge */
-    pjmedia_conf_connect_port(machine->conf, call->player_port, call->conf_port, 0);
+static int sip_worker_thread(void *arg)
+{
+    pj_time_val timeout = {ENDPT_TIMEOUT_SEC, ENDPT_TIMEOUT_MSEC};
 
-    /* Start the audio stream */
-    status = pjmedia_stream_start(call->med_stream);
-    if (status != PJ_SUCCESS)
-    {
-        app_perror(THIS_FILE, "Unable to start audio stream", status);
-        return;
-    }
+    PJ_UNUSED_ARG(arg);
 
-    /* Start the UDP media transport */
-    status = pjmedia_transport_media_start(call->socket->med_transport, 0, 0, 0, 0);
-    if (status != PJ_SUCCESS)
+    affinity_apply("sip_worker", settings_get()->sip_thread_cpus, (int)settings_get()->sip_thread_priority);
+
+    while (!machine->quit)
     {
-        app_perror(THIS_FILE, "Unable to start UDP media transport", status);
-        return;
+        pjsip_endpt_handle_events(machine->g_endpt, &timeout);
     }
 
-    pjsip_endpt_schedule_timer(machine->g_endpt, call->media_session_timer, &call->media_session_time);
+    return 0;
 }
 
 /*
- * Callback when INVITE session state has changed.
- * This callback is registered when the invite session module is initialized.
- * We mostly want to know when the invite session has been disconnected,
- * so that we can quit the application.
+ * Callback when incoming requests outside any transactions and any
+ * dialogs are received. We're only interested to hande incoming INVITE
+ * request, and we'll reject any other requests with 500 response.
  */
-static void call_on_state_changed(pjsip_inv_session *inv, pjsip_event *e)
+static pj_bool_t on_rx_request(pjsip_rx_data *rdata)
 {
-    struct call_t *call;
-    PJ_UNUSED_ARG(e);
+    pjsip_sip_uri *uri;
+    pj_uint64_t invite_msec;
+    struct route_table_t *routes;
+    struct route_t *route;
+    struct route_t prompt_route;
+    struct prompt_t *prompt = NULL;
+    pj_timestamp start, end;
 
-    if (inv->state == PJSIP_INV_STATE_DISCONNECTED)
+    TRACE_ZONE("on_rx_request");
+
+    pj_get_timestamp(&start);
+
+    /* Respond (statelessly) any non-INVITE requests with 405 */
+    if (rdata->msg_info.msg->line.req.method.id != PJSIP_INVITE_METHOD)
     {
-        PJ_LOG(3, 
-               (THIS_FILE, "Call DISCONNECTED [reason=%d (%s)]", inv->cause, pjsip_get_status_text(inv->cause)->ptr));
-        call_find(&inv->dlg->call_id->id, &call);
-    
-        if (pj_timer_entry_running(call->ringing_timer) == PJ_TRUE)
-        {
-            pjsip_endpt_cancel_timer(machine->g_endpt, call->ringing_timer);
-        }
-        if (pj_timer_entry_running(call->media_session_timer) == PJ_TRUE) 
+        if (rdata->msg_info.msg->line.req.method.id != PJSIP_ACK_METHOD)
         {
-            pjsip_endpt_cancel_timer(machine->g_endpt, call->media_session_timer);
-        }
+            reject_send(machine->reject, rdata, REJECT_NOT_ALLOWED);
 
-        if (call->player_port != -1 && call->conf_port != -1) {  
-            pjmedia_conf_disconnect_port(machine->conf, call->player_port, call->conf_port);
-            pjmedia_conf_remove_port(machine->conf, call->conf_port);
+            pj_get_timestamp(&end);
+            METRICS_ADD(reject_nsec, pj_elapsed_nanosec(&start, &end));
         }
-        
-        call_delete(&inv->dlg->call_id->id);
+        return PJ_TRUE;
     }
-    else
+
+    METRICS_INC(calls_received);
+    invite_msec = cdr_now_msec();
+
+    /* Not relayed to a new instance, the caller tries again elsewhere or a bit later */
+    if (machine->draining)
     {
-        PJ_LOG(3, (THIS_FILE, "Call state changed to %s", pjsip_inv_state_name(inv->state)));
+        METRICS_INC(calls_rejected);
+        reject_send(machine->reject, rdata, REJECT_DRAINING);
+        return PJ_TRUE;
     }
-}
 
-static void on_ringing_timer_expire_callback(pj_timer_heap_t *timer_heap, struct pj_timer_entry *entry)
-{
-    pj_status_t status;
-    pjsip_tx_data *tdata;
-    struct call_t *call = entry->user_data;
+    /* Scanners mostly call users we do not have, they are turned away before anything else */
+    uri = (pjsip_sip_uri *) pjsip_uri_get_uri(rdata->msg_info.to->uri);
 
-    PJ_UNUSED_ARG(timer_heap);
+    /* The generation stays alive for this INVITE however many reloads happen meanwhile */
+    pj_rwmutex_lock_read(machine->routes_lock);
+    routes = machine->routes;
+    route_table_add_ref(routes);
+    pj_rwmutex_unlock_read(machine->routes_lock);
 
-    /* Create 200 response */
-    status = pjsip_inv_answer(call->inv,
-                              200,
-                              NULL, 
-                              NULL, 
-                              &tdata);
+    route = route_table_find(routes, uri->user.ptr, (int)uri->user.slen);
 
-    /* Send the 200 response */
-    status = pjsip_inv_send_msg(call->inv, tdata);
-}
+    /* A user without a route hears the prompt of the same name */
+    if (route == NULL && machine->announcements->prompts && uri->user.slen > 0)
+    {
+        prompt = prompt_cache_find(machine->announcements->prompts, uri->user.ptr, (int)uri->user.slen);
+        if (prompt)
+        {
+            pj_bzero(&prompt_route, sizeof(prompt_route));
+            prompt_route.ptime = MEDIA_PTIME;
+            route = &prompt_route;
+        }
+    }
 
-static void on_active_call_timer_expire_callback(pj_timer_heap_t *timer_heap, struct pj_timer_entry *entry)
-{
-    pj_status_t status;
-    pjsip_tx_data *tdata;
-    struct call_t *call = entry->user_data;
+    if (route == NULL)
+    {
+        route_table_release(routes);
 
-    PJ_UNUSED_ARG(timer_heap);
+        METRICS_INC(calls_rejected);
+        reject_send(machine->reject, rdata, REJECT_UNKNOWN_USER);
 
-    status = pjsip_inv_end_session(call->inv,
-                                   403, 
-                                   NULL, 
-                                   &tdata);
+        pj_get_timestamp(&end);
+        METRICS_ADD(reject_nsec, pj_elapsed_nanosec(&start, &end));
+        return PJ_TRUE;
+    }
+
+    call_answer(rdata, uri, routes, route, prompt, &start, invite_msec);
+    route_table_release(routes);
 
-    status = pjsip_inv_send_msg(call->inv, tdata);
+    return PJ_TRUE;
 }
 
 /*
- * Callback when incoming requests outside any transactions and any
- * dialogs are received. We're only interested to hande incoming INVITE
- * request, and we'll reject any other requests with 500 response.
+ * Set up the call of an INVITE with a route. The generation of the route
+ * is held by the caller, the call takes its own reference to it. The
+ * INVITE is answered in any case, statelessly when there is no call.
  */
-static pj_bool_t on_rx_request(pjsip_rx_data *rdata)
+static void call_answer(pjsip_rx_data *rdata,
+                        const pjsip_sip_uri *uri,
+                        struct route_table_t *routes,
+                        struct route_t *route,
+                        struct prompt_t *prompt,
+                        const pj_timestamp *start,
+                        pj_uint64_t invite_msec)
 {
     pj_sockaddr hostaddr;
     pj_str_t local_uri;
     pj_str_t reason;
     pjsip_dialog *dlg;
     pjmedia_sdp_session *local_sdp;
+    pjsip_rdata_sdp_info *sdp_info;
     pjsip_user_agent *ua;
     pjsip_tx_data *tdata;
-    pjsip_sip_uri *uri;
+    pjsip_tpselector tp_selector;
     pj_pool_t *call_pool;
     unsigned options = 0;
-    unsigned int *player_port;
     pj_status_t status;
     char temp[80], hostip[PJ_INET6_ADDRSTRLEN];
     struct call_t *call;
+    struct media_socket_t *socket;
+    struct playlist_t *playlist;
+    pj_timestamp end;
 
-    /* Respond (statelessly) any non-INVITE requests with 500 */
-    if (rdata->msg_info.msg->line.req.method.id != PJSIP_INVITE_METHOD)
+    /* Verify that we can handle the request. */
+    status = pjsip_inv_verify_request(rdata, &options, NULL, NULL, machine->g_endpt, NULL);
+    if (status != PJ_SUCCESS)
     {
+        METRICS_INC(calls_rejected);
 
-        if (rdata->msg_info.msg->line.req.method.id != PJSIP_ACK_METHOD)
-        {
-            reason = pj_str("Simple UA unable to handle "
-                                     "this request");
+        reason = pj_str("Sorry Simple UA can not handle this INVITE");
 
-            pjsip_endpt_respond_stateless(machine->g_endpt, rdata, 405, &reason, NULL, NULL);
-        }
-        return PJ_TRUE;
+        pjsip_endpt_respond_stateless(machine->g_endpt, rdata, 400, &reason, NULL, NULL);
+        return;
     }
 
-    /* Verify that we can handle the request. */
-    status = pjsip_inv_verify_request(rdata, &options, NULL, NULL, machine->g_endpt, NULL);
+    /* Every call gets its own RTP socket, advertised in its SDP */
+    status = socket_find(&socket);
     if (status != PJ_SUCCESS)
     {
+        METRICS_INC(calls_rejected);
 
-        reason = pj_str("Sorry Simple UA can not handle this INVITE");
+        reason = pj_str("No free media ports");
 
-        pjsip_endpt_respond_stateless(machine->g_endpt, rdata, 400, &reason, NULL, NULL);
-        return PJ_TRUE;
+        pjsip_endpt_respond_stateless(machine->g_endpt, rdata, 486, &reason, NULL, NULL);
+        return;
     }
 
-    /* Verify username */
-    uri = (pjsip_sip_uri *) pjsip_uri_get_uri(rdata->msg_info.to->uri);
-    player_port = pj_hash_get(machine->table, uri->user.ptr, uri->user.slen, 0);
-    if (player_port == NULL)
+    /* Get media capability, with the crypto of SDES when the socket has SRTP */
+    sdp_info = pjsip_rdata_get_sdp_info(rdata);
+    status = pjmedia_endpt_create_sdp(machine->g_med_endpt, 
+                                      rdata->tp_info.pool, 
+                                      1, 
+                                      &socket->sock_info, &local_sdp);
+    pj_assert(status == PJ_SUCCESS);
+    if (status == PJ_SUCCESS)
+    {
+        status = media_socket_sdp_encode(socket, rdata->tp_info.pool, sdp_info ? sdp_info->sdp : NULL, local_sdp);
+    }
+    if (status != PJ_SUCCESS)
     {
-        reason = pj_str("Can't find username");
+        METRICS_INC(calls_rejected);
+        socket_release(socket);
 
-        pjsip_endpt_respond_stateless(machine->g_endpt, rdata, 403, &reason, NULL, NULL);
-        return PJ_TRUE;
+        pjsip_endpt_respond_stateless(machine->g_endpt, rdata, 488, NULL, NULL, NULL);
+        return;
     }
 
     /* Generate Contact URI */
     if (pj_gethostip(AF, &hostaddr) != PJ_SUCCESS)
     {
         app_perror(THIS_FILE, "Unable to retrieve local host IP", status);
-        return PJ_TRUE;
+        socket_release(socket);
+        return;
     }
     pj_sockaddr_print(&hostaddr, hostip, sizeof(hostip), 2);
 
-    pj_ansi_snprintf(temp, sizeof(temp), "<sip:simpleuas@%s:%d>", hostip, SIP_PORT);
+    pj_ansi_snprintf(temp, sizeof(temp), "<sip:simpleuas@%s:%d>", hostip, machine->sip_port);
     local_uri = pj_str(temp);
 
     /* Create UAS dialog */
@@ -730,63 +2531,170 @@ static pj_bool_t on_rx_request(pjsip_rx_data *rdata)
                                                &dlg);
     if (status != PJ_SUCCESS)
     {
+        METRICS_INC(calls_rejected);
+        socket_release(socket);
+
         pjsip_endpt_respond_stateless(machine->g_endpt, rdata, 500, NULL, NULL, NULL);
-        return PJ_TRUE;
+        return;
     }
+
+    /* Keep the dialog on the listener that has received its INVITE */
+    pj_bzero(&tp_selector, sizeof(tp_selector));
+    tp_selector.type = PJSIP_TPSELECTOR_TRANSPORT;
+    tp_selector.u.transport = rdata->tp_info.transport;
+    pjsip_dlg_set_transport(dlg, &tp_selector);
     
+#if EMBEDDED_PROFILE
+    call_pool = arena_pool_create(machine->call_arena, "call_pool");
+#else
     call_pool = pj_pool_create(&machine->cp->factory, "call_pool", sizeof(*call), sizeof(*call), NULL);
+#endif
+    if (call_pool == NULL)
+    {
+        METRICS_INC(calls_rejected);
+        socket_release(socket);
+
+        pjsip_dlg_dec_lock(dlg);
+        pjsip_endpt_respond_stateless(machine->g_endpt, rdata, 503, NULL, NULL, NULL);
+        return;
+    }
 
     status = call_create(call_pool, dlg->call_id->id, &call);
     if (status != PJ_SUCCESS)
     {
         app_perror(THIS_FILE, "Error in call creation", status);
+        METRICS_INC(calls_rejected);
+        socket_release(socket);
+
+#if EMBEDDED_PROFILE
+        arena_pool_release(machine->call_arena, call_pool);
+#else
+        pj_pool_release(call_pool);
+#endif
+        pjsip_dlg_dec_lock(dlg);
+        pjsip_endpt_respond_stateless(machine->g_endpt, rdata, 500, NULL, NULL, NULL);
+        return;
     }
 
-    call->player_port = *player_port;
+    call->arena = machine->call_arena;
+    call->socket = socket;
+    call->routes = routes;
+    route_table_add_ref(routes);
+    call->shard = shard_find(rdata->tp_info.transport);
+    call->ptime = ptime_negotiate(rdata, route->ptime);
 
-    status = call_add(call);
-    if (status != PJ_SUCCESS)
+    call->cdr.invite_msec = invite_msec;
+    call->cdr.rtp_port = pj_sockaddr_get_port(&socket->sock_info.rtp_addr_name);
+    pj_ansi_snprintf(call->cdr.username, sizeof(call->cdr.username), "%.*s", (int)uri->user.slen, uri->user.ptr);
+
+    /* Init timers of the call */
+    pj_timer_entry_init(call->ringing_timer, 1, call, on_ringing_timer_expire_callback);
+    pj_timer_entry_init(call->media_session_timer, 1, call, on_active_call_timer_expire_callback);
+    pj_timer_entry_init(call->hangup_timer, 1, call, on_active_call_timer_expire_callback);
+
+    /* The playlist of a prompt lives as long as its call */
+    if (prompt)
     {
-        app_perror(THIS_FILE, "Error in adding call to array", status);
+        playlist = PJ_POOL_ZALLOC_T(call->pool, struct playlist_t);
+        pj_ansi_snprintf(playlist->spec, sizeof(playlist->spec), "@%s", prompt->name);
+        playlist->segments[0].prompt = prompt;
+        playlist->segments[0].repeat = 1;
+        playlist->segments_count = 1;
+        route->playlist = playlist;
     }
 
-    /* Get media capability */
-    status = pjmedia_endpt_create_sdp(machine->g_med_endpt, 
-                                      rdata->tp_info.pool, 
-                                      MAX_MEDIA_CNT, 
-                                      machine->g_sock_info, &local_sdp);
-    pj_assert(status == PJ_SUCCESS);
+    if (route->playlist || route->menu)
+    {
+        /*
+         * A playlist has its own player per call, connected to the bridge for the whole call.
+         * The player of a menu holds all its targets, digits move its cursor between them.
+         */
+        call->menu = route->menu;
+        status = playlist_port_create(call->pool,
+                                      machine->announcements,
+                                      route->menu ? route->menu->targets : route->playlist,
+                                      route->menu ? route->menu->targets_count : 1,
+                                      call->grp_lock,
+                                      &call->playlist);
+        if (status == PJ_SUCCESS && machine->conf)
+        {
+            status = pjmedia_conf_add_port(machine->conf, call->pool, &call->playlist->base, NULL, &call->player_port);
+            if (status != PJ_SUCCESS)
+            {
+                playlist_port_release(call->playlist);
+            }
+        }
+
+        /* A voicemail is recorded on top of the session */
+        if (status == PJ_SUCCESS && playlist_port_records(call->playlist))
+        {
+            call->media_session_time.sec += settings_get()->record_max_sec;
+        }
+
+        if (status != PJ_SUCCESS)
+        {
+            app_perror(THIS_FILE, "Unable to create playlist player", status);
+            call->playlist = NULL;
+            call_setup_abort(call, dlg, rdata, 500);
+            return;
+        }
+    }
+    else
+    {
+        /* Pin the current version of the announcement for the whole call */
+        call->announcement = announcement_acquire(machine->announcements, route->announcement);
+        call->player_port = call->announcement->slot;
+    }
+
+    /* An untracked call would never give its socket and versions back */
+    status = call_add(call);
     if (status != PJ_SUCCESS)
     {
-        pjsip_dlg_dec_lock(dlg);
-        return PJ_TRUE;
+        app_perror(THIS_FILE, "Error in adding call to array", status);
+        call_setup_abort(call, dlg, rdata, 503);
+        return;
     }
 
+    ptime_attr_add(rdata->tp_info.pool, local_sdp, call->ptime);
+
     /* Create invite session */
     status = pjsip_inv_create_uas(dlg, rdata, local_sdp, 0, &call->inv);
-    pj_assert(status == PJ_SUCCESS);
     if (status != PJ_SUCCESS)
     {
-        pjsip_dlg_dec_lock(dlg);
-        return PJ_TRUE;
+        app_perror(THIS_FILE, "Unable to create invite session", status);
+
+        /* The table lets its reference go, the abort the one taken for it */
+        pj_grp_lock_add_ref(call->grp_lock);
+        call_delete(&call->call_id);
+        call->inv = NULL;
+        call_setup_abort(call, dlg, rdata, 500);
+        return;
     }
 
-    /* Invite session has been created, decrement & release dialog lock */
-    pjsip_dlg_dec_lock(dlg);
+    /* The call keeps the session alive until its last timer has run */
+    pjsip_inv_add_ref(call->inv);
 
     /* Create initial 180 response */
     status = pjsip_inv_initial_answer(call->inv, rdata, 180, NULL, NULL, &tdata);
-    PJ_ASSERT_RETURN(status == PJ_SUCCESS, PJ_TRUE);
-
-    /* Send the 180 response. */
-    status = pjsip_inv_send_msg(call->inv, tdata);
-    PJ_ASSERT_RETURN(status == PJ_SUCCESS, PJ_TRUE);
+    if (status == PJ_SUCCESS)
+    {
+        /* Send the 180 response. */
+        status = pjsip_inv_send_msg(call->inv, tdata);
+    }
 
-    /* Init timers of the call */
-    pj_timer_entry_init(call->ringing_timer, 1, call, on_ringing_timer_expire_callback);
-    pj_timer_entry_init(call->media_session_timer, 1, call, on_active_call_timer_expire_callback);
+    if (status == PJ_SUCCESS)
+    {
+        call->cdr.ringing_msec = cdr_now_msec();
+        pjsip_endpt_schedule_timer_w_grp_lock(machine->g_endpt, call->ringing_timer, &call->ringing_time, 1, call->grp_lock);
 
-    pjsip_endpt_schedule_timer(machine->g_endpt, call->ringing_timer, &call->ringing_time);
+        pj_get_timestamp(&end);
+        METRICS_ADD(setup_nsec, pj_elapsed_nanosec(start, &end));
+        METRICS_INC(setups);
+    }
 
-    return PJ_TRUE;
+    /*
+     * Invite session has been set up, decrement & release dialog lock.
+     * Requests of this dialog received by other SIP threads wait for it.
+     */
+    pjsip_dlg_dec_lock(dlg);
 }
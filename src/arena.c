@@ -0,0 +1,77 @@
+#include "../headers/arena.h"
+
+#define THIS_FILE "arena.c"
+
+pj_status_t arena_create(pj_pool_t *pool, pj_size_t slot_size, int slots_count, struct arena_t **arena)
+{
+    pj_status_t status;
+    int i;
+
+    (*arena) = PJ_POOL_ZALLOC_T(pool, struct arena_t);
+    if (!(*arena))
+    {
+        return PJ_ENOMEM;
+    }
+
+    (*arena)->buf = (char *)pj_pool_alloc(pool, slot_size * slots_count);
+    if (!(*arena)->buf)
+    {
+        return PJ_ENOMEM;
+    }
+
+    (*arena)->free_slots = (int *)pj_pool_calloc(pool, slots_count, sizeof(int));
+    if (!(*arena)->free_slots)
+    {
+        return PJ_ENOMEM;
+    }
+
+    status = pj_mutex_create_simple(pool, "arena", &(*arena)->lock);
+    if (status != PJ_SUCCESS)
+    {
+        return status;
+    }
+
+    (*arena)->slot_size = slot_size;
+    (*arena)->slots_count = slots_count;
+
+    for (i = 0; i < slots_count; i++)
+    {
+        (*arena)->free_slots[i] = slots_count - 1 - i;
+    }
+    (*arena)->free_count = slots_count;
+
+    return PJ_SUCCESS;
+}
+
+/* NULL once every slot is taken */
+pj_pool_t *arena_pool_create(struct arena_t *arena, const char *name)
+{
+    int slot = -1;
+
+    pj_mutex_lock(arena->lock);
+    if (arena->free_count > 0)
+    {
+        slot = arena->free_slots[--arena->free_count];
+    }
+    pj_mutex_unlock(arena->lock);
+
+    if (slot < 0)
+    {
+        PJ_LOG(3, (THIS_FILE, "All %d slots of the arena are in use", arena->slots_count));
+        return NULL;
+    }
+
+    return pj_pool_create_on_buf(name, arena->buf + slot * arena->slot_size, arena->slot_size);
+}
+
+/* A pool on a buffer owns nothing else, giving back its slot is all there is to release */
+void arena_pool_release(struct arena_t *arena, pj_pool_t *pool)
+{
+    int slot = (int)(((char *)pool - arena->buf) / arena->slot_size);
+
+    PJ_ASSERT_ON_FAIL(slot >= 0 && slot < arena->slots_count, return);
+
+    pj_mutex_lock(arena->lock);
+    arena->free_slots[arena->free_count++] = slot;
+    pj_mutex_unlock(arena->lock);
+}
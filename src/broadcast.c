@@ -0,0 +1,281 @@
+#include "../headers/broadcast.h"
+
+#define THIS_FILE "broadcast.c"
+
+static struct broadcast_group_t *group_get(struct broadcaster_t *broadcaster,
+                                           const struct announcement_version_t *version,
+                                           int pt,
+                                           unsigned ptime);
+
+static void group_encode(struct broadcaster_t *broadcaster, struct broadcast_group_t *group, unsigned count);
+
+pj_status_t broadcaster_create(pj_pool_t *pool, struct broadcaster_t **broadcaster)
+{
+    pj_status_t status;
+
+    (*broadcaster) = PJ_POOL_ZALLOC_T(pool, struct broadcaster_t);
+    if (!(*broadcaster))
+    {
+        return PJ_ENOMEM;
+    }
+
+    (*broadcaster)->kernels = g711_kernels_select();
+    if ((*broadcaster)->kernels == NULL)
+    {
+        (*broadcaster)->kernels = g711_kernels_scalar();
+    }
+
+    status = pj_mutex_create_simple(pool, "broadcast", &(*broadcaster)->lock);
+    if (status != PJ_SUCCESS)
+    {
+        return status;
+    }
+
+    PJ_LOG(4, (THIS_FILE, "Broadcast groups encode with %s kernels", (*broadcaster)->kernels->name));
+
+    return PJ_SUCCESS;
+}
+
+pj_bool_t broadcast_accepts(const struct announcement_version_t *version, int pt, unsigned clock_rate, unsigned ptime)
+{
+    return version && version->samples_count > 0 && version->clock_rate == BROADCAST_CLOCK_RATE &&
+           clock_rate == BROADCAST_CLOCK_RATE && (pt == PJMEDIA_RTP_PT_PCMU || pt == PJMEDIA_RTP_PT_PCMA) &&
+           ptime >= MEDIA_PTIME_STEP && ptime <= MEDIA_MAX_PTIME && ptime % MEDIA_PTIME_STEP == 0;
+}
+
+pj_status_t broadcast_subscribe(struct broadcaster_t *broadcaster,
+                                struct broadcast_sub_t *sub,
+                                const struct announcement_version_t *version,
+                                int pt,
+                                unsigned ptime,
+                                pjmedia_transport *transport,
+                                pjmedia_port *stream_port)
+{
+    struct broadcast_group_t *group;
+    pj_uint32_t ssrc = pj_rand();
+
+    PJ_ASSERT_RETURN(sub->group == NULL, PJ_EINVALIDOP);
+    PJ_ASSERT_RETURN(PJMEDIA_PIA_SPF(&stream_port->info) <= BROADCAST_MAX_PAYLOAD, PJ_ETOOBIG);
+
+    pjmedia_rtp_session_init(&sub->rtp, pt, ssrc);
+    pjmedia_rtcp_init(&sub->rtcp, NULL, BROADCAST_CLOCK_RATE, BROADCAST_CLOCK_RATE * ptime / 1000, ssrc);
+    sub->rtcp_countdown = BROADCAST_RTCP_INTERVAL_MSEC / ptime;
+    sub->transport = transport;
+    sub->stream_port = stream_port;
+    sub->marker = 1;
+    sub->prev = NULL;
+
+    pj_mutex_lock(broadcaster->lock);
+
+    group = group_get(broadcaster, version, pt, ptime);
+    if (!group)
+    {
+        pj_mutex_unlock(broadcaster->lock);
+        return PJ_ETOOMANY;
+    }
+
+    sub->group = group;
+    sub->next = group->subs;
+    if (group->subs)
+    {
+        group->subs->prev = sub;
+    }
+    group->subs = sub;
+    group->subs_count++;
+
+    pj_mutex_unlock(broadcaster->lock);
+
+    METRICS_INC(broadcast_calls);
+
+    return PJ_SUCCESS;
+}
+
+void broadcast_unsubscribe(struct broadcaster_t *broadcaster, struct broadcast_sub_t *sub)
+{
+    struct broadcast_group_t *group;
+
+    pj_mutex_lock(broadcaster->lock);
+
+    group = sub->group;
+    if (!group)
+    {
+        pj_mutex_unlock(broadcaster->lock);
+        return;
+    }
+
+    if (sub->prev)
+    {
+        sub->prev->next = sub->next;
+    }
+    else
+    {
+        group->subs = sub->next;
+    }
+    if (sub->next)
+    {
+        sub->next->prev = sub->prev;
+    }
+
+    sub->group = NULL;
+    sub->stream_port = NULL;
+    sub->prev = NULL;
+    sub->next = NULL;
+
+    /* The last call frees the slot, its version is not looked at afterwards */
+    if (--group->subs_count == 0)
+    {
+        group->version = NULL;
+    }
+
+    pj_mutex_unlock(broadcaster->lock);
+}
+
+void broadcaster_tick(void *user_data)
+{
+    struct broadcaster_t *broadcaster = (struct broadcaster_t *)user_data;
+    struct broadcast_group_t *group;
+    struct broadcast_sub_t *sub;
+    const void *header;
+    void *rtcp;
+    pjmedia_frame frame;
+    pj_timestamp start, end;
+    unsigned long packets = 0;
+    unsigned count;
+    int header_len;
+    int rtcp_len;
+    int i;
+
+    pj_get_timestamp(&start);
+
+    pj_mutex_lock(broadcaster->lock);
+
+    for (i = 0; i < BROADCAST_MAX_GROUPS; i++)
+    {
+        group = &broadcaster->groups[i];
+        if (group->subs == NULL)
+        {
+            continue;
+        }
+
+        group->elapsed_msec += MEDIA_PTIME_STEP;
+        if (group->elapsed_msec < group->ptime)
+        {
+            continue;
+        }
+        group->elapsed_msec = 0;
+
+        /* One encode for the group, then a header and a send per call */
+        count = BROADCAST_CLOCK_RATE * group->ptime / 1000;
+        group_encode(broadcaster, group, count);
+
+        for (sub = group->subs; sub; sub = sub->next)
+        {
+            pjmedia_rtp_encode_rtp(&sub->rtp, group->pt, sub->marker, (int)count, (int)count, &header, &header_len);
+            sub->marker = 0;
+
+            pj_memcpy(group->packet, header, BROADCAST_RTP_HEADER_LEN);
+            if (pjmedia_transport_send_rtp(sub->transport, group->packet, BROADCAST_RTP_HEADER_LEN + count) ==
+                PJ_SUCCESS)
+            {
+                sub->packets++;
+                sub->bytes += count;
+                packets++;
+                pjmedia_rtcp_tx_rtp(&sub->rtcp, count);
+            }
+
+            if (--sub->rtcp_countdown == 0)
+            {
+                sub->rtcp_countdown = BROADCAST_RTCP_INTERVAL_MSEC / group->ptime;
+                pjmedia_rtcp_build_rtcp(&sub->rtcp, &rtcp, &rtcp_len);
+                pjmedia_transport_send_rtcp(sub->transport, rtcp, rtcp_len);
+            }
+
+            /* What the bridge would have pulled over the packet, the received audio is not used */
+            frame.type = PJMEDIA_FRAME_TYPE_AUDIO;
+            frame.buf = broadcaster->drained;
+            frame.size = PJMEDIA_PIA_SPF(&sub->stream_port->info) * sizeof(pj_int16_t);
+            pjmedia_port_get_frame(sub->stream_port, &frame);
+        }
+
+        METRICS_INC(broadcast_encodes);
+    }
+
+    pj_mutex_unlock(broadcaster->lock);
+
+    if (packets > 0)
+    {
+        pj_get_timestamp(&end);
+        METRICS_ADD(broadcast_packets, packets);
+        METRICS_ADD(broadcast_nsec, pj_elapsed_nanosec(&start, &end));
+    }
+}
+
+void broadcaster_free(struct broadcaster_t *broadcaster)
+{
+    pj_mutex_destroy(broadcaster->lock);
+}
+
+/* Slot of the version, codec and ptime, bounded by BROADCAST_MAX_GROUPS whatever the number of calls */
+static struct broadcast_group_t *group_get(struct broadcaster_t *broadcaster,
+                                           const struct announcement_version_t *version,
+                                           int pt,
+                                           unsigned ptime)
+{
+    struct broadcast_group_t *free_group = NULL;
+    struct broadcast_group_t *group;
+    int i;
+
+    for (i = 0; i < BROADCAST_MAX_GROUPS; i++)
+    {
+        group = &broadcaster->groups[i];
+        if (group->version == version && group->pt == pt && group->ptime == ptime)
+        {
+            return group;
+        }
+        if (!free_group && group->version == NULL)
+        {
+            free_group = group;
+        }
+    }
+
+    if (free_group)
+    {
+        free_group->version = version;
+        free_group->pt = pt;
+        free_group->ptime = ptime;
+        free_group->position = 0;
+        free_group->elapsed_msec = 0;
+    }
+
+    return free_group;
+}
+
+/* Samples of the version from the position of the group, wrapping around at its end */
+static void group_encode(struct broadcaster_t *broadcaster, struct broadcast_group_t *group, unsigned count)
+{
+    const struct announcement_version_t *version = group->version;
+    pj_uint8_t *payload = group->packet + BROADCAST_RTP_HEADER_LEN;
+    unsigned done = 0;
+    unsigned chunk;
+
+    while (done < count)
+    {
+        chunk = (unsigned)PJ_MIN(count - done, version->samples_count - group->position);
+
+        if (group->pt == PJMEDIA_RTP_PT_PCMA)
+        {
+            broadcaster->kernels->alaw_encode(version->samples + group->position, payload + done, chunk);
+        }
+        else
+        {
+            broadcaster->kernels->ulaw_encode(version->samples + group->position, payload + done, chunk);
+        }
+
+        done += chunk;
+        group->position += chunk;
+        if (group->position == version->samples_count)
+        {
+            group->position = 0;
+        }
+    }
+}
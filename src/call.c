@@ -1,37 +1,79 @@
 #include "../headers/call.h"
+#include "../headers/mem_stats.h"
+
+static void call_on_destroy(void *member);
 
 pj_status_t call_create(pj_pool_t *pool, pj_str_t call_id, struct call_t **call)
 {
+    pj_status_t status;
+
     (*call) = (struct call_t *)pj_pool_alloc(pool, sizeof(**call));
-    if (!call)
+    if (!*call)
     {
         return FAILURE;
     }
 
     (*call)->pool = pool;
+    (*call)->arena = NULL;
     (*call)->call_id = call_id;
+    (*call)->inv = NULL;
+    (*call)->terminated = PJ_FALSE;
     (*call)->snd_port = NULL;
     (*call)->med_stream = NULL;
+    (*call)->socket = NULL;
+    (*call)->routes = NULL;
+    (*call)->announcement = NULL;
+    (*call)->playlist = NULL;
+    (*call)->recording = NULL;
+    (*call)->menu = NULL;
+    (*call)->hangup_requested = PJ_FALSE;
+    (*call)->shard = 0;
 
     (*call)->player_port = -1;
     (*call)->conf_port = -1;
+    (*call)->stream_port = NULL;
+    (*call)->direct_frame = NULL;
+    (*call)->direct_period = 1;
+    (*call)->direct_ticks = 0;
+    pj_bzero(&(*call)->broadcast, sizeof((*call)->broadcast));
+
+    cdr_record_init(&(*call)->cdr);
+    pj_ansi_snprintf((*call)->cdr.call_id, sizeof((*call)->cdr.call_id), "%.*s", (int)call_id.slen, call_id.ptr);
 
     /* Timers */
     (*call)->ringing_timer = (pj_timer_entry *) pj_pool_alloc(pool, sizeof(pj_timer_entry));
     (*call)->media_session_timer = (pj_timer_entry *) pj_pool_alloc(pool, sizeof(pj_timer_entry));
+    (*call)->hangup_timer = (pj_timer_entry *) pj_pool_alloc(pool, sizeof(pj_timer_entry));
 
     /* Time values */
-    (*call)->ringing_time.sec = RINGING_TIME;
+    (*call)->ringing_time.sec = settings_get()->ringing_time;
     (*call)->ringing_time.msec = 0;
 
-    (*call)->media_session_time.sec = MEDIA_SESSION_TIME;
+    (*call)->media_session_time.sec = settings_get()->media_session_time;
     (*call)->media_session_time.msec = 0;
 
+    /* The call is destroyed once the machine and all its timers have released it */
+    status = pj_grp_lock_create(pool, NULL, &(*call)->grp_lock);
+    if (status != PJ_SUCCESS)
+    {
+        return status;
+    }
+
+    pj_grp_lock_add_ref((*call)->grp_lock);
+    pj_grp_lock_add_handler((*call)->grp_lock, pool, *call, &call_on_destroy);
+
     return PJ_SUCCESS;
 }
 
 void call_free(struct call_t *call)
 {
+    pj_grp_lock_dec_ref(call->grp_lock);
+}
+
+static void call_on_destroy(void *member)
+{
+    struct call_t *call = (struct call_t *)member;
+
     if (call->socket)
     {
         call->socket->occupied = PJ_FALSE;
@@ -42,5 +84,21 @@ void call_free(struct call_t *call)
         pjmedia_snd_port_destroy(call->snd_port);
     }
 
-    pj_pool_release(call->pool);
+    if (call->inv)
+    {
+        pjsip_inv_dec_ref(call->inv);
+    }
+
+    /* The bridge has let the player go, nothing reads the playlists of the generation any more */
+    route_table_release(call->routes);
+
+    mem_stats_call_pool(call->pool);
+    if (call->arena)
+    {
+        arena_pool_release(call->arena, call->pool);
+    }
+    else
+    {
+        pj_pool_release(call->pool);
+    }
 }
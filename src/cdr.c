@@ -0,0 +1,214 @@
+#include "../headers/cdr.h"
+
+#include <errno.h>
+
+#define THIS_FILE "cdr.c"
+
+static pj_status_t file_open(struct cdr_writer_t *writer);
+
+static void file_rotate(struct cdr_writer_t *writer);
+
+static pj_uint32_t ring_flush(struct cdr_writer_t *writer);
+
+static int writer_thread(void *arg);
+
+/*
+ * CDRs are written without any I/O on the signaling threads:
+ * records are copied into a ring and a writer thread appends
+ * everything buffered with one write per flush interval.
+ */
+pj_status_t cdr_writer_create(pj_pool_t *pool, const char *path, struct cdr_writer_t **writer)
+{
+    pj_status_t status;
+
+    PJ_ASSERT_RETURN((CDR_RING_SIZE & (CDR_RING_SIZE - 1)) == 0, PJ_EINVAL);
+
+    (*writer) = PJ_POOL_ZALLOC_T(pool, struct cdr_writer_t);
+    if (!(*writer))
+    {
+        return PJ_ENOMEM;
+    }
+
+    (*writer)->pool = pool;
+    (*writer)->ring = (struct cdr_record_t *)pj_pool_alloc(pool, CDR_RING_SIZE * sizeof(struct cdr_record_t));
+    pj_ansi_strncpy((*writer)->path, path, sizeof((*writer)->path) - 1);
+
+    status = pj_mutex_create_simple(pool, "cdr", &(*writer)->lock);
+    if (status != PJ_SUCCESS)
+    {
+        return status;
+    }
+
+    status = file_open(*writer);
+    if (status != PJ_SUCCESS)
+    {
+        return status;
+    }
+
+    return pj_thread_create(pool, "cdr_writer", &writer_thread, *writer, 0, 0, &(*writer)->thread);
+}
+
+void cdr_record_init(struct cdr_record_t *record)
+{
+    pj_bzero(record, sizeof(*record));
+
+    record->magic = CDR_MAGIC;
+    record->size = sizeof(*record);
+}
+
+pj_uint64_t cdr_now_msec(void)
+{
+    pj_time_val now;
+
+    pj_gettimeofday(&now);
+
+    return (pj_uint64_t)now.sec * 1000 + now.msec;
+}
+
+/* Queue a record, dropping it if the writer has fallen a whole ring behind */
+pj_status_t cdr_write(struct cdr_writer_t *writer, const struct cdr_record_t *record)
+{
+    pj_mutex_lock(writer->lock);
+
+    if (writer->head - writer->tail == CDR_RING_SIZE)
+    {
+        pj_mutex_unlock(writer->lock);
+        METRICS_INC(cdr_dropped);
+        return PJ_ETOOMANY;
+    }
+
+    writer->ring[writer->head & (CDR_RING_SIZE - 1)] = *record;
+    writer->head++;
+
+    pj_mutex_unlock(writer->lock);
+
+    return PJ_SUCCESS;
+}
+
+void cdr_writer_free(struct cdr_writer_t *writer)
+{
+    writer->quit = PJ_TRUE;
+
+    if (writer->thread)
+    {
+        pj_thread_join(writer->thread);
+        pj_thread_destroy(writer->thread);
+    }
+
+    if (writer->file)
+    {
+        fclose(writer->file);
+    }
+
+    pj_mutex_destroy(writer->lock);
+}
+
+static pj_status_t file_open(struct cdr_writer_t *writer)
+{
+    writer->file = fopen(writer->path, "ab");
+    if (writer->file == NULL)
+    {
+        return PJ_RETURN_OS_ERROR(errno);
+    }
+
+    fseek(writer->file, 0, SEEK_END);
+    writer->file_size = ftell(writer->file);
+
+    return PJ_SUCCESS;
+}
+
+/* Move the full file aside with its rotation time, new records go to a fresh one */
+static void file_rotate(struct cdr_writer_t *writer)
+{
+    char rotated[sizeof(writer->path) + 24];
+    pj_status_t status;
+
+    fclose(writer->file);
+    writer->file = NULL;
+
+    pj_ansi_snprintf(rotated, sizeof(rotated), "%s.%llu", writer->path, (unsigned long long)cdr_now_msec());
+    if (rename(writer->path, rotated) != 0)
+    {
+        app_perror(THIS_FILE, "Unable to rotate CDR file", PJ_RETURN_OS_ERROR(errno));
+    }
+    else
+    {
+        PJ_LOG(4, (THIS_FILE, "CDR file rotated to %s", rotated));
+    }
+
+    status = file_open(writer);
+    if (status != PJ_SUCCESS)
+    {
+        app_perror(THIS_FILE, "Unable to reopen CDR file", status);
+    }
+}
+
+/*
+ * Write all buffered records. Producers never touch the slots between
+ * tail and head, so the file is written straight from the ring
+ * in at most two chunks without holding the lock.
+ */
+static pj_uint32_t ring_flush(struct cdr_writer_t *writer)
+{
+    pj_uint32_t head, tail, first, count, chunk;
+
+    pj_mutex_lock(writer->lock);
+    head = writer->head;
+    tail = writer->tail;
+    pj_mutex_unlock(writer->lock);
+
+    count = head - tail;
+    if (count == 0)
+    {
+        return 0;
+    }
+
+    if (writer->file)
+    {
+        first = tail & (CDR_RING_SIZE - 1);
+        chunk = PJ_MIN(count, CDR_RING_SIZE - first);
+
+        fwrite(&writer->ring[first], sizeof(struct cdr_record_t), chunk, writer->file);
+        if (chunk < count)
+        {
+            fwrite(&writer->ring[0], sizeof(struct cdr_record_t), count - chunk, writer->file);
+        }
+        fflush(writer->file);
+
+        writer->file_size += count * sizeof(struct cdr_record_t);
+
+        METRICS_ADD(cdr_written, count);
+        METRICS_INC(cdr_batches);
+    }
+    else
+    {
+        METRICS_ADD(cdr_dropped, count);
+    }
+
+    pj_mutex_lock(writer->lock);
+    writer->tail = head;
+    pj_mutex_unlock(writer->lock);
+
+    if (writer->file_size >= CDR_ROTATE_BYTES)
+    {
+        file_rotate(writer);
+    }
+
+    return count;
+}
+
+static int writer_thread(void *arg)
+{
+    struct cdr_writer_t *writer = (struct cdr_writer_t *)arg;
+
+    while (!writer->quit)
+    {
+        pj_thread_sleep(CDR_FLUSH_MSEC);
+        ring_flush(writer);
+    }
+
+    /* Records of the last calls */
+    ring_flush(writer);
+
+    return 0;
+}
@@ -0,0 +1,583 @@
+#include "../headers/dispatcher.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define THIS_FILE "dispatcher.c"
+
+static pj_status_t backends_parse(const char *backends);
+
+static void ring_build(void);
+
+static int ring_compare(const void *a, const void *b);
+
+static pj_uint32_t hash_mix(pj_uint32_t hash);
+
+static struct dispatcher_backend_t *backend_find(const pj_str_t *call_id);
+
+static void backend_check(struct dispatcher_backend_t *backend);
+
+static void on_backend_check_done(void *token, pjsip_event *e);
+
+static void on_check_timer_callback(pj_timer_heap_t *timer_heap, struct pj_timer_entry *entry);
+
+static pj_bool_t dispatcher_on_rx_request(pjsip_rx_data *rdata);
+
+static pj_bool_t dispatcher_on_rx_response(pjsip_rx_data *rdata);
+
+static pj_bool_t route_is_own(const pjsip_route_hdr *route);
+
+static pj_bool_t source_is_backend(const pjsip_rx_data *rdata);
+
+static void record_route_add(pjsip_tx_data *tdata);
+
+static void on_soak_done(int result);
+
+static int dispatcher_thread(void *arg);
+
+static pj_caching_pool cp;
+
+static struct dispatcher_t *dispatcher;
+
+pj_status_t dispatcher_create(int sip_port, const char *backends)
+{
+    pj_status_t status;
+    pj_sockaddr_in addr;
+    pj_pool_t *pool;
+
+    status = pj_init();
+    PJ_ASSERT_RETURN(status == PJ_SUCCESS, status);
+
+    status = pjlib_util_init();
+    PJ_ASSERT_RETURN(status == PJ_SUCCESS, status);
+
+    pj_caching_pool_init(&cp, &pj_pool_factory_default_policy, 0);
+    mem_stats_init(&cp);
+
+    pool = pj_pool_create(&cp.factory, "dispatcher_pool", DISPATCHER_POOL_SIZE, DISPATCHER_POOL_INC, NULL);
+    mem_stats_track(pool);
+
+    dispatcher = PJ_POOL_ZALLOC_T(pool, struct dispatcher_t);
+    dispatcher->cp = &cp;
+    dispatcher->pool = pool;
+    dispatcher->sip_port = sip_port;
+
+    status = backends_parse(backends);
+    if (status != PJ_SUCCESS)
+    {
+        return status;
+    }
+
+    ring_build();
+
+    status = pjsip_endpt_create(&cp.factory, pj_gethostname()->ptr, &dispatcher->endpt);
+    PJ_ASSERT_RETURN(status == PJ_SUCCESS, status);
+
+    pj_sockaddr_in_init(&addr, NULL, (pj_uint16_t)sip_port);
+    status = pjsip_udp_transport_start(dispatcher->endpt, &addr, NULL, 1, &dispatcher->transport);
+    if (status != PJ_SUCCESS)
+    {
+        app_perror(THIS_FILE, "Unable to start UDP transport", status);
+        return status;
+    }
+
+    /* Only the OPTIONS probes are sent statefully */
+    status = pjsip_tsx_layer_init_module(dispatcher->endpt);
+    PJ_ASSERT_RETURN(status == PJ_SUCCESS, status);
+
+    dispatcher->module.name = pj_str("mod-dispatcher");
+    dispatcher->module.id = -1;
+    dispatcher->module.priority = PJSIP_MOD_PRIORITY_APPLICATION;
+    dispatcher->module.on_rx_request = &dispatcher_on_rx_request;
+    dispatcher->module.on_rx_response = &dispatcher_on_rx_response;
+
+    status = pjsip_endpt_register_module(dispatcher->endpt, &dispatcher->module);
+    PJ_ASSERT_RETURN(status == PJ_SUCCESS, status);
+
+    PJ_LOG(3,
+           (THIS_FILE,
+            "Dispatching port %d to %d backends over %d ring points",
+            sip_port,
+            dispatcher->backends_count,
+            dispatcher->ring_count));
+
+    return PJ_SUCCESS;
+}
+
+/* Run synthetic calls through the dispatcher, it quits once they are done */
+pj_status_t dispatcher_soak_start(unsigned long calls, int concurrency, unsigned flood_rate)
+{
+    pj_status_t status;
+
+    status = soak_start(
+        dispatcher->pool, dispatcher->sip_port, calls, concurrency, flood_rate, &on_soak_done, &dispatcher->soak);
+    if (status != PJ_SUCCESS)
+    {
+        app_perror(THIS_FILE, "Unable to start soak", status);
+    }
+
+    return status;
+}
+
+int dispatcher_run(void)
+{
+    pj_time_val timeout = {0, 10};
+    pj_time_val check_interval = {0, 0};
+    pj_status_t status;
+    int i;
+
+    /* The first probe right away */
+    pj_timer_entry_init(&dispatcher->check_timer, 1, NULL, &on_check_timer_callback);
+    pjsip_endpt_schedule_timer(dispatcher->endpt, &dispatcher->check_timer, &check_interval);
+
+    for (i = 1; i < DISPATCHER_THREADS; i++)
+    {
+        status = pj_thread_create(
+            dispatcher->pool, "dispatcher", &dispatcher_thread, NULL, 0, 0, &dispatcher->threads[i]);
+        if (status != PJ_SUCCESS)
+        {
+            app_perror(THIS_FILE, "Unable to start dispatcher thread", status);
+        }
+    }
+
+    affinity_apply("dispatcher", settings_get()->sip_thread_cpus, (int)settings_get()->sip_thread_priority);
+
+    while (!dispatcher->quit)
+    {
+        pjsip_endpt_handle_events(dispatcher->endpt, &timeout);
+    }
+
+    for (i = 1; i < DISPATCHER_THREADS; i++)
+    {
+        if (dispatcher->threads[i])
+        {
+            pj_thread_join(dispatcher->threads[i]);
+            pj_thread_destroy(dispatcher->threads[i]);
+        }
+    }
+
+    pjsip_endpt_cancel_timer(dispatcher->endpt, &dispatcher->check_timer);
+    pjsip_endpt_destroy(dispatcher->endpt);
+    pj_pool_release(dispatcher->pool);
+    pj_caching_pool_destroy(&cp);
+    pj_shutdown();
+
+    return dispatcher->exit_code;
+}
+
+static pj_status_t backends_parse(const char *backends)
+{
+    char copy[DISPATCHER_MAX_BACKENDS * (DISPATCHER_HOST_LEN + 8)];
+    struct dispatcher_backend_t *backend;
+    char *item, *next, *port;
+
+    PJ_ASSERT_RETURN(pj_ansi_strlen(backends) < sizeof(copy), PJ_ENAMETOOLONG);
+    pj_ansi_strcpy(copy, backends);
+
+    for (item = copy; item != NULL && *item != '\0'; item = next)
+    {
+        next = strchr(item, ',');
+        if (next)
+        {
+            *next++ = '\0';
+        }
+
+        port = strrchr(item, ':');
+        if (port == NULL || port == item || port - item >= DISPATCHER_HOST_LEN || atoi(port + 1) <= 0)
+        {
+            PJ_LOG(1, (THIS_FILE, "Backend %s is not host:port", item));
+            return PJ_EINVAL;
+        }
+
+        if (dispatcher->backends_count == DISPATCHER_MAX_BACKENDS)
+        {
+            PJ_LOG(1, (THIS_FILE, "More than %d backends", DISPATCHER_MAX_BACKENDS));
+            return PJ_ETOOMANY;
+        }
+
+        *port++ = '\0';
+
+        backend = &dispatcher->backends[dispatcher->backends_count++];
+        pj_ansi_strcpy(backend->host, item);
+        backend->port = atoi(port);
+        pj_ansi_snprintf(backend->uri, sizeof(backend->uri), "sip:%s:%d", backend->host, backend->port);
+
+        /* Backends start in the ring, the first probe takes out those not running */
+        backend->alive = PJ_TRUE;
+    }
+
+    return dispatcher->backends_count > 0 ? PJ_SUCCESS : PJ_EINVAL;
+}
+
+/*
+ * Place every backend on the ring at the hashes of "host:port#n". Adding
+ * or losing a backend only moves the Call-IDs next to its own points.
+ */
+static void ring_build(void)
+{
+    struct dispatcher_point_t *point;
+    char key[DISPATCHER_HOST_LEN + 24];
+    int len;
+    int i, j;
+
+    for (i = 0; i < dispatcher->backends_count; i++)
+    {
+        for (j = 0; j < DISPATCHER_RING_POINTS; j++)
+        {
+            len = pj_ansi_snprintf(
+                key, sizeof(key), "%s:%d#%d", dispatcher->backends[i].host, dispatcher->backends[i].port, j);
+
+            point = &dispatcher->ring[dispatcher->ring_count++];
+            point->hash = hash_mix(pj_hash_calc(0, key, len));
+            point->backend = i;
+        }
+    }
+
+    qsort(dispatcher->ring, dispatcher->ring_count, sizeof(dispatcher->ring[0]), &ring_compare);
+}
+
+static int ring_compare(const void *a, const void *b)
+{
+    const struct dispatcher_point_t *p1 = (const struct dispatcher_point_t *)a;
+    const struct dispatcher_point_t *p2 = (const struct dispatcher_point_t *)b;
+
+    return p1->hash < p2->hash ? -1 : (p1->hash > p2->hash ? 1 : 0);
+}
+
+/* Spread the bits of the string hash over the whole ring */
+static pj_uint32_t hash_mix(pj_uint32_t hash)
+{
+    hash ^= hash >> 16;
+    hash *= 0x85ebca6b;
+    hash ^= hash >> 13;
+    hash *= 0xc2b2ae35;
+    hash ^= hash >> 16;
+
+    return hash;
+}
+
+/* First live backend clockwise from the hash of the Call-ID, NULL if all are down */
+static struct dispatcher_backend_t *backend_find(const pj_str_t *call_id)
+{
+    pj_uint32_t hash = hash_mix(pj_hash_calc(0, call_id->ptr, (unsigned)call_id->slen));
+    struct dispatcher_backend_t *backend;
+    int low = 0, high = dispatcher->ring_count;
+    int middle;
+    int i;
+
+    while (low < high)
+    {
+        middle = (low + high) / 2;
+        if (dispatcher->ring[middle].hash < hash)
+        {
+            low = middle + 1;
+        }
+        else
+        {
+            high = middle;
+        }
+    }
+
+    for (i = 0; i < dispatcher->ring_count; i++)
+    {
+        backend = &dispatcher->backends[dispatcher->ring[(low + i) % dispatcher->ring_count].backend];
+        if (__atomic_load_n(&backend->alive, __ATOMIC_RELAXED))
+        {
+            return backend;
+        }
+    }
+
+    return NULL;
+}
+
+static void backend_check(struct dispatcher_backend_t *backend)
+{
+    char from_buf[DISPATCHER_HOST_LEN + 32];
+    pj_str_t target = pj_str(backend->uri);
+    pj_str_t from;
+    pjsip_tx_data *tdata;
+    pj_status_t status;
+
+    pj_ansi_snprintf(from_buf,
+                     sizeof(from_buf),
+                     "<sip:%s@%.*s:%d>",
+                     DISPATCHER_USER,
+                     (int)dispatcher->transport->local_name.host.slen,
+                     dispatcher->transport->local_name.host.ptr,
+                     dispatcher->transport->local_name.port);
+    from = pj_str(from_buf);
+
+    status = pjsip_endpt_create_request(
+        dispatcher->endpt, &pjsip_options_method, &target, &from, &target, NULL, NULL, -1, NULL, &tdata);
+    if (status == PJ_SUCCESS)
+    {
+        backend->checking = PJ_TRUE;
+        status = pjsip_endpt_send_request(
+            dispatcher->endpt, tdata, DISPATCHER_CHECK_TIMEOUT_MSEC, backend, &on_backend_check_done);
+    }
+
+    if (status != PJ_SUCCESS)
+    {
+        app_perror(THIS_FILE, "Unable to probe backend", status);
+        backend->checking = PJ_FALSE;
+    }
+}
+
+/* Any response proves the backend alive, even a 405 to the OPTIONS itself */
+static void on_backend_check_done(void *token, pjsip_event *e)
+{
+    struct dispatcher_backend_t *backend = (struct dispatcher_backend_t *)token;
+    pj_bool_t answered = e->body.tsx_state.type == PJSIP_EVENT_RX_MSG;
+
+    backend->checking = PJ_FALSE;
+
+    if (answered)
+    {
+        backend->failures = 0;
+        if (!backend->alive)
+        {
+            PJ_LOG(3, (THIS_FILE, "Backend %s:%d is up", backend->host, backend->port));
+            __atomic_store_n(&backend->alive, PJ_TRUE, __ATOMIC_RELAXED);
+        }
+        return;
+    }
+
+    if (++backend->failures >= DISPATCHER_MAX_FAILURES && backend->alive)
+    {
+        PJ_LOG(2, (THIS_FILE, "Backend %s:%d is down", backend->host, backend->port));
+        __atomic_store_n(&backend->alive, PJ_FALSE, __ATOMIC_RELAXED);
+        METRICS_INC(dispatcher_backends_lost);
+    }
+}
+
+static void on_check_timer_callback(pj_timer_heap_t *timer_heap, struct pj_timer_entry *entry)
+{
+    pj_time_val check_interval = {DISPATCHER_CHECK_INTERVAL_SEC, 0};
+    int i;
+
+    PJ_UNUSED_ARG(timer_heap);
+
+    for (i = 0; i < dispatcher->backends_count; i++)
+    {
+        if (!dispatcher->backends[i].checking)
+        {
+            backend_check(&dispatcher->backends[i]);
+        }
+    }
+
+    pjsip_endpt_schedule_timer(dispatcher->endpt, entry, &check_interval);
+}
+
+/*
+ * Forward a request statelessly. The Request-URI keeps its user, the
+ * backend routes by it, only the host part is pointed at the backend.
+ * Requests of a backend, like a BYE once the call is over, go on to
+ * the Request-URI the caller has left in the dialog.
+ */
+static pj_bool_t dispatcher_on_rx_request(pjsip_rx_data *rdata)
+{
+    struct dispatcher_backend_t *backend = NULL;
+    pjsip_msg *msg = rdata->msg_info.msg;
+    pj_bool_t downstream = source_is_backend(rdata);
+    pj_bool_t ack = msg->line.req.method.id == PJSIP_ACK_METHOD;
+    pjsip_route_hdr *route;
+    pjsip_sip_uri *target;
+    pjsip_tx_data *tdata;
+    pj_status_t status;
+
+    if (rdata->msg_info.max_fwd && rdata->msg_info.max_fwd->ivalue <= 1)
+    {
+        if (!ack)
+        {
+            pjsip_endpt_respond_stateless(dispatcher->endpt, rdata, 483, NULL, NULL, NULL);
+        }
+        return PJ_TRUE;
+    }
+
+    if (!downstream)
+    {
+        backend = backend_find(&rdata->msg_info.cid->id);
+    }
+    if (!downstream && backend == NULL)
+    {
+        METRICS_INC(dispatcher_rejected);
+        if (!ack)
+        {
+            pjsip_endpt_respond_stateless(dispatcher->endpt, rdata, 503, NULL, NULL, NULL);
+        }
+        return PJ_TRUE;
+    }
+
+    status = pjsip_endpt_create_request_fwd(dispatcher->endpt, rdata, NULL, NULL, 0, &tdata);
+    if (status != PJ_SUCCESS)
+    {
+        app_perror(THIS_FILE, "Unable to forward request", status);
+        return PJ_TRUE;
+    }
+
+    /* In-dialog requests come back with the Record-Route of the dispatcher as their Route */
+    route = (pjsip_route_hdr *)pjsip_msg_find_hdr(tdata->msg, PJSIP_H_ROUTE, NULL);
+    if (route && route_is_own(route))
+    {
+        pj_list_erase(route);
+    }
+
+    /* Keep the dispatcher in the dialogs it sets up */
+    if (!downstream && msg->line.req.method.id == PJSIP_INVITE_METHOD && rdata->msg_info.to->tag.slen == 0)
+    {
+        record_route_add(tdata);
+    }
+
+    if (!downstream && PJSIP_URI_SCHEME_IS_SIP(tdata->msg->line.req.uri))
+    {
+        target = (pjsip_sip_uri *)pjsip_uri_get_uri(tdata->msg->line.req.uri);
+        target->host = pj_str(backend->host);
+        target->port = backend->port;
+    }
+
+    status = pjsip_endpt_send_request_stateless(dispatcher->endpt, tdata, NULL, NULL);
+    if (status != PJ_SUCCESS)
+    {
+        app_perror(THIS_FILE, "Unable to send request to backend", status);
+        return PJ_TRUE;
+    }
+
+    METRICS_INC(dispatcher_requests);
+    if (backend)
+    {
+        __sync_fetch_and_add(&backend->requests, 1);
+    }
+
+    return PJ_TRUE;
+}
+
+/* Send a response back to the address of the next Via, once ours is removed */
+static pj_bool_t dispatcher_on_rx_response(pjsip_rx_data *rdata)
+{
+    pjsip_response_addr res_addr;
+    pjsip_tx_data *tdata;
+    pjsip_via_hdr *via;
+    pj_status_t status;
+
+    status = pjsip_endpt_create_response_fwd(dispatcher->endpt, rdata, 0, &tdata);
+    if (status != PJ_SUCCESS)
+    {
+        app_perror(THIS_FILE, "Unable to forward response", status);
+        return PJ_TRUE;
+    }
+
+    /* Late responses to our own probes have no Via left */
+    via = (pjsip_via_hdr *)pjsip_msg_find_hdr(tdata->msg, PJSIP_H_VIA, NULL);
+    if (via == NULL)
+    {
+        pjsip_tx_data_dec_ref(tdata);
+        return PJ_TRUE;
+    }
+
+    pj_bzero(&res_addr, sizeof(res_addr));
+    res_addr.dst_host.type = pjsip_transport_get_type_from_name(&via->transport);
+    res_addr.dst_host.flag = pjsip_transport_get_flag_from_type(res_addr.dst_host.type);
+
+    res_addr.dst_host.addr.host = via->recvd_param.slen ? via->recvd_param : via->sent_by.host;
+    res_addr.dst_host.addr.port = via->rport_param > 0 ? via->rport_param : via->sent_by.port;
+    if (res_addr.dst_host.addr.port == 0)
+    {
+        res_addr.dst_host.addr.port = pjsip_transport_get_default_port_for_type(res_addr.dst_host.type);
+    }
+
+    status = pjsip_endpt_send_response(dispatcher->endpt, &res_addr, tdata, NULL, NULL);
+    if (status != PJ_SUCCESS)
+    {
+        app_perror(THIS_FILE, "Unable to send response upstream", status);
+        return PJ_TRUE;
+    }
+
+    METRICS_INC(dispatcher_responses);
+
+    return PJ_TRUE;
+}
+
+static pj_bool_t route_is_own(const pjsip_route_hdr *route)
+{
+    const pjsip_sip_uri *uri;
+
+    if (!PJSIP_URI_SCHEME_IS_SIP(route->name_addr.uri))
+    {
+        return PJ_FALSE;
+    }
+
+    uri = (const pjsip_sip_uri *)pjsip_uri_get_uri(route->name_addr.uri);
+
+    return pj_strcmp2(&uri->user, DISPATCHER_USER) == 0 && uri->port == dispatcher->transport->local_name.port;
+}
+
+/* Backends are given by address, so their requests are told apart by the source */
+static pj_bool_t source_is_backend(const pjsip_rx_data *rdata)
+{
+    int i;
+
+    for (i = 0; i < dispatcher->backends_count; i++)
+    {
+        if (rdata->pkt_info.src_port == dispatcher->backends[i].port &&
+            pj_ansi_strcmp(rdata->pkt_info.src_name, dispatcher->backends[i].host) == 0)
+        {
+            return PJ_TRUE;
+        }
+    }
+
+    return PJ_FALSE;
+}
+
+static void record_route_add(pjsip_tx_data *tdata)
+{
+    pjsip_rr_hdr *record_route;
+    pjsip_sip_uri *uri;
+
+    uri = pjsip_sip_uri_create(tdata->pool, PJ_FALSE);
+    uri->user = pj_str(DISPATCHER_USER);
+    uri->host = dispatcher->transport->local_name.host;
+    uri->port = dispatcher->transport->local_name.port;
+    uri->lr_param = 1;
+
+    record_route = pjsip_rr_hdr_create(tdata->pool);
+    record_route->name_addr.uri = (pjsip_uri *)uri;
+
+    pjsip_msg_insert_first_hdr(tdata->msg, (pjsip_hdr *)record_route);
+}
+
+static void on_soak_done(int result)
+{
+    int i;
+
+    metrics_dump(metrics_get(), "Soak");
+
+    for (i = 0; i < dispatcher->backends_count; i++)
+    {
+        PJ_LOG(3,
+               (THIS_FILE,
+                "Backend %s:%d %s, %lu requests",
+                dispatcher->backends[i].host,
+                dispatcher->backends[i].port,
+                dispatcher->backends[i].alive ? "up" : "down",
+                (unsigned long)dispatcher->backends[i].requests));
+    }
+
+    dispatcher->exit_code = result;
+    dispatcher->quit = PJ_TRUE;
+}
+
+static int dispatcher_thread(void *arg)
+{
+    pj_time_val timeout = {0, 10};
+
+    PJ_UNUSED_ARG(arg);
+
+    affinity_apply("dispatcher", settings_get()->sip_thread_cpus, (int)settings_get()->sip_thread_priority);
+
+    while (!dispatcher->quit)
+    {
+        pjsip_endpt_handle_events(dispatcher->endpt, &timeout);
+    }
+
+    return 0;
+}
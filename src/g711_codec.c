@@ -0,0 +1,419 @@
+#include "../headers/g711_codec.h"
+
+#define THIS_FILE "g711_codec.c"
+
+static pj_status_t factory_test_alloc(pjmedia_codec_factory *factory, const pjmedia_codec_info *info);
+
+static pj_status_t factory_default_attr(pjmedia_codec_factory *factory,
+                                        const pjmedia_codec_info *info,
+                                        pjmedia_codec_param *attr);
+
+static pj_status_t factory_enum_info(pjmedia_codec_factory *factory, unsigned *count, pjmedia_codec_info codecs[]);
+
+static pj_status_t factory_alloc_codec(pjmedia_codec_factory *factory,
+                                       const pjmedia_codec_info *info,
+                                       pjmedia_codec **codec);
+
+static pj_status_t factory_dealloc_codec(pjmedia_codec_factory *factory, pjmedia_codec *codec);
+
+static pj_status_t codec_init(pjmedia_codec *codec, pj_pool_t *pool);
+
+static pj_status_t codec_open(pjmedia_codec *codec, pjmedia_codec_param *attr);
+
+static pj_status_t codec_close(pjmedia_codec *codec);
+
+static pj_status_t codec_modify(pjmedia_codec *codec, const pjmedia_codec_param *attr);
+
+static pj_status_t codec_parse(pjmedia_codec *codec,
+                               void *pkt,
+                               pj_size_t pkt_size,
+                               const pj_timestamp *timestamp,
+                               unsigned *frame_cnt,
+                               pjmedia_frame frames[]);
+
+static pj_status_t codec_encode(pjmedia_codec *codec,
+                                const struct pjmedia_frame *input,
+                                unsigned output_buf_len,
+                                struct pjmedia_frame *output);
+
+static pj_status_t codec_decode(pjmedia_codec *codec,
+                                const struct pjmedia_frame *input,
+                                unsigned output_buf_len,
+                                struct pjmedia_frame *output);
+
+static pj_status_t codec_recover(pjmedia_codec *codec, unsigned output_buf_len, struct pjmedia_frame *output);
+
+static pjmedia_codec_factory_op factory_op = {
+    &factory_test_alloc,
+    &factory_default_attr,
+    &factory_enum_info,
+    &factory_alloc_codec,
+    &factory_dealloc_codec,
+    &g711_codec_deinit,
+};
+
+static pjmedia_codec_op codec_op = {
+    &codec_init,
+    &codec_open,
+    &codec_close,
+    &codec_modify,
+    &codec_parse,
+    &codec_encode,
+    &codec_decode,
+    &codec_recover,
+};
+
+static struct g711_factory_t g711_factory;
+
+/*
+ * Register PCMU and PCMA in place of the stock G.711 codec of pjmedia.
+ * Fails if no kernels pass the self-check, the stock codec is used then.
+ */
+pj_status_t g711_codec_init(pjmedia_endpt *endpt)
+{
+    pjmedia_codec_mgr *codec_mgr;
+    pj_status_t status;
+
+    if (g711_factory.pool != NULL)
+    {
+        return PJ_SUCCESS;
+    }
+
+    g711_factory.kernels = g711_kernels_select();
+    if (g711_factory.kernels == NULL)
+    {
+        return PJ_ENOTSUP;
+    }
+    g711_kernels_benchmark(g711_factory.kernels);
+
+    g711_factory.base.op = &factory_op;
+    g711_factory.base.factory_data = NULL;
+    g711_factory.endpt = endpt;
+
+    g711_factory.pool = pjmedia_endpt_create_pool(endpt, "g711", G711_POOL_SIZE, G711_POOL_INC);
+    if (!g711_factory.pool)
+    {
+        return PJ_ENOMEM;
+    }
+
+    pj_list_init(&g711_factory.codec_list);
+
+    status = pj_mutex_create_simple(g711_factory.pool, "g711", &g711_factory.mutex);
+    if (status != PJ_SUCCESS)
+    {
+        goto on_error;
+    }
+
+    codec_mgr = pjmedia_endpt_get_codec_mgr(endpt);
+    if (!codec_mgr)
+    {
+        status = PJ_EINVALIDOP;
+        goto on_error;
+    }
+
+    status = pjmedia_codec_mgr_register_factory(codec_mgr, &g711_factory.base);
+    if (status != PJ_SUCCESS)
+    {
+        goto on_error;
+    }
+
+    return PJ_SUCCESS;
+
+on_error:
+    if (g711_factory.mutex)
+    {
+        pj_mutex_destroy(g711_factory.mutex);
+        g711_factory.mutex = NULL;
+    }
+    pj_pool_release(g711_factory.pool);
+    g711_factory.pool = NULL;
+
+    return status;
+}
+
+pj_status_t g711_codec_deinit(void)
+{
+    pjmedia_codec_mgr *codec_mgr;
+    pj_status_t status;
+
+    if (g711_factory.pool == NULL)
+    {
+        return PJ_SUCCESS;
+    }
+
+    pj_mutex_lock(g711_factory.mutex);
+
+    codec_mgr = pjmedia_endpt_get_codec_mgr(g711_factory.endpt);
+    status = codec_mgr ? pjmedia_codec_mgr_unregister_factory(codec_mgr, &g711_factory.base) : PJ_EINVALIDOP;
+
+    pj_mutex_unlock(g711_factory.mutex);
+    pj_mutex_destroy(g711_factory.mutex);
+    g711_factory.mutex = NULL;
+
+    pj_pool_release(g711_factory.pool);
+    g711_factory.pool = NULL;
+
+    return status;
+}
+
+static pj_status_t factory_test_alloc(pjmedia_codec_factory *factory, const pjmedia_codec_info *info)
+{
+    PJ_UNUSED_ARG(factory);
+
+    if (info->type != PJMEDIA_TYPE_AUDIO ||
+        (info->pt != PJMEDIA_RTP_PT_PCMU && info->pt != PJMEDIA_RTP_PT_PCMA) ||
+        info->clock_rate != G711_CLOCK_RATE || info->channel_cnt != 1)
+    {
+        return PJMEDIA_CODEC_EUNSUP;
+    }
+
+    return PJ_SUCCESS;
+}
+
+static pj_status_t factory_default_attr(pjmedia_codec_factory *factory,
+                                        const pjmedia_codec_info *info,
+                                        pjmedia_codec_param *attr)
+{
+    PJ_UNUSED_ARG(factory);
+
+    pj_bzero(attr, sizeof(pjmedia_codec_param));
+    attr->info.clock_rate = G711_CLOCK_RATE;
+    attr->info.channel_cnt = 1;
+    attr->info.avg_bps = G711_BPS;
+    attr->info.max_bps = G711_BPS;
+    attr->info.pcm_bits_per_sample = 16;
+    attr->info.frm_ptime = G711_PTIME;
+    attr->info.pt = (pj_uint8_t)info->pt;
+
+    attr->setting.frm_per_pkt = G711_FRM_PER_PKT;
+    attr->setting.plc = 1;
+
+    return PJ_SUCCESS;
+}
+
+static pj_status_t factory_enum_info(pjmedia_codec_factory *factory, unsigned *count, pjmedia_codec_info codecs[])
+{
+    PJ_UNUSED_ARG(factory);
+
+    if (*count > 0)
+    {
+        pj_bzero(&codecs[0], sizeof(pjmedia_codec_info));
+        codecs[0].type = PJMEDIA_TYPE_AUDIO;
+        codecs[0].pt = PJMEDIA_RTP_PT_PCMU;
+        codecs[0].encoding_name = pj_str("PCMU");
+        codecs[0].clock_rate = G711_CLOCK_RATE;
+        codecs[0].channel_cnt = 1;
+    }
+
+    if (*count > 1)
+    {
+        pj_bzero(&codecs[1], sizeof(pjmedia_codec_info));
+        codecs[1].type = PJMEDIA_TYPE_AUDIO;
+        codecs[1].pt = PJMEDIA_RTP_PT_PCMA;
+        codecs[1].encoding_name = pj_str("PCMA");
+        codecs[1].clock_rate = G711_CLOCK_RATE;
+        codecs[1].channel_cnt = 1;
+    }
+
+    *count = PJ_MIN(*count, 2);
+
+    return PJ_SUCCESS;
+}
+
+static pj_status_t factory_alloc_codec(pjmedia_codec_factory *factory,
+                                       const pjmedia_codec_info *info,
+                                       pjmedia_codec **codec)
+{
+    struct g711_codec_t *g711;
+    pj_status_t status;
+
+    PJ_ASSERT_RETURN(factory == &g711_factory.base, PJ_EINVAL);
+
+    pj_mutex_lock(g711_factory.mutex);
+
+    if (!pj_list_empty(&g711_factory.codec_list))
+    {
+        g711 = (struct g711_codec_t *)g711_factory.codec_list.next;
+        pj_list_erase(&g711->base);
+    }
+    else
+    {
+        g711 = PJ_POOL_ZALLOC_T(g711_factory.pool, struct g711_codec_t);
+        if (!g711)
+        {
+            pj_mutex_unlock(g711_factory.mutex);
+            return PJ_ENOMEM;
+        }
+
+        status = pjmedia_plc_create(g711_factory.pool, G711_CLOCK_RATE, G711_SAMPLES_PER_FRAME, 0, &g711->plc);
+        if (status != PJ_SUCCESS)
+        {
+            pj_mutex_unlock(g711_factory.mutex);
+            return status;
+        }
+
+        g711->base.factory = factory;
+        g711->base.op = &codec_op;
+        g711->base.codec_data = g711;
+    }
+
+    pj_mutex_unlock(g711_factory.mutex);
+
+    g711->ulaw = info->pt == PJMEDIA_RTP_PT_PCMU;
+    g711->plc_enabled = PJ_FALSE;
+
+    *codec = &g711->base;
+
+    return PJ_SUCCESS;
+}
+
+static pj_status_t factory_dealloc_codec(pjmedia_codec_factory *factory, pjmedia_codec *codec)
+{
+    PJ_ASSERT_RETURN(factory == &g711_factory.base, PJ_EINVAL);
+
+    pj_mutex_lock(g711_factory.mutex);
+    pj_list_push_front(&g711_factory.codec_list, codec);
+    pj_mutex_unlock(g711_factory.mutex);
+
+    return PJ_SUCCESS;
+}
+
+static pj_status_t codec_init(pjmedia_codec *codec, pj_pool_t *pool)
+{
+    PJ_UNUSED_ARG(codec);
+    PJ_UNUSED_ARG(pool);
+
+    return PJ_SUCCESS;
+}
+
+static pj_status_t codec_open(pjmedia_codec *codec, pjmedia_codec_param *attr)
+{
+    struct g711_codec_t *g711 = (struct g711_codec_t *)codec->codec_data;
+
+    g711->plc_enabled = attr->setting.plc != 0;
+
+    return PJ_SUCCESS;
+}
+
+static pj_status_t codec_close(pjmedia_codec *codec)
+{
+    PJ_UNUSED_ARG(codec);
+
+    return PJ_SUCCESS;
+}
+
+static pj_status_t codec_modify(pjmedia_codec *codec, const pjmedia_codec_param *attr)
+{
+    struct g711_codec_t *g711 = (struct g711_codec_t *)codec->codec_data;
+
+    g711->plc_enabled = attr->setting.plc != 0;
+
+    return PJ_SUCCESS;
+}
+
+/* Split a packet into frames of G711_PTIME */
+static pj_status_t codec_parse(pjmedia_codec *codec,
+                               void *pkt,
+                               pj_size_t pkt_size,
+                               const pj_timestamp *timestamp,
+                               unsigned *frame_cnt,
+                               pjmedia_frame frames[])
+{
+    unsigned count = 0;
+
+    PJ_UNUSED_ARG(codec);
+
+    while (pkt_size >= G711_SAMPLES_PER_FRAME && count < *frame_cnt)
+    {
+        frames[count].type = PJMEDIA_FRAME_TYPE_AUDIO;
+        frames[count].buf = pkt;
+        frames[count].size = G711_SAMPLES_PER_FRAME;
+        frames[count].timestamp.u64 = timestamp->u64 + (pj_uint64_t)G711_SAMPLES_PER_FRAME * count;
+
+        pkt = (pj_uint8_t *)pkt + G711_SAMPLES_PER_FRAME;
+        pkt_size -= G711_SAMPLES_PER_FRAME;
+        count++;
+    }
+
+    *frame_cnt = count;
+
+    return PJ_SUCCESS;
+}
+
+static pj_status_t codec_encode(pjmedia_codec *codec,
+                                const struct pjmedia_frame *input,
+                                unsigned output_buf_len,
+                                struct pjmedia_frame *output)
+{
+    struct g711_codec_t *g711 = (struct g711_codec_t *)codec->codec_data;
+    unsigned samples = (unsigned)(input->size >> 1);
+
+    if (output_buf_len < samples)
+    {
+        return PJMEDIA_CODEC_EFRMTOOSHORT;
+    }
+
+    if (g711->ulaw)
+    {
+        g711_factory.kernels->ulaw_encode((const pj_int16_t *)input->buf, (pj_uint8_t *)output->buf, samples);
+    }
+    else
+    {
+        g711_factory.kernels->alaw_encode((const pj_int16_t *)input->buf, (pj_uint8_t *)output->buf, samples);
+    }
+
+    output->type = PJMEDIA_FRAME_TYPE_AUDIO;
+    output->size = samples;
+    output->timestamp = input->timestamp;
+
+    return PJ_SUCCESS;
+}
+
+static pj_status_t codec_decode(pjmedia_codec *codec,
+                                const struct pjmedia_frame *input,
+                                unsigned output_buf_len,
+                                struct pjmedia_frame *output)
+{
+    struct g711_codec_t *g711 = (struct g711_codec_t *)codec->codec_data;
+    unsigned samples = (unsigned)input->size;
+
+    if (output_buf_len < (samples << 1))
+    {
+        return PJMEDIA_CODEC_EPCMTOOSHORT;
+    }
+
+    if (g711->ulaw)
+    {
+        g711_factory.kernels->ulaw_decode((const pj_uint8_t *)input->buf, (pj_int16_t *)output->buf, samples);
+    }
+    else
+    {
+        g711_factory.kernels->alaw_decode((const pj_uint8_t *)input->buf, (pj_int16_t *)output->buf, samples);
+    }
+
+    output->type = PJMEDIA_FRAME_TYPE_AUDIO;
+    output->size = samples << 1;
+    output->timestamp = input->timestamp;
+
+    if (g711->plc_enabled && samples == G711_SAMPLES_PER_FRAME)
+    {
+        pjmedia_plc_save(g711->plc, (pj_int16_t *)output->buf);
+    }
+
+    return PJ_SUCCESS;
+}
+
+static pj_status_t codec_recover(pjmedia_codec *codec, unsigned output_buf_len, struct pjmedia_frame *output)
+{
+    struct g711_codec_t *g711 = (struct g711_codec_t *)codec->codec_data;
+
+    PJ_ASSERT_RETURN(g711->plc_enabled, PJ_EINVALIDOP);
+    PJ_ASSERT_RETURN(output_buf_len >= G711_SAMPLES_PER_FRAME * 2, PJMEDIA_CODEC_EPCMTOOSHORT);
+
+    pjmedia_plc_generate(g711->plc, (pj_int16_t *)output->buf);
+
+    output->type = PJMEDIA_FRAME_TYPE_AUDIO;
+    output->size = G711_SAMPLES_PER_FRAME * 2;
+
+    return PJ_SUCCESS;
+}
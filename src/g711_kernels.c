@@ -0,0 +1,764 @@
+#include "../headers/g711_kernels.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define G711_HAS_X86 1
+#include <immintrin.h>
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define G711_HAS_NEON 1
+#include <arm_neon.h>
+#if !defined(__aarch64__)
+#include <sys/auxv.h>
+#define G711_HWCAP_NEON (1 << 12)
+#endif
+#endif
+
+#define THIS_FILE "g711_kernels.c"
+
+/*
+ * All kernels implement the segment search of the reference coder
+ * with the exponent of a float: the magnitude converted to float
+ * carries the segment in its exponent and the quantized step in the
+ * top four bits of its mantissa. Decoding builds the float back.
+ */
+#define ULAW_CLIP 8158
+#define ULAW_BIAS 33
+#define ULAW_EXP_BIAS 2112 /* (127 + 5) << 4 */
+#define ALAW_EXP_BIAS 2096 /* (127 + 4) << 4 */
+#define DECODE_EXP_BIAS 2144 /* (127 + 7) << 4 */
+#define DECODE_HALF_STEP 0x40000
+
+static pj_uint8_t ulaw_encode_sample(pj_int16_t sample);
+
+static pj_int16_t ulaw_decode_sample(pj_uint8_t code);
+
+static pj_uint8_t alaw_encode_sample(pj_int16_t sample);
+
+static pj_int16_t alaw_decode_sample(pj_uint8_t code);
+
+static void scalar_ulaw_encode(const pj_int16_t *in, pj_uint8_t *out, unsigned count);
+
+static void scalar_ulaw_decode(const pj_uint8_t *in, pj_int16_t *out, unsigned count);
+
+static void scalar_alaw_encode(const pj_int16_t *in, pj_uint8_t *out, unsigned count);
+
+static void scalar_alaw_decode(const pj_uint8_t *in, pj_int16_t *out, unsigned count);
+
+static double benchmark_encode(g711_encode_fn encode, const pj_int16_t *pcm, pj_uint8_t *codes);
+
+static double benchmark_decode(g711_decode_fn decode, const pj_uint8_t *codes, pj_int16_t *pcm);
+
+static const struct g711_kernels_t scalar_kernels = {
+    "scalar", &scalar_ulaw_encode, &scalar_ulaw_decode, &scalar_alaw_encode, &scalar_alaw_decode};
+
+/* Reference coder, one sample at a time */
+static pj_uint8_t ulaw_encode_sample(pj_int16_t sample)
+{
+    int value = sample >> 2;
+    int mask = 0xFF;
+    int seg = 0;
+
+    if (value < 0)
+    {
+        value = -value;
+        mask = 0x7F;
+    }
+
+    if (value > ULAW_CLIP)
+    {
+        value = ULAW_CLIP;
+    }
+    value += ULAW_BIAS;
+
+    while (seg < 7 && value >= (0x40 << seg))
+    {
+        seg++;
+    }
+
+    return (pj_uint8_t)(((seg << 4) | ((value >> (seg + 1)) & 0x0F)) ^ mask);
+}
+
+static pj_int16_t ulaw_decode_sample(pj_uint8_t code)
+{
+    int value = ~code & 0xFF;
+    int t = (((value & 0x0F) << 3) + 0x84) << ((value & 0x70) >> 4);
+
+    return (pj_int16_t)((value & 0x80) ? 0x84 - t : t - 0x84);
+}
+
+static pj_uint8_t alaw_encode_sample(pj_int16_t sample)
+{
+    int value = sample >> 3;
+    int mask = 0xD5;
+    int seg = 0;
+    int quant;
+
+    if (value < 0)
+    {
+        value = -value - 1;
+        mask = 0x55;
+    }
+
+    while (seg < 7 && value >= (0x20 << seg))
+    {
+        seg++;
+    }
+
+    quant = seg < 2 ? value >> 1 : value >> seg;
+
+    return (pj_uint8_t)(((seg << 4) | (quant & 0x0F)) ^ mask);
+}
+
+static pj_int16_t alaw_decode_sample(pj_uint8_t code)
+{
+    int value = code ^ 0x55;
+    int seg = (value & 0x70) >> 4;
+    int t = (value & 0x0F) << 4;
+
+    if (seg == 0)
+    {
+        t += 8;
+    }
+    else
+    {
+        t = (t + 0x108) << (seg - 1);
+    }
+
+    return (pj_int16_t)((value & 0x80) ? t : -t);
+}
+
+static void scalar_ulaw_encode(const pj_int16_t *in, pj_uint8_t *out, unsigned count)
+{
+    unsigned i;
+
+    for (i = 0; i < count; i++)
+    {
+        out[i] = ulaw_encode_sample(in[i]);
+    }
+}
+
+static void scalar_ulaw_decode(const pj_uint8_t *in, pj_int16_t *out, unsigned count)
+{
+    unsigned i;
+
+    for (i = 0; i < count; i++)
+    {
+        out[i] = ulaw_decode_sample(in[i]);
+    }
+}
+
+static void scalar_alaw_encode(const pj_int16_t *in, pj_uint8_t *out, unsigned count)
+{
+    unsigned i;
+
+    for (i = 0; i < count; i++)
+    {
+        out[i] = alaw_encode_sample(in[i]);
+    }
+}
+
+static void scalar_alaw_decode(const pj_uint8_t *in, pj_int16_t *out, unsigned count)
+{
+    unsigned i;
+
+    for (i = 0; i < count; i++)
+    {
+        out[i] = alaw_decode_sample(in[i]);
+    }
+}
+
+#if G711_HAS_X86
+
+/* SSE2, 8 samples per vector */
+static inline __m128i sse2_exp_code(__m128i magnitude, int bias)
+{
+    __m128i zero = _mm_setzero_si128();
+    __m128i lo = _mm_castps_si128(_mm_cvtepi32_ps(_mm_unpacklo_epi16(magnitude, zero)));
+    __m128i hi = _mm_castps_si128(_mm_cvtepi32_ps(_mm_unpackhi_epi16(magnitude, zero)));
+
+    lo = _mm_sub_epi32(_mm_srli_epi32(lo, 19), _mm_set1_epi32(bias));
+    hi = _mm_sub_epi32(_mm_srli_epi32(hi, 19), _mm_set1_epi32(bias));
+
+    return _mm_packs_epi32(lo, hi);
+}
+
+static inline __m128i sse2_exp_linear(__m128i code)
+{
+    __m128i zero = _mm_setzero_si128();
+    __m128i lo = _mm_unpacklo_epi16(code, zero);
+    __m128i hi = _mm_unpackhi_epi16(code, zero);
+    __m128i half = _mm_set1_epi32(DECODE_HALF_STEP);
+
+    lo = _mm_or_si128(_mm_slli_epi32(_mm_add_epi32(lo, _mm_set1_epi32(DECODE_EXP_BIAS)), 19), half);
+    hi = _mm_or_si128(_mm_slli_epi32(_mm_add_epi32(hi, _mm_set1_epi32(DECODE_EXP_BIAS)), 19), half);
+
+    return _mm_packs_epi32(_mm_cvttps_epi32(_mm_castsi128_ps(lo)), _mm_cvttps_epi32(_mm_castsi128_ps(hi)));
+}
+
+static inline __m128i sse2_ulaw_encode8(__m128i sample)
+{
+    __m128i sign = _mm_srai_epi16(sample, 15);
+    __m128i value = _mm_srai_epi16(sample, 2);
+    __m128i mask = _mm_xor_si128(_mm_set1_epi16(0xFF), _mm_and_si128(sign, _mm_set1_epi16(0x80)));
+
+    value = _mm_sub_epi16(_mm_xor_si128(value, sign), sign);
+    value = _mm_add_epi16(_mm_min_epi16(value, _mm_set1_epi16(ULAW_CLIP)), _mm_set1_epi16(ULAW_BIAS));
+
+    return _mm_xor_si128(sse2_exp_code(value, ULAW_EXP_BIAS), mask);
+}
+
+static inline __m128i sse2_alaw_encode8(__m128i sample)
+{
+    __m128i sign = _mm_srai_epi16(sample, 15);
+    __m128i value = _mm_xor_si128(_mm_srai_epi16(sample, 3), sign);
+    __m128i mask = _mm_xor_si128(_mm_set1_epi16(0xD5), _mm_and_si128(sign, _mm_set1_epi16(0x80)));
+    __m128i small = _mm_cmplt_epi16(value, _mm_set1_epi16(0x20));
+    __m128i code = sse2_exp_code(value, ALAW_EXP_BIAS);
+
+    code = _mm_or_si128(_mm_and_si128(small, _mm_srli_epi16(value, 1)), _mm_andnot_si128(small, code));
+
+    return _mm_xor_si128(code, mask);
+}
+
+static inline __m128i sse2_ulaw_decode8(__m128i code)
+{
+    __m128i value = _mm_xor_si128(code, _mm_set1_epi16(0xFF));
+    __m128i t = _mm_sub_epi16(sse2_exp_linear(_mm_and_si128(value, _mm_set1_epi16(0x7F))), _mm_set1_epi16(0x84));
+    __m128i negative = _mm_srai_epi16(_mm_slli_epi16(value, 8), 15);
+
+    return _mm_sub_epi16(_mm_xor_si128(t, negative), negative);
+}
+
+static inline __m128i sse2_alaw_decode8(__m128i code)
+{
+    __m128i value = _mm_xor_si128(code, _mm_set1_epi16(0x55));
+    __m128i low = _mm_and_si128(value, _mm_set1_epi16(0x7F));
+    __m128i seg0 = _mm_cmplt_epi16(low, _mm_set1_epi16(0x10));
+    __m128i small = _mm_add_epi16(_mm_slli_epi16(_mm_and_si128(value, _mm_set1_epi16(0x0F)), 4), _mm_set1_epi16(8));
+    __m128i t = sse2_exp_linear(low);
+    __m128i negative = _mm_xor_si128(_mm_srai_epi16(_mm_slli_epi16(value, 8), 15), _mm_set1_epi16(-1));
+
+    t = _mm_or_si128(_mm_and_si128(seg0, small), _mm_andnot_si128(seg0, t));
+
+    return _mm_sub_epi16(_mm_xor_si128(t, negative), negative);
+}
+
+static void sse2_ulaw_encode(const pj_int16_t *in, pj_uint8_t *out, unsigned count)
+{
+    unsigned i;
+
+    for (i = 0; i + 16 <= count; i += 16)
+    {
+        __m128i lo = sse2_ulaw_encode8(_mm_loadu_si128((const __m128i *)(in + i)));
+        __m128i hi = sse2_ulaw_encode8(_mm_loadu_si128((const __m128i *)(in + i + 8)));
+
+        _mm_storeu_si128((__m128i *)(out + i), _mm_packus_epi16(lo, hi));
+    }
+
+    scalar_ulaw_encode(in + i, out + i, count - i);
+}
+
+static void sse2_ulaw_decode(const pj_uint8_t *in, pj_int16_t *out, unsigned count)
+{
+    __m128i zero = _mm_setzero_si128();
+    unsigned i;
+
+    for (i = 0; i + 16 <= count; i += 16)
+    {
+        __m128i code = _mm_loadu_si128((const __m128i *)(in + i));
+
+        _mm_storeu_si128((__m128i *)(out + i), sse2_ulaw_decode8(_mm_unpacklo_epi8(code, zero)));
+        _mm_storeu_si128((__m128i *)(out + i + 8), sse2_ulaw_decode8(_mm_unpackhi_epi8(code, zero)));
+    }
+
+    scalar_ulaw_decode(in + i, out + i, count - i);
+}
+
+static void sse2_alaw_encode(const pj_int16_t *in, pj_uint8_t *out, unsigned count)
+{
+    unsigned i;
+
+    for (i = 0; i + 16 <= count; i += 16)
+    {
+        __m128i lo = sse2_alaw_encode8(_mm_loadu_si128((const __m128i *)(in + i)));
+        __m128i hi = sse2_alaw_encode8(_mm_loadu_si128((const __m128i *)(in + i + 8)));
+
+        _mm_storeu_si128((__m128i *)(out + i), _mm_packus_epi16(lo, hi));
+    }
+
+    scalar_alaw_encode(in + i, out + i, count - i);
+}
+
+static void sse2_alaw_decode(const pj_uint8_t *in, pj_int16_t *out, unsigned count)
+{
+    __m128i zero = _mm_setzero_si128();
+    unsigned i;
+
+    for (i = 0; i + 16 <= count; i += 16)
+    {
+        __m128i code = _mm_loadu_si128((const __m128i *)(in + i));
+
+        _mm_storeu_si128((__m128i *)(out + i), sse2_alaw_decode8(_mm_unpacklo_epi8(code, zero)));
+        _mm_storeu_si128((__m128i *)(out + i + 8), sse2_alaw_decode8(_mm_unpackhi_epi8(code, zero)));
+    }
+
+    scalar_alaw_decode(in + i, out + i, count - i);
+}
+
+static const struct g711_kernels_t sse2_kernels = {
+    "sse2", &sse2_ulaw_encode, &sse2_ulaw_decode, &sse2_alaw_encode, &sse2_alaw_decode};
+
+/*
+ * AVX2, 16 samples per vector. Unpacking and packing stay within
+ * the 128-bit lanes, only the final pack to bytes crosses them.
+ */
+#define G711_AVX2 __attribute__((target("avx2")))
+
+static inline G711_AVX2 __m256i avx2_exp_code(__m256i magnitude, int bias)
+{
+    __m256i zero = _mm256_setzero_si256();
+    __m256i lo = _mm256_castps_si256(_mm256_cvtepi32_ps(_mm256_unpacklo_epi16(magnitude, zero)));
+    __m256i hi = _mm256_castps_si256(_mm256_cvtepi32_ps(_mm256_unpackhi_epi16(magnitude, zero)));
+
+    lo = _mm256_sub_epi32(_mm256_srli_epi32(lo, 19), _mm256_set1_epi32(bias));
+    hi = _mm256_sub_epi32(_mm256_srli_epi32(hi, 19), _mm256_set1_epi32(bias));
+
+    return _mm256_packs_epi32(lo, hi);
+}
+
+static inline G711_AVX2 __m256i avx2_exp_linear(__m256i code)
+{
+    __m256i zero = _mm256_setzero_si256();
+    __m256i lo = _mm256_unpacklo_epi16(code, zero);
+    __m256i hi = _mm256_unpackhi_epi16(code, zero);
+    __m256i half = _mm256_set1_epi32(DECODE_HALF_STEP);
+
+    lo = _mm256_or_si256(_mm256_slli_epi32(_mm256_add_epi32(lo, _mm256_set1_epi32(DECODE_EXP_BIAS)), 19), half);
+    hi = _mm256_or_si256(_mm256_slli_epi32(_mm256_add_epi32(hi, _mm256_set1_epi32(DECODE_EXP_BIAS)), 19), half);
+
+    return _mm256_packs_epi32(_mm256_cvttps_epi32(_mm256_castsi256_ps(lo)),
+                              _mm256_cvttps_epi32(_mm256_castsi256_ps(hi)));
+}
+
+static inline G711_AVX2 __m256i avx2_ulaw_encode16(__m256i sample)
+{
+    __m256i sign = _mm256_srai_epi16(sample, 15);
+    __m256i value = _mm256_abs_epi16(_mm256_srai_epi16(sample, 2));
+    __m256i mask = _mm256_xor_si256(_mm256_set1_epi16(0xFF), _mm256_and_si256(sign, _mm256_set1_epi16(0x80)));
+
+    value = _mm256_add_epi16(_mm256_min_epi16(value, _mm256_set1_epi16(ULAW_CLIP)), _mm256_set1_epi16(ULAW_BIAS));
+
+    return _mm256_xor_si256(avx2_exp_code(value, ULAW_EXP_BIAS), mask);
+}
+
+static inline G711_AVX2 __m256i avx2_alaw_encode16(__m256i sample)
+{
+    __m256i sign = _mm256_srai_epi16(sample, 15);
+    __m256i value = _mm256_xor_si256(_mm256_srai_epi16(sample, 3), sign);
+    __m256i mask = _mm256_xor_si256(_mm256_set1_epi16(0xD5), _mm256_and_si256(sign, _mm256_set1_epi16(0x80)));
+    __m256i small = _mm256_cmpgt_epi16(_mm256_set1_epi16(0x20), value);
+
+    return _mm256_xor_si256(
+        _mm256_blendv_epi8(avx2_exp_code(value, ALAW_EXP_BIAS), _mm256_srli_epi16(value, 1), small), mask);
+}
+
+static inline G711_AVX2 __m256i avx2_ulaw_decode16(__m256i code)
+{
+    __m256i value = _mm256_xor_si256(code, _mm256_set1_epi16(0xFF));
+    __m256i t =
+        _mm256_sub_epi16(avx2_exp_linear(_mm256_and_si256(value, _mm256_set1_epi16(0x7F))), _mm256_set1_epi16(0x84));
+    __m256i negative = _mm256_srai_epi16(_mm256_slli_epi16(value, 8), 15);
+
+    return _mm256_sub_epi16(_mm256_xor_si256(t, negative), negative);
+}
+
+static inline G711_AVX2 __m256i avx2_alaw_decode16(__m256i code)
+{
+    __m256i value = _mm256_xor_si256(code, _mm256_set1_epi16(0x55));
+    __m256i low = _mm256_and_si256(value, _mm256_set1_epi16(0x7F));
+    __m256i seg0 = _mm256_cmpgt_epi16(_mm256_set1_epi16(0x10), low);
+    __m256i small =
+        _mm256_add_epi16(_mm256_slli_epi16(_mm256_and_si256(value, _mm256_set1_epi16(0x0F)), 4), _mm256_set1_epi16(8));
+    __m256i negative = _mm256_xor_si256(_mm256_srai_epi16(_mm256_slli_epi16(value, 8), 15), _mm256_set1_epi16(-1));
+    __m256i t = _mm256_blendv_epi8(avx2_exp_linear(low), small, seg0);
+
+    return _mm256_sub_epi16(_mm256_xor_si256(t, negative), negative);
+}
+
+static G711_AVX2 void avx2_ulaw_encode(const pj_int16_t *in, pj_uint8_t *out, unsigned count)
+{
+    unsigned i;
+
+    for (i = 0; i + 32 <= count; i += 32)
+    {
+        __m256i lo = avx2_ulaw_encode16(_mm256_loadu_si256((const __m256i *)(in + i)));
+        __m256i hi = avx2_ulaw_encode16(_mm256_loadu_si256((const __m256i *)(in + i + 16)));
+
+        _mm256_storeu_si256((__m256i *)(out + i), _mm256_permute4x64_epi64(_mm256_packus_epi16(lo, hi), 0xD8));
+    }
+
+    sse2_ulaw_encode(in + i, out + i, count - i);
+}
+
+static G711_AVX2 void avx2_ulaw_decode(const pj_uint8_t *in, pj_int16_t *out, unsigned count)
+{
+    unsigned i;
+
+    for (i = 0; i + 16 <= count; i += 16)
+    {
+        __m256i code = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(in + i)));
+
+        _mm256_storeu_si256((__m256i *)(out + i), avx2_ulaw_decode16(code));
+    }
+
+    scalar_ulaw_decode(in + i, out + i, count - i);
+}
+
+static G711_AVX2 void avx2_alaw_encode(const pj_int16_t *in, pj_uint8_t *out, unsigned count)
+{
+    unsigned i;
+
+    for (i = 0; i + 32 <= count; i += 32)
+    {
+        __m256i lo = avx2_alaw_encode16(_mm256_loadu_si256((const __m256i *)(in + i)));
+        __m256i hi = avx2_alaw_encode16(_mm256_loadu_si256((const __m256i *)(in + i + 16)));
+
+        _mm256_storeu_si256((__m256i *)(out + i), _mm256_permute4x64_epi64(_mm256_packus_epi16(lo, hi), 0xD8));
+    }
+
+    sse2_alaw_encode(in + i, out + i, count - i);
+}
+
+static G711_AVX2 void avx2_alaw_decode(const pj_uint8_t *in, pj_int16_t *out, unsigned count)
+{
+    unsigned i;
+
+    for (i = 0; i + 16 <= count; i += 16)
+    {
+        __m256i code = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(in + i)));
+
+        _mm256_storeu_si256((__m256i *)(out + i), avx2_alaw_decode16(code));
+    }
+
+    scalar_alaw_decode(in + i, out + i, count - i);
+}
+
+static const struct g711_kernels_t avx2_kernels = {
+    "avx2", &avx2_ulaw_encode, &avx2_ulaw_decode, &avx2_alaw_encode, &avx2_alaw_decode};
+
+#endif /* G711_HAS_X86 */
+
+#if G711_HAS_NEON
+
+/* NEON, 8 samples per vector */
+static inline int16x8_t neon_exp_code(int16x8_t magnitude, int bias)
+{
+    int32x4_t lo = vreinterpretq_s32_f32(vcvtq_f32_s32(vmovl_s16(vget_low_s16(magnitude))));
+    int32x4_t hi = vreinterpretq_s32_f32(vcvtq_f32_s32(vmovl_s16(vget_high_s16(magnitude))));
+
+    lo = vsubq_s32(vshrq_n_s32(lo, 19), vdupq_n_s32(bias));
+    hi = vsubq_s32(vshrq_n_s32(hi, 19), vdupq_n_s32(bias));
+
+    return vcombine_s16(vmovn_s32(lo), vmovn_s32(hi));
+}
+
+static inline int16x8_t neon_exp_linear(uint16x8_t code)
+{
+    uint32x4_t lo = vmovl_u16(vget_low_u16(code));
+    uint32x4_t hi = vmovl_u16(vget_high_u16(code));
+    uint32x4_t half = vdupq_n_u32(DECODE_HALF_STEP);
+
+    lo = vorrq_u32(vshlq_n_u32(vaddq_u32(lo, vdupq_n_u32(DECODE_EXP_BIAS)), 19), half);
+    hi = vorrq_u32(vshlq_n_u32(vaddq_u32(hi, vdupq_n_u32(DECODE_EXP_BIAS)), 19), half);
+
+    return vcombine_s16(vmovn_s32(vcvtq_s32_f32(vreinterpretq_f32_u32(lo))),
+                        vmovn_s32(vcvtq_s32_f32(vreinterpretq_f32_u32(hi))));
+}
+
+static inline uint8x8_t neon_ulaw_encode8(int16x8_t sample)
+{
+    int16x8_t sign = vshrq_n_s16(sample, 15);
+    int16x8_t value = vabsq_s16(vshrq_n_s16(sample, 2));
+    int16x8_t mask = veorq_s16(vdupq_n_s16(0xFF), vandq_s16(sign, vdupq_n_s16(0x80)));
+
+    value = vaddq_s16(vminq_s16(value, vdupq_n_s16(ULAW_CLIP)), vdupq_n_s16(ULAW_BIAS));
+
+    return vmovn_u16(vreinterpretq_u16_s16(veorq_s16(neon_exp_code(value, ULAW_EXP_BIAS), mask)));
+}
+
+static inline uint8x8_t neon_alaw_encode8(int16x8_t sample)
+{
+    int16x8_t sign = vshrq_n_s16(sample, 15);
+    int16x8_t value = veorq_s16(vshrq_n_s16(sample, 3), sign);
+    int16x8_t mask = veorq_s16(vdupq_n_s16(0xD5), vandq_s16(sign, vdupq_n_s16(0x80)));
+    uint16x8_t small = vcltq_s16(value, vdupq_n_s16(0x20));
+    int16x8_t code = vbslq_s16(small, vshrq_n_s16(value, 1), neon_exp_code(value, ALAW_EXP_BIAS));
+
+    return vmovn_u16(vreinterpretq_u16_s16(veorq_s16(code, mask)));
+}
+
+static inline int16x8_t neon_ulaw_decode8(uint8x8_t code)
+{
+    uint16x8_t value = veorq_u16(vmovl_u8(code), vdupq_n_u16(0xFF));
+    int16x8_t t = vsubq_s16(neon_exp_linear(vandq_u16(value, vdupq_n_u16(0x7F))), vdupq_n_s16(0x84));
+    int16x8_t negative = vreinterpretq_s16_u16(vtstq_u16(value, vdupq_n_u16(0x80)));
+
+    return vsubq_s16(veorq_s16(t, negative), negative);
+}
+
+static inline int16x8_t neon_alaw_decode8(uint8x8_t code)
+{
+    uint16x8_t value = veorq_u16(vmovl_u8(code), vdupq_n_u16(0x55));
+    uint16x8_t low = vandq_u16(value, vdupq_n_u16(0x7F));
+    uint16x8_t seg0 = vcltq_u16(low, vdupq_n_u16(0x10));
+    uint16x8_t small = vaddq_u16(vshlq_n_u16(vandq_u16(value, vdupq_n_u16(0x0F)), 4), vdupq_n_u16(8));
+    int16x8_t t = vbslq_s16(seg0, vreinterpretq_s16_u16(small), neon_exp_linear(low));
+    int16x8_t negative = vreinterpretq_s16_u16(vmvnq_u16(vtstq_u16(value, vdupq_n_u16(0x80))));
+
+    return vsubq_s16(veorq_s16(t, negative), negative);
+}
+
+static void neon_ulaw_encode(const pj_int16_t *in, pj_uint8_t *out, unsigned count)
+{
+    unsigned i;
+
+    for (i = 0; i + 16 <= count; i += 16)
+    {
+        vst1q_u8(out + i, vcombine_u8(neon_ulaw_encode8(vld1q_s16(in + i)), neon_ulaw_encode8(vld1q_s16(in + i + 8))));
+    }
+
+    scalar_ulaw_encode(in + i, out + i, count - i);
+}
+
+static void neon_ulaw_decode(const pj_uint8_t *in, pj_int16_t *out, unsigned count)
+{
+    unsigned i;
+
+    for (i = 0; i + 16 <= count; i += 16)
+    {
+        uint8x16_t code = vld1q_u8(in + i);
+
+        vst1q_s16(out + i, neon_ulaw_decode8(vget_low_u8(code)));
+        vst1q_s16(out + i + 8, neon_ulaw_decode8(vget_high_u8(code)));
+    }
+
+    scalar_ulaw_decode(in + i, out + i, count - i);
+}
+
+static void neon_alaw_encode(const pj_int16_t *in, pj_uint8_t *out, unsigned count)
+{
+    unsigned i;
+
+    for (i = 0; i + 16 <= count; i += 16)
+    {
+        vst1q_u8(out + i, vcombine_u8(neon_alaw_encode8(vld1q_s16(in + i)), neon_alaw_encode8(vld1q_s16(in + i + 8))));
+    }
+
+    scalar_alaw_encode(in + i, out + i, count - i);
+}
+
+static void neon_alaw_decode(const pj_uint8_t *in, pj_int16_t *out, unsigned count)
+{
+    unsigned i;
+
+    for (i = 0; i + 16 <= count; i += 16)
+    {
+        uint8x16_t code = vld1q_u8(in + i);
+
+        vst1q_s16(out + i, neon_alaw_decode8(vget_low_u8(code)));
+        vst1q_s16(out + i + 8, neon_alaw_decode8(vget_high_u8(code)));
+    }
+
+    scalar_alaw_decode(in + i, out + i, count - i);
+}
+
+static const struct g711_kernels_t neon_kernels = {
+    "neon", &neon_ulaw_encode, &neon_ulaw_decode, &neon_alaw_encode, &neon_alaw_decode};
+
+#endif /* G711_HAS_NEON */
+
+const struct g711_kernels_t *g711_kernels_scalar(void)
+{
+    return &scalar_kernels;
+}
+
+/*
+ * Widest kernels the CPU supports that are bit-exact with the
+ * reference coder, NULL if not even the reference coder matches
+ * the G.711 decoder of pjmedia.
+ */
+const struct g711_kernels_t *g711_kernels_select(void)
+{
+    const struct g711_kernels_t *candidates[4];
+    int count = 0;
+    int i;
+
+#if G711_HAS_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+    {
+        candidates[count++] = &avx2_kernels;
+    }
+    if (__builtin_cpu_supports("sse2"))
+    {
+        candidates[count++] = &sse2_kernels;
+    }
+#endif
+
+#if G711_HAS_NEON
+#if defined(__aarch64__)
+    candidates[count++] = &neon_kernels;
+#else
+    if (getauxval(AT_HWCAP) & G711_HWCAP_NEON)
+    {
+        candidates[count++] = &neon_kernels;
+    }
+#endif
+#endif
+
+    candidates[count++] = &scalar_kernels;
+
+    for (i = 0; i < count; i++)
+    {
+        if (g711_kernels_check(candidates[i]) == PJ_SUCCESS)
+        {
+            PJ_LOG(4, (THIS_FILE, "G.711 uses %s kernels", candidates[i]->name));
+            return candidates[i];
+        }
+
+        PJ_LOG(2, (THIS_FILE, "G.711 %s kernels failed the self-check", candidates[i]->name));
+    }
+
+    return NULL;
+}
+
+/*
+ * Compare every possible input with the coder of pjmedia, every
+ * sample of the int16 range when encoding and every code when
+ * decoding. Lengths that are not a multiple of the vector width
+ * exercise the scalar tails.
+ */
+pj_status_t g711_kernels_check(const struct g711_kernels_t *kernels)
+{
+    static pj_int16_t pcm[65536];
+    static pj_uint8_t codes[65536];
+    static pj_int16_t decoded[256];
+    static pj_uint8_t all_codes[256];
+    unsigned count;
+    unsigned i;
+
+    for (i = 0; i < PJ_ARRAY_SIZE(pcm); i++)
+    {
+        pcm[i] = (pj_int16_t)(i - 32768);
+    }
+
+    for (i = 0; i < PJ_ARRAY_SIZE(all_codes); i++)
+    {
+        all_codes[i] = (pj_uint8_t)i;
+    }
+
+    for (count = PJ_ARRAY_SIZE(pcm); count + 31 > PJ_ARRAY_SIZE(pcm); count -= 5)
+    {
+        kernels->ulaw_encode(pcm, codes, count);
+        for (i = 0; i < count; i++)
+        {
+            if (codes[i] != pjmedia_linear2ulaw(pcm[i]))
+            {
+                return PJ_EBUG;
+            }
+        }
+
+        kernels->alaw_encode(pcm, codes, count);
+        for (i = 0; i < count; i++)
+        {
+            if (codes[i] != pjmedia_linear2alaw(pcm[i]))
+            {
+                return PJ_EBUG;
+            }
+        }
+    }
+
+    for (count = PJ_ARRAY_SIZE(all_codes); count + 31 > PJ_ARRAY_SIZE(all_codes); count -= 5)
+    {
+        kernels->ulaw_decode(all_codes, decoded, count);
+        for (i = 0; i < count; i++)
+        {
+            if (decoded[i] != pjmedia_ulaw2linear(all_codes[i]))
+            {
+                return PJ_EBUG;
+            }
+        }
+
+        kernels->alaw_decode(all_codes, decoded, count);
+        for (i = 0; i < count; i++)
+        {
+            if (decoded[i] != pjmedia_alaw2linear(all_codes[i]))
+            {
+                return PJ_EBUG;
+            }
+        }
+    }
+
+    return PJ_SUCCESS;
+}
+
+/* Throughput of one core against the reference coder, in calls one core can transcode */
+void g711_kernels_benchmark(const struct g711_kernels_t *kernels)
+{
+    static pj_int16_t pcm[G711_BENCH_SAMPLES];
+    static pj_uint8_t codes[G711_BENCH_SAMPLES];
+    double encode, decode;
+    double scalar_encode, scalar_decode;
+    unsigned i;
+
+    /* A sweep over the whole range, every segment is visited */
+    for (i = 0; i < G711_BENCH_SAMPLES; i++)
+    {
+        pcm[i] = (pj_int16_t)(i * 2654435761u >> 16);
+    }
+
+    scalar_encode = benchmark_encode(scalar_kernels.ulaw_encode, pcm, codes);
+    scalar_decode = benchmark_decode(scalar_kernels.ulaw_decode, codes, pcm);
+    encode = benchmark_encode(kernels->ulaw_encode, pcm, codes);
+    decode = benchmark_decode(kernels->ulaw_decode, codes, pcm);
+
+    PJ_LOG(4,
+           (THIS_FILE,
+            "G.711 %s: encode %.0f Msamples/s (%.1fx), decode %.0f Msamples/s (%.1fx), "
+            "%.0f calls per core",
+            kernels->name,
+            encode / 1e6,
+            encode / scalar_encode,
+            decode / 1e6,
+            decode / scalar_decode,
+            1 / (8000 / encode + 8000 / decode)));
+}
+
+static double benchmark_encode(g711_encode_fn encode, const pj_int16_t *pcm, pj_uint8_t *codes)
+{
+    pj_timestamp start, end;
+    pj_uint32_t usec;
+
+    pj_get_timestamp(&start);
+    encode(pcm, codes, G711_BENCH_SAMPLES);
+    pj_get_timestamp(&end);
+
+    usec = pj_elapsed_usec(&start, &end);
+
+    return G711_BENCH_SAMPLES * 1e6 / (usec ? usec : 1);
+}
+
+static double benchmark_decode(g711_decode_fn decode, const pj_uint8_t *codes, pj_int16_t *pcm)
+{
+    pj_timestamp start, end;
+    pj_uint32_t usec;
+
+    pj_get_timestamp(&start);
+    decode(codes, pcm, G711_BENCH_SAMPLES);
+    pj_get_timestamp(&end);
+
+    usec = pj_elapsed_usec(&start, &end);
+
+    return G711_BENCH_SAMPLES * 1e6 / (usec ? usec : 1);
+}
@@ -0,0 +1,356 @@
+#define _GNU_SOURCE
+
+#include "../headers/handoff.h"
+
+#include <errno.h>
+#include <stddef.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#define THIS_FILE "handoff.c"
+
+static int unix_addr_init(const char *path, struct sockaddr_un *addr);
+
+static void packet_inject(struct handoff_t *handoff, pjsip_transport *transport, int len);
+
+pj_status_t handoff_create(pj_pool_t *pool, pjsip_endpoint *endpt, const char *path, struct handoff_t **handoff)
+{
+    PJ_ASSERT_RETURN(pj_ansi_strlen(path) < sizeof((*handoff)->path), PJ_ENAMETOOLONG);
+
+    (*handoff) = PJ_POOL_ZALLOC_T(pool, struct handoff_t);
+    if (!(*handoff))
+    {
+        return PJ_ENOMEM;
+    }
+
+    (*handoff)->rdata = PJ_POOL_ZALLOC_T(pool, pjsip_rx_data);
+    if (!(*handoff)->rdata)
+    {
+        return PJ_ENOMEM;
+    }
+
+    (*handoff)->rdata_pool =
+        pjsip_endpt_create_pool(endpt, "handoff_rdata", PJSIP_POOL_RDATA_LEN, PJSIP_POOL_RDATA_INC);
+    if (!(*handoff)->rdata_pool)
+    {
+        return PJ_ENOMEM;
+    }
+
+    (*handoff)->endpt = endpt;
+    (*handoff)->listener = -1;
+    (*handoff)->peer = -1;
+    pj_ansi_strcpy((*handoff)->path, path);
+
+    return PJ_SUCCESS;
+}
+
+/*
+ * The running instance answers from its SIP loop, a few ticks at most.
+ * The connection stays open, it carries the relayed messages from then on.
+ */
+pj_status_t handoff_take(struct handoff_t *handoff, pj_sock_t *socks, int max_socks, int *socks_count)
+{
+    struct sockaddr_un addr;
+    struct timeval timeout = {HANDOFF_TIMEOUT_MSEC / 1000, (HANDOFF_TIMEOUT_MSEC % 1000) * 1000};
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    struct iovec iov;
+    char control[CMSG_SPACE(sizeof(int) * MAX_SIP_SHARDS)];
+    int count = 0;
+    int *fds;
+    int fd;
+    int i;
+
+    PJ_ASSERT_RETURN(max_socks <= MAX_SIP_SHARDS, PJ_EINVAL);
+
+    *socks_count = 0;
+
+    if (unix_addr_init(handoff->path, &addr) != 0)
+    {
+        return PJ_ENAMETOOLONG;
+    }
+
+    fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+    {
+        return PJ_RETURN_OS_ERROR(errno);
+    }
+
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0)
+    {
+        close(fd);
+        return PJ_RETURN_OS_ERROR(errno);
+    }
+
+    pj_bzero(&msg, sizeof(msg));
+    iov.iov_base = &count;
+    iov.iov_len = sizeof(count);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    if (recvmsg(fd, &msg, MSG_CMSG_CLOEXEC) != (ssize_t)sizeof(count))
+    {
+        close(fd);
+        return PJ_ETIMEDOUT;
+    }
+
+    cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS ||
+        cmsg->cmsg_len != CMSG_LEN(sizeof(int) * count) || count <= 0)
+    {
+        close(fd);
+        return PJ_EINVALIDOP;
+    }
+
+    fds = (int *)CMSG_DATA(cmsg);
+    for (i = 0; i < count; i++)
+    {
+        if (i < max_socks)
+        {
+            socks[(*socks_count)++] = fds[i];
+        }
+        else
+        {
+            close(fds[i]);
+        }
+    }
+
+    handoff->peer = fd;
+    handoff->connected = 1;
+
+    return PJ_SUCCESS;
+}
+
+pj_status_t handoff_listen(struct handoff_t *handoff)
+{
+    struct sockaddr_un addr;
+    pj_status_t status;
+    int fd;
+
+    if (unix_addr_init(handoff->path, &addr) != 0)
+    {
+        return PJ_ENAMETOOLONG;
+    }
+
+    fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+    {
+        return PJ_RETURN_OS_ERROR(errno);
+    }
+
+    /* The instance that has just handed over does not accept any more */
+    unlink(handoff->path);
+
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(fd, 1) != 0)
+    {
+        status = PJ_RETURN_OS_ERROR(errno);
+        close(fd);
+        return status;
+    }
+
+    handoff->listener = fd;
+
+    return PJ_SUCCESS;
+}
+
+pj_bool_t handoff_give(struct handoff_t *handoff, const pj_sock_t *socks, int socks_count)
+{
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    struct iovec iov;
+    char control[CMSG_SPACE(sizeof(int) * MAX_SIP_SHARDS)];
+    int *fds;
+    int fd;
+    int i;
+
+    if (handoff->listener < 0 || socks_count <= 0 || socks_count > MAX_SIP_SHARDS)
+    {
+        return PJ_FALSE;
+    }
+
+    fd = accept4(handoff->listener, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0)
+    {
+        return PJ_FALSE;
+    }
+
+    pj_bzero(&msg, sizeof(msg));
+    pj_bzero(control, sizeof(control));
+    iov.iov_base = &socks_count;
+    iov.iov_len = sizeof(socks_count);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = CMSG_SPACE(sizeof(int) * socks_count);
+
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * socks_count);
+
+    fds = (int *)CMSG_DATA(cmsg);
+    for (i = 0; i < socks_count; i++)
+    {
+        fds[i] = (int)socks[i];
+    }
+
+    if (sendmsg(fd, &msg, MSG_NOSIGNAL) != (ssize_t)sizeof(socks_count))
+    {
+        app_perror(THIS_FILE, "Unable to hand over SIP sockets", PJ_RETURN_OS_ERROR(errno));
+        close(fd);
+        return PJ_FALSE;
+    }
+
+    /* The path belongs to the new instance now */
+    close(handoff->listener);
+    handoff->listener = -1;
+
+    handoff->peer = fd;
+    __atomic_store_n(&handoff->connected, 1, __ATOMIC_RELEASE);
+
+    return PJ_TRUE;
+}
+
+pj_bool_t handoff_is_connected(const struct handoff_t *handoff)
+{
+    return __atomic_load_n(&handoff->connected, __ATOMIC_ACQUIRE) != 0;
+}
+
+pj_bool_t handoff_is_relayed(const struct handoff_t *handoff, const pjsip_rx_data *rdata)
+{
+    return rdata == handoff->rdata;
+}
+
+/*
+ * Called by any SIP thread. A message is one datagram of the connection,
+ * if the other instance does not keep up it is lost like any UDP packet.
+ */
+pj_bool_t handoff_relay(struct handoff_t *handoff, const pjsip_rx_data *rdata)
+{
+    struct handoff_packet_t packet;
+    size_t size;
+
+    if (!handoff_is_connected(handoff) || rdata->pkt_info.len >= (pj_ssize_t)sizeof(packet.data))
+    {
+        return PJ_FALSE;
+    }
+
+    pj_memcpy(&packet.src_addr, &rdata->pkt_info.src_addr, rdata->pkt_info.src_addr_len);
+    packet.src_addr_len = rdata->pkt_info.src_addr_len;
+    packet.len = (int)rdata->pkt_info.len;
+    pj_memcpy(packet.data, rdata->pkt_info.packet, rdata->pkt_info.len);
+
+    size = offsetof(struct handoff_packet_t, data) + packet.len;
+    if (send(handoff->peer, &packet, size, MSG_DONTWAIT | MSG_NOSIGNAL) != (ssize_t)size)
+    {
+        return PJ_FALSE;
+    }
+
+    METRICS_INC(handoff_relayed);
+
+    return PJ_TRUE;
+}
+
+void handoff_poll(struct handoff_t *handoff, pjsip_transport *transport)
+{
+    ssize_t received;
+    int i;
+
+    if (!handoff_is_connected(handoff))
+    {
+        return;
+    }
+
+    for (i = 0; i < HANDOFF_POLL_BATCH; i++)
+    {
+        received = recv(handoff->peer, &handoff->packet, sizeof(handoff->packet), MSG_DONTWAIT);
+        if (received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+        {
+            return;
+        }
+
+        /* The old instance has finished its calls, or the new one has died */
+        if (received <= 0)
+        {
+            PJ_LOG(3, (THIS_FILE, "Other instance has gone, messages are no longer relayed"));
+            __atomic_store_n(&handoff->connected, 0, __ATOMIC_RELEASE);
+            return;
+        }
+
+        if (received < (ssize_t)offsetof(struct handoff_packet_t, data) ||
+            handoff->packet.len != received - (ssize_t)offsetof(struct handoff_packet_t, data) ||
+            handoff->packet.len >= (int)sizeof(handoff->packet.data) ||
+            handoff->packet.src_addr_len > (int)sizeof(handoff->packet.src_addr))
+        {
+            continue;
+        }
+
+        packet_inject(handoff, transport, handoff->packet.len);
+    }
+}
+
+void handoff_free(struct handoff_t *handoff)
+{
+    if (handoff->listener >= 0)
+    {
+        close(handoff->listener);
+        unlink(handoff->path);
+    }
+
+    if (handoff->peer >= 0)
+    {
+        close(handoff->peer);
+    }
+
+    if (handoff->rdata_pool)
+    {
+        pj_pool_release(handoff->rdata_pool);
+    }
+}
+
+static int unix_addr_init(const char *path, struct sockaddr_un *addr)
+{
+    pj_bzero(addr, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+
+    if (pj_ansi_strlen(path) >= sizeof(addr->sun_path))
+    {
+        return -1;
+    }
+    pj_ansi_strcpy(addr->sun_path, path);
+
+    return 0;
+}
+
+/* Filled in the way the UDP transport fills its own, then parsed and dispatched by the endpoint */
+static void packet_inject(struct handoff_t *handoff, pjsip_transport *transport, int len)
+{
+    pjsip_rx_data *rdata = handoff->rdata;
+
+    pj_bzero(rdata, sizeof(*rdata));
+    rdata->tp_info.pool = handoff->rdata_pool;
+    rdata->tp_info.transport = transport;
+
+    pj_gettimeofday(&rdata->pkt_info.timestamp);
+    pj_memcpy(rdata->pkt_info.packet, handoff->packet.data, len);
+    rdata->pkt_info.packet[len] = '\0';
+    rdata->pkt_info.zero = 0;
+    rdata->pkt_info.len = len;
+
+    pj_memcpy(&rdata->pkt_info.src_addr, &handoff->packet.src_addr, handoff->packet.src_addr_len);
+    rdata->pkt_info.src_addr_len = handoff->packet.src_addr_len;
+    pj_sockaddr_print(&rdata->pkt_info.src_addr, rdata->pkt_info.src_name, sizeof(rdata->pkt_info.src_name), 0);
+    rdata->pkt_info.src_port = pj_sockaddr_get_port(&rdata->pkt_info.src_addr);
+
+    METRICS_INC(handoff_injected);
+
+    pjsip_tpmgr_receive_packet(pjsip_endpt_get_tpmgr(handoff->endpt), rdata);
+
+    pj_pool_reset(handoff->rdata_pool);
+}
@@ -0,0 +1,124 @@
+#include "../headers/ivr.h"
+
+#include <string.h>
+
+#define THIS_FILE "ivr.c"
+
+static int ivr_digit_index(int digit);
+
+static int ivr_target_add(struct announcement_mgr_t *mgr, const char *spec, struct ivr_menu_t *menu);
+
+/*
+ * Parse the menu of a route whose own target is root. Digits sharing
+ * a target share its playlist, so the player pins it only once.
+ */
+pj_status_t ivr_menu_parse(struct announcement_mgr_t *mgr, const char *root, const char *spec, struct ivr_menu_t *menu)
+{
+    char copy[IVR_SPEC_LEN];
+    char *item, *next, *target;
+    int index, action;
+
+    PJ_ASSERT_RETURN(pj_ansi_strlen(spec) < sizeof(copy), PJ_ENAMETOOLONG);
+
+    pj_bzero(menu, sizeof(*menu));
+    pj_ansi_strcpy(menu->spec, spec);
+    pj_ansi_strcpy(copy, spec);
+    pj_memset(menu->actions, IVR_ACTION_IGNORE, sizeof(menu->actions));
+
+    if (ivr_target_add(mgr, root, menu) < 0)
+    {
+        return PJ_EINVAL;
+    }
+
+    for (item = copy; item != NULL; item = next)
+    {
+        next = strchr(item, ';');
+        if (next)
+        {
+            *next++ = '\0';
+        }
+
+        item = playlist_spec_trim(item);
+        if (*item == '\0')
+        {
+            continue;
+        }
+
+        target = strchr(item, '=');
+        if (target == NULL || target != item + 1 || (index = ivr_digit_index(*item)) < 0)
+        {
+            PJ_LOG(3, (THIS_FILE, "Invalid entry %s in menu %s", item, spec));
+            return PJ_EINVAL;
+        }
+
+        target = playlist_spec_trim(target + 1);
+        if (pj_ansi_strcmp(target, IVR_HANGUP) == 0)
+        {
+            action = IVR_ACTION_HANGUP;
+        }
+        else
+        {
+            action = ivr_target_add(mgr, target, menu);
+            if (action < 0)
+            {
+                PJ_LOG(3, (THIS_FILE, "Invalid target %s of digit %c in menu %s", target, *item, spec));
+                return PJ_EINVAL;
+            }
+        }
+
+        menu->actions[index] = (pj_int16_t)action;
+    }
+
+    return PJ_SUCCESS;
+}
+
+/* Target index, IVR_ACTION_HANGUP or IVR_ACTION_IGNORE for a digit of a telephone event */
+int ivr_menu_action(const struct ivr_menu_t *menu, int digit)
+{
+    int index = ivr_digit_index(digit);
+
+    return index < 0 ? IVR_ACTION_IGNORE : menu->actions[index];
+}
+
+static int ivr_digit_index(int digit)
+{
+    static const char digits[IVR_DIGITS + 1] = "0123456789*#ABCD";
+    const char *found;
+
+    if (digit == '\0')
+    {
+        return -1;
+    }
+
+    found = strchr(digits, pj_toupper(digit));
+
+    return found ? (int)(found - digits) : -1;
+}
+
+/* Index of the playlist of spec in the menu, -1 if it can not be played */
+static int ivr_target_add(struct announcement_mgr_t *mgr, const char *spec, struct ivr_menu_t *menu)
+{
+    int i;
+
+    for (i = 0; i < menu->targets_count; i++)
+    {
+        if (pj_ansi_strcmp(menu->targets[i].spec, spec) == 0)
+        {
+            return i;
+        }
+    }
+
+    if (menu->targets_count == IVR_MAX_TARGETS)
+    {
+        PJ_LOG(3, (THIS_FILE, "Menu %s has more than %d targets", menu->spec, IVR_MAX_TARGETS));
+        return -1;
+    }
+
+    /* A plain announcement is a playlist of one segment */
+    if (playlist_parse(mgr, spec, &menu->targets[menu->targets_count]) != PJ_SUCCESS)
+    {
+        return -1;
+    }
+
+    return menu->targets_count++;
+}
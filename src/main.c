@@ -1,26 +1,255 @@
 #include "../headers/answering_machine.h"
+#include "../headers/dispatcher.h"
 #include "../headers/signals.h"
+#include "../headers/supervisor.h"
 
-int main(void)
+#include <stdlib.h>
+
+/* Settings given on the command line, applied over the config file */
+#define MAX_OVERRIDES 32
+
+struct override_t
+{
+    const char *key; /* NULL for a "key=value" pair */
+    const char *value;
+};
+
+/* Signals in the announcement store */
+static const struct announcement_spec_t announcements[] = {
+    {"longtone", NULL, &signals_longtone_create, LONG_TONE_LENGTH_MSEC},
+    {"wav", WAV_FILE, &signals_wav_create, 0},
+    {"rbt", NULL, &signals_rbt_create, RBT_ON_MSEC + RBT_OFF_MSEC},
+    {"beep", NULL, &signals_beep_create, BEEP_LENGTH_MSEC},
+};
+
+/* Usernames answered with every signal, their ptime, 0 for MEDIA_PTIME, and menu */
+static const struct route_spec_t routes[] = {
+    {"longtone", "longtone", 60, NULL},
+    {"wav", "wav", 0, NULL},
+    {"rbt", "rbt", 0, NULL},
+    {"intro", "rbt*2,silence:500,wav,longtone", 0, NULL},
+    {"menu", "wav", 0, "1=longtone;2=rbt*2,silence:500,longtone;0=wav;#=hangup"},
+    {"voicemail", "@example3,silence:300,beep,record", 0, NULL},
+};
+
+static void usage(const char *name)
+{
+    printf("Usage: %s [-f file] [-o key=value] [-p port] [-r port] [-d backends]\n"
+           "          [-s calls] [-c concurrency] [-j rate] [-R capture] [-x scale] [-t]\n"
+           "  -f file         load settings from a config file of key = value lines\n"
+           "  -o key=value    override a setting, e.g. max_calls=500 or clock_rate=8000\n"
+           "  -p port         SIP port, same as -o sip_port=port (default %d)\n"
+           "  -r port         first RTP port, same as -o rtp_port=port (default %d)\n"
+           "  -d backends     dispatch calls to host:port,host:port,... instead of answering them\n"
+           "  -s calls        run a soak of this many synthetic calls and exit\n"
+           "  -c concurrency  concurrent soak calls (default %d)\n"
+           "  -j rate         junk requests per second sent next to the soak calls\n"
+           "  -R capture      replay the requests of a pcap or text capture, check the responses\n"
+           "                  and the resources left behind, and exit\n"
+           "  -x scale        replay the capture this many times faster (default 1)\n"
+           "  -t              take over the SIP port from the instance running on it, which\n"
+           "                  finishes its calls and exits, SIGUSR1 drains without a successor\n",
+           name,
+           SIP_PORT,
+           RTP_PORT,
+           SOAK_CONCURRENCY);
+}
+
+int main(int argc, char *argv[])
 {
-    pjmedia_port *longtone;
-    pjmedia_port *wav;
-    pjmedia_port *rbt;
     pj_pool_t *pool;
-    
-    answering_machine_create(&pool);
-    
-    /* Create signals */
-    signals_longtone_create(pool, &longtone);
-    signals_wav_create(pool, &wav);
-    signals_rbt_create(pool, &rbt);
-    
-    /* Add signals to answering machine */
-    answering_machine_signal_add(longtone, "longtone");
-    answering_machine_signal_add(wav, "wav");
-    answering_machine_signal_add(rbt, "rbt");
-
-    answering_machine_calls_recv();
-
-    return 0;
+    pj_status_t status;
+    unsigned long soak_calls = 0;
+    int soak_concurrency = SOAK_CONCURRENCY;
+    unsigned soak_flood_rate = 0;
+    const char *replay_path = NULL;
+    unsigned replay_scale = 1;
+    const struct settings_t *settings = settings_get();
+    const char *config_path = NULL;
+    struct override_t overrides[MAX_OVERRIDES];
+    int overrides_count = 0;
+    const char *backends = NULL;
+    int worker = -1;
+    pj_bool_t takeover = PJ_FALSE;
+    int c;
+    int i;
+
+    /* Settings are parsed before anything is created, they size it all */
+    status = pj_init();
+    if (status != PJ_SUCCESS)
+    {
+        return 1;
+    }
+
+    while ((c = pj_getopt(argc, argv, "f:o:p:r:d:s:c:j:R:x:th")) != -1)
+    {
+        if ((c == 'o' || c == 'p' || c == 'r') && overrides_count == MAX_OVERRIDES)
+        {
+            printf("More than %d settings on the command line\n", MAX_OVERRIDES);
+            return 1;
+        }
+
+        switch (c)
+        {
+        case 'f':
+            config_path = pj_optarg;
+            break;
+        case 'o':
+            overrides[overrides_count].key = NULL;
+            overrides[overrides_count++].value = pj_optarg;
+            break;
+        case 'p':
+            overrides[overrides_count].key = "sip_port";
+            overrides[overrides_count++].value = pj_optarg;
+            break;
+        case 'r':
+            overrides[overrides_count].key = "rtp_port";
+            overrides[overrides_count++].value = pj_optarg;
+            break;
+        case 'd':
+            backends = pj_optarg;
+            break;
+        case 's':
+            soak_calls = strtoul(pj_optarg, NULL, 10);
+            break;
+        case 'c':
+            soak_concurrency = atoi(pj_optarg);
+            break;
+        case 'j':
+            soak_flood_rate = (unsigned)strtoul(pj_optarg, NULL, 10);
+            break;
+        case 'R':
+            replay_path = pj_optarg;
+            break;
+        case 'x':
+            replay_scale = (unsigned)strtoul(pj_optarg, NULL, 10);
+            break;
+        case 't':
+            takeover = PJ_TRUE;
+            break;
+        default:
+            usage(argv[0]);
+            return c == 'h' ? 0 : 1;
+        }
+    }
+
+    if (settings_check_defaults() != PJ_SUCCESS)
+    {
+        return 1;
+    }
+
+    if (config_path && settings_load(config_path) != PJ_SUCCESS)
+    {
+        return 1;
+    }
+
+    for (i = 0; i < overrides_count; i++)
+    {
+        status = overrides[i].key ? settings_set(overrides[i].key, overrides[i].value)
+                                  : settings_set_pair(overrides[i].value);
+        if (status != PJ_SUCCESS)
+        {
+            return 1;
+        }
+    }
+
+    if (settings_validate() != PJ_SUCCESS)
+    {
+        return 1;
+    }
+
+    /* A dispatcher only forwards, a soak through it measures all its backends together */
+    if (backends)
+    {
+        if (replay_path)
+        {
+            printf("Replay is not supported with a dispatcher\n");
+            return 1;
+        }
+        if (dispatcher_create((int)settings->sip_port, backends) != PJ_SUCCESS)
+        {
+            return 1;
+        }
+        if (soak_calls > 0 && dispatcher_soak_start(soak_calls, soak_concurrency, soak_flood_rate) != PJ_SUCCESS)
+        {
+            return 1;
+        }
+
+        return dispatcher_run();
+    }
+
+    /* Fork workers sharing announcements and routes through a mapped file */
+    if (settings->workers > 0 && soak_calls == 0 && !replay_path)
+    {
+        /* Workers are restarted by their supervisor, only a standalone instance hands over */
+        if (takeover)
+        {
+            printf("Takeover is not supported with workers\n");
+            return 1;
+        }
+
+        status = supervisor_run(announcements,
+                                PJ_ARRAY_SIZE(announcements),
+                                routes,
+                                PJ_ARRAY_SIZE(routes),
+                                (int)settings->workers,
+                                &worker);
+        if (status != PJ_SUCCESS || worker < 0)
+        {
+            return status == PJ_SUCCESS ? 0 : 1;
+        }
+    }
+
+    answering_machine_create(&pool, worker, (int)settings->sip_port, (int)settings->rtp_port, takeover);
+
+    if (worker >= 0)
+    {
+        answering_machine_shared_store_load(SUPERVISOR_STORE_PATH);
+    }
+    else
+    {
+        /* Register signals in the announcement store */
+        for (i = 0; i < (int)PJ_ARRAY_SIZE(announcements); i++)
+        {
+            answering_machine_announcement_add(announcements[i].name,
+                                               announcements[i].path,
+                                               announcements[i].create,
+                                               announcements[i].length_msec);
+        }
+
+        /* Decode signals, SIGHUP reloads the files without dropping calls */
+        answering_machine_announcements_load();
+
+        /* Add signals to answering machine */
+        if (answering_machine_routes_begin() != PJ_SUCCESS)
+        {
+            return 1;
+        }
+
+        for (i = 0; i < (int)PJ_ARRAY_SIZE(routes); i++)
+        {
+            status = answering_machine_signal_add(
+                routes[i].announcement, routes[i].username, routes[i].ptime, routes[i].menu);
+            if (status != PJ_SUCCESS)
+            {
+                printf("Route %s can not be answered\n", routes[i].username);
+                return 1;
+            }
+        }
+
+        answering_machine_routes_commit();
+    }
+
+    /* The soak and the replay measure a single process, workers are not forked for them */
+    if (soak_calls > 0 && answering_machine_soak_start(soak_calls, soak_concurrency, soak_flood_rate) != PJ_SUCCESS)
+    {
+        return 1;
+    }
+
+    if (replay_path && answering_machine_replay_start(replay_path, replay_scale) != PJ_SUCCESS)
+    {
+        return 1;
+    }
+
+    return answering_machine_calls_recv();
 }
@@ -0,0 +1,155 @@
+#include "../headers/media_clock.h"
+
+#define THIS_FILE "media_clock.c"
+
+static void tick_observe(struct media_clock_tick_t *tick);
+
+static pj_status_t probe_get_frame(pjmedia_port *port, pjmedia_frame *frame);
+
+static pj_status_t probe_put_frame(pjmedia_port *port, pjmedia_frame *frame);
+
+static void direct_on_tick(const pj_timestamp *ts, void *user_data);
+
+pj_status_t media_clock_probe_create(pj_pool_t *pool, pjmedia_port *target, struct media_clock_probe_t **probe)
+{
+    pj_str_t name = pj_str("clock_probe");
+
+    (*probe) = PJ_POOL_ZALLOC_T(pool, struct media_clock_probe_t);
+    if (!(*probe))
+    {
+        return PJ_ENOMEM;
+    }
+
+    (*probe)->target = target;
+    (*probe)->tick.period_usec = (unsigned)((pj_uint64_t)PJMEDIA_PIA_SPF(&target->info) * 1000000 /
+                                            PJMEDIA_PIA_CCNT(&target->info) / PJMEDIA_PIA_SRATE(&target->info));
+
+    pjmedia_port_info_init(&(*probe)->base.info,
+                           &name,
+                           MEDIA_CLOCK_SIGNATURE,
+                           PJMEDIA_PIA_SRATE(&target->info),
+                           PJMEDIA_PIA_CCNT(&target->info),
+                           PJMEDIA_PIA_BITS(&target->info),
+                           PJMEDIA_PIA_SPF(&target->info));
+
+    (*probe)->base.port_data.pdata = *probe;
+    (*probe)->base.get_frame = &probe_get_frame;
+    (*probe)->base.put_frame = &probe_put_frame;
+
+    return PJ_SUCCESS;
+}
+
+/* Set before the master port starts */
+void media_clock_probe_sched_set(struct media_clock_probe_t *probe, const char *cpus, int priority)
+{
+    probe->tick.cpus = cpus;
+    probe->tick.priority = priority;
+}
+
+void media_clock_probe_tick_set(struct media_clock_probe_t *probe, media_clock_tick_cb on_tick, void *user_data)
+{
+    probe->on_tick = on_tick;
+    probe->user_data = user_data;
+}
+
+pj_status_t media_clock_direct_create(pj_pool_t *pool,
+                                      unsigned clock_rate,
+                                      unsigned samples_per_frame,
+                                      const char *cpus,
+                                      int priority,
+                                      media_clock_tick_cb on_tick,
+                                      void *user_data,
+                                      struct media_clock_direct_t **direct)
+{
+    pj_status_t status;
+
+    (*direct) = PJ_POOL_ZALLOC_T(pool, struct media_clock_direct_t);
+    if (!(*direct))
+    {
+        return PJ_ENOMEM;
+    }
+
+    (*direct)->on_tick = on_tick;
+    (*direct)->user_data = user_data;
+    (*direct)->tick.period_usec = (unsigned)((pj_uint64_t)samples_per_frame * 1000000 / clock_rate);
+    (*direct)->tick.cpus = cpus;
+    (*direct)->tick.priority = priority;
+
+    status = pjmedia_clock_create(
+        pool, clock_rate, NCHANNELS, samples_per_frame, 0, &direct_on_tick, *direct, &(*direct)->clock);
+    if (status != PJ_SUCCESS)
+    {
+        return status;
+    }
+
+    return pjmedia_clock_start((*direct)->clock);
+}
+
+void media_clock_direct_destroy(struct media_clock_direct_t *direct)
+{
+    pjmedia_clock_destroy(direct->clock);
+}
+
+/* Catch-up ticks of a late clock come early and count as on time */
+static void tick_observe(struct media_clock_tick_t *tick)
+{
+    pj_timestamp now;
+    pj_uint32_t interval;
+
+    pj_get_timestamp(&now);
+
+    if (tick->ticks == 0)
+    {
+        affinity_apply("media clock", tick->cpus, tick->priority);
+    }
+    else
+    {
+        interval = pj_elapsed_usec(&tick->last_tick, &now);
+        metrics_clock_sample(interval > tick->period_usec ? interval - tick->period_usec : 0);
+    }
+
+    tick->last_tick = now;
+    tick->ticks++;
+}
+
+/* The bridge mixes all its ports when the master port pulls a frame */
+static pj_status_t probe_get_frame(pjmedia_port *port, pjmedia_frame *frame)
+{
+    struct media_clock_probe_t *probe = (struct media_clock_probe_t *)port->port_data.pdata;
+    pj_status_t status;
+
+    TRACE_ZONE("clock_tick");
+
+    tick_observe(&probe->tick);
+
+    status = pjmedia_port_get_frame(probe->target, frame);
+
+    if (probe->on_tick)
+    {
+        probe->on_tick(probe->user_data);
+    }
+
+    return status;
+}
+
+static pj_status_t probe_put_frame(pjmedia_port *port, pjmedia_frame *frame)
+{
+    struct media_clock_probe_t *probe = (struct media_clock_probe_t *)port->port_data.pdata;
+
+    TRACE_ZONE("clock_put_frame");
+
+    return pjmedia_port_put_frame(probe->target, frame);
+}
+
+static void direct_on_tick(const pj_timestamp *ts, void *user_data)
+{
+    struct media_clock_direct_t *direct = (struct media_clock_direct_t *)user_data;
+
+    PJ_UNUSED_ARG(ts);
+
+    TRACE_ZONE("clock_tick");
+
+    tick_observe(&direct->tick);
+
+    direct->on_tick(direct->user_data);
+}
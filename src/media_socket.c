@@ -1,38 +1,196 @@
 #include "../headers/media_socket.h"
 
+#define THIS_FILE "media_socket.c"
+
+static pj_status_t media_socket_srtp_create(struct media_socket_t *socket);
+
+/*
+ * Suites of SDES, strongest first. The cipher comes from libsrtp, which
+ * uses AES-NI or the ARMv8 crypto extensions through OpenSSL when
+ * pjproject is built with it, and only then has GCM.
+ */
+static const char *srtp_suites[] = {
+#if defined(PJMEDIA_SRTP_HAS_AES_GCM_128) && PJMEDIA_SRTP_HAS_AES_GCM_128
+    "AEAD_AES_128_GCM",
+#endif
+    "AES_CM_128_HMAC_SHA1_80",
+    "AES_CM_128_HMAC_SHA1_32",
+};
+
 pj_status_t media_socket_create(pj_pool_t *pool, 
                                 pjmedia_endpt *endpt,  
                                 const pj_uint16_t af,
                                 const int rtp_port, 
+                                enum media_srtp srtp,
                                 struct media_socket_t **socket) 
 {
-    pj_status_t status;
-     
-    (*socket) = (struct media_socket_t*) pj_pool_alloc(pool, sizeof(**socket)); 
-    if (!socket) {
+    (*socket) = (struct media_socket_t*) pj_pool_zalloc(pool, sizeof(**socket)); 
+    if (!(*socket)) {
         return FAILURE; 
     }   
     
+    (*socket)->endpt = endpt;
+    (*socket)->af = af;
+    (*socket)->rtp_port = rtp_port;
+    (*socket)->srtp = srtp;
     (*socket)->occupied = PJ_FALSE;
 
-    status = pjmedia_transport_udp_create3(endpt, af, NULL, NULL, 
-                                           rtp_port, 0, 
-                                           &(*socket)->med_transport);
+    return PJ_SUCCESS;
+}
+
+pj_status_t media_socket_open(struct media_socket_t *socket)
+{
+    pj_status_t status;
+
+    if (socket->med_transport)
+    {
+        return PJ_SUCCESS;
+    }
+
+    status = pjmedia_transport_udp_create3(socket->endpt, socket->af, NULL, NULL, 
+                                           socket->rtp_port, 0, 
+                                           &socket->med_transport);
     if (status != PJ_SUCCESS) 
     {
+        socket->med_transport = NULL;
         return status;
     }
 
-    pjmedia_transport_info_init(&(*socket)->med_tpinfo);
-    pjmedia_transport_get_info((*socket)->med_transport, &(*socket)->med_tpinfo);
+    pjmedia_transport_info_init(&socket->med_tpinfo);
+    pjmedia_transport_get_info(socket->med_transport, &socket->med_tpinfo);
 
-    pj_memcpy(&(*socket)->sock_info, &(*socket)->med_tpinfo.sock_info,
+    pj_memcpy(&socket->sock_info, &socket->med_tpinfo.sock_info,
               sizeof(pjmedia_sock_info));
 
+    socket->transport = socket->med_transport;
+    if (socket->srtp != MEDIA_SRTP_DISABLED)
+    {
+        status = media_socket_srtp_create(socket);
+        if (status != PJ_SUCCESS)
+        {
+            media_socket_close(socket);
+            return status;
+        }
+    }
+
     return PJ_SUCCESS;
 }
 
-void media_socket_free(struct media_socket_t *socket) {
+void media_socket_close(struct media_socket_t *socket)
+{
+    if (socket->transport && socket->transport != socket->med_transport)
+    {
+        pjmedia_transport_close(socket->transport);
+    }
+    socket->transport = NULL;
+
     if (socket->med_transport)
+    {
         pjmedia_transport_close(socket->med_transport);
+        socket->med_transport = NULL;
+    }
+}
+
+pj_status_t media_socket_sdp_encode(struct media_socket_t *socket,
+                                    pj_pool_t *pool,
+                                    const pjmedia_sdp_session *remote_sdp,
+                                    pjmedia_sdp_session *local_sdp)
+{
+    pj_timestamp start, end;
+    pj_status_t status;
+
+    pj_get_timestamp(&start);
+
+    status = pjmedia_transport_media_create(socket->transport, pool, 0, remote_sdp, 0);
+    if (status == PJ_SUCCESS)
+    {
+        status = pjmedia_transport_encode_sdp(socket->transport, pool, local_sdp, remote_sdp, 0);
+        if (status != PJ_SUCCESS)
+        {
+            pjmedia_transport_media_stop(socket->transport);
+        }
+    }
+
+    pj_get_timestamp(&end);
+    socket->keying_nsec = pj_elapsed_nanosec(&start, &end);
+
+    if (socket->transport != socket->med_transport && status != PJ_SUCCESS)
+    {
+        METRICS_ADD(srtp_setup_nsec, socket->keying_nsec);
+        METRICS_INC(srtp_rejected);
+    }
+
+    return status;
+}
+
+pj_status_t media_socket_start(struct media_socket_t *socket,
+                               pj_pool_t *pool,
+                               const pjmedia_sdp_session *local_sdp,
+                               const pjmedia_sdp_session *remote_sdp)
+{
+    pj_str_t savp = pj_str("SAVP");
+    pj_timestamp start, end;
+    pj_status_t status;
+
+    pj_get_timestamp(&start);
+
+    status = pjmedia_transport_media_start(socket->transport, pool, local_sdp, remote_sdp, 0);
+
+    if (socket->transport != socket->med_transport && status == PJ_SUCCESS)
+    {
+        pj_get_timestamp(&end);
+
+        /* An optional transport lets plain RTP through, only an answer of RTP/SAVP is encrypted */
+        if (local_sdp->media_count > 0 && pj_strstr(&local_sdp->media[0]->desc.transport, &savp) != NULL)
+        {
+            METRICS_ADD(srtp_setup_nsec, socket->keying_nsec + pj_elapsed_nanosec(&start, &end));
+            METRICS_INC(srtp_calls);
+        }
+    }
+
+    return status;
+}
+
+void media_socket_stop(struct media_socket_t *socket)
+{
+    pjmedia_transport_media_stop(socket->transport);
+}
+
+/* Created once per binding, media_stop drops the keys of a call so the next one starts clean */
+static pj_status_t media_socket_srtp_create(struct media_socket_t *socket)
+{
+#if defined(PJMEDIA_HAS_SRTP) && PJMEDIA_HAS_SRTP
+    pjmedia_srtp_setting setting;
+    pj_status_t status;
+    unsigned i;
+
+    pjmedia_srtp_setting_default(&setting);
+    setting.use = socket->srtp == MEDIA_SRTP_MANDATORY ? PJMEDIA_SRTP_MANDATORY : PJMEDIA_SRTP_OPTIONAL;
+    setting.close_member_tp = PJ_FALSE;
+    setting.keying_count = 1;
+    setting.keying[0] = PJMEDIA_SRTP_KEYING_SDES;
+
+    setting.crypto_count = PJ_ARRAY_SIZE(srtp_suites);
+    for (i = 0; i < setting.crypto_count; i++)
+    {
+        pj_bzero(&setting.crypto[i], sizeof(setting.crypto[i]));
+        setting.crypto[i].name = pj_str((char *)srtp_suites[i]);
+    }
+
+    status = pjmedia_transport_srtp_create(socket->endpt, socket->med_transport, &setting, &socket->transport);
+    if (status != PJ_SUCCESS)
+    {
+        socket->transport = socket->med_transport;
+        app_perror(THIS_FILE, "Unable to create SRTP transport", status);
+    }
+
+    return status;
+#else
+    PJ_LOG(1, (THIS_FILE, "SRTP is enabled but pjmedia is built without it"));
+    return PJ_ENOTSUP;
+#endif
+}
+
+void media_socket_free(struct media_socket_t *socket) {
+    media_socket_close(socket);
 }
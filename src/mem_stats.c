@@ -0,0 +1,119 @@
+#include "../headers/mem_stats.h"
+
+#include <stdio.h>
+#include <unistd.h>
+
+#define THIS_FILE "mem_stats.c"
+
+static void counter_max(metrics_counter_t *counter, metrics_counter_t value);
+
+static metrics_counter_t rss_kb(void);
+
+struct mem_stats_t
+{
+    pj_caching_pool *cp;
+
+    pj_pool_t *pools[MAX_TRACKED_POOLS];
+    int pools_count;
+};
+
+static struct mem_stats_t mem_stats;
+
+void mem_stats_init(pj_caching_pool *cp)
+{
+    mem_stats.cp = cp;
+    mem_stats.pools_count = 0;
+}
+
+/* Pools living as long as the machine, their index is the same in every worker */
+int mem_stats_track(pj_pool_t *pool)
+{
+    if (pool == NULL || mem_stats.pools_count == MAX_TRACKED_POOLS)
+    {
+        return -1;
+    }
+
+    mem_stats.pools[mem_stats.pools_count] = pool;
+
+    PJ_LOG(4, (THIS_FILE, "Tracking pool [%d] %s", mem_stats.pools_count, pj_pool_getobjname(pool)));
+
+    return mem_stats.pools_count++;
+}
+
+int mem_stats_find(pj_pool_t *pool)
+{
+    int i;
+
+    for (i = 0; i < mem_stats.pools_count; i++)
+    {
+        if (mem_stats.pools[i] == pool)
+        {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+/* Called once a call pool is about to be released */
+void mem_stats_call_pool(pj_pool_t *pool)
+{
+    counter_max(&metrics_get()->call_pool_peak, pj_pool_get_used_size(pool));
+}
+
+void mem_stats_update(void)
+{
+    struct metrics_t *metrics = metrics_get();
+    pj_size_t used;
+    int i;
+
+    for (i = 0; i < mem_stats.pools_count; i++)
+    {
+        used = pj_pool_get_used_size(mem_stats.pools[i]);
+
+        metrics->pool_used[i] = used;
+        metrics->pool_capacity[i] = pj_pool_get_capacity(mem_stats.pools[i]);
+        counter_max(&metrics->pool_peak[i], used);
+    }
+
+    if (mem_stats.cp)
+    {
+        metrics->cp_used_count = mem_stats.cp->used_count;
+        metrics->cp_used_size = mem_stats.cp->used_size;
+        metrics->cp_peak_used_size = mem_stats.cp->peak_used_size;
+    }
+
+    metrics->rss_kb = rss_kb();
+    counter_max(&metrics->rss_peak_kb, metrics->rss_kb);
+}
+
+static void counter_max(metrics_counter_t *counter, metrics_counter_t value)
+{
+    metrics_counter_t current = *counter;
+
+    while (value > current && !__sync_bool_compare_and_swap(counter, current, value))
+    {
+        current = *counter;
+    }
+}
+
+/* Resident pages are the second field of statm */
+static metrics_counter_t rss_kb(void)
+{
+    unsigned long size, resident;
+    FILE *file;
+
+    file = fopen("/proc/self/statm", "r");
+    if (file == NULL)
+    {
+        return 0;
+    }
+
+    if (fscanf(file, "%lu %lu", &size, &resident) != 2)
+    {
+        resident = 0;
+    }
+    fclose(file);
+
+    return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
@@ -0,0 +1,305 @@
+#include "../headers/metrics.h"
+
+#include <sys/resource.h>
+
+#define THIS_FILE "metrics.c"
+
+static struct metrics_t local_metrics;
+
+static struct metrics_t *current_metrics = &local_metrics;
+
+/* Upper bounds of the histogram buckets, the last bucket is unbounded */
+static const unsigned loss_bounds[METRICS_HIST_BUCKETS - 1] = {0, 1, 5, 10, 20, 50, 100};
+static const unsigned jitter_bounds[METRICS_HIST_BUCKETS - 1] = {1, 2, 5, 10, 20, 50, 100};
+static const unsigned rtt_bounds[METRICS_HIST_BUCKETS - 1] = {10, 20, 50, 100, 200, 500, 1000};
+static const unsigned clock_late_bounds[METRICS_HIST_BUCKETS - 1] = {100, 250, 500, 1000, 2000, 5000, 10000};
+
+static int hist_bucket(const unsigned *bounds, unsigned value);
+
+static int hist_print(char *buf, int size, const metrics_counter_t *hist);
+
+struct metrics_t *metrics_get(void)
+{
+    return current_metrics;
+}
+
+/* Redirect all counters to external storage, e.g. a shared memory slot */
+void metrics_attach(struct metrics_t *storage)
+{
+    current_metrics = storage ? storage : &local_metrics;
+}
+
+/* The metrics are nothing but counters, so they are summed word by word */
+void metrics_sum(struct metrics_t *dst, const struct metrics_t *src)
+{
+    metrics_counter_t *d = (metrics_counter_t *)dst;
+    const metrics_counter_t *s = (const metrics_counter_t *)src;
+    pj_size_t i;
+
+    for (i = 0; i < sizeof(*dst) / sizeof(metrics_counter_t); i++)
+    {
+        d[i] += s[i];
+    }
+}
+
+void metrics_media_sample(int shard, unsigned loss_permille, unsigned jitter_usec, unsigned rtt_usec)
+{
+    METRICS_INC(media[shard].loss_hist[hist_bucket(loss_bounds, loss_permille)]);
+    METRICS_INC(media[shard].jitter_hist[hist_bucket(jitter_bounds, jitter_usec / 1000)]);
+    METRICS_INC(media[shard].rtt_hist[hist_bucket(rtt_bounds, rtt_usec / 1000)]);
+}
+
+void metrics_clock_sample(unsigned late_usec)
+{
+    METRICS_INC(clock_ticks);
+    METRICS_INC(clock_late_hist[hist_bucket(clock_late_bounds, late_usec)]);
+}
+
+void metrics_cpu_update(void)
+{
+    struct rusage usage;
+
+    if (getrusage(RUSAGE_SELF, &usage) != 0)
+    {
+        return;
+    }
+
+    metrics_get()->cpu_user_msec = usage.ru_utime.tv_sec * 1000 + usage.ru_utime.tv_usec / 1000;
+    metrics_get()->cpu_system_msec = usage.ru_stime.tv_sec * 1000 + usage.ru_stime.tv_usec / 1000;
+}
+
+void metrics_dump(const struct metrics_t *metrics, const char *title)
+{
+    char shards[MAX_SIP_SHARDS * 24];
+    char loss[METRICS_HIST_BUCKETS * 12], jitter[METRICS_HIST_BUCKETS * 12], rtt[METRICS_HIST_BUCKETS * 12];
+    char clock_late[METRICS_HIST_BUCKETS * 12];
+    const struct metrics_media_t *media;
+    metrics_counter_t samples;
+    int len = 0;
+    int i, j;
+
+    shards[0] = '\0';
+    for (i = 0; i < MAX_SIP_SHARDS && len < (int)sizeof(shards); i++)
+    {
+        if (metrics->sip_rx_packets[i] == 0)
+        {
+            continue;
+        }
+
+        len += pj_ansi_snprintf(
+            shards + len, sizeof(shards) - len, " [%d]=%lu", i, (unsigned long)metrics->sip_rx_packets[i]);
+    }
+
+    PJ_LOG(3,
+           (THIS_FILE,
+            "%s: calls received=%lu rejected=%lu answered=%lu disconnected=%lu, sip rx per shard:%s",
+            title,
+            (unsigned long)metrics->calls_received,
+            (unsigned long)metrics->calls_rejected,
+            (unsigned long)metrics->calls_answered,
+            (unsigned long)metrics->calls_disconnected,
+            shards));
+
+    PJ_LOG(3,
+           (THIS_FILE,
+            "%s: fast rejects sent=%lu dropped=%lu blocked=%lu, %lu ns per reject, %lu ns per call setup",
+            title,
+            (unsigned long)metrics->rejects_sent,
+            (unsigned long)metrics->rejects_dropped,
+            (unsigned long)metrics->rejects_blocked,
+            (unsigned long)(metrics->reject_nsec / PJ_MAX(metrics->rejects_sent + metrics->rejects_dropped, 1)),
+            (unsigned long)(metrics->setup_nsec / PJ_MAX(metrics->setups, 1))));
+
+    PJ_LOG(3,
+           (THIS_FILE,
+            "%s: handoff messages relayed=%lu injected=%lu",
+            title,
+            (unsigned long)metrics->handoff_relayed,
+            (unsigned long)metrics->handoff_injected));
+
+    PJ_LOG(3,
+           (THIS_FILE,
+            "%s: prompts hits=%lu misses=%lu (%lu%% hit), loads=%lu failed=%lu, %lu us per load, evictions=%lu",
+            title,
+            (unsigned long)metrics->prompt_hits,
+            (unsigned long)metrics->prompt_misses,
+            (unsigned long)(100 * metrics->prompt_hits / PJ_MAX(metrics->prompt_hits + metrics->prompt_misses, 1)),
+            (unsigned long)metrics->prompt_loads,
+            (unsigned long)metrics->prompt_load_failures,
+            (unsigned long)(metrics->prompt_load_nsec / 1000 / PJ_MAX(metrics->prompt_loads, 1)),
+            (unsigned long)metrics->prompt_evictions));
+
+    PJ_LOG(3,
+           (THIS_FILE,
+            "%s: voicemails=%lu bytes=%lu in %lu writes, overruns=%lu failures=%lu",
+            title,
+            (unsigned long)metrics->recordings,
+            (unsigned long)metrics->record_bytes,
+            (unsigned long)metrics->record_writes,
+            (unsigned long)metrics->record_overruns,
+            (unsigned long)metrics->record_failures));
+
+    PJ_LOG(3,
+           (THIS_FILE,
+            "%s: srtp calls=%lu rejected=%lu, %lu us of keying per call",
+            title,
+            (unsigned long)metrics->srtp_calls,
+            (unsigned long)metrics->srtp_rejected,
+            (unsigned long)(metrics->srtp_setup_nsec / 1000 /
+                            PJ_MAX(metrics->srtp_calls + metrics->srtp_rejected, 1))));
+
+    PJ_LOG(3,
+           (THIS_FILE,
+            "%s: broadcast calls=%lu encodes=%lu packets=%lu, %lu ns per packet",
+            title,
+            (unsigned long)metrics->broadcast_calls,
+            (unsigned long)metrics->broadcast_encodes,
+            (unsigned long)metrics->broadcast_packets,
+            (unsigned long)(metrics->broadcast_nsec / PJ_MAX(metrics->broadcast_packets, 1))));
+
+    PJ_LOG(3,
+           (THIS_FILE,
+            "%s: dtmf digits=%lu menu switches=%lu hangups=%lu",
+            title,
+            (unsigned long)metrics->dtmf_digits,
+            (unsigned long)metrics->ivr_switches,
+            (unsigned long)metrics->ivr_hangups));
+
+    PJ_LOG(3,
+           (THIS_FILE,
+            "%s: dispatcher requests=%lu responses=%lu rejected=%lu backends lost=%lu",
+            title,
+            (unsigned long)metrics->dispatcher_requests,
+            (unsigned long)metrics->dispatcher_responses,
+            (unsigned long)metrics->dispatcher_rejected,
+            (unsigned long)metrics->dispatcher_backends_lost));
+
+    PJ_LOG(3,
+           (THIS_FILE,
+            "%s: tcp calls=%lu connections pooled=%lu calls on pooled connections=%lu",
+            title,
+            (unsigned long)metrics->calls_received_tcp,
+            (unsigned long)metrics->sip_tcp_connections,
+            (unsigned long)metrics->sip_tcp_reused_calls));
+
+    PJ_LOG(3,
+           (THIS_FILE,
+            "%s: cdr written=%lu in %lu batches, dropped=%lu",
+            title,
+            (unsigned long)metrics->cdr_written,
+            (unsigned long)metrics->cdr_batches,
+            (unsigned long)metrics->cdr_dropped));
+
+    hist_print(clock_late, sizeof(clock_late), metrics->clock_late_hist);
+
+    PJ_LOG(3,
+           (THIS_FILE,
+            "%s: clock ticks=%lu late by <=0.1/0.25/0.5/1/2/5/10/>10 ms [%s]",
+            title,
+            (unsigned long)metrics->clock_ticks,
+            clock_late));
+
+    PJ_LOG(3,
+           (THIS_FILE,
+            "%s: cpu user=%lu ms system=%lu ms, %lu us per answered call",
+            title,
+            (unsigned long)metrics->cpu_user_msec,
+            (unsigned long)metrics->cpu_system_msec,
+            (unsigned long)((metrics->cpu_user_msec + metrics->cpu_system_msec) * 1000 /
+                            PJ_MAX(metrics->calls_answered, 1))));
+
+    PJ_LOG(3,
+           (THIS_FILE,
+            "%s: memory rss=%lu kB (peak %lu kB), caching pool %lu pools %lu bytes (peak %lu), call pool peak=%lu",
+            title,
+            (unsigned long)metrics->rss_kb,
+            (unsigned long)metrics->rss_peak_kb,
+            (unsigned long)metrics->cp_used_count,
+            (unsigned long)metrics->cp_used_size,
+            (unsigned long)metrics->cp_peak_used_size,
+            (unsigned long)metrics->call_pool_peak));
+
+    for (i = 0; i < MAX_TRACKED_POOLS; i++)
+    {
+        if (metrics->pool_capacity[i] == 0)
+        {
+            continue;
+        }
+
+        PJ_LOG(3,
+               (THIS_FILE,
+                "%s: pool [%d] used=%lu capacity=%lu peak=%lu",
+                title,
+                i,
+                (unsigned long)metrics->pool_used[i],
+                (unsigned long)metrics->pool_capacity[i],
+                (unsigned long)metrics->pool_peak[i]));
+    }
+
+    for (i = 0; i < MAX_SIP_SHARDS; i++)
+    {
+        media = &metrics->media[i];
+
+        samples = 0;
+        for (j = 0; j < METRICS_HIST_BUCKETS; j++)
+        {
+            samples += media->loss_hist[j];
+        }
+
+        if (media->streams == 0 && samples == 0)
+        {
+            continue;
+        }
+
+        hist_print(loss, sizeof(loss), media->loss_hist);
+        hist_print(jitter, sizeof(jitter), media->jitter_hist);
+        hist_print(rtt, sizeof(rtt), media->rtt_hist);
+
+        PJ_LOG(3,
+               (THIS_FILE,
+                "%s: shard %d media streams=%lu rx=%lu pkts/%lu bytes tx=%lu pkts/%lu bytes lost=%lu "
+                "discarded=%lu late=%lu, loss permille [%s] jitter ms [%s] rtt ms [%s]",
+                title,
+                i,
+                (unsigned long)media->streams,
+                (unsigned long)media->rx_packets,
+                (unsigned long)media->rx_bytes,
+                (unsigned long)media->tx_packets,
+                (unsigned long)media->tx_bytes,
+                (unsigned long)media->rx_lost,
+                (unsigned long)media->rx_discarded,
+                (unsigned long)media->late_frames,
+                loss,
+                jitter,
+                rtt));
+    }
+}
+
+static int hist_bucket(const unsigned *bounds, unsigned value)
+{
+    int i;
+
+    for (i = 0; i < METRICS_HIST_BUCKETS - 1; i++)
+    {
+        if (value <= bounds[i])
+        {
+            return i;
+        }
+    }
+
+    return METRICS_HIST_BUCKETS - 1;
+}
+
+static int hist_print(char *buf, int size, const metrics_counter_t *hist)
+{
+    int len = 0;
+    int i;
+
+    buf[0] = '\0';
+    for (i = 0; i < METRICS_HIST_BUCKETS && len < size; i++)
+    {
+        len += pj_ansi_snprintf(buf + len, size - len, i ? " %lu" : "%lu", (unsigned long)hist[i]);
+    }
+
+    return len;
+}
@@ -0,0 +1,433 @@
+#include "../headers/playlist.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define THIS_FILE "playlist.c"
+
+static pj_status_t playlist_get_frame(pjmedia_port *port, pjmedia_frame *frame);
+
+/* Targets with a list, a repeat, a gap or a prompt are playlists, plain names are announcements */
+pj_bool_t playlist_is_spec(const char *spec)
+{
+    return strpbrk(spec, ",*:@") != NULL;
+}
+
+pj_status_t playlist_parse(struct announcement_mgr_t *mgr, const char *spec, struct playlist_t *playlist)
+{
+    char copy[PLAYLIST_SPEC_LEN];
+    struct playlist_segment_t *segment;
+    char *item, *next, *arg;
+    unsigned long value;
+
+    PJ_ASSERT_RETURN(pj_ansi_strlen(spec) < sizeof(copy), PJ_ENAMETOOLONG);
+
+    pj_bzero(playlist, sizeof(*playlist));
+    pj_ansi_strcpy(playlist->spec, spec);
+    pj_ansi_strcpy(copy, spec);
+
+    for (item = copy; item != NULL; item = next)
+    {
+        next = strchr(item, ',');
+        if (next)
+        {
+            *next++ = '\0';
+        }
+
+        item = playlist_spec_trim(item);
+        if (*item == '\0')
+        {
+            continue;
+        }
+
+        if (playlist->segments_count == PLAYLIST_MAX_SEGMENTS)
+        {
+            PJ_LOG(3, (THIS_FILE, "Playlist %s has more than %d segments", spec, PLAYLIST_MAX_SEGMENTS));
+            return PJ_ETOOMANY;
+        }
+
+        /* The cursor never leaves a record segment */
+        if (playlist->segments_count > 0 && playlist->segments[playlist->segments_count - 1].record)
+        {
+            PJ_LOG(3, (THIS_FILE, "Recording is not the last segment of playlist %s", spec));
+            return PJ_EINVAL;
+        }
+
+        segment = &playlist->segments[playlist->segments_count];
+        segment->repeat = 1;
+
+        arg = strchr(item, ':');
+        if (arg)
+        {
+            *arg++ = '\0';
+            value = strtoul(arg, NULL, 10);
+
+            if (pj_ansi_strcmp(playlist_spec_trim(item), PLAYLIST_SILENCE) != 0 || value == 0)
+            {
+                PJ_LOG(3, (THIS_FILE, "Invalid gap in playlist %s", spec));
+                return PJ_EINVAL;
+            }
+
+            segment->silence_msec = (unsigned)value;
+        }
+        else if (pj_ansi_strcmp(playlist_spec_trim(item), PLAYLIST_RECORD) == 0)
+        {
+            segment->record = PJ_TRUE;
+        }
+        else
+        {
+            arg = strchr(item, '*');
+            if (arg)
+            {
+                *arg++ = '\0';
+                value = strtoul(arg, NULL, 10);
+
+                if (value == 0 || value > PLAYLIST_MAX_REPEAT)
+                {
+                    PJ_LOG(3, (THIS_FILE, "Invalid repeat count in playlist %s", spec));
+                    return PJ_EINVAL;
+                }
+
+                segment->repeat = (unsigned)value;
+            }
+
+            item = playlist_spec_trim(item);
+            if (*item == '@')
+            {
+                segment->prompt =
+                    mgr->prompts ? prompt_cache_find(mgr->prompts, item + 1, (int)pj_ansi_strlen(item + 1)) : NULL;
+                if (segment->prompt == NULL)
+                {
+                    PJ_LOG(3, (THIS_FILE, "Unknown prompt %s in playlist %s", item + 1, spec));
+                    return PJ_ENOTFOUND;
+                }
+
+                playlist->segments_count++;
+                continue;
+            }
+
+            segment->announcement = announcement_find(mgr, item);
+            if (segment->announcement == NULL)
+            {
+                PJ_LOG(3, (THIS_FILE, "Unknown announcement %s in playlist %s", item, spec));
+                return PJ_ENOTFOUND;
+            }
+        }
+
+        playlist->segments_count++;
+    }
+
+    return playlist->segments_count > 0 ? PJ_SUCCESS : PJ_EINVAL;
+}
+
+/*
+ * Pin the current version of every segment of every playlist for the
+ * whole call. The port shares the group lock of the call, so the bridge
+ * keeps the call alive until it has let the port go. Prompts are pinned
+ * too, the ones not in memory are queued for the loader.
+ */
+pj_status_t playlist_port_create(pj_pool_t *pool,
+                                 struct announcement_mgr_t *mgr,
+                                 const struct playlist_t *playlists,
+                                 int playlists_count,
+                                 pj_grp_lock_t *grp_lock,
+                                 struct playlist_port_t **port)
+{
+    pj_str_t name = pj_str("playlist");
+    const struct playlist_t *playlist;
+    const struct playlist_segment_t *segment;
+    struct announcement_version_t *version;
+    pj_size_t samples_count;
+    pj_status_t status;
+    int i, j;
+
+    PJ_ASSERT_RETURN(playlists_count > 0, PJ_EINVAL);
+
+    (*port) = PJ_POOL_ZALLOC_T(pool, struct playlist_port_t);
+    if (!(*port))
+    {
+        return PJ_ENOMEM;
+    }
+
+    (*port)->versions = (struct announcement_version_t ***)pj_pool_calloc(
+        pool, playlists_count, sizeof(*(*port)->versions));
+    if (!(*port)->versions)
+    {
+        return PJ_ENOMEM;
+    }
+
+    for (i = 0; i < playlists_count; i++)
+    {
+        (*port)->versions[i] = (struct announcement_version_t **)pj_pool_calloc(
+            pool, playlists[i].segments_count, sizeof(*(*port)->versions[i]));
+        if (!(*port)->versions[i])
+        {
+            return PJ_ENOMEM;
+        }
+    }
+
+    (*port)->playlists = playlists;
+    (*port)->playlists_count = playlists_count;
+    (*port)->playlist = &playlists[0];
+    (*port)->pending = -1;
+    (*port)->mgr = mgr;
+
+    /* Announcements and prompts are all decoded to the rate of the player */
+    for (i = 0; i < playlists_count; i++)
+    {
+        playlist = &playlists[i];
+
+        for (j = 0; j < playlist->segments_count; j++)
+        {
+            segment = &playlist->segments[j];
+            if (segment->announcement == NULL)
+            {
+                continue;
+            }
+
+            version = announcement_acquire(mgr, segment->announcement);
+            (*port)->versions[i][j] = version;
+
+            if (version == NULL || version->clock_rate != PLAYLIST_CLOCK_RATE)
+            {
+                PJ_LOG(3,
+                       (THIS_FILE,
+                        "Segment %s of playlist %s can not be played",
+                        segment->announcement->name,
+                        playlist->spec));
+                playlist_port_release(*port);
+                return version == NULL ? PJ_ENOTFOUND : PJMEDIA_ENCCLOCKRATE;
+            }
+        }
+    }
+
+    /* The cursor never stops on an empty playlist, a prompt or a recording is never empty */
+    for (i = 0; i < playlists_count; i++)
+    {
+        samples_count = 0;
+
+        for (j = 0; j < playlists[i].segments_count; j++)
+        {
+            version = (*port)->versions[i][j];
+            samples_count += playlists[i].segments[j].prompt || playlists[i].segments[j].record ? 1
+                             : version ? version->samples_count
+                                       : (pj_size_t)playlists[i].segments[j].silence_msec * PLAYLIST_CLOCK_RATE / 1000;
+        }
+
+        if (samples_count == 0)
+        {
+            playlist_port_release(*port);
+            return PJ_EINVAL;
+        }
+    }
+
+    pjmedia_port_info_init(&(*port)->base.info,
+                           &name,
+                           PLAYLIST_SIGNATURE,
+                           PLAYLIST_CLOCK_RATE,
+                           NCHANNELS,
+                           NBITS,
+                           PLAYLIST_CLOCK_RATE * MEDIA_PTIME_STEP / 1000);
+
+    (*port)->base.port_data.pdata = *port;
+    (*port)->base.get_frame = &playlist_get_frame;
+
+    status = pjmedia_port_init_grp_lock(&(*port)->base, pool, grp_lock);
+    if (status != PJ_SUCCESS)
+    {
+        playlist_port_release(*port);
+        return status;
+    }
+
+    for (i = 0; i < playlists_count; i++)
+    {
+        for (j = 0; j < playlists[i].segments_count; j++)
+        {
+            if (playlists[i].segments[j].prompt)
+            {
+                prompt_cache_acquire(mgr->prompts, playlists[i].segments[j].prompt);
+            }
+        }
+    }
+    (*port)->prompts_pinned = PJ_TRUE;
+
+    return PJ_SUCCESS;
+}
+
+/*
+ * Play another playlist of the player from its start. Called from any
+ * thread, the bridge picks it up at its next frame, so the cursor is
+ * only ever moved by the clock thread.
+ */
+void playlist_port_switch(struct playlist_port_t *port, int playlist)
+{
+    PJ_ASSERT_ON_FAIL(playlist >= 0 && playlist < port->playlists_count, return);
+
+    __atomic_store_n(&port->pending, playlist, __ATOMIC_RELEASE);
+}
+
+/* Some playlist of the player records the caller */
+pj_bool_t playlist_port_records(const struct playlist_port_t *port)
+{
+    int i, j;
+
+    for (i = 0; i < port->playlists_count; i++)
+    {
+        for (j = 0; j < port->playlists[i].segments_count; j++)
+        {
+            if (port->playlists[i].segments[j].record)
+            {
+                return PJ_TRUE;
+            }
+        }
+    }
+
+    return PJ_FALSE;
+}
+
+/* Called once the stream exists, the player may already be waiting on the record segment */
+void playlist_port_record(struct playlist_port_t *port, struct recording_t *recording)
+{
+    __atomic_store_n(&port->recording, recording, __ATOMIC_RELEASE);
+}
+
+/*
+ * Unpin the versions and prompts once the port has been removed from the
+ * bridge, and drop the reference the port holds on the call. The port
+ * may still be asked for the current tick, released versions and
+ * prompts stay readable for their retire grace period.
+ */
+void playlist_port_release(struct playlist_port_t *port)
+{
+    int i, j;
+
+    for (i = 0; i < port->playlists_count; i++)
+    {
+        for (j = 0; j < port->playlists[i].segments_count; j++)
+        {
+            announcement_release(port->mgr, port->versions[i][j]);
+
+            if (port->prompts_pinned && port->playlists[i].segments[j].prompt)
+            {
+                prompt_cache_release(port->mgr->prompts, port->playlists[i].segments[j].prompt);
+            }
+        }
+    }
+
+    pjmedia_port_destroy(&port->base);
+}
+
+/* Strip the spaces around a segment in place */
+char *playlist_spec_trim(char *text)
+{
+    char *end;
+
+    while (*text == ' ')
+    {
+        text++;
+    }
+
+    end = text + pj_ansi_strlen(text);
+    while (end > text && end[-1] == ' ')
+    {
+        *--end = '\0';
+    }
+
+    return text;
+}
+
+/*
+ * Fill the frame from the segments under the cursor, wrapping around at
+ * the end. Frames of any size are served, the bridge asks for one tick
+ * and the direct playback of the embedded profile for a whole packet.
+ */
+static pj_status_t playlist_get_frame(pjmedia_port *port, pjmedia_frame *frame)
+{
+    struct playlist_port_t *player = (struct playlist_port_t *)port->port_data.pdata;
+    struct playlist_cursor_t *cursor = &player->cursor;
+    const struct playlist_t *playlist;
+    const struct playlist_segment_t *segment;
+    const struct announcement_version_t *version;
+    struct announcement_version_t **versions;
+    struct recording_t *recording;
+    pj_int16_t *out = (pj_int16_t *)frame->buf;
+    unsigned needed = (unsigned)(frame->size / sizeof(pj_int16_t));
+    pj_size_t length;
+    unsigned chunk;
+    int pending;
+
+    /* Switching is a cursor reset, the versions of all playlists stay pinned */
+    if (__atomic_load_n(&player->pending, __ATOMIC_RELAXED) >= 0)
+    {
+        pending = __atomic_exchange_n(&player->pending, -1, __ATOMIC_ACQUIRE);
+        player->playlist = &player->playlists[pending];
+        pj_bzero(cursor, sizeof(*cursor));
+    }
+
+    playlist = player->playlist;
+    versions = player->versions[playlist - player->playlists];
+
+    while (needed > 0)
+    {
+        segment = &playlist->segments[cursor->segment];
+        version = versions[cursor->segment];
+
+        /* The prompt has been played, the caller speaks from here on */
+        if (segment->record)
+        {
+            recording = __atomic_load_n(&player->recording, __ATOMIC_ACQUIRE);
+            if (recording)
+            {
+                recording_start(recording);
+            }
+
+            pj_bzero(out, needed * sizeof(pj_int16_t));
+            break;
+        }
+
+        /* The call never waits for the loader, a prompt not in memory yet is silence */
+        if (segment->prompt && !prompt_is_ready(segment->prompt))
+        {
+            pj_bzero(out, needed * sizeof(pj_int16_t));
+            break;
+        }
+
+        length = segment->prompt ? segment->prompt->samples_count
+                 : version       ? version->samples_count
+                                 : (pj_size_t)segment->silence_msec * PJMEDIA_PIA_SRATE(&port->info) / 1000;
+
+        chunk = (unsigned)PJ_MIN((pj_size_t)needed, length - cursor->offset);
+
+        if (segment->prompt)
+        {
+            pj_memcpy(out, segment->prompt->samples + cursor->offset, chunk * sizeof(pj_int16_t));
+        }
+        else if (version)
+        {
+            pj_memcpy(out, version->samples + cursor->offset, chunk * sizeof(pj_int16_t));
+        }
+        else
+        {
+            pj_bzero(out, chunk * sizeof(pj_int16_t));
+        }
+
+        out += chunk;
+        needed -= chunk;
+        cursor->offset += chunk;
+
+        if (cursor->offset >= length)
+        {
+            cursor->offset = 0;
+
+            if (++cursor->repeat >= segment->repeat)
+            {
+                cursor->repeat = 0;
+                cursor->segment = (pj_uint16_t)((cursor->segment + 1) % playlist->segments_count);
+            }
+        }
+    }
+
+    frame->type = PJMEDIA_FRAME_TYPE_AUDIO;
+
+    return PJ_SUCCESS;
+}
@@ -0,0 +1,584 @@
+#include "../headers/prompt_cache.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define THIS_FILE "prompt_cache.c"
+
+/* Format tags of the WAV files the loader understands */
+#define WAV_FORMAT_PCM 1
+#define WAV_FORMAT_ALAW 6
+#define WAV_FORMAT_ULAW 7
+
+/* Audio of a mapped WAV file */
+struct wav_info_t
+{
+    unsigned format;
+    unsigned channels;
+    unsigned clock_rate;
+    unsigned bits;
+    const pj_uint8_t *data;
+    pj_size_t size;
+};
+
+static int loader_thread(void *arg);
+
+static void prompt_load(struct prompt_cache_t *cache, struct prompt_t *prompt);
+
+static pj_status_t prompt_decode(struct prompt_cache_t *cache,
+                                 const char *name,
+                                 const pj_uint8_t *file,
+                                 pj_size_t size,
+                                 pj_pool_t **pool,
+                                 pj_int16_t **samples,
+                                 pj_size_t *samples_count);
+
+static pj_status_t wav_parse(const pj_uint8_t *file, pj_size_t size, struct wav_info_t *info);
+
+static void lru_append(struct prompt_cache_t *cache, struct prompt_t *prompt);
+
+static void lru_unlink(struct prompt_t *prompt);
+
+static void lru_evict(struct prompt_cache_t *cache);
+
+pj_status_t prompt_cache_create(pj_pool_factory *factory,
+                                const char *dir,
+                                pj_size_t capacity,
+                                struct prompt_cache_t **cache)
+{
+    pj_pool_t *pool;
+    struct prompt_t *prompt;
+    struct dirent *entry;
+    pj_status_t status;
+    DIR *dir_handle;
+    pj_size_t len;
+
+    PJ_ASSERT_RETURN(pj_ansi_strlen(dir) < PROMPT_PATH_LEN, PJ_ENAMETOOLONG);
+
+    /* Grows with the library, the machine pool of the embedded profile does not */
+    pool = pj_pool_create(factory, "prompt_cache", PROMPT_POOL_SIZE, PROMPT_POOL_INC, NULL);
+    if (!pool)
+    {
+        return PJ_ENOMEM;
+    }
+
+    (*cache) = PJ_POOL_ZALLOC_T(pool, struct prompt_cache_t);
+    (*cache)->factory = factory;
+    (*cache)->pool = pool;
+    (*cache)->capacity = capacity;
+    (*cache)->lru.lru_prev = &(*cache)->lru;
+    (*cache)->lru.lru_next = &(*cache)->lru;
+    pj_ansi_strcpy((*cache)->dir, dir);
+
+    (*cache)->kernels = g711_kernels_select();
+    if ((*cache)->kernels == NULL)
+    {
+        (*cache)->kernels = g711_kernels_scalar();
+    }
+
+    (*cache)->index = pj_hash_create(pool, PROMPT_INDEX_BUCKETS);
+
+    status = pj_mutex_create_simple(pool, "prompt_cache", &(*cache)->lock);
+    if (status != PJ_SUCCESS)
+    {
+        return status;
+    }
+
+    status = pj_sem_create(pool, "prompt_queue", 0, PJ_MAXINT32, &(*cache)->queue_sem);
+    if (status != PJ_SUCCESS)
+    {
+        return status;
+    }
+
+    (*cache)->scratch = pj_pool_create(factory, "prompt_scratch", PROMPT_POOL_SIZE, PROMPT_POOL_INC, NULL);
+    if (!(*cache)->scratch)
+    {
+        return PJ_ENOMEM;
+    }
+
+    /* Only names are kept, a library of thousands of prompts costs a few hundred KB */
+    dir_handle = opendir(dir);
+    if (dir_handle == NULL)
+    {
+        PJ_LOG(3, (THIS_FILE, "No prompt library in %s", dir));
+    }
+
+    while (dir_handle && (entry = readdir(dir_handle)) != NULL)
+    {
+        len = pj_ansi_strlen(entry->d_name);
+        if (len <= sizeof(PROMPT_EXT) - 1 || len - (sizeof(PROMPT_EXT) - 1) >= PROMPT_NAME_LEN ||
+            pj_ansi_strcmp(entry->d_name + len - (sizeof(PROMPT_EXT) - 1), PROMPT_EXT) != 0)
+        {
+            continue;
+        }
+        len -= sizeof(PROMPT_EXT) - 1;
+
+        prompt = PJ_POOL_ZALLOC_T(pool, struct prompt_t);
+        pj_memcpy(prompt->name, entry->d_name, len);
+        prompt->name[len] = '\0';
+
+        pj_hash_set(pool, (*cache)->index, prompt->name, (unsigned)len, 0, prompt);
+
+        prompt->next = (*cache)->prompts;
+        (*cache)->prompts = prompt;
+        (*cache)->prompts_count++;
+    }
+
+    if (dir_handle)
+    {
+        closedir(dir_handle);
+    }
+
+    status = pj_thread_create(pool, "prompt_loader", &loader_thread, *cache, 0, 0, &(*cache)->loader);
+    if (status != PJ_SUCCESS)
+    {
+        return status;
+    }
+
+    PJ_LOG(3,
+           (THIS_FILE,
+            "Indexed %d prompts in %s, up to %lu bytes of them are kept decoded",
+            (*cache)->prompts_count,
+            dir,
+            (unsigned long)capacity));
+
+    return PJ_SUCCESS;
+}
+
+struct prompt_t *prompt_cache_find(struct prompt_cache_t *cache, const char *name, int len)
+{
+    return (struct prompt_t *)pj_hash_get(cache->index, name, (unsigned)len, NULL);
+}
+
+void prompt_cache_acquire(struct prompt_cache_t *cache, struct prompt_t *prompt)
+{
+    pj_mutex_lock(cache->lock);
+
+    /* A ready prompt nobody played was waiting in the LRU */
+    if (prompt->refs++ == 0 && prompt->state == PROMPT_READY)
+    {
+        lru_unlink(prompt);
+    }
+
+    if (prompt->state == PROMPT_READY)
+    {
+        METRICS_INC(prompt_hits);
+    }
+    else
+    {
+        METRICS_INC(prompt_misses);
+
+        if (prompt->state == PROMPT_IDLE)
+        {
+            __atomic_store_n(&prompt->state, PROMPT_LOADING, __ATOMIC_RELEASE);
+            pj_get_timestamp(&prompt->requested);
+
+            prompt->queue_next = NULL;
+            if (cache->queue_tail)
+            {
+                cache->queue_tail->queue_next = prompt;
+            }
+            else
+            {
+                cache->queue_head = prompt;
+            }
+            cache->queue_tail = prompt;
+
+            pj_sem_post(cache->queue_sem);
+        }
+    }
+
+    pj_mutex_unlock(cache->lock);
+}
+
+void prompt_cache_release(struct prompt_cache_t *cache, struct prompt_t *prompt)
+{
+    pj_mutex_lock(cache->lock);
+
+    if (--prompt->refs == 0 && prompt->state == PROMPT_READY)
+    {
+        lru_append(cache, prompt);
+        lru_evict(cache);
+    }
+
+    pj_mutex_unlock(cache->lock);
+}
+
+pj_bool_t prompt_is_ready(const struct prompt_t *prompt)
+{
+    return __atomic_load_n(&prompt->state, __ATOMIC_ACQUIRE) == PROMPT_READY;
+}
+
+void prompt_cache_free(struct prompt_cache_t *cache)
+{
+    struct prompt_t *prompt;
+
+    if (cache->loader)
+    {
+        __atomic_store_n(&cache->quit, 1, __ATOMIC_RELEASE);
+        pj_sem_post(cache->queue_sem);
+
+        pj_thread_join(cache->loader);
+        pj_thread_destroy(cache->loader);
+    }
+
+    for (prompt = cache->prompts; prompt; prompt = prompt->next)
+    {
+        if (prompt->pool)
+        {
+            pj_pool_release(prompt->pool);
+        }
+    }
+
+    pj_pool_release(cache->scratch);
+    pj_sem_destroy(cache->queue_sem);
+    pj_mutex_destroy(cache->lock);
+    pj_pool_release(cache->pool);
+}
+
+static int loader_thread(void *arg)
+{
+    struct prompt_cache_t *cache = (struct prompt_cache_t *)arg;
+    struct prompt_t *prompt;
+
+    for (;;)
+    {
+        pj_sem_wait(cache->queue_sem);
+
+        if (__atomic_load_n(&cache->quit, __ATOMIC_ACQUIRE))
+        {
+            break;
+        }
+
+        pj_mutex_lock(cache->lock);
+
+        prompt = cache->queue_head;
+        if (prompt)
+        {
+            cache->queue_head = prompt->queue_next;
+            if (cache->queue_head == NULL)
+            {
+                cache->queue_tail = NULL;
+            }
+        }
+
+        pj_mutex_unlock(cache->lock);
+
+        if (prompt)
+        {
+            prompt_load(cache, prompt);
+        }
+    }
+
+    return 0;
+}
+
+/* Map the file, decode it and hand the samples to the players waiting for them */
+static void prompt_load(struct prompt_cache_t *cache, struct prompt_t *prompt)
+{
+    char path[PROMPT_PATH_LEN + PROMPT_NAME_LEN + sizeof(PROMPT_EXT) + 1];
+    pj_int16_t *samples = NULL;
+    pj_size_t samples_count = 0;
+    pj_pool_t *pool = NULL;
+    pj_timestamp end;
+    pj_status_t status;
+    struct stat st;
+    void *file = MAP_FAILED;
+    int fd;
+
+    pj_ansi_snprintf(path, sizeof(path), "%s/%s%s", cache->dir, prompt->name, PROMPT_EXT);
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd >= 0 && fstat(fd, &st) == 0 && st.st_size > 0)
+    {
+        file = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    if (fd >= 0)
+    {
+        close(fd);
+    }
+
+    if (file == MAP_FAILED)
+    {
+        status = PJ_RETURN_OS_ERROR(errno);
+    }
+    else
+    {
+        madvise(file, (size_t)st.st_size, MADV_SEQUENTIAL);
+
+        status = prompt_decode(
+            cache, prompt->name, (const pj_uint8_t *)file, (pj_size_t)st.st_size, &pool, &samples, &samples_count);
+
+        munmap(file, (size_t)st.st_size);
+    }
+
+    pj_pool_reset(cache->scratch);
+    pj_get_timestamp(&end);
+
+    pj_mutex_lock(cache->lock);
+
+    if (status == PJ_SUCCESS)
+    {
+        prompt->pool = pool;
+        prompt->samples = samples;
+        prompt->samples_count = samples_count;
+        cache->bytes += samples_count * sizeof(pj_int16_t);
+
+        __atomic_store_n(&prompt->state, PROMPT_READY, __ATOMIC_RELEASE);
+
+        METRICS_INC(prompt_loads);
+        METRICS_ADD(prompt_load_nsec, pj_elapsed_nanosec(&prompt->requested, &end));
+
+        /* The calls that asked for it may all have ended already */
+        if (prompt->refs == 0)
+        {
+            lru_append(cache, prompt);
+            lru_evict(cache);
+        }
+    }
+    else
+    {
+        __atomic_store_n(&prompt->state, PROMPT_FAILED, __ATOMIC_RELEASE);
+        METRICS_INC(prompt_load_failures);
+    }
+
+    pj_mutex_unlock(cache->lock);
+
+    if (status == PJ_SUCCESS)
+    {
+        PJ_LOG(4,
+               (THIS_FILE,
+                "Prompt %s loaded, %lu samples in %u us",
+                prompt->name,
+                (unsigned long)samples_count,
+                (unsigned)(pj_elapsed_nanosec(&prompt->requested, &end) / 1000)));
+    }
+    else
+    {
+        PJ_LOG(3, (THIS_FILE, "Unable to load prompt %s, its calls hear silence", path));
+        app_perror(THIS_FILE, "Prompt load error", status);
+    }
+}
+
+/*
+ * Convert the audio of a mapped WAV file to mono PCM at PROMPT_CLOCK_RATE.
+ * G.711 is expanded with the codec kernels, other rates are resampled in
+ * runs of PROMPT_RESAMPLE_MSEC. Only the result is allocated per prompt.
+ */
+static pj_status_t prompt_decode(struct prompt_cache_t *cache,
+                                 const char *name,
+                                 const pj_uint8_t *file,
+                                 pj_size_t size,
+                                 pj_pool_t **pool,
+                                 pj_int16_t **samples,
+                                 pj_size_t *samples_count)
+{
+    struct wav_info_t info;
+    pjmedia_resample *resample;
+    pj_int16_t *pcm, *mono, *last;
+    pj_size_t frames, runs, i;
+    unsigned in_frame, out_frame, c;
+    pj_status_t status;
+    int sum;
+
+    status = wav_parse(file, size, &info);
+    if (status != PJ_SUCCESS)
+    {
+        return status;
+    }
+
+    frames = info.size / (info.channels * info.bits / 8);
+    if (frames == 0)
+    {
+        return PJ_EEOF;
+    }
+
+    in_frame = info.clock_rate * PROMPT_RESAMPLE_MSEC / 1000;
+    out_frame = PROMPT_CLOCK_RATE * PROMPT_RESAMPLE_MSEC / 1000;
+    if (info.clock_rate * PROMPT_RESAMPLE_MSEC % 1000 != 0)
+    {
+        PJ_LOG(3, (THIS_FILE, "Clock rate %u of prompt %s can not be converted", info.clock_rate, name));
+        return PJMEDIA_ENCCLOCKRATE;
+    }
+
+    pcm = (pj_int16_t *)pj_pool_alloc(cache->scratch, frames * info.channels * sizeof(pj_int16_t));
+
+    if (info.format == WAV_FORMAT_PCM)
+    {
+        pj_memcpy(pcm, info.data, frames * info.channels * sizeof(pj_int16_t));
+    }
+    else if (info.format == WAV_FORMAT_ALAW)
+    {
+        cache->kernels->alaw_decode(info.data, pcm, (unsigned)(frames * info.channels));
+    }
+    else
+    {
+        cache->kernels->ulaw_decode(info.data, pcm, (unsigned)(frames * info.channels));
+    }
+
+    /* Channels are mixed down in place */
+    mono = pcm;
+    if (info.channels > 1)
+    {
+        for (i = 0; i < frames; i++)
+        {
+            sum = 0;
+            for (c = 0; c < info.channels; c++)
+            {
+                sum += pcm[i * info.channels + c];
+            }
+            mono[i] = (pj_int16_t)(sum / (int)info.channels);
+        }
+    }
+
+    runs = info.clock_rate == PROMPT_CLOCK_RATE ? 0 : (frames + in_frame - 1) / in_frame;
+    *samples_count = runs ? runs * out_frame : frames;
+
+    *pool = pj_pool_create(cache->factory, name, *samples_count * sizeof(pj_int16_t) + 256, PROMPT_POOL_INC, NULL);
+    if (!*pool)
+    {
+        return PJ_ENOMEM;
+    }
+    *samples = (pj_int16_t *)pj_pool_alloc(*pool, *samples_count * sizeof(pj_int16_t));
+
+    if (runs == 0)
+    {
+        pj_memcpy(*samples, mono, frames * sizeof(pj_int16_t));
+        return PJ_SUCCESS;
+    }
+
+    status = pjmedia_resample_create(
+        cache->scratch, PJ_TRUE, PJ_FALSE, 1, info.clock_rate, PROMPT_CLOCK_RATE, in_frame, &resample);
+    if (status != PJ_SUCCESS)
+    {
+        pj_pool_release(*pool);
+        return status;
+    }
+
+    /* The last run is padded with silence */
+    last = (pj_int16_t *)pj_pool_zalloc(cache->scratch, in_frame * sizeof(pj_int16_t));
+    pj_memcpy(last, mono + (runs - 1) * in_frame, (frames - (runs - 1) * in_frame) * sizeof(pj_int16_t));
+
+    for (i = 0; i < runs; i++)
+    {
+        pjmedia_resample_run(resample, i + 1 < runs ? mono + i * in_frame : last, *samples + i * out_frame);
+    }
+
+    pjmedia_resample_destroy(resample);
+
+    return PJ_SUCCESS;
+}
+
+static pj_status_t wav_parse(const pj_uint8_t *file, pj_size_t size, struct wav_info_t *info)
+{
+    const pj_uint8_t *chunk;
+    pj_size_t pos = 12;
+    pj_size_t len;
+
+    pj_bzero(info, sizeof(*info));
+
+    if (size < 12 || pj_memcmp(file, "RIFF", 4) != 0 || pj_memcmp(file + 8, "WAVE", 4) != 0)
+    {
+        return PJMEDIA_ENOTVALIDWAVE;
+    }
+
+    while (pos + 8 <= size && info->data == NULL)
+    {
+        chunk = file + pos;
+        len = (pj_size_t)chunk[4] | (pj_size_t)chunk[5] << 8 | (pj_size_t)chunk[6] << 16 | (pj_size_t)chunk[7] << 24;
+
+        /* Writers that never went back to fix the length leave the data chunk open */
+        len = PJ_MIN(len, size - pos - 8);
+
+        if (pj_memcmp(chunk, "fmt ", 4) == 0 && len >= 16)
+        {
+            info->format = chunk[8] | chunk[9] << 8;
+            info->channels = chunk[10] | chunk[11] << 8;
+            info->clock_rate = chunk[12] | chunk[13] << 8 | chunk[14] << 16 | (unsigned)chunk[15] << 24;
+            info->bits = chunk[22] | chunk[23] << 8;
+        }
+        else if (pj_memcmp(chunk, "data", 4) == 0)
+        {
+            info->data = chunk + 8;
+            info->size = len;
+        }
+
+        pos += 8 + len + (len & 1);
+    }
+
+    if (info->data == NULL || info->channels == 0 || info->clock_rate == 0)
+    {
+        return PJMEDIA_ENOTVALIDWAVE;
+    }
+
+    if (!(info->format == WAV_FORMAT_PCM && info->bits == 16) &&
+        !((info->format == WAV_FORMAT_ALAW || info->format == WAV_FORMAT_ULAW) && info->bits == 8))
+    {
+        return PJMEDIA_EWAVEUNSUPP;
+    }
+
+    return PJ_SUCCESS;
+}
+
+/* Most recently released at the tail, the ring is in the order of the release times */
+static void lru_append(struct prompt_cache_t *cache, struct prompt_t *prompt)
+{
+    pj_gettickcount(&prompt->release_time);
+
+    prompt->lru_prev = cache->lru.lru_prev;
+    prompt->lru_next = &cache->lru;
+    cache->lru.lru_prev->lru_next = prompt;
+    cache->lru.lru_prev = prompt;
+}
+
+static void lru_unlink(struct prompt_t *prompt)
+{
+    prompt->lru_prev->lru_next = prompt->lru_next;
+    prompt->lru_next->lru_prev = prompt->lru_prev;
+    prompt->lru_prev = NULL;
+    prompt->lru_next = NULL;
+}
+
+/*
+ * Only prompts no call plays are in the LRU. A player released within
+ * the grace period may still be read by the bridge, the prompts released
+ * after it are younger still, so the cache stays above capacity until
+ * the next release or load finds them old enough.
+ */
+static void lru_evict(struct prompt_cache_t *cache)
+{
+    struct prompt_t *victim;
+    pj_time_val now;
+    pj_time_val age;
+
+    pj_gettickcount(&now);
+
+    while (cache->bytes > cache->capacity && cache->lru.lru_next != &cache->lru)
+    {
+        victim = cache->lru.lru_next;
+
+        age = now;
+        PJ_TIME_VAL_SUB(age, victim->release_time);
+        if (PJ_TIME_VAL_MSEC(age) < PROMPT_RETIRE_MSEC)
+        {
+            break;
+        }
+
+        lru_unlink(victim);
+
+        cache->bytes -= victim->samples_count * sizeof(pj_int16_t);
+
+        __atomic_store_n(&victim->state, PROMPT_IDLE, __ATOMIC_RELEASE);
+        victim->samples = NULL;
+        victim->samples_count = 0;
+
+        pj_pool_release(victim->pool);
+        victim->pool = NULL;
+
+        METRICS_INC(prompt_evictions);
+    }
+}
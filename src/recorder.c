@@ -0,0 +1,438 @@
+#include "../headers/recorder.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define THIS_FILE "recorder.c"
+
+static pj_status_t recording_put_frame(pjmedia_port *port, pjmedia_frame *frame);
+
+static pj_status_t recording_get_frame(pjmedia_port *port, pjmedia_frame *frame);
+
+static void recording_flush(struct recorder_t *recorder, struct recording_t *recording);
+
+static void recording_finish(struct recording_t *recording);
+
+static void wav_header_write(pj_uint8_t *header, enum recorder_format format, unsigned clock_rate, pj_uint32_t size);
+
+static void le_write(pj_uint8_t *at, pj_uint32_t value, int bytes);
+
+static int writer_thread(void *arg);
+
+/*
+ * Voicemails are written without any I/O on the media clock: frames
+ * are copied into the ring of their call and a writer thread appends
+ * everything buffered with one write per recording and flush interval.
+ */
+pj_status_t recorder_create(pj_pool_factory *factory,
+                            pj_pool_t *pool,
+                            const char *dir,
+                            unsigned max_sec,
+                            unsigned max_bytes,
+                            struct recorder_t **recorder)
+{
+    pj_status_t status;
+
+    PJ_ASSERT_RETURN((RECORDER_RING_SAMPLES & (RECORDER_RING_SAMPLES - 1)) == 0, PJ_EINVAL);
+    PJ_ASSERT_RETURN(pj_ansi_strlen(dir) < PJ_ARRAY_SIZE((*recorder)->dir), PJ_ENAMETOOLONG);
+    PJ_ASSERT_RETURN(max_bytes > RECORDER_WAV_HEADER_LEN, PJ_EINVAL);
+
+    (*recorder) = PJ_POOL_ZALLOC_T(pool, struct recorder_t);
+    if (!(*recorder))
+    {
+        return PJ_ENOMEM;
+    }
+
+    (*recorder)->factory = factory;
+    (*recorder)->pool = pool;
+    (*recorder)->max_sec = max_sec;
+    (*recorder)->max_bytes = max_bytes;
+    pj_ansi_strcpy((*recorder)->dir, dir);
+
+    (*recorder)->kernels = g711_kernels_select();
+    if ((*recorder)->kernels == NULL)
+    {
+        (*recorder)->kernels = g711_kernels_scalar();
+    }
+
+    (*recorder)->encoded = (pj_uint8_t *)pj_pool_alloc(pool, RECORDER_RING_SAMPLES);
+    if (!(*recorder)->encoded)
+    {
+        return PJ_ENOMEM;
+    }
+
+    status = pj_mutex_create_simple(pool, "recorder", &(*recorder)->lock);
+    if (status != PJ_SUCCESS)
+    {
+        return status;
+    }
+
+    return pj_thread_create(pool, "recorder", &writer_thread, *recorder, 0, 0, &(*recorder)->thread);
+}
+
+pj_status_t recorder_open(struct recorder_t *recorder,
+                          const char *username,
+                          pj_uint64_t invite_msec,
+                          unsigned clock_rate,
+                          enum recorder_format format,
+                          struct recording_t **recording)
+{
+    pj_str_t name = pj_str("recording");
+    pj_uint32_t sample_bytes = format == RECORDER_PCM ? sizeof(pj_int16_t) : 1;
+    pj_pool_t *pool;
+
+    /* A ring of the embedded profile is larger than the whole arena of a call */
+    pool = pj_pool_create(recorder->factory, "recording", RECORDER_POOL_SIZE, RECORDER_POOL_INC, NULL);
+    if (!pool)
+    {
+        return PJ_ENOMEM;
+    }
+
+    (*recording) = PJ_POOL_ZALLOC_T(pool, struct recording_t);
+    (*recording)->pool = pool;
+    (*recording)->fd = -1;
+    (*recording)->format = format;
+    (*recording)->slot = (unsigned)-1;
+    (*recording)->samples_max = PJ_MIN(
+        recorder->max_sec * clock_rate, (recorder->max_bytes - RECORDER_WAV_HEADER_LEN) / sample_bytes);
+
+    (*recording)->ring = (pj_int16_t *)pj_pool_alloc(pool, RECORDER_RING_SAMPLES * sizeof(pj_int16_t));
+    if (!(*recording)->ring)
+    {
+        pj_pool_release(pool);
+        return PJ_ENOMEM;
+    }
+
+    pj_mutex_lock(recorder->lock);
+    pj_ansi_snprintf((*recording)->path,
+                     sizeof((*recording)->path),
+                     "%s/voicemail-%s-%llu-%d-%u.wav",
+                     recorder->dir,
+                     username,
+                     (unsigned long long)invite_msec,
+                     (int)getpid(),
+                     recorder->sequence++);
+    pj_mutex_unlock(recorder->lock);
+
+    pjmedia_port_info_init(&(*recording)->base.info,
+                           &name,
+                           RECORDER_SIGNATURE,
+                           clock_rate,
+                           NCHANNELS,
+                           NBITS,
+                           clock_rate * MEDIA_PTIME_STEP / 1000);
+
+    (*recording)->base.port_data.pdata = *recording;
+    (*recording)->base.put_frame = &recording_put_frame;
+    (*recording)->base.get_frame = &recording_get_frame;
+
+    pj_mutex_lock(recorder->lock);
+    (*recording)->next = recorder->recordings;
+    recorder->recordings = *recording;
+    pj_mutex_unlock(recorder->lock);
+
+    return PJ_SUCCESS;
+}
+
+void recording_start(struct recording_t *recording)
+{
+    if (!__atomic_load_n(&recording->started, __ATOMIC_RELAXED))
+    {
+        __atomic_store_n(&recording->started, 1, __ATOMIC_RELEASE);
+    }
+}
+
+/* Never blocks the clock, a frame the ring has no room for is lost */
+void recording_put(struct recording_t *recording, const pj_int16_t *samples, unsigned count)
+{
+    pj_uint32_t head, tail, first, chunk;
+
+    if (!__atomic_load_n(&recording->started, __ATOMIC_ACQUIRE) ||
+        __atomic_load_n(&recording->stopped, __ATOMIC_ACQUIRE))
+    {
+        return;
+    }
+
+    count = PJ_MIN(count, recording->samples_max - recording->samples_taken);
+    if (count == 0)
+    {
+        return;
+    }
+
+    head = recording->head;
+    tail = __atomic_load_n(&recording->tail, __ATOMIC_ACQUIRE);
+
+    if (RECORDER_RING_SAMPLES - (head - tail) < count)
+    {
+        METRICS_INC(record_overruns);
+        return;
+    }
+
+    first = head & (RECORDER_RING_SAMPLES - 1);
+    chunk = PJ_MIN(count, RECORDER_RING_SAMPLES - first);
+
+    if (samples)
+    {
+        pj_memcpy(recording->ring + first, samples, chunk * sizeof(pj_int16_t));
+        pj_memcpy(recording->ring, samples + chunk, (count - chunk) * sizeof(pj_int16_t));
+    }
+    else
+    {
+        pj_bzero(recording->ring + first, chunk * sizeof(pj_int16_t));
+        pj_bzero(recording->ring, (count - chunk) * sizeof(pj_int16_t));
+    }
+
+    recording->samples_taken += count;
+    __atomic_store_n(&recording->head, head + count, __ATOMIC_RELEASE);
+}
+
+void recorder_close(struct recorder_t *recorder, struct recording_t *recording)
+{
+    PJ_UNUSED_ARG(recorder);
+
+    pj_get_timestamp(&recording->stop_time);
+    __atomic_store_n(&recording->stopped, 1, __ATOMIC_RELEASE);
+}
+
+void recorder_free(struct recorder_t *recorder)
+{
+    recorder->quit = PJ_TRUE;
+
+    if (recorder->thread)
+    {
+        pj_thread_join(recorder->thread);
+        pj_thread_destroy(recorder->thread);
+    }
+
+    pj_mutex_destroy(recorder->lock);
+}
+
+static pj_status_t recording_put_frame(pjmedia_port *port, pjmedia_frame *frame)
+{
+    struct recording_t *recording = (struct recording_t *)port->port_data.pdata;
+
+    /* Gaps of the stream are kept as silence so the recording keeps its timing */
+    recording_put(recording,
+                  frame->type == PJMEDIA_FRAME_TYPE_AUDIO ? (const pj_int16_t *)frame->buf : NULL,
+                  frame->type == PJMEDIA_FRAME_TYPE_AUDIO ? (unsigned)(frame->size / sizeof(pj_int16_t))
+                                                          : PJMEDIA_PIA_SPF(&port->info));
+
+    return PJ_SUCCESS;
+}
+
+/* A sink only, never connected as a source */
+static pj_status_t recording_get_frame(pjmedia_port *port, pjmedia_frame *frame)
+{
+    PJ_UNUSED_ARG(port);
+
+    frame->type = PJMEDIA_FRAME_TYPE_NONE;
+    frame->size = 0;
+
+    return PJ_SUCCESS;
+}
+
+/*
+ * Append everything buffered. The clock never touches the samples
+ * between tail and head, so they are written straight from the ring in
+ * at most two chunks, G.711 is encoded here and not on the clock.
+ */
+static void recording_flush(struct recorder_t *recorder, struct recording_t *recording)
+{
+    pj_uint8_t header[RECORDER_WAV_HEADER_LEN];
+    pj_uint32_t head, tail, first, count, chunk, part;
+    const void *data;
+    pj_size_t size;
+
+    head = __atomic_load_n(&recording->head, __ATOMIC_ACQUIRE);
+    tail = recording->tail;
+
+    count = head - tail;
+    if (count == 0)
+    {
+        return;
+    }
+
+    if (recording->fd == -1)
+    {
+        recording->fd = open(recording->path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (recording->fd < 0)
+        {
+            app_perror(THIS_FILE, "Unable to create voicemail file", PJ_RETURN_OS_ERROR(errno));
+            METRICS_INC(record_failures);
+
+            /* Keep the clock going, the samples are lost */
+            recording->fd = -2;
+        }
+        else
+        {
+            /* Sizes are filled in once the recording is finished */
+            wav_header_write(header, recording->format, PJMEDIA_PIA_SRATE(&recording->base.info), 0);
+            if (write(recording->fd, header, sizeof(header)) != (ssize_t)sizeof(header))
+            {
+                METRICS_INC(record_failures);
+            }
+
+            METRICS_INC(recordings);
+            PJ_LOG(4, (THIS_FILE, "Recording voicemail into %s", recording->path));
+        }
+    }
+
+    for (part = 0; part < 2 && count > 0; part++)
+    {
+        first = (head - count) & (RECORDER_RING_SAMPLES - 1);
+        chunk = PJ_MIN(count, RECORDER_RING_SAMPLES - first);
+
+        if (recording->format == RECORDER_PCM)
+        {
+            data = recording->ring + first;
+            size = chunk * sizeof(pj_int16_t);
+        }
+        else
+        {
+            if (recording->format == RECORDER_ALAW)
+            {
+                recorder->kernels->alaw_encode(recording->ring + first, recorder->encoded, chunk);
+            }
+            else
+            {
+                recorder->kernels->ulaw_encode(recording->ring + first, recorder->encoded, chunk);
+            }
+            data = recorder->encoded;
+            size = chunk;
+        }
+
+        if (recording->fd >= 0)
+        {
+            if (write(recording->fd, data, size) == (ssize_t)size)
+            {
+                recording->data_bytes += (pj_uint32_t)size;
+                METRICS_ADD(record_bytes, size);
+                METRICS_INC(record_writes);
+            }
+            else
+            {
+                METRICS_INC(record_failures);
+            }
+        }
+
+        count -= chunk;
+    }
+
+    __atomic_store_n(&recording->tail, head, __ATOMIC_RELEASE);
+}
+
+/* Fill in the sizes left open by the header written first */
+static void recording_finish(struct recording_t *recording)
+{
+    pj_uint8_t header[RECORDER_WAV_HEADER_LEN];
+
+    if (recording->fd < 0)
+    {
+        return;
+    }
+
+    wav_header_write(header, recording->format, PJMEDIA_PIA_SRATE(&recording->base.info), recording->data_bytes);
+    if (pwrite(recording->fd, header, sizeof(header), 0) != (ssize_t)sizeof(header))
+    {
+        METRICS_INC(record_failures);
+    }
+
+    close(recording->fd);
+    recording->fd = -1;
+
+    PJ_LOG(3,
+           (THIS_FILE,
+            "Voicemail %s written, %u bytes of audio",
+            recording->path,
+            (unsigned)recording->data_bytes));
+}
+
+static void wav_header_write(pj_uint8_t *header, enum recorder_format format, unsigned clock_rate, pj_uint32_t size)
+{
+    unsigned sample_bytes = format == RECORDER_PCM ? sizeof(pj_int16_t) : 1;
+
+    pj_memcpy(header, "RIFF", 4);
+    le_write(header + 4, size + RECORDER_WAV_HEADER_LEN - 8, 4);
+    pj_memcpy(header + 8, "WAVEfmt ", 8);
+    le_write(header + 16, 16, 4);
+    le_write(header + 20, format, 2);
+    le_write(header + 22, NCHANNELS, 2);
+    le_write(header + 24, clock_rate, 4);
+    le_write(header + 28, clock_rate * sample_bytes, 4);
+    le_write(header + 32, sample_bytes, 2);
+    le_write(header + 34, sample_bytes * 8, 2);
+    pj_memcpy(header + 36, "data", 4);
+    le_write(header + 40, size, 4);
+}
+
+static void le_write(pj_uint8_t *at, pj_uint32_t value, int bytes)
+{
+    int i;
+
+    for (i = 0; i < bytes; i++)
+    {
+        at[i] = (pj_uint8_t)(value >> (8 * i));
+    }
+}
+
+static int writer_thread(void *arg)
+{
+    struct recorder_t *recorder = (struct recorder_t *)arg;
+    struct recording_t *recording, **link, *finished;
+    pj_timestamp now;
+    pj_bool_t quit;
+
+    do
+    {
+        quit = recorder->quit;
+        if (!quit)
+        {
+            pj_thread_sleep(RECORDER_FLUSH_MSEC);
+        }
+
+        pj_mutex_lock(recorder->lock);
+        recording = recorder->recordings;
+        pj_mutex_unlock(recorder->lock);
+
+        /* Only this thread unlinks recordings, the list past the head is stable */
+        for (; recording; recording = recording->next)
+        {
+            recording_flush(recorder, recording);
+        }
+
+        pj_get_timestamp(&now);
+        finished = NULL;
+
+        pj_mutex_lock(recorder->lock);
+        for (link = &recorder->recordings; *link;)
+        {
+            recording = *link;
+
+            if (quit || (__atomic_load_n(&recording->stopped, __ATOMIC_ACQUIRE) &&
+                         pj_elapsed_msec(&recording->stop_time, &now) >= RECORDER_RETIRE_MSEC))
+            {
+                *link = recording->next;
+                recording->next = finished;
+                finished = recording;
+            }
+            else
+            {
+                link = &recording->next;
+            }
+        }
+        pj_mutex_unlock(recorder->lock);
+
+        while (finished)
+        {
+            recording = finished;
+            finished = recording->next;
+
+            recording_flush(recorder, recording);
+            recording_finish(recording);
+            pj_pool_release(recording->pool);
+        }
+    } while (!quit);
+
+    return 0;
+}
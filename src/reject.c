@@ -0,0 +1,195 @@
+#include "../headers/reject.h"
+
+#define THIS_FILE "reject.c"
+
+/* Status line and the headers after the copied ones, encoded once */
+struct reject_template_t
+{
+    pj_str_t status_line;
+    pj_str_t tail;
+    pj_bool_t limited; /* Counted against the source */
+};
+
+static pj_uint32_t source_key(const pjsip_rx_data *rdata);
+
+static int header_print(char *buf, int size, void *hdr);
+
+static const struct reject_template_t templates[REJECT_REASONS] = {
+    {{"SIP/2.0 403 Forbidden\r\n", 23}, {"Content-Length: 0\r\n\r\n", 21}, PJ_TRUE},
+    {{"SIP/2.0 405 Method Not Allowed\r\n", 32},
+     {"Allow: INVITE, ACK, BYE, CANCEL\r\nContent-Length: 0\r\n\r\n", 54},
+     PJ_TRUE},
+    {{"SIP/2.0 503 Service Unavailable\r\n", 33}, {"Retry-After: 1\r\nContent-Length: 0\r\n\r\n", 37}, PJ_FALSE},
+};
+
+pj_status_t reject_create(pj_pool_t *pool, struct reject_t **reject)
+{
+    (*reject) = PJ_POOL_ZALLOC_T(pool, struct reject_t);
+    if (!(*reject))
+    {
+        return PJ_ENOMEM;
+    }
+
+    return PJ_SUCCESS;
+}
+
+/* Only the source counted in the slot is blocked, and never within a dialog it already has */
+pj_bool_t reject_is_blocked(struct reject_t *reject, const pjsip_rx_data *rdata)
+{
+    pj_uint32_t key;
+    const struct reject_slot_t *slot;
+
+    if (rdata->msg_info.to && rdata->msg_info.to->tag.slen > 0)
+    {
+        return PJ_FALSE;
+    }
+
+    key = source_key(rdata);
+    slot = &reject->slots[key & (REJECT_LIMITER_SLOTS - 1)];
+
+    return slot->key == key && slot->second == (pj_uint32_t)rdata->pkt_info.timestamp.sec &&
+           slot->count > REJECT_LIMIT_PER_SEC;
+}
+
+/*
+ * Answer with the template of the reason, only the Via, From, To,
+ * Call-ID and CSeq of the request are printed into it. Over UDP the
+ * response goes straight to the socket the request came in on, to the
+ * source address as RFC 3581 asks, without a transmit buffer.
+ */
+void reject_send(struct reject_t *reject, pjsip_rx_data *rdata, enum reject_reason reason)
+{
+    const struct reject_template_t *template = &templates[reason];
+    pj_uint32_t key = source_key(rdata);
+    struct reject_slot_t *slot = &reject->slots[key & (REJECT_LIMITER_SLOTS - 1)];
+    pj_uint32_t second = (pj_uint32_t)rdata->pkt_info.timestamp.sec;
+    pjsip_msg *msg = rdata->msg_info.msg;
+    pjsip_hdr *hdr;
+    char buf[REJECT_MSG_SIZE];
+    pj_ssize_t sent;
+    int len, printed;
+
+    if (template->limited)
+    {
+        /* A new source or a new second starts counting over */
+        if (slot->key != key || slot->second != second)
+        {
+            slot->key = key;
+            slot->second = second;
+            slot->count = 0;
+        }
+
+        if (++slot->count > REJECT_LIMIT_PER_SEC)
+        {
+            METRICS_INC(rejects_dropped);
+            return;
+        }
+    }
+
+    pj_memcpy(buf, template->status_line.ptr, template->status_line.slen);
+    len = (int)template->status_line.slen;
+
+    for (hdr = msg->hdr.next; hdr != &msg->hdr; hdr = hdr->next)
+    {
+        if (hdr->type != PJSIP_H_VIA)
+        {
+            continue;
+        }
+
+        printed = header_print(buf + len, sizeof(buf) - len, hdr);
+        if (printed < 0)
+        {
+            return;
+        }
+        len += printed;
+    }
+
+    printed = header_print(buf + len, sizeof(buf) - len, rdata->msg_info.from);
+    if (printed < 0)
+    {
+        return;
+    }
+    len += printed;
+
+    printed = header_print(buf + len, sizeof(buf) - len, rdata->msg_info.to);
+    if (printed < 0)
+    {
+        return;
+    }
+    len += printed;
+
+    /* Final responses carry a To tag, one per second and source is as good as any */
+    if (rdata->msg_info.to->tag.slen == 0)
+    {
+        len -= 2;
+        printed = pj_ansi_snprintf(buf + len, sizeof(buf) - len, ";tag=rj%x%x\r\n", key, second);
+        if (printed < 0 || printed >= (int)sizeof(buf) - len)
+        {
+            return;
+        }
+        len += printed;
+    }
+
+    printed = header_print(buf + len, sizeof(buf) - len, rdata->msg_info.cid);
+    if (printed < 0)
+    {
+        return;
+    }
+    len += printed;
+
+    printed = header_print(buf + len, sizeof(buf) - len, rdata->msg_info.cseq);
+    if (printed < 0 || len + printed + template->tail.slen > (int)sizeof(buf))
+    {
+        return;
+    }
+    len += printed;
+
+    pj_memcpy(buf + len, template->tail.ptr, template->tail.slen);
+    len += (int)template->tail.slen;
+
+    METRICS_INC(rejects_sent);
+
+    if (PJSIP_TRANSPORT_IS_RELIABLE(rdata->tp_info.transport))
+    {
+        pjsip_transport_send_raw(rdata->tp_info.transport,
+                                 buf,
+                                 len,
+                                 &rdata->pkt_info.src_addr,
+                                 rdata->pkt_info.src_addr_len,
+                                 NULL,
+                                 NULL);
+        return;
+    }
+
+    sent = len;
+    pj_sock_sendto(pjsip_udp_transport_get_socket(rdata->tp_info.transport),
+                   buf,
+                   &sent,
+                   0,
+                   &rdata->pkt_info.src_addr,
+                   rdata->pkt_info.src_addr_len);
+}
+
+/* Sources are told apart by address only, scanners rotate their ports */
+static pj_uint32_t source_key(const pjsip_rx_data *rdata)
+{
+    return pj_hash_calc(0,
+                        pj_sockaddr_get_addr(&rdata->pkt_info.src_addr),
+                        pj_sockaddr_get_addr_len(&rdata->pkt_info.src_addr));
+}
+
+/* A header with its line end, -1 when it does not fit */
+static int header_print(char *buf, int size, void *hdr)
+{
+    int len = pjsip_hdr_print_on(hdr, buf, size - 2);
+
+    if (len < 0)
+    {
+        return -1;
+    }
+
+    buf[len++] = '\r';
+    buf[len++] = '\n';
+
+    return len;
+}
@@ -0,0 +1,1114 @@
+#include "../headers/replay.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define THIS_FILE "replay.c"
+
+static pj_status_t capture_load(struct replay_t *replay, const char *path);
+
+static pj_status_t text_parse(struct replay_t *replay, char *text, pj_size_t size);
+
+static int text_msg_build(const char *lines, int len, char *out, int size);
+
+static pj_status_t pcap_parse(struct replay_t *replay, const pj_uint8_t *data, pj_size_t size);
+
+static struct replay_tsx_t *msg_add(struct replay_t *replay, pj_uint32_t at_msec, const char *data, int len);
+
+static void expect_add(struct replay_t *replay, const char *call_id, const char *cseq, int code);
+
+static struct replay_tsx_t *tsx_get(struct replay_t *replay, const char *call_id, const char *cseq);
+
+static int replay_thread(void *arg);
+
+static void msg_send(struct replay_t *replay, struct replay_msg_t *msg);
+
+static int msg_rewrite(struct replay_t *replay, const char *data, char *out, int size);
+
+static int sent_by_rewrite(struct replay_t *replay, const char *line, int line_len, char *out, int size);
+
+static int contact_rewrite(struct replay_t *replay, const char *line, int line_len, char *out, int size);
+
+static void messages_receive(struct replay_t *replay, unsigned msec);
+
+static void message_handle(struct replay_t *replay, char *msg);
+
+static void response_send(struct replay_t *replay, const char *request);
+
+static void usage_take(struct replay_t *replay, struct replay_usage_t *usage);
+
+static int report(struct replay_t *replay, pj_uint32_t elapsed_msec);
+
+static int latency_compare(const void *a, const void *b);
+
+static pj_bool_t replay_header_get(const char *msg, const char *name, const char *compact, char *value, int size);
+
+static pj_bool_t header_is(const char *line, const char *name, const char *compact);
+
+static pj_uint32_t pcap_u32(const pj_uint8_t *data, pj_bool_t swapped);
+
+static pj_uint16_t net_u16(const pj_uint8_t *data);
+
+/*
+ * Replay of a SIP capture: the requests and ACKs the clients sent are
+ * sent again from one socket at the pace of the capture, the final
+ * responses the machine gave are what it has to answer this time.
+ */
+pj_status_t replay_start(pj_pool_factory *factory,
+                         int sip_port,
+                         const char *path,
+                         unsigned scale,
+                         pj_uint32_t settle_sec,
+                         replay_usage_cb usage,
+                         soak_done_cb on_done,
+                         struct replay_t **replay)
+{
+    pj_status_t status;
+    pj_str_t loopback = pj_str("127.0.0.1");
+    pj_sockaddr local;
+    pj_pool_t *pool;
+    int addr_len;
+
+    pool = pj_pool_create(factory, "replay", REPLAY_POOL_SIZE, REPLAY_POOL_INC, NULL);
+    if (!pool)
+    {
+        return PJ_ENOMEM;
+    }
+
+    (*replay) = PJ_POOL_ZALLOC_T(pool, struct replay_t);
+    (*replay)->pool = pool;
+    (*replay)->scale = PJ_MIN(PJ_MAX(scale, 1), REPLAY_MAX_SCALE);
+    (*replay)->settle_sec = settle_sec + REPLAY_SETTLE_MARGIN_SEC;
+    (*replay)->usage = usage;
+    (*replay)->on_done = on_done;
+    (*replay)->tsxs = pj_hash_create(pool, REPLAY_HASH_BUCKETS);
+    (*replay)->expects = pj_hash_create(pool, REPLAY_HASH_BUCKETS);
+    (*replay)->dialogs = pj_hash_create(pool, REPLAY_HASH_BUCKETS);
+
+    status = capture_load(*replay, path);
+    if (status != PJ_SUCCESS)
+    {
+        app_perror(THIS_FILE, "Unable to load the capture", status);
+        pj_pool_release(pool);
+        return status;
+    }
+
+    if ((*replay)->msgs_count == 0)
+    {
+        PJ_LOG(3, (THIS_FILE, "Replay: %s has no requests of a client", path));
+        pj_pool_release(pool);
+        return PJ_ENOTFOUND;
+    }
+
+    (*replay)->latencies_usec = (pj_uint32_t *)pj_pool_calloc(pool,
+                                                              PJ_MAX((*replay)->expects_count, 1),
+                                                              sizeof(pj_uint32_t));
+
+    status = pj_sockaddr_in_init(&(*replay)->server.ipv4, &loopback, (pj_uint16_t)sip_port);
+    if (status == PJ_SUCCESS)
+    {
+        status = pj_sock_socket(pj_AF_INET(), pj_SOCK_DGRAM(), 0, &(*replay)->sock);
+    }
+    if (status != PJ_SUCCESS)
+    {
+        pj_pool_release(pool);
+        return status;
+    }
+
+    pj_sockaddr_in_init(&local.ipv4, &loopback, 0);
+    status = pj_sock_bind((*replay)->sock, &local, sizeof(local.ipv4));
+    if (status != PJ_SUCCESS)
+    {
+        pj_sock_close((*replay)->sock);
+        pj_pool_release(pool);
+        return status;
+    }
+
+    addr_len = sizeof(local);
+    pj_sock_getsockname((*replay)->sock, &local, &addr_len);
+    pj_sockaddr_print(&local, (*replay)->local, sizeof((*replay)->local), 1);
+
+    usage_take(*replay, &(*replay)->baseline);
+
+    PJ_LOG(3,
+           (THIS_FILE,
+            "Replay: %lu messages with %lu responses expected from %s at %ux, from %s to port %d",
+            (*replay)->msgs_count,
+            (*replay)->expects_count,
+            path,
+            (*replay)->scale,
+            (*replay)->local,
+            sip_port));
+
+    return pj_thread_create(pool, "replay", &replay_thread, *replay, 0, 0, &(*replay)->thread);
+}
+
+static pj_status_t capture_load(struct replay_t *replay, const char *path)
+{
+    FILE *file;
+    long size;
+    char *data;
+    pj_uint32_t magic;
+
+    file = fopen(path, "rb");
+    if (!file)
+    {
+        return PJ_RETURN_OS_ERROR(errno);
+    }
+
+    if (fseek(file, 0, SEEK_END) != 0 || (size = ftell(file)) <= 0 || size > REPLAY_MAX_CAPTURE_BYTES)
+    {
+        fclose(file);
+        return PJ_ETOOBIG;
+    }
+    rewind(file);
+
+    data = (char *)pj_pool_alloc(replay->pool, size + 1);
+    if (fread(data, 1, size, file) != (size_t)size)
+    {
+        fclose(file);
+        return PJ_EEOF;
+    }
+    fclose(file);
+    data[size] = '\0';
+
+    if (size >= REPLAY_PCAP_HEADER_LEN)
+    {
+        magic = pcap_u32((const pj_uint8_t *)data, PJ_FALSE);
+        if (magic == REPLAY_PCAP_MAGIC || magic == REPLAY_PCAP_MAGIC_NSEC)
+        {
+            return pcap_parse(replay, (const pj_uint8_t *)data, size);
+        }
+
+        magic = pcap_u32((const pj_uint8_t *)data, PJ_TRUE);
+        if (magic == REPLAY_PCAP_MAGIC || magic == REPLAY_PCAP_MAGIC_NSEC)
+        {
+            return pcap_parse(replay, (const pj_uint8_t *)data, size);
+        }
+    }
+
+    return text_parse(replay, data, size);
+}
+
+/*
+ * Text captures, written by hand for the cases a pcap does not have:
+ *
+ *   send <msec>
+ *   <request or ACK, the Content-Length is filled in>
+ *   .
+ *   expect <code> [method]
+ *
+ * An expectation is of the last request sent, with another method it is
+ * of a request of the same CSeq number, i.e. the 487 to an INVITE after
+ * its CANCEL. Lines starting with # are comments.
+ */
+static pj_status_t text_parse(struct replay_t *replay, char *text, pj_size_t size)
+{
+    char lines[REPLAY_MSG_SIZE];
+    char msg[REPLAY_MSG_SIZE];
+    char method[REPLAY_CSEQ_LEN];
+    char cseq[REPLAY_CSEQ_LEN];
+    struct replay_tsx_t *last = NULL;
+    struct replay_tsx_t *tsx;
+    char *line, *next, *end;
+    pj_bool_t in_msg = PJ_FALSE;
+    pj_uint32_t at_msec = 0;
+    int lines_len = 0;
+    int line_no = 0;
+    int line_len, msg_len, code;
+
+    for (line = text; line < text + size; line = next)
+    {
+        end = strchr(line, '\n');
+        next = end ? end + 1 : text + size;
+        line_len = end ? (int)(end - line) : (int)pj_ansi_strlen(line);
+        if (line_len > 0 && line[line_len - 1] == '\r')
+        {
+            line_len--;
+        }
+        line[line_len] = '\0';
+        line_no++;
+
+        if (in_msg)
+        {
+            if (pj_ansi_strcmp(line, REPLAY_TEXT_END) != 0)
+            {
+                if (lines_len + line_len + 2 >= (int)sizeof(lines))
+                {
+                    PJ_LOG(3, (THIS_FILE, "Replay: message at line %d is too long", line_no));
+                    return PJ_ETOOBIG;
+                }
+
+                pj_memcpy(lines + lines_len, line, line_len);
+                lines_len += line_len;
+                lines[lines_len++] = '\r';
+                lines[lines_len++] = '\n';
+                continue;
+            }
+
+            in_msg = PJ_FALSE;
+            lines[lines_len] = '\0';
+            msg_len = text_msg_build(lines, lines_len, msg, sizeof(msg));
+            if (msg_len <= 0)
+            {
+                PJ_LOG(3, (THIS_FILE, "Replay: message ending at line %d is too long", line_no));
+                return PJ_ETOOBIG;
+            }
+
+            tsx = msg_add(replay, at_msec, msg, msg_len);
+            if (tsx)
+            {
+                last = tsx;
+            }
+            continue;
+        }
+
+        if (line[0] == '\0' || line[0] == '#')
+        {
+            continue;
+        }
+
+        if (pj_ansi_strncmp(line, REPLAY_TEXT_SEND " ", sizeof(REPLAY_TEXT_SEND)) == 0)
+        {
+            at_msec = (pj_uint32_t)strtoul(line + sizeof(REPLAY_TEXT_SEND), NULL, 10);
+            lines_len = 0;
+            in_msg = PJ_TRUE;
+            continue;
+        }
+
+        if (pj_ansi_strncmp(line, REPLAY_TEXT_EXPECT " ", sizeof(REPLAY_TEXT_EXPECT)) == 0)
+        {
+            if (!last)
+            {
+                PJ_LOG(3, (THIS_FILE, "Replay: expectation at line %d without a request before", line_no));
+                return PJ_EINVAL;
+            }
+
+            if (sscanf(line, REPLAY_TEXT_EXPECT " %d %15s", &code, method) == 2)
+            {
+                pj_ansi_snprintf(cseq, sizeof(cseq), "%lu %s", strtoul(last->cseq, NULL, 10), method);
+                expect_add(replay, last->call_id, cseq, code);
+            }
+            else
+            {
+                expect_add(replay, last->call_id, last->cseq, atoi(line + sizeof(REPLAY_TEXT_EXPECT)));
+            }
+            continue;
+        }
+
+        PJ_LOG(3, (THIS_FILE, "Replay: line %d of the capture is not understood", line_no));
+        return PJ_EINVAL;
+    }
+
+    if (in_msg)
+    {
+        PJ_LOG(3, (THIS_FILE, "Replay: the last message of the capture has no end"));
+        return PJ_EINVAL;
+    }
+
+    return PJ_SUCCESS;
+}
+
+/* Message of the lines of a text capture with the Content-Length of its body */
+static int text_msg_build(const char *lines, int len, char *out, int size)
+{
+    const char *body = strstr(lines, "\r\n\r\n");
+    const char *line = lines;
+    const char *headers_end;
+    const char *end;
+    int body_len, line_len;
+    int out_len = 0;
+    int n;
+
+    headers_end = body ? body + 2 : lines + len;
+    body = body ? body + 4 : lines + len;
+    body_len = (int)(lines + len - body);
+
+    while (line < headers_end)
+    {
+        end = strstr(line, "\r\n");
+        line_len = (int)(end - line) + 2;
+
+        if (!header_is(line, "Content-Length", "l"))
+        {
+            if (out_len + line_len >= size)
+            {
+                return -1;
+            }
+
+            pj_memcpy(out + out_len, line, line_len);
+            out_len += line_len;
+        }
+
+        line += line_len;
+    }
+
+    n = pj_ansi_snprintf(out + out_len, size - out_len, "Content-Length: %d\r\n\r\n%.*s", body_len, body_len, body);
+    if (n < 0 || n >= size - out_len)
+    {
+        return -1;
+    }
+
+    return out_len + n;
+}
+
+/*
+ * Classic pcap of SIP over UDP and IPv4. The first request decides
+ * which address and port are the server, packets to it are replayed
+ * and the responses from it are expected.
+ */
+static pj_status_t pcap_parse(struct replay_t *replay, const pj_uint8_t *data, pj_size_t size)
+{
+    char msg[REPLAY_MSG_SIZE];
+    char call_id[REPLAY_CALL_ID_LEN];
+    char cseq[REPLAY_CSEQ_LEN];
+    const pj_uint8_t *packet, *ip, *udp;
+    pj_uint32_t magic, link, len, l2_len, ip_len, src_addr, dst_addr;
+    pj_uint32_t server_addr = 0;
+    pj_uint64_t usec, first_usec = 0;
+    pj_bool_t swapped, nsec, response;
+    pj_bool_t first = PJ_TRUE;
+    pj_size_t pos = REPLAY_PCAP_HEADER_LEN;
+    unsigned long skipped = 0;
+    int server_port = -1;
+    int src_port, dst_port, payload_len, ethertype;
+
+    magic = pcap_u32(data, PJ_FALSE);
+    swapped = magic != REPLAY_PCAP_MAGIC && magic != REPLAY_PCAP_MAGIC_NSEC;
+    nsec = pcap_u32(data, swapped) == REPLAY_PCAP_MAGIC_NSEC;
+    link = pcap_u32(data + 20, swapped);
+
+    if (link != REPLAY_LINK_ETHERNET && link != REPLAY_LINK_RAW && link != REPLAY_LINK_LINUX_SLL)
+    {
+        PJ_LOG(3, (THIS_FILE, "Replay: link type %u of the capture is not supported", link));
+        return PJ_ENOTSUP;
+    }
+
+    while (pos + REPLAY_PCAP_RECORD_LEN <= size)
+    {
+        usec = (pj_uint64_t)pcap_u32(data + pos, swapped) * 1000000;
+        usec += nsec ? pcap_u32(data + pos + 4, swapped) / 1000 : pcap_u32(data + pos + 4, swapped);
+        len = pcap_u32(data + pos + 8, swapped);
+        packet = data + pos + REPLAY_PCAP_RECORD_LEN;
+
+        if (len > size - pos - REPLAY_PCAP_RECORD_LEN)
+        {
+            PJ_LOG(3, (THIS_FILE, "Replay: the capture is truncated"));
+            break;
+        }
+        pos += REPLAY_PCAP_RECORD_LEN + len;
+
+        if (link == REPLAY_LINK_ETHERNET)
+        {
+            l2_len = 14;
+            while (len >= l2_len + 4 && net_u16(packet + l2_len - 2) == 0x8100)
+            {
+                l2_len += 4;
+            }
+            ethertype = len >= l2_len ? net_u16(packet + l2_len - 2) : 0;
+        }
+        else if (link == REPLAY_LINK_LINUX_SLL)
+        {
+            l2_len = 16;
+            ethertype = len >= l2_len ? net_u16(packet + 14) : 0;
+        }
+        else
+        {
+            l2_len = 0;
+            ethertype = 0x0800;
+        }
+
+        /* IPv4 and UDP only, fragments are not put together */
+        ip = packet + l2_len;
+        if (ethertype != 0x0800 || len < l2_len + 20 || (ip[0] >> 4) != 4 || ip[9] != 17 ||
+            (net_u16(ip + 6) & 0x3fff) != 0)
+        {
+            skipped++;
+            continue;
+        }
+
+        ip_len = (ip[0] & 0x0f) * 4;
+        udp = ip + ip_len;
+        if (ip_len < 20 || len < l2_len + ip_len + 8 || net_u16(udp + 4) < 8)
+        {
+            skipped++;
+            continue;
+        }
+
+        payload_len = (int)PJ_MIN((pj_uint32_t)net_u16(udp + 4) - 8, len - l2_len - ip_len - 8);
+        if (payload_len <= 0 || payload_len >= (int)sizeof(msg))
+        {
+            skipped++;
+            continue;
+        }
+
+        pj_memcpy(msg, udp + 8, payload_len);
+        msg[payload_len] = '\0';
+
+        src_addr = ((pj_uint32_t)net_u16(ip + 12) << 16) | net_u16(ip + 14);
+        dst_addr = ((pj_uint32_t)net_u16(ip + 16) << 16) | net_u16(ip + 18);
+        src_port = net_u16(udp);
+        dst_port = net_u16(udp + 2);
+        response = pj_ansi_strncmp(msg, "SIP/2.0 ", 8) == 0;
+
+        if (server_port < 0 && !response && strstr(msg, " SIP/2.0\r\n") != NULL)
+        {
+            server_addr = dst_addr;
+            server_port = dst_port;
+        }
+
+        if (server_port < 0)
+        {
+            skipped++;
+            continue;
+        }
+
+        if (first)
+        {
+            first_usec = usec;
+            first = PJ_FALSE;
+        }
+
+        if (dst_addr == server_addr && dst_port == server_port)
+        {
+            msg_add(replay, usec > first_usec ? (pj_uint32_t)((usec - first_usec) / 1000) : 0, msg, payload_len);
+        }
+        else if (src_addr == server_addr && src_port == server_port && response &&
+                 replay_header_get(msg, "Call-ID", "i", call_id, sizeof(call_id)) &&
+                 replay_header_get(msg, "CSeq", NULL, cseq, sizeof(cseq)))
+        {
+            expect_add(replay, call_id, cseq, atoi(msg + 8));
+        }
+    }
+
+    if (skipped > 0)
+    {
+        PJ_LOG(4, (THIS_FILE, "Replay: %lu packets of the capture are not SIP over UDP and IPv4", skipped));
+    }
+
+    return PJ_SUCCESS;
+}
+
+/* Requests and ACKs are replayed, responses of the client are made by the replay itself */
+static struct replay_tsx_t *msg_add(struct replay_t *replay, pj_uint32_t at_msec, const char *data, int len)
+{
+    char call_id[REPLAY_CALL_ID_LEN];
+    char cseq[REPLAY_CSEQ_LEN];
+    struct replay_msg_t *msg;
+
+    if (len <= 0 || len >= REPLAY_MSG_SIZE || pj_ansi_strncmp(data, "SIP/2.0 ", 8) == 0)
+    {
+        return NULL;
+    }
+
+    msg = PJ_POOL_ZALLOC_T(replay->pool, struct replay_msg_t);
+    msg->at_msec = at_msec;
+    msg->len = len;
+    msg->data = (char *)pj_pool_alloc(replay->pool, len + 1);
+    pj_memcpy(msg->data, data, len);
+    msg->data[len] = '\0';
+
+    if (!replay_header_get(msg->data, "Call-ID", "i", call_id, sizeof(call_id)) ||
+        !replay_header_get(msg->data, "CSeq", NULL, cseq, sizeof(cseq)))
+    {
+        PJ_LOG(4, (THIS_FILE, "Replay: message without Call-ID or CSeq skipped"));
+        return NULL;
+    }
+
+    if (pj_ansi_strncmp(msg->data, "ACK ", 4) != 0)
+    {
+        msg->tsx = tsx_get(replay, call_id, cseq);
+    }
+
+    if (replay->msgs_tail)
+    {
+        replay->msgs_tail->next = msg;
+    }
+    else
+    {
+        replay->msgs = msg;
+    }
+    replay->msgs_tail = msg;
+    replay->msgs_count++;
+
+    return msg->tsx;
+}
+
+/* Provisional responses are not expected, the machine may or may not send a 100 */
+static void expect_add(struct replay_t *replay, const char *call_id, const char *cseq, int code)
+{
+    char key[REPLAY_CALL_ID_LEN + REPLAY_CSEQ_LEN + 8];
+    struct replay_expect_t *expect;
+    char *stored;
+
+    if (code < 101 || code > 699)
+    {
+        return;
+    }
+
+    pj_ansi_snprintf(key, sizeof(key), "%s|%s|%d", call_id, cseq, code);
+    if (pj_hash_get(replay->expects, key, PJ_HASH_KEY_STRING, NULL) != NULL)
+    {
+        return;
+    }
+
+    expect = PJ_POOL_ZALLOC_T(replay->pool, struct replay_expect_t);
+    expect->tsx = tsx_get(replay, call_id, cseq);
+    expect->code = code;
+    expect->next = replay->expects_list;
+    replay->expects_list = expect;
+    replay->expects_count++;
+
+    stored = (char *)pj_pool_alloc(replay->pool, pj_ansi_strlen(key) + 1);
+    pj_ansi_strcpy(stored, key);
+    pj_hash_set(replay->pool, replay->expects, stored, PJ_HASH_KEY_STRING, 0, expect);
+}
+
+static struct replay_tsx_t *tsx_get(struct replay_t *replay, const char *call_id, const char *cseq)
+{
+    char key[REPLAY_CALL_ID_LEN + REPLAY_CSEQ_LEN + 1];
+    struct replay_tsx_t *tsx;
+    char *stored;
+
+    pj_ansi_snprintf(key, sizeof(key), "%s|%s", call_id, cseq);
+    tsx = (struct replay_tsx_t *)pj_hash_get(replay->tsxs, key, PJ_HASH_KEY_STRING, NULL);
+    if (tsx)
+    {
+        return tsx;
+    }
+
+    tsx = PJ_POOL_ZALLOC_T(replay->pool, struct replay_tsx_t);
+    pj_ansi_strncpy(tsx->call_id, call_id, sizeof(tsx->call_id) - 1);
+    pj_ansi_strncpy(tsx->cseq, cseq, sizeof(tsx->cseq) - 1);
+
+    stored = (char *)pj_pool_alloc(replay->pool, pj_ansi_strlen(key) + 1);
+    pj_ansi_strcpy(stored, key);
+    pj_hash_set(replay->pool, replay->tsxs, stored, PJ_HASH_KEY_STRING, 0, tsx);
+
+    return tsx;
+}
+
+static int replay_thread(void *arg)
+{
+    struct replay_t *replay = (struct replay_t *)arg;
+    struct replay_msg_t *msg = replay->msgs;
+    struct replay_usage_t usage;
+    pj_timestamp start, now, last_sent, done;
+    pj_uint32_t elapsed, due;
+    int result;
+
+    pj_get_timestamp(&start);
+    last_sent = start;
+
+    for (;;)
+    {
+        pj_get_timestamp(&now);
+        elapsed = pj_elapsed_msec(&start, &now);
+
+        while (msg && msg->at_msec / replay->scale <= elapsed)
+        {
+            msg_send(replay, msg);
+            msg = msg->next;
+            pj_get_timestamp(&last_sent);
+        }
+
+        if (!msg && (replay->matched == replay->expects_count ||
+                     pj_elapsed_msec(&last_sent, &now) >= REPLAY_RESPONSE_TIMEOUT_MSEC))
+        {
+            break;
+        }
+
+        due = msg ? msg->at_msec / replay->scale - elapsed : REPLAY_POLL_MSEC;
+        messages_receive(replay, PJ_MIN(due, REPLAY_POLL_MSEC));
+    }
+
+    /* Calls the capture leaves up end with the session timer of the machine */
+    for (;;)
+    {
+        pj_get_timestamp(&done);
+        usage_take(replay, &usage);
+        if (usage.calls <= replay->baseline.calls || pj_elapsed_msec(&now, &done) >= replay->settle_sec * 1000)
+        {
+            break;
+        }
+
+        messages_receive(replay, REPLAY_POLL_MSEC);
+    }
+
+    pj_thread_sleep(SOAK_SETTLE_MSEC);
+
+    result = report(replay, elapsed);
+    pj_sock_close(replay->sock);
+
+    if (replay->on_done)
+    {
+        replay->on_done(result);
+    }
+
+    return 0;
+}
+
+static void msg_send(struct replay_t *replay, struct replay_msg_t *msg)
+{
+    char out[REPLAY_MSG_SIZE];
+    pj_ssize_t size;
+    int len;
+
+    len = msg_rewrite(replay, msg->data, out, sizeof(out));
+    if (len <= 0)
+    {
+        PJ_LOG(3, (THIS_FILE, "Replay: message of %d bytes does not fit once rewritten", msg->len));
+        return;
+    }
+
+    size = len;
+    pj_sock_sendto(replay->sock, out, &size, 0, &replay->server, sizeof(replay->server.ipv4));
+    replay->sent++;
+
+    if (msg->tsx && !msg->tsx->sent)
+    {
+        msg->tsx->sent = PJ_TRUE;
+        pj_get_timestamp(&msg->tsx->sent_time);
+    }
+}
+
+/*
+ * The first Via and the Contact point at the replay, so responses and
+ * the requests of the machine come back to it. The To-tag of a request
+ * within a dialog is the one the machine gave the dialog in this run.
+ */
+static int msg_rewrite(struct replay_t *replay, const char *data, char *out, int size)
+{
+    char call_id[REPLAY_CALL_ID_LEN];
+    struct replay_dialog_t *dialog = NULL;
+    const char *line = data;
+    const char *end, *tag, *tag_end;
+    pj_bool_t headers = PJ_TRUE;
+    pj_bool_t via_done = PJ_FALSE;
+    int len = 0;
+    int line_len, n;
+
+    if (replay_header_get(data, "Call-ID", "i", call_id, sizeof(call_id)))
+    {
+        dialog = (struct replay_dialog_t *)pj_hash_get(replay->dialogs, call_id, PJ_HASH_KEY_STRING, NULL);
+    }
+
+    while (*line)
+    {
+        end = strstr(line, "\r\n");
+        line_len = end ? (int)(end - line) + 2 : (int)pj_ansi_strlen(line);
+        if (line_len == 2)
+        {
+            headers = PJ_FALSE;
+        }
+
+        if (headers && !via_done && header_is(line, "Via", "v"))
+        {
+            n = sent_by_rewrite(replay, line, line_len, out + len, size - len);
+            via_done = PJ_TRUE;
+        }
+        else if (headers && header_is(line, "Contact", "m"))
+        {
+            n = contact_rewrite(replay, line, line_len, out + len, size - len);
+        }
+        else if (headers && dialog && header_is(line, "To", "t") && (tag = strstr(line, ";tag=")) != NULL &&
+                 tag < line + line_len)
+        {
+            tag += 5;
+            for (tag_end = tag; tag_end < line + line_len && *tag_end != ';' && *tag_end != '\r'; tag_end++)
+            {
+            }
+
+            n = pj_ansi_snprintf(out + len,
+                                 size - len,
+                                 "%.*s%s%.*s",
+                                 (int)(tag - line),
+                                 line,
+                                 dialog->tag,
+                                 (int)(line + line_len - tag_end),
+                                 tag_end);
+        }
+        else
+        {
+            n = pj_ansi_snprintf(out + len, size - len, "%.*s", line_len, line);
+        }
+
+        if (n < 0 || n >= size - len)
+        {
+            return -1;
+        }
+
+        len += n;
+        line += line_len;
+    }
+
+    return len;
+}
+
+/* Sent-by of the first Via is the replay, with rport so the machine answers the port it sent from */
+static int sent_by_rewrite(struct replay_t *replay, const char *line, int line_len, char *out, int size)
+{
+    const char *sent_by = NULL;
+    const char *rest, *rport;
+    const char *p;
+
+    for (p = line; p + 3 < line + line_len; p++)
+    {
+        if (pj_ansi_strnicmp(p, "UDP", 3) == 0)
+        {
+            sent_by = p + 3;
+            break;
+        }
+    }
+
+    if (!sent_by)
+    {
+        return pj_ansi_snprintf(out, size, "%.*s", line_len, line);
+    }
+
+    while (*sent_by == ' ' || *sent_by == '\t')
+    {
+        sent_by++;
+    }
+
+    for (rest = sent_by; rest < line + line_len && !strchr(";, \t\r", *rest); rest++)
+    {
+    }
+
+    rport = strstr(rest, ";rport");
+
+    return pj_ansi_snprintf(out,
+                            size,
+                            "%.*s%s%s%.*s",
+                            (int)(sent_by - line),
+                            line,
+                            replay->local,
+                            rport && rport < line + line_len ? "" : ";rport",
+                            (int)(line + line_len - rest),
+                            rest);
+}
+
+/* Host and port of the Contact URI are the replay, the machine sends its BYE there */
+static int contact_rewrite(struct replay_t *replay, const char *line, int line_len, char *out, int size)
+{
+    const char *host = NULL;
+    const char *rest;
+    const char *p;
+
+    for (p = line; p < line + line_len && *p != '>' && *p != '\r'; p++)
+    {
+        if (*p == '@' || (!host && pj_ansi_strnicmp(p, "sip:", 4) == 0))
+        {
+            host = *p == '@' ? p + 1 : p + 4;
+        }
+    }
+
+    if (!host)
+    {
+        return pj_ansi_snprintf(out, size, "%.*s", line_len, line);
+    }
+
+    for (rest = host; rest < line + line_len && !strchr(";>, \t\r", *rest); rest++)
+    {
+    }
+
+    return pj_ansi_snprintf(out,
+                            size,
+                            "%.*s%s%.*s",
+                            (int)(host - line),
+                            line,
+                            replay->local,
+                            (int)(line + line_len - rest),
+                            rest);
+}
+
+static void messages_receive(struct replay_t *replay, unsigned msec)
+{
+    char msg[REPLAY_MSG_SIZE];
+    pj_time_val timeout = {0, (long)msec};
+    pj_fd_set_t rset;
+    pj_ssize_t len;
+
+    PJ_FD_ZERO(&rset);
+    PJ_FD_SET(replay->sock, &rset);
+
+    while (pj_sock_select(replay->sock + 1, &rset, NULL, NULL, &timeout) > 0)
+    {
+        len = sizeof(msg) - 1;
+        if (pj_sock_recvfrom(replay->sock, msg, &len, 0, NULL, NULL) == PJ_SUCCESS && len > 0)
+        {
+            msg[len] = '\0';
+            message_handle(replay, msg);
+        }
+
+        timeout.sec = 0;
+        timeout.msec = 0;
+        PJ_FD_ZERO(&rset);
+        PJ_FD_SET(replay->sock, &rset);
+    }
+}
+
+static void message_handle(struct replay_t *replay, char *msg)
+{
+    char key[REPLAY_CALL_ID_LEN + REPLAY_CSEQ_LEN + 8];
+    char call_id[REPLAY_CALL_ID_LEN];
+    char cseq[REPLAY_CSEQ_LEN];
+    char tag[REPLAY_TAG_LEN];
+    struct replay_dialog_t *dialog;
+    struct replay_expect_t *expect;
+    pj_timestamp now;
+    int code;
+
+    if (!soak_header_get(msg, "Call-ID", call_id, sizeof(call_id)) || !soak_header_get(msg, "CSeq", cseq, sizeof(cseq)))
+    {
+        return;
+    }
+
+    if (pj_ansi_strncmp(msg, "SIP/2.0 ", 8) != 0)
+    {
+        if (pj_ansi_strncmp(msg, "ACK ", 4) != 0)
+        {
+            response_send(replay, msg);
+        }
+        return;
+    }
+
+    code = atoi(msg + 8);
+
+    soak_to_tag_get(msg, tag, sizeof(tag));
+    if (tag[0] && pj_hash_get(replay->dialogs, call_id, PJ_HASH_KEY_STRING, NULL) == NULL)
+    {
+        dialog = PJ_POOL_ZALLOC_T(replay->pool, struct replay_dialog_t);
+        pj_ansi_strcpy(dialog->call_id, call_id);
+        pj_ansi_strcpy(dialog->tag, tag);
+        pj_hash_set(replay->pool, replay->dialogs, dialog->call_id, PJ_HASH_KEY_STRING, 0, dialog);
+    }
+
+    pj_ansi_snprintf(key, sizeof(key), "%s|%s|%d", call_id, cseq, code);
+    expect = (struct replay_expect_t *)pj_hash_get(replay->expects, key, PJ_HASH_KEY_STRING, NULL);
+    if (expect)
+    {
+        if (!expect->matched)
+        {
+            expect->matched = PJ_TRUE;
+            pj_get_timestamp(&now);
+            replay->latencies_usec[replay->matched++] =
+                expect->tsx->sent ? pj_elapsed_usec(&expect->tsx->sent_time, &now) : 0;
+        }
+    }
+    else if (code >= 200)
+    {
+        replay->unexpected++;
+        PJ_LOG(3, (THIS_FILE, "Replay: unexpected %d to %s of %s", code, cseq, call_id));
+    }
+}
+
+/* Answer a request of the machine, i.e. its BYE, with 200 */
+static void response_send(struct replay_t *replay, const char *request)
+{
+    char msg[REPLAY_MSG_SIZE];
+    char via[256], from[256], to[256], call_id[REPLAY_CALL_ID_LEN], cseq[REPLAY_CSEQ_LEN];
+    pj_ssize_t size;
+    int len;
+
+    if (!soak_header_get(request, "Via", via, sizeof(via)) || !soak_header_get(request, "From", from, sizeof(from)) ||
+        !soak_header_get(request, "To", to, sizeof(to)) ||
+        !soak_header_get(request, "Call-ID", call_id, sizeof(call_id)) ||
+        !soak_header_get(request, "CSeq", cseq, sizeof(cseq)))
+    {
+        return;
+    }
+
+    len = pj_ansi_snprintf(msg,
+                           sizeof(msg),
+                           "SIP/2.0 200 OK\r\n"
+                           "Via: %s\r\n"
+                           "From: %s\r\n"
+                           "To: %s\r\n"
+                           "Call-ID: %s\r\n"
+                           "CSeq: %s\r\n"
+                           "Content-Length: 0\r\n"
+                           "\r\n",
+                           via,
+                           from,
+                           to,
+                           call_id,
+                           cseq);
+    if (len <= 0 || len >= (int)sizeof(msg))
+    {
+        return;
+    }
+
+    size = len;
+    pj_sock_sendto(replay->sock, msg, &size, 0, &replay->server, sizeof(replay->server.ipv4));
+}
+
+static void usage_take(struct replay_t *replay, struct replay_usage_t *usage)
+{
+    const struct metrics_t *metrics = metrics_get();
+
+    pj_bzero(usage, sizeof(*usage));
+    if (replay->usage)
+    {
+        replay->usage(usage);
+    }
+
+    mem_stats_update();
+    usage->cp_used_count = metrics->cp_used_count;
+    usage->cp_used_size = metrics->cp_used_size;
+    usage->rss_kb = metrics->rss_kb;
+}
+
+/* 0 if every expected response came and the calls gave back what they took, 1 otherwise */
+static int report(struct replay_t *replay, pj_uint32_t elapsed_msec)
+{
+    const struct replay_usage_t *baseline = &replay->baseline;
+    struct replay_usage_t usage;
+    struct replay_expect_t *expect;
+    unsigned long missing = 0;
+    pj_bool_t leaked;
+    int result;
+
+    for (expect = replay->expects_list; expect; expect = expect->next)
+    {
+        if (!expect->matched)
+        {
+            missing++;
+            PJ_LOG(3, (THIS_FILE, "Replay: no %d to %s of %s", expect->code, expect->tsx->cseq, expect->tsx->call_id));
+        }
+    }
+
+    usage_take(replay, &usage);
+    leaked = usage.calls > baseline->calls || usage.media_sockets > baseline->media_sockets;
+    result = missing > 0 || replay->unexpected > 0 || leaked ? 1 : 0;
+
+    PJ_LOG(3,
+           (THIS_FILE,
+            "Replay %s: %lu messages sent in %u ms at %ux, %lu of %lu responses as expected, %lu missing, "
+            "%lu unexpected",
+            result == 0 ? "passed" : "FAILED",
+            replay->sent,
+            elapsed_msec,
+            replay->scale,
+            replay->matched,
+            replay->expects_count,
+            missing,
+            replay->unexpected));
+
+    if (replay->matched > 0)
+    {
+        qsort(replay->latencies_usec, replay->matched, sizeof(pj_uint32_t), &latency_compare);
+        PJ_LOG(3,
+               (THIS_FILE,
+                "Replay latency: p50 %u us, p99 %u us, max %u us",
+                replay->latencies_usec[replay->matched / 2],
+                replay->latencies_usec[(replay->matched - 1) * 99 / 100],
+                replay->latencies_usec[replay->matched - 1]));
+    }
+
+    PJ_LOG(3,
+           (THIS_FILE,
+            "Replay resources: calls %+d, media sockets %+d, pools %+ld, pool bytes %+ld, RSS %+ld kB",
+            usage.calls - baseline->calls,
+            usage.media_sockets - baseline->media_sockets,
+            (long)(usage.cp_used_count - baseline->cp_used_count),
+            (long)(usage.cp_used_size - baseline->cp_used_size),
+            (long)(usage.rss_kb - baseline->rss_kb)));
+
+    if (leaked)
+    {
+        PJ_LOG(2, (THIS_FILE, "Replay: calls or media sockets of the capture were not released"));
+    }
+
+    return result;
+}
+
+static int latency_compare(const void *a, const void *b)
+{
+    pj_uint32_t x = *(const pj_uint32_t *)a;
+    pj_uint32_t y = *(const pj_uint32_t *)b;
+
+    return x < y ? -1 : x > y ? 1 : 0;
+}
+
+/* Captures of other user agents may use the compact form of a header */
+static pj_bool_t replay_header_get(const char *msg, const char *name, const char *compact, char *value, int size)
+{
+    const char *line = msg;
+    const char *end;
+    int len;
+
+    if (soak_header_get(msg, name, value, size))
+    {
+        return PJ_TRUE;
+    }
+
+    while ((line = strstr(line, "\r\n")) != NULL)
+    {
+        line += 2;
+        if (line[0] == '\r')
+        {
+            break;
+        }
+
+        if (header_is(line, name, compact))
+        {
+            line = strchr(line, ':') + 1;
+            while (*line == ' ' || *line == '\t')
+            {
+                line++;
+            }
+
+            end = strstr(line, "\r\n");
+            len = end ? (int)(end - line) : (int)pj_ansi_strlen(line);
+            if (len >= size)
+            {
+                return PJ_FALSE;
+            }
+
+            pj_memcpy(value, line, len);
+            value[len] = '\0';
+            return PJ_TRUE;
+        }
+    }
+
+    return PJ_FALSE;
+}
+
+static pj_bool_t header_is(const char *line, const char *name, const char *compact)
+{
+    int len = (int)pj_ansi_strlen(name);
+
+    if (pj_ansi_strnicmp(line, name, len) != 0)
+    {
+        len = compact ? (int)pj_ansi_strlen(compact) : 0;
+        if (len == 0 || pj_ansi_strnicmp(line, compact, len) != 0)
+        {
+            return PJ_FALSE;
+        }
+    }
+
+    while (line[len] == ' ' || line[len] == '\t')
+    {
+        len++;
+    }
+
+    return line[len] == ':';
+}
+
+static pj_uint32_t pcap_u32(const pj_uint8_t *data, pj_bool_t swapped)
+{
+    if (swapped)
+    {
+        return ((pj_uint32_t)data[0] << 24) | ((pj_uint32_t)data[1] << 16) | ((pj_uint32_t)data[2] << 8) | data[3];
+    }
+
+    return ((pj_uint32_t)data[3] << 24) | ((pj_uint32_t)data[2] << 16) | ((pj_uint32_t)data[1] << 8) | data[0];
+}
+
+static pj_uint16_t net_u16(const pj_uint8_t *data)
+{
+    return (pj_uint16_t)((data[0] << 8) | data[1]);
+}
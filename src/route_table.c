@@ -0,0 +1,80 @@
+#include "../headers/route_table.h"
+
+#define THIS_FILE "route_table.c"
+
+pj_status_t route_table_create(pj_pool_factory *factory,
+                               unsigned buckets,
+                               unsigned generation,
+                               struct route_table_t **table)
+{
+    pj_status_t status;
+    pj_pool_t *pool;
+
+    pool = pj_pool_create(factory, "routes", ROUTE_TABLE_POOL_SIZE, ROUTE_TABLE_POOL_INC, NULL);
+    if (!pool)
+    {
+        return PJ_ENOMEM;
+    }
+
+    (*table) = PJ_POOL_ZALLOC_T(pool, struct route_table_t);
+    (*table)->pool = pool;
+    (*table)->generation = generation;
+    (*table)->hash = pj_hash_create(pool, buckets);
+
+    /* The first reference is the one of the machine */
+    status = pj_atomic_create(pool, 1, &(*table)->ref_cnt);
+    if (status != PJ_SUCCESS || (*table)->hash == NULL)
+    {
+        pj_pool_release(pool);
+        return status != PJ_SUCCESS ? status : PJ_ENOMEM;
+    }
+
+    return PJ_SUCCESS;
+}
+
+struct route_t *route_table_find(const struct route_table_t *table, const char *username, int len)
+{
+    return (struct route_t *)pj_hash_get(table->hash, username, (unsigned)len, NULL);
+}
+
+struct route_t *route_table_add(struct route_table_t *table, const char *username)
+{
+    struct route_t *route;
+    char *key;
+
+    route = route_table_find(table, username, (int)pj_ansi_strlen(username));
+    if (route)
+    {
+        pj_bzero(route, sizeof(*route));
+        return route;
+    }
+
+    key = (char *)pj_pool_alloc(table->pool, pj_ansi_strlen(username) + 1);
+    pj_ansi_strcpy(key, username);
+
+    route = PJ_POOL_ZALLOC_T(table->pool, struct route_t);
+    pj_hash_set(table->pool, table->hash, key, PJ_HASH_KEY_STRING, 0, route);
+
+    return route;
+}
+
+void route_table_add_ref(struct route_table_t *table)
+{
+    pj_atomic_inc(table->ref_cnt);
+}
+
+void route_table_release(struct route_table_t *table)
+{
+    if (table == NULL)
+    {
+        return;
+    }
+
+    if (pj_atomic_dec_and_get(table->ref_cnt) == 0)
+    {
+        PJ_LOG(4, (THIS_FILE, "Routes of generation %u released", table->generation));
+
+        pj_atomic_destroy(table->ref_cnt);
+        pj_pool_release(table->pool);
+    }
+}
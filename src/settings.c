@@ -0,0 +1,353 @@
+#include "../headers/settings.h"
+#include "../headers/affinity.h"
+#include "../headers/announcement.h"
+#include "../headers/supervisor.h"
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define THIS_FILE "settings.c"
+
+enum settings_type
+{
+    SETTINGS_NUMBER,
+    SETTINGS_CPUS /* CPU list of SETTINGS_CPUS_LEN, checked by affinity_parse */
+};
+
+/* Name of a setting with its default and the bounds of its value */
+struct settings_field_t
+{
+    const char *name;
+    pj_size_t offset;
+    enum settings_type type;
+    unsigned def; /* Default from config.h */
+    unsigned min;
+    unsigned max;
+    const char *def_cpus;
+};
+
+#define SETTINGS_FIELD(name, def, min, max) \
+    {#name, offsetof(struct settings_t, name), SETTINGS_NUMBER, def, min, max, NULL}
+#define SETTINGS_CPUS_FIELD(name, def) {#name, offsetof(struct settings_t, name), SETTINGS_CPUS, 0, 0, 0, def}
+
+static char *settings_trim(char *text);
+
+static struct settings_t settings = {
+    .sip_port = SIP_PORT,
+    .rtp_port = RTP_PORT,
+    .workers = SUPERVISOR_WORKERS,
+    .sip_shards = SIP_SHARDS,
+    .max_calls = MAX_CALLS,
+    .max_media = MAX_MEDIA_CNT,
+    .route_buckets = ROUTE_BUCKETS,
+    .clock_rate = CLOCK_RATE,
+    .nsamples = 0,
+    .bridge_ports = 0,
+    .ringing_time = RINGING_TIME,
+    .media_session_time = MEDIA_SESSION_TIME,
+    .machine_pool_size = MACHINE_POOL_SIZE,
+    .media_pool_size = MEDIA_POOL_SIZE,
+    .prompt_cache_size = PROMPT_CACHE_SIZE,
+    .record_max_sec = RECORD_MAX_SEC,
+    .record_max_bytes = RECORD_MAX_BYTES,
+    .srtp = SRTP_MODE,
+    .broadcast = BROADCAST,
+    .media_clock_cpus = MEDIA_CLOCK_CPUS,
+    .media_clock_priority = MEDIA_CLOCK_PRIORITY,
+    .sip_thread_cpus = SIP_THREAD_CPUS,
+    .sip_thread_priority = SIP_THREAD_PRIORITY,
+};
+
+static const struct settings_field_t fields[] = {
+    SETTINGS_FIELD(sip_port, SIP_PORT, 1, 65535),
+    SETTINGS_FIELD(rtp_port, RTP_PORT, 1024, 65534),
+    SETTINGS_FIELD(workers, SUPERVISOR_WORKERS, 0, SUPERVISOR_MAX_WORKERS),
+    SETTINGS_FIELD(sip_shards, SIP_SHARDS, 1, MAX_SIP_SHARDS),
+    SETTINGS_FIELD(max_calls, MAX_CALLS, 1, SETTINGS_MAX_CALLS),
+    SETTINGS_FIELD(max_media, MAX_MEDIA_CNT, 1, SETTINGS_MAX_CALLS),
+    SETTINGS_FIELD(route_buckets, ROUTE_BUCKETS, 1, SETTINGS_MAX_ROUTE_BUCKETS),
+    SETTINGS_FIELD(clock_rate, CLOCK_RATE, 8000, 48000),
+    SETTINGS_FIELD(ringing_time, RINGING_TIME, 0, 3600),
+    SETTINGS_FIELD(media_session_time, MEDIA_SESSION_TIME, 1, 86400),
+    SETTINGS_FIELD(machine_pool_size, MACHINE_POOL_SIZE, 512, SETTINGS_MAX_POOL_SIZE),
+    SETTINGS_FIELD(media_pool_size, MEDIA_POOL_SIZE, 256, SETTINGS_MAX_POOL_SIZE),
+    SETTINGS_FIELD(prompt_cache_size, PROMPT_CACHE_SIZE, 64 * 1024, SETTINGS_MAX_CACHE_SIZE),
+    SETTINGS_FIELD(record_max_sec, RECORD_MAX_SEC, 1, 3600),
+    SETTINGS_FIELD(record_max_bytes, RECORD_MAX_BYTES, 4096, SETTINGS_MAX_CACHE_SIZE),
+    SETTINGS_FIELD(srtp, SRTP_MODE, 0, 2),
+    SETTINGS_FIELD(broadcast, BROADCAST, 0, 1),
+    SETTINGS_CPUS_FIELD(media_clock_cpus, MEDIA_CLOCK_CPUS),
+    SETTINGS_FIELD(media_clock_priority, MEDIA_CLOCK_PRIORITY, 0, SETTINGS_MAX_PRIORITY),
+    SETTINGS_CPUS_FIELD(sip_thread_cpus, SIP_THREAD_CPUS),
+    SETTINGS_FIELD(sip_thread_priority, SIP_THREAD_PRIORITY, 0, SETTINGS_MAX_PRIORITY),
+};
+
+struct settings_t *settings_get(void)
+{
+    return &settings;
+}
+
+pj_status_t settings_check_defaults(void)
+{
+    const char *cpus;
+    unsigned value;
+    unsigned i;
+
+    for (i = 0; i < PJ_ARRAY_SIZE(fields); i++)
+    {
+        if (fields[i].type == SETTINGS_CPUS)
+        {
+            cpus = (const char *)&settings + fields[i].offset;
+            if (pj_ansi_strcmp(cpus, fields[i].def_cpus) != 0 || affinity_parse(cpus) != PJ_SUCCESS)
+            {
+                PJ_LOG(1, (THIS_FILE, "Built-in default \"%s\" of %s does not match config.h", cpus, fields[i].name));
+                return PJ_EBUG;
+            }
+            continue;
+        }
+
+        value = *(unsigned *)((char *)&settings + fields[i].offset);
+        if (value != fields[i].def || value < fields[i].min || value > fields[i].max)
+        {
+            PJ_LOG(1, (THIS_FILE, "Built-in default %u of %s does not match config.h", value, fields[i].name));
+            return PJ_EBUG;
+        }
+    }
+
+    /* Derived settings are only set by settings_validate */
+    if (settings.nsamples != 0 || settings.bridge_ports != 0)
+    {
+        PJ_LOG(1, (THIS_FILE, "Derived settings are set before validation"));
+        return PJ_EBUG;
+    }
+
+    return PJ_SUCCESS;
+}
+
+pj_status_t settings_set(const char *key, const char *value)
+{
+    unsigned long number;
+    char *end;
+    unsigned i;
+
+    for (i = 0; i < PJ_ARRAY_SIZE(fields); i++)
+    {
+        if (pj_ansi_strcmp(fields[i].name, key) == 0)
+        {
+            break;
+        }
+    }
+
+    if (i == PJ_ARRAY_SIZE(fields))
+    {
+        PJ_LOG(1, (THIS_FILE, "Unknown setting %s", key));
+        return PJ_ENOTFOUND;
+    }
+
+    if (fields[i].type == SETTINGS_CPUS)
+    {
+        if (pj_ansi_strlen(value) >= SETTINGS_CPUS_LEN || affinity_parse(value) != PJ_SUCCESS)
+        {
+            PJ_LOG(1, (THIS_FILE, "Setting %s must be a CPU list like 2 or 0-1,4, or empty", key));
+            return PJ_EINVAL;
+        }
+
+        pj_ansi_strcpy((char *)&settings + fields[i].offset, value);
+        return PJ_SUCCESS;
+    }
+
+    number = strtoul(value, &end, 10);
+    if (*value == '\0' || *end != '\0' || number < fields[i].min || number > fields[i].max)
+    {
+        PJ_LOG(1, (THIS_FILE, "Setting %s must be a number from %u to %u", key, fields[i].min, fields[i].max));
+        return PJ_EINVAL;
+    }
+
+    *(unsigned *)((char *)&settings + fields[i].offset) = (unsigned)number;
+
+    return PJ_SUCCESS;
+}
+
+pj_status_t settings_set_pair(const char *pair)
+{
+    char copy[SETTINGS_LINE_LEN];
+    char *value;
+
+    PJ_ASSERT_RETURN(pj_ansi_strlen(pair) < sizeof(copy), PJ_ENAMETOOLONG);
+
+    pj_ansi_strcpy(copy, pair);
+
+    value = strchr(copy, '=');
+    if (value == NULL)
+    {
+        PJ_LOG(1, (THIS_FILE, "Setting %s has no value", pair));
+        return PJ_EINVAL;
+    }
+    *value++ = '\0';
+
+    return settings_set(settings_trim(copy), settings_trim(value));
+}
+
+pj_status_t settings_load(const char *path)
+{
+    char line[SETTINGS_LINE_LEN];
+    char *text;
+    pj_status_t status = PJ_SUCCESS;
+    FILE *file;
+    int number = 0;
+
+    file = fopen(path, "r");
+    if (file == NULL)
+    {
+        status = PJ_RETURN_OS_ERROR(errno);
+        app_perror(THIS_FILE, "Unable to open config file", status);
+        return status;
+    }
+
+    while (fgets(line, sizeof(line), file) != NULL)
+    {
+        number++;
+
+        text = settings_trim(line);
+        if (*text == '\0' || *text == '#')
+        {
+            continue;
+        }
+
+        status = settings_set_pair(text);
+        if (status != PJ_SUCCESS)
+        {
+            PJ_LOG(1, (THIS_FILE, "Invalid line %d of %s", number, path));
+            break;
+        }
+    }
+
+    fclose(file);
+
+    return status;
+}
+
+pj_status_t settings_validate(void)
+{
+    /* Workers take consecutive RTP ranges, a standalone process takes the first one */
+    unsigned long last_rtp_port =
+        settings.rtp_port + (unsigned long)PJ_MAX(settings.workers, 1) * settings.max_media * 2 - 1;
+
+    if (settings.rtp_port % 2 != 0)
+    {
+        PJ_LOG(1, (THIS_FILE, "RTP port %u is odd, RTCP takes the odd port after it", settings.rtp_port));
+        return PJ_EINVAL;
+    }
+
+    if (last_rtp_port > 65535)
+    {
+        PJ_LOG(1,
+               (THIS_FILE,
+                "RTP ports from %u do not fit %u media sockets of %u workers",
+                settings.rtp_port,
+                settings.max_media,
+                PJ_MAX(settings.workers, 1)));
+        return PJ_EINVAL;
+    }
+
+    /* A media socket is only ever taken by a call of the call table */
+    if (settings.max_media > settings.max_calls)
+    {
+        PJ_LOG(1,
+               (THIS_FILE,
+                "%u media sockets are more than the %u calls that can use them",
+                settings.max_media,
+                settings.max_calls));
+        return PJ_EINVAL;
+    }
+
+    /* Frames of every allowed ptime are whole bridge ticks of whole samples */
+    if (settings.clock_rate * MEDIA_PTIME_STEP % 1000 != 0)
+    {
+        PJ_LOG(1, (THIS_FILE, "Clock rate %u has no whole samples per tick", settings.clock_rate));
+        return PJ_EINVAL;
+    }
+
+    settings.nsamples = settings.clock_rate * MEDIA_PTIME_STEP / 1000;
+    settings.bridge_ports = BRIDGE_PORTS_PER_CALL * settings.max_calls + 2 * MAX_ANNOUNCEMENTS;
+
+    return PJ_SUCCESS;
+}
+
+/* Everything sized at startup, so a box can be checked against its hardware */
+void settings_report(void)
+{
+    unsigned first_rtp_port = settings.rtp_port;
+    unsigned workers = PJ_MAX(settings.workers, 1);
+
+    PJ_LOG(3,
+           (THIS_FILE,
+            "Capacity: %u calls, %u media sockets, %u route buckets, %u bridge ports, %u workers, %u SIP shards",
+            settings.max_calls,
+            settings.max_media,
+            settings.route_buckets,
+            settings.bridge_ports,
+            settings.workers,
+            settings.sip_shards));
+    PJ_LOG(3,
+           (THIS_FILE,
+            "Capacity: SIP port %u, RTP ports %u-%u, clock %u Hz with %u samples per tick",
+            settings.sip_port,
+            first_rtp_port,
+            first_rtp_port + workers * settings.max_media * 2 - 1,
+            settings.clock_rate,
+            settings.nsamples));
+    PJ_LOG(3,
+           (THIS_FILE,
+            "Capacity: ringing %u s, media session %u s, machine pool %u bytes, media pool %u bytes",
+            settings.ringing_time,
+            settings.media_session_time,
+            settings.machine_pool_size,
+            settings.media_pool_size));
+    PJ_LOG(3,
+           (THIS_FILE,
+            "Capacity: prompt cache %u bytes, voicemails up to %u s and %u bytes, SRTP %s, broadcast %s",
+            settings.prompt_cache_size,
+            settings.record_max_sec,
+            settings.record_max_bytes,
+            settings.srtp == 2 ? "mandatory" : settings.srtp == 1 ? "optional" : "off",
+            settings.broadcast ? "on" : "off"));
+    PJ_LOG(3,
+           (THIS_FILE,
+            "Threads: media clock on CPUs %s at priority %u, SIP on CPUs %s at priority %u",
+            settings.media_clock_cpus[0] ? settings.media_clock_cpus : "any",
+            settings.media_clock_priority,
+            settings.sip_thread_cpus[0] ? settings.sip_thread_cpus : "any",
+            settings.sip_thread_priority));
+
+    if (settings.max_media < settings.max_calls)
+    {
+        PJ_LOG(2,
+               (THIS_FILE,
+                "Only %u of %u calls can have media, the others are rejected",
+                settings.max_media,
+                settings.max_calls));
+    }
+}
+
+/* Strip the spaces and the line end around a value in place */
+static char *settings_trim(char *text)
+{
+    char *end;
+
+    while (pj_isspace(*text))
+    {
+        text++;
+    }
+
+    end = text + pj_ansi_strlen(text);
+    while (end > text && pj_isspace(end[-1]))
+    {
+        *--end = '\0';
+    }
+
+    return text;
+}
@@ -0,0 +1,253 @@
+#include "../headers/shared_store.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define THIS_FILE "shared_store.c"
+
+static pj_uint64_t store_align(pj_uint64_t offset);
+
+/*
+ * Decode all announcements and write them with the routing table
+ * into a new store file. The file is written next to the target
+ * and renamed over it, so workers never map a half written store.
+ */
+pj_status_t shared_store_build(pj_pool_factory *factory,
+                               const char *path,
+                               unsigned generation,
+                               const struct announcement_spec_t *specs,
+                               int specs_count,
+                               const struct route_spec_t *routes,
+                               int routes_count)
+{
+    pj_status_t status = PJ_SUCCESS;
+    pj_pool_t *pool;
+    struct shared_store_header_t *header;
+    pj_int16_t *samples[MAX_ANNOUNCEMENTS];
+    pj_size_t samples_count;
+    unsigned clock_rate;
+    pj_uint64_t offset;
+    char tmp_path[ANNOUNCEMENT_PATH_LEN + 8];
+    FILE *file;
+    int i;
+
+    PJ_ASSERT_RETURN(specs_count <= MAX_ANNOUNCEMENTS && routes_count <= MAX_ROUTES, PJ_ETOOMANY);
+
+    pool = pj_pool_create(factory, "shared_store_build", SHARED_STORE_POOL_SIZE, SHARED_STORE_POOL_INC, NULL);
+    if (!pool)
+    {
+        return PJ_ENOMEM;
+    }
+
+    header = PJ_POOL_ZALLOC_T(pool, struct shared_store_header_t);
+    header->magic = SHARED_STORE_MAGIC;
+    header->generation = generation;
+    offset = store_align(sizeof(*header));
+
+    for (i = 0; i < specs_count; i++)
+    {
+        status = announcement_decode(
+            pool, specs[i].create, specs[i].path, specs[i].length_msec, &samples[i], &samples_count, &clock_rate);
+        if (status != PJ_SUCCESS)
+        {
+            PJ_LOG(3, (THIS_FILE, "Unable to decode announcement %s", specs[i].name));
+            pj_pool_release(pool);
+            return status;
+        }
+
+        pj_ansi_strncpy(header->entries[i].name, specs[i].name, sizeof(header->entries[i].name) - 1);
+        header->entries[i].clock_rate = clock_rate;
+        header->entries[i].samples_count = (pj_uint32_t)samples_count;
+        header->entries[i].offset = offset;
+
+        offset = store_align(offset + samples_count * sizeof(pj_int16_t));
+    }
+    header->entries_count = specs_count;
+
+    for (i = 0; i < routes_count; i++)
+    {
+        pj_ansi_strncpy(header->routes[i].username, routes[i].username, sizeof(header->routes[i].username) - 1);
+        pj_ansi_strncpy(
+            header->routes[i].announcement, routes[i].announcement, sizeof(header->routes[i].announcement) - 1);
+        header->routes[i].ptime = routes[i].ptime;
+        if (routes[i].menu)
+        {
+            pj_ansi_strncpy(header->routes[i].menu, routes[i].menu, sizeof(header->routes[i].menu) - 1);
+        }
+    }
+    header->routes_count = routes_count;
+
+    pj_ansi_snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+
+    file = fopen(tmp_path, "wb");
+    if (file == NULL)
+    {
+        pj_pool_release(pool);
+        return PJ_RETURN_OS_ERROR(errno);
+    }
+
+    if (fwrite(header, sizeof(*header), 1, file) != 1)
+    {
+        status = PJ_RETURN_OS_ERROR(errno);
+    }
+
+    for (i = 0; i < specs_count && status == PJ_SUCCESS; i++)
+    {
+        if (fseek(file, (long)header->entries[i].offset, SEEK_SET) != 0 ||
+            fwrite(samples[i], sizeof(pj_int16_t), header->entries[i].samples_count, file) !=
+                header->entries[i].samples_count)
+        {
+            status = PJ_RETURN_OS_ERROR(errno);
+        }
+    }
+
+    if (fclose(file) != 0 && status == PJ_SUCCESS)
+    {
+        status = PJ_RETURN_OS_ERROR(errno);
+    }
+
+    if (status == PJ_SUCCESS && rename(tmp_path, path) != 0)
+    {
+        status = PJ_RETURN_OS_ERROR(errno);
+    }
+
+    if (status != PJ_SUCCESS)
+    {
+        unlink(tmp_path);
+    }
+    else
+    {
+        PJ_LOG(3,
+               (THIS_FILE,
+                "Shared store %s generation %u: %d announcements, %d routes, %lu bytes",
+                path,
+                generation,
+                specs_count,
+                routes_count,
+                (unsigned long)offset));
+    }
+
+    pj_pool_release(pool);
+
+    return status;
+}
+
+/* Map the store read-only, the caller owns the first reference */
+pj_status_t shared_store_map(pj_pool_factory *factory, const char *path, struct shared_store_t **store)
+{
+    pj_status_t status;
+    pj_pool_t *pool;
+    struct stat st;
+    void *base;
+    const struct shared_store_header_t *header;
+    unsigned i;
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        return PJ_RETURN_OS_ERROR(errno);
+    }
+
+    if (fstat(fd, &st) != 0)
+    {
+        status = PJ_RETURN_OS_ERROR(errno);
+        close(fd);
+        return status;
+    }
+
+    if ((pj_size_t)st.st_size < sizeof(*header))
+    {
+        close(fd);
+        return PJ_ETOOSMALL;
+    }
+
+    base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED)
+    {
+        return PJ_RETURN_OS_ERROR(errno);
+    }
+
+    /* Do not trust the file further than its own size */
+    header = (const struct shared_store_header_t *)base;
+    status = PJ_SUCCESS;
+    if (header->magic != SHARED_STORE_MAGIC || header->entries_count > MAX_ANNOUNCEMENTS ||
+        header->routes_count > MAX_ROUTES)
+    {
+        status = PJ_EINVAL;
+    }
+
+    for (i = 0; i < header->entries_count && status == PJ_SUCCESS; i++)
+    {
+        if (header->entries[i].offset + (pj_uint64_t)header->entries[i].samples_count * sizeof(pj_int16_t) >
+            (pj_uint64_t)st.st_size)
+        {
+            status = PJ_EINVAL;
+        }
+    }
+
+    if (status != PJ_SUCCESS)
+    {
+        munmap(base, st.st_size);
+        return status;
+    }
+
+    pool = pj_pool_create(factory, "shared_store", SHARED_STORE_POOL_SIZE, SHARED_STORE_POOL_INC, NULL);
+    if (!pool)
+    {
+        munmap(base, st.st_size);
+        return PJ_ENOMEM;
+    }
+
+    (*store) = PJ_POOL_ZALLOC_T(pool, struct shared_store_t);
+    (*store)->pool = pool;
+    (*store)->base = base;
+    (*store)->size = st.st_size;
+    (*store)->header = header;
+
+    status = pj_atomic_create(pool, 1, &(*store)->ref_cnt);
+    if (status != PJ_SUCCESS)
+    {
+        munmap(base, st.st_size);
+        pj_pool_release(pool);
+        return status;
+    }
+
+    return PJ_SUCCESS;
+}
+
+pj_int16_t *shared_store_samples(const struct shared_store_t *store, int entry)
+{
+    return (pj_int16_t *)((char *)store->base + store->header->entries[entry].offset);
+}
+
+void shared_store_add_ref(struct shared_store_t *store)
+{
+    pj_atomic_inc(store->ref_cnt);
+}
+
+void shared_store_dec_ref(void *arg)
+{
+    struct shared_store_t *store = (struct shared_store_t *)arg;
+
+    if (pj_atomic_dec_and_get(store->ref_cnt) > 0)
+    {
+        return;
+    }
+
+    PJ_LOG(4, (THIS_FILE, "Unmapping shared store generation %u", store->header->generation));
+
+    munmap(store->base, store->size);
+    pj_atomic_destroy(store->ref_cnt);
+    pj_pool_release(store->pool);
+}
+
+static pj_uint64_t store_align(pj_uint64_t offset)
+{
+    return (offset + SHARED_STORE_ALIGN - 1) / SHARED_STORE_ALIGN * SHARED_STORE_ALIGN;
+}
@@ -1,9 +1,11 @@
 #include "../headers/signals.h"
 
-pj_status_t signals_longtone_create(pj_pool_t *pool, pjmedia_port **port)
+pj_status_t signals_longtone_create(pj_pool_t *pool, const char *path, pjmedia_port **port)
 {
     pj_status_t status;
 
+    PJ_UNUSED_ARG(path);
+
     /* Create long tonegen */
     status = pjmedia_tonegen_create(pool, 
                                     SIGNALS_CLOCK_RATE, 
@@ -33,20 +35,22 @@ pj_status_t signals_longtone_create(pj_pool_t *pool, pjmedia_port **port)
     return status;
 }
 
-pj_status_t signals_wav_create(pj_pool_t *pool, pjmedia_port **port)
+pj_status_t signals_wav_create(pj_pool_t *pool, const char *path, pjmedia_port **port)
 {
     pj_status_t status;
 
-    /* Create wav player */
-    status = pjmedia_wav_player_port_create(pool, WAV_FILE, PTIME, 0, 0, port);
+    /* Create wav player, the announcement store decodes it up to the end */
+    status = pjmedia_wav_player_port_create(pool, path, PTIME, PJMEDIA_FILE_NO_LOOP, 0, port);
 
     return status;
 }
 
-pj_status_t signals_rbt_create(pj_pool_t *pool, pjmedia_port **port)
+pj_status_t signals_rbt_create(pj_pool_t *pool, const char *path, pjmedia_port **port)
 {
     pj_status_t status;
 
+    PJ_UNUSED_ARG(path);
+
     /* Create rbt tonegen */
     status = pjmedia_tonegen_create(pool, 
                                     SIGNALS_CLOCK_RATE, 
@@ -75,3 +79,38 @@ pj_status_t signals_rbt_create(pj_pool_t *pool, pjmedia_port **port)
 
     return status;
 }
+
+pj_status_t signals_beep_create(pj_pool_t *pool, const char *path, pjmedia_port **port)
+{
+    pj_status_t status;
+
+    PJ_UNUSED_ARG(path);
+
+    /* Create beep tonegen, silent once the beep has been played */
+    status = pjmedia_tonegen_create(pool, 
+                                    SIGNALS_CLOCK_RATE, 
+                                    CHANNEL_COUNT, 
+                                    SAMPLES_PER_FRAME, 
+                                    BITS_PER_SAMPLE, 
+                                    0, 
+                                    port);
+    if (status != PJ_SUCCESS)
+    {
+        return status;
+    }
+
+    /* Init beep */
+    {
+        pjmedia_tone_desc tones[1];
+
+        tones[0].freq1 = BEEP_FREQUENCY;
+        tones[0].freq2 = 0;
+        tones[0].on_msec = BEEP_LENGTH_MSEC;
+        tones[0].off_msec = 0;
+        tones[0].volume = PJMEDIA_TONEGEN_VOLUME;
+
+        status = pjmedia_tonegen_play(*port, 1, tones, 0);
+    }
+
+    return status;
+}
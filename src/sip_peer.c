@@ -0,0 +1,210 @@
+#include "../headers/sip_peer.h"
+
+#define THIS_FILE "sip_peer.c"
+
+static struct sip_peer_t *peer_find(struct sip_peer_pool_t *peers, const char *name);
+
+static void peer_remove(struct sip_peer_pool_t *peers, int i);
+
+static void on_transport_state(pjsip_transport *transport,
+                               pjsip_transport_state state,
+                               const pjsip_transport_state_info *info);
+
+static void on_sweep_timer_callback(pj_timer_heap_t *timer_heap, struct pj_timer_entry *entry);
+
+/* The transport manager has a single state callback, so the pool is global */
+static struct sip_peer_pool_t *peer_pool;
+
+/*
+ * Keep connections of trunk peers open between calls.
+ * pjsip closes a reliable transport soon after its last reference is gone,
+ * the pool holds one more reference per peer until the peer goes idle.
+ */
+pj_status_t sip_peer_pool_create(pj_pool_t *pool, pjsip_endpoint *endpt, struct sip_peer_pool_t **peers)
+{
+    pj_status_t status;
+    pjsip_tpmgr *tpmgr;
+    pj_time_val interval = {SIP_PEER_SWEEP_SEC, 0};
+
+    (*peers) = PJ_POOL_ZALLOC_T(pool, struct sip_peer_pool_t);
+    if (!(*peers))
+    {
+        return PJ_ENOMEM;
+    }
+
+    (*peers)->endpt = endpt;
+
+    status = pj_mutex_create_simple(pool, "sip_peers", &(*peers)->lock);
+    if (status != PJ_SUCCESS)
+    {
+        return status;
+    }
+
+    tpmgr = pjsip_endpt_get_tpmgr(endpt);
+    (*peers)->prev_state_cb = pjsip_tpmgr_get_state_cb(tpmgr);
+    pjsip_tpmgr_set_state_cb(tpmgr, &on_transport_state);
+
+    peer_pool = *peers;
+
+    pj_timer_entry_init(&(*peers)->sweep_timer, 0, *peers, &on_sweep_timer_callback);
+
+    return pjsip_endpt_schedule_timer(endpt, &(*peers)->sweep_timer, &interval);
+}
+
+/* Record traffic of a peer, pooling its connection on first contact */
+void sip_peer_touch(struct sip_peer_pool_t *peers, pjsip_transport *transport, pj_bool_t new_call)
+{
+    struct sip_peer_t *peer;
+    char name[sizeof(peer->name)];
+
+    pj_ansi_snprintf(name,
+                     sizeof(name),
+                     "%.*s:%d",
+                     (int)transport->remote_name.host.slen,
+                     transport->remote_name.host.ptr,
+                     transport->remote_name.port);
+
+    pj_mutex_lock(peers->lock);
+
+    peer = peer_find(peers, name);
+    if (peer && peer->transport != transport)
+    {
+        /* The peer has reconnected, pool the new connection instead */
+        pjsip_transport_dec_ref(peer->transport);
+        peer->transport = transport;
+        pjsip_transport_add_ref(transport);
+    }
+    else if (peer == NULL)
+    {
+        if (peers->peers_count == MAX_SIP_PEERS)
+        {
+            pj_mutex_unlock(peers->lock);
+            return;
+        }
+
+        peer = &peers->peers[peers->peers_count++];
+        pj_bzero(peer, sizeof(*peer));
+        pj_ansi_strncpy(peer->name, name, sizeof(peer->name) - 1);
+        peer->transport = transport;
+        pjsip_transport_add_ref(transport);
+
+        METRICS_INC(sip_tcp_connections);
+
+        PJ_LOG(4, (THIS_FILE, "Pooled connection %s to peer %s", transport->obj_name, peer->name));
+    }
+    else if (new_call)
+    {
+        METRICS_INC(sip_tcp_reused_calls);
+    }
+
+    if (new_call)
+    {
+        peer->calls++;
+    }
+    pj_gettickcount(&peer->last_active);
+
+    pj_mutex_unlock(peers->lock);
+}
+
+void sip_peer_pool_free(struct sip_peer_pool_t *peers)
+{
+    pjsip_endpt_cancel_timer(peers->endpt, &peers->sweep_timer);
+
+    pj_mutex_lock(peers->lock);
+    while (peers->peers_count > 0)
+    {
+        peer_remove(peers, peers->peers_count - 1);
+    }
+    pj_mutex_unlock(peers->lock);
+
+    pjsip_tpmgr_set_state_cb(pjsip_endpt_get_tpmgr(peers->endpt), peers->prev_state_cb);
+    peer_pool = NULL;
+
+    pj_mutex_destroy(peers->lock);
+}
+
+static struct sip_peer_t *peer_find(struct sip_peer_pool_t *peers, const char *name)
+{
+    int i;
+
+    for (i = 0; i < peers->peers_count; i++)
+    {
+        if (pj_ansi_strcmp(peers->peers[i].name, name) == 0)
+        {
+            return &peers->peers[i];
+        }
+    }
+
+    return NULL;
+}
+
+/* Drop the pool reference, the last peer takes the freed slot */
+static void peer_remove(struct sip_peer_pool_t *peers, int i)
+{
+    pjsip_transport *transport = peers->peers[i].transport;
+
+    PJ_LOG(4,
+           (THIS_FILE,
+            "Releasing connection to peer %s after %u calls",
+            peers->peers[i].name,
+            peers->peers[i].calls));
+
+    peers->peers[i] = peers->peers[peers->peers_count - 1];
+    peers->peers_count--;
+
+    pjsip_transport_dec_ref(transport);
+}
+
+static void on_transport_state(pjsip_transport *transport,
+                               pjsip_transport_state state,
+                               const pjsip_transport_state_info *info)
+{
+    struct sip_peer_pool_t *peers = peer_pool;
+    int i;
+
+    if (peers && state == PJSIP_TP_STATE_DISCONNECTED)
+    {
+        pj_mutex_lock(peers->lock);
+        for (i = 0; i < peers->peers_count; i++)
+        {
+            if (peers->peers[i].transport == transport)
+            {
+                peer_remove(peers, i);
+                break;
+            }
+        }
+        pj_mutex_unlock(peers->lock);
+    }
+
+    if (peers && peers->prev_state_cb)
+    {
+        peers->prev_state_cb(transport, state, info);
+    }
+}
+
+static void on_sweep_timer_callback(pj_timer_heap_t *timer_heap, struct pj_timer_entry *entry)
+{
+    struct sip_peer_pool_t *peers = (struct sip_peer_pool_t *)entry->user_data;
+    pj_time_val interval = {SIP_PEER_SWEEP_SEC, 0};
+    pj_time_val now, idle;
+    int i;
+
+    PJ_UNUSED_ARG(timer_heap);
+
+    pj_gettickcount(&now);
+
+    pj_mutex_lock(peers->lock);
+    for (i = peers->peers_count - 1; i >= 0; i--)
+    {
+        idle = now;
+        PJ_TIME_VAL_SUB(idle, peers->peers[i].last_active);
+
+        if (idle.sec >= SIP_PEER_IDLE_SEC)
+        {
+            peer_remove(peers, i);
+        }
+    }
+    pj_mutex_unlock(peers->lock);
+
+    pjsip_endpt_schedule_timer(peers->endpt, &peers->sweep_timer, &interval);
+}
@@ -0,0 +1,853 @@
+#include "../headers/soak.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define THIS_FILE "soak.c"
+
+static int soak_thread(void *arg);
+
+static void call_start(struct soak_t *soak, struct soak_call_t *call);
+
+static void call_done(struct soak_t *soak, struct soak_call_t *call, pj_bool_t success);
+
+static struct soak_call_t *call_find_by_id(struct soak_t *soak, const char *call_id);
+
+static void request_send(struct soak_t *soak, struct soak_call_t *call, const char *method, unsigned cseq);
+
+static void ack_send(struct soak_t *soak, const char *response, pj_bool_t success);
+
+static void response_send(struct soak_t *soak, const char *request);
+
+static void message_send(struct soak_t *soak, const char *msg, int len);
+
+static void message_handle(struct soak_t *soak, char *msg);
+
+static void sample_take(struct soak_t *soak, struct soak_sample_t *sample);
+
+static int samples_compare(const struct soak_t *soak, const struct soak_sample_t *sample);
+
+static int footprint_check(const struct soak_t *soak);
+
+static void ptime_check(struct soak_t *soak, const struct soak_call_t *call, const char *msg);
+
+static void flood_send(struct soak_t *soak, const pj_time_val *start);
+
+static void flood_drain(struct soak_t *soak);
+
+static const char *soak_sdp = "v=0\r\n"
+                              "o=soak 1 1 IN IP4 127.0.0.1\r\n"
+                              "s=soak\r\n"
+                              "c=IN IP4 127.0.0.1\r\n"
+                              "t=0 0\r\n"
+                              "m=audio 9 RTP/AVP 0\r\n"
+                              "a=rtpmap:0 PCMU/8000\r\n";
+
+/* Offered instead when the machine has SRTP, so a soak measures the keying of every call */
+static const char *soak_sdp_srtp = "v=0\r\n"
+                                   "o=soak 1 1 IN IP4 127.0.0.1\r\n"
+                                   "s=soak\r\n"
+                                   "c=IN IP4 127.0.0.1\r\n"
+                                   "t=0 0\r\n"
+                                   "m=audio 9 RTP/SAVP 0\r\n"
+                                   "a=rtpmap:0 PCMU/8000\r\n"
+                                   "a=crypto:1 AES_CM_128_HMAC_SHA1_80 "
+                                   "inline:H695D3JDlwMQ40vajZqCFrxDkQtAEgzB4Z1WXCEQ\r\n";
+
+/*
+ * Offers cycle through these limits, the answer must round each down to
+ * whole bridge ticks, never below one, and never above the route ptime,
+ * which is at least one tick itself.
+ */
+static const struct
+{
+    unsigned maxptime;
+    unsigned ptime;
+} soak_offers[] = {
+    {30, MEDIA_PTIME_STEP},
+    {10, MEDIA_PTIME_STEP},
+};
+
+/*
+ * Soak client: a raw UDP SIP client in the same process that runs
+ * synthetic calls against the machine and watches the memory
+ * it uses once the warmup is over.
+ */
+pj_status_t soak_start(pj_pool_t *pool,
+                       int sip_port,
+                       unsigned long calls,
+                       int concurrency,
+                       unsigned flood_rate,
+                       soak_done_cb on_done,
+                       struct soak_t **soak)
+{
+    pj_status_t status;
+    pj_str_t loopback = pj_str("127.0.0.1");
+    pj_str_t flood_addr = pj_str(SOAK_FLOOD_ADDR);
+    pj_sockaddr local;
+    int addr_len;
+
+    (*soak) = PJ_POOL_ZALLOC_T(pool, struct soak_t);
+    if (!(*soak))
+    {
+        return PJ_ENOMEM;
+    }
+
+    (*soak)->pool = pool;
+    (*soak)->machine_pool = mem_stats_find(pool);
+    (*soak)->total = calls;
+    (*soak)->concurrency = PJ_MIN(PJ_MAX(concurrency, 1), SOAK_MAX_CONCURRENCY);
+    (*soak)->on_done = on_done;
+    (*soak)->flood_rate = flood_rate;
+    (*soak)->flood_sock = PJ_INVALID_SOCKET;
+
+    status = pj_sockaddr_in_init(&(*soak)->server.ipv4, &loopback, (pj_uint16_t)sip_port);
+    if (status != PJ_SUCCESS)
+    {
+        return status;
+    }
+
+    status = pj_sock_socket(pj_AF_INET(), pj_SOCK_DGRAM(), 0, &(*soak)->sock);
+    if (status != PJ_SUCCESS)
+    {
+        return status;
+    }
+
+    pj_sockaddr_in_init(&local.ipv4, &loopback, 0);
+    status = pj_sock_bind((*soak)->sock, &local, sizeof(local.ipv4));
+    if (status != PJ_SUCCESS)
+    {
+        pj_sock_close((*soak)->sock);
+        return status;
+    }
+
+    addr_len = sizeof(local);
+    pj_sock_getsockname((*soak)->sock, &local, &addr_len);
+    pj_sockaddr_print(&local, (*soak)->local, sizeof((*soak)->local), 1);
+
+    if (flood_rate > 0)
+    {
+        status = pj_sock_socket(pj_AF_INET(), pj_SOCK_DGRAM(), 0, &(*soak)->flood_sock);
+        if (status == PJ_SUCCESS)
+        {
+            pj_sockaddr_in_init(&local.ipv4, &flood_addr, 0);
+            status = pj_sock_bind((*soak)->flood_sock, &local, sizeof(local.ipv4));
+        }
+
+        if (status != PJ_SUCCESS)
+        {
+            if ((*soak)->flood_sock != PJ_INVALID_SOCKET)
+            {
+                pj_sock_close((*soak)->flood_sock);
+            }
+            pj_sock_close((*soak)->sock);
+            return status;
+        }
+
+        PJ_LOG(3, (THIS_FILE, "Soak: flood of %u junk requests/s from %s", flood_rate, SOAK_FLOOD_ADDR));
+    }
+
+    PJ_LOG(3,
+           (THIS_FILE,
+            "Soak: %lu calls, %d concurrent, from %s to port %d",
+            calls,
+            (*soak)->concurrency,
+            (*soak)->local,
+            sip_port));
+
+    return pj_thread_create(pool, "soak", &soak_thread, *soak, 0, 0, &(*soak)->thread);
+}
+
+static int soak_thread(void *arg)
+{
+    struct soak_t *soak = (struct soak_t *)arg;
+    struct soak_sample_t sample;
+    pj_time_val timeout = {0, 10};
+    pj_time_val now, idle, start, elapsed;
+    pj_fd_set_t rset;
+    char msg[SOAK_MSG_SIZE];
+    pj_ssize_t len;
+    unsigned long warmup = soak->total * SOAK_WARMUP_PERCENT / 100;
+    unsigned long next_sample = SOAK_SAMPLE_CALLS;
+    pj_uint32_t elapsed_msec;
+    int result;
+    int i;
+
+    pj_gettickcount(&start);
+
+    while (soak->completed + soak->failed < soak->total)
+    {
+        /* Keep every slot busy while there are calls left */
+        for (i = 0; i < soak->concurrency && soak->started < soak->total; i++)
+        {
+            if (soak->calls[i].state == SOAK_CALL_IDLE)
+            {
+                call_start(soak, &soak->calls[i]);
+            }
+        }
+
+        PJ_FD_ZERO(&rset);
+        PJ_FD_SET(soak->sock, &rset);
+
+        if (pj_sock_select(soak->sock + 1, &rset, NULL, NULL, &timeout) > 0)
+        {
+            len = sizeof(msg) - 1;
+            if (pj_sock_recvfrom(soak->sock, msg, &len, 0, NULL, NULL) == PJ_SUCCESS && len > 0)
+            {
+                msg[len] = '\0';
+                message_handle(soak, msg);
+            }
+        }
+
+        if (soak->flood_rate > 0)
+        {
+            flood_send(soak, &start);
+            flood_drain(soak);
+        }
+
+        pj_gettickcount(&now);
+        for (i = 0; i < soak->concurrency; i++)
+        {
+            if (soak->calls[i].state == SOAK_CALL_IDLE)
+            {
+                continue;
+            }
+
+            idle = now;
+            PJ_TIME_VAL_SUB(idle, soak->calls[i].last_activity);
+            if (idle.sec >= SOAK_CALL_TIMEOUT_SEC)
+            {
+                PJ_LOG(3, (THIS_FILE, "Soak call %s timed out", soak->calls[i].call_id));
+                call_done(soak, &soak->calls[i], PJ_FALSE);
+            }
+        }
+
+        if (!soak->has_baseline && soak->completed >= warmup)
+        {
+            sample_take(soak, &soak->baseline);
+            soak->has_baseline = PJ_TRUE;
+        }
+
+        if (soak->completed >= next_sample)
+        {
+            sample_take(soak, &sample);
+            next_sample += SOAK_SAMPLE_CALLS;
+        }
+    }
+
+    /* Call rate of the whole run, before the settle time */
+    pj_gettickcount(&elapsed);
+    PJ_TIME_VAL_SUB(elapsed, start);
+    elapsed_msec = PJ_MAX(PJ_TIME_VAL_MSEC(elapsed), 1);
+
+    pj_thread_sleep(SOAK_SETTLE_MSEC);
+
+    sample_take(soak, &sample);
+    result = samples_compare(soak, &sample);
+    result |= footprint_check(soak);
+
+    if (soak->completed == 0)
+    {
+        result = 1;
+    }
+
+    if (soak->ptime_mismatched > 0)
+    {
+        PJ_LOG(2, (THIS_FILE, "Soak: %lu answers had the wrong ptime for their offer", soak->ptime_mismatched));
+        result = 1;
+    }
+
+    PJ_LOG(3,
+           (THIS_FILE,
+            "Soak %s: %lu calls completed, %lu failed in %u ms, %lu calls/s",
+            result == 0 ? "passed" : "FAILED",
+            soak->completed,
+            soak->failed,
+            elapsed_msec,
+            (unsigned long)((pj_uint64_t)soak->completed * 1000 / elapsed_msec)));
+
+    if (soak->flood_rate > 0)
+    {
+        PJ_LOG(3,
+               (THIS_FILE,
+                "Soak flood: %lu junk requests sent, %lu answered, %lu requests/s",
+                soak->flood_sent,
+                soak->flood_answered,
+                (unsigned long)((pj_uint64_t)soak->flood_sent * 1000 / elapsed_msec)));
+
+        pj_sock_close(soak->flood_sock);
+    }
+
+    pj_sock_close(soak->sock);
+
+    if (soak->on_done)
+    {
+        soak->on_done(result);
+    }
+
+    return 0;
+}
+
+static void call_start(struct soak_t *soak, struct soak_call_t *call)
+{
+    call->index = soak->started++;
+    call->state = SOAK_CALL_INVITING;
+    call->to_tag[0] = '\0';
+    /* Answered calls are every SOAK_ANSWER_EVERY, so they take turns with the offers */
+    call->offer = (unsigned)(call->index / SOAK_ANSWER_EVERY % PJ_ARRAY_SIZE(soak_offers));
+
+    pj_ansi_snprintf(call->call_id, sizeof(call->call_id), "soak-%lu-%08x@soak", call->index, pj_rand());
+    pj_ansi_snprintf(call->branch, sizeof(call->branch), "z9hG4bK-soak-%lu-i", call->index);
+    pj_gettickcount(&call->last_activity);
+
+    request_send(soak, call, "INVITE", 1);
+}
+
+static void call_done(struct soak_t *soak, struct soak_call_t *call, pj_bool_t success)
+{
+    call->state = SOAK_CALL_IDLE;
+
+    if (success)
+    {
+        soak->completed++;
+    }
+    else
+    {
+        soak->failed++;
+    }
+}
+
+static struct soak_call_t *call_find_by_id(struct soak_t *soak, const char *call_id)
+{
+    int i;
+
+    for (i = 0; i < soak->concurrency; i++)
+    {
+        if (soak->calls[i].state != SOAK_CALL_IDLE && pj_ansi_strcmp(soak->calls[i].call_id, call_id) == 0)
+        {
+            return &soak->calls[i];
+        }
+    }
+
+    return NULL;
+}
+
+/* Requests of the client side of the call, CANCEL shares the branch of the INVITE */
+static void request_send(struct soak_t *soak, struct soak_call_t *call, const char *method, unsigned cseq)
+{
+    char msg[SOAK_MSG_SIZE];
+    char branch[sizeof(call->branch) + 2];
+    char to_tag[sizeof(call->to_tag) + 5];
+    char sdp[512];
+    pj_bool_t invite = pj_ansi_strcmp(method, "INVITE") == 0;
+    int len;
+
+    if (pj_ansi_strcmp(method, "BYE") == 0)
+    {
+        pj_ansi_snprintf(branch, sizeof(branch), "%.*sb", (int)pj_ansi_strlen(call->branch) - 1, call->branch);
+    }
+    else
+    {
+        pj_ansi_strcpy(branch, call->branch);
+    }
+
+    to_tag[0] = '\0';
+    if (call->to_tag[0] && pj_ansi_strcmp(method, "CANCEL") != 0)
+    {
+        pj_ansi_snprintf(to_tag, sizeof(to_tag), ";tag=%s", call->to_tag);
+    }
+
+    sdp[0] = '\0';
+    if (invite)
+    {
+        pj_ansi_snprintf(sdp,
+                         sizeof(sdp),
+                         "%sa=maxptime:%u\r\n",
+                         settings_get()->srtp != 0 ? soak_sdp_srtp : soak_sdp,
+                         soak_offers[call->offer].maxptime);
+    }
+
+    len = pj_ansi_snprintf(msg,
+                           sizeof(msg),
+                           "%s sip:%s@127.0.0.1:%d SIP/2.0\r\n"
+                           "Via: SIP/2.0/UDP %s;rport;branch=%s\r\n"
+                           "Max-Forwards: 70\r\n"
+                           "From: <sip:soak@%s>;tag=soak%lu\r\n"
+                           "To: <sip:%s@127.0.0.1:%d>%s\r\n"
+                           "Call-ID: %s\r\n"
+                           "CSeq: %u %s\r\n"
+                           "Contact: <sip:soak@%s>\r\n"
+                           "%s"
+                           "Content-Length: %d\r\n"
+                           "\r\n"
+                           "%s",
+                           method,
+                           SOAK_USERNAME,
+                           pj_sockaddr_get_port(&soak->server),
+                           soak->local,
+                           branch,
+                           soak->local,
+                           call->index,
+                           SOAK_USERNAME,
+                           pj_sockaddr_get_port(&soak->server),
+                           to_tag,
+                           call->call_id,
+                           cseq,
+                           method,
+                           soak->local,
+                           invite ? "Content-Type: application/sdp\r\n" : "",
+                           (int)pj_ansi_strlen(sdp),
+                           sdp);
+
+    message_send(soak, msg, len);
+}
+
+/*
+ * ACK a final response to INVITE. A failure is acknowledged within
+ * the INVITE transaction, a 2xx in a transaction of its own.
+ */
+static void ack_send(struct soak_t *soak, const char *response, pj_bool_t success)
+{
+    char msg[SOAK_MSG_SIZE];
+    char via[256], from[256], to[256], call_id[128], cseq[64];
+    int len;
+
+    if (!soak_header_get(response, "Via", via, sizeof(via)) || !soak_header_get(response, "From", from, sizeof(from)) ||
+        !soak_header_get(response, "To", to, sizeof(to)) ||
+        !soak_header_get(response, "Call-ID", call_id, sizeof(call_id)) ||
+        !soak_header_get(response, "CSeq", cseq, sizeof(cseq)))
+    {
+        return;
+    }
+
+    if (success)
+    {
+        pj_ansi_snprintf(via, sizeof(via), "SIP/2.0/UDP %s;rport;branch=z9hG4bK-soak-%08x-a", soak->local, pj_rand());
+    }
+
+    len = pj_ansi_snprintf(msg,
+                           sizeof(msg),
+                           "ACK sip:%s@127.0.0.1:%d SIP/2.0\r\n"
+                           "Via: %s\r\n"
+                           "Max-Forwards: 70\r\n"
+                           "From: %s\r\n"
+                           "To: %s\r\n"
+                           "Call-ID: %s\r\n"
+                           "CSeq: %u ACK\r\n"
+                           "Content-Length: 0\r\n"
+                           "\r\n",
+                           SOAK_USERNAME,
+                           pj_sockaddr_get_port(&soak->server),
+                           via,
+                           from,
+                           to,
+                           call_id,
+                           (unsigned)strtoul(cseq, NULL, 10));
+
+    message_send(soak, msg, len);
+}
+
+/* Answer a request of the machine, i.e. its BYE, with 200 */
+static void response_send(struct soak_t *soak, const char *request)
+{
+    char msg[SOAK_MSG_SIZE];
+    char via[256], from[256], to[256], call_id[128], cseq[64];
+    int len;
+
+    if (!soak_header_get(request, "Via", via, sizeof(via)) || !soak_header_get(request, "From", from, sizeof(from)) ||
+        !soak_header_get(request, "To", to, sizeof(to)) ||
+        !soak_header_get(request, "Call-ID", call_id, sizeof(call_id)) ||
+        !soak_header_get(request, "CSeq", cseq, sizeof(cseq)))
+    {
+        return;
+    }
+
+    len = pj_ansi_snprintf(msg,
+                           sizeof(msg),
+                           "SIP/2.0 200 OK\r\n"
+                           "Via: %s\r\n"
+                           "From: %s\r\n"
+                           "To: %s\r\n"
+                           "Call-ID: %s\r\n"
+                           "CSeq: %s\r\n"
+                           "Content-Length: 0\r\n"
+                           "\r\n",
+                           via,
+                           from,
+                           to,
+                           call_id,
+                           cseq);
+
+    message_send(soak, msg, len);
+}
+
+static void message_send(struct soak_t *soak, const char *msg, int len)
+{
+    pj_ssize_t size;
+
+    if (len <= 0 || len >= SOAK_MSG_SIZE)
+    {
+        return;
+    }
+
+    size = len;
+    pj_sock_sendto(soak->sock, msg, &size, 0, &soak->server, sizeof(soak->server.ipv4));
+}
+
+static void message_handle(struct soak_t *soak, char *msg)
+{
+    struct soak_call_t *call;
+    char call_id[128], cseq[64];
+    const char *method;
+    int code;
+
+    if (!soak_header_get(msg, "Call-ID", call_id, sizeof(call_id)) || !soak_header_get(msg, "CSeq", cseq, sizeof(cseq)))
+    {
+        return;
+    }
+
+    method = strchr(cseq, ' ');
+    method = method ? method + 1 : "";
+
+    call = call_find_by_id(soak, call_id);
+
+    /* Requests of the machine */
+    if (pj_ansi_strncmp(msg, "SIP/2.0 ", 8) != 0)
+    {
+        if (pj_ansi_strncmp(msg, "BYE ", 4) == 0)
+        {
+            response_send(soak, msg);
+            if (call)
+            {
+                call_done(soak, call, PJ_TRUE);
+            }
+        }
+        return;
+    }
+
+    code = atoi(msg + 8);
+
+    if (pj_ansi_strcmp(method, "INVITE") == 0)
+    {
+        /* Retransmissions of final responses after the call is gone are ACKed again */
+        if (code >= 200)
+        {
+            ack_send(soak, msg, code < 300);
+        }
+
+        if (call == NULL)
+        {
+            return;
+        }
+        pj_gettickcount(&call->last_activity);
+
+        if (code == 180 && call->state == SOAK_CALL_INVITING)
+        {
+            soak_to_tag_get(msg, call->to_tag, sizeof(call->to_tag));
+
+            if (call->index % SOAK_ANSWER_EVERY != 0)
+            {
+                call->state = SOAK_CALL_CANCELLING;
+                request_send(soak, call, "CANCEL", 1);
+            }
+        }
+        else if (code >= 200 && code < 300 && call->state != SOAK_CALL_BYEING)
+        {
+            soak_to_tag_get(msg, call->to_tag, sizeof(call->to_tag));
+            ptime_check(soak, call, msg);
+
+            call->state = SOAK_CALL_BYEING;
+            request_send(soak, call, "BYE", 2);
+        }
+        else if (code >= 300)
+        {
+            call_done(soak, call, code == 487);
+        }
+    }
+    else if (pj_ansi_strcmp(method, "BYE") == 0 && call && code >= 200)
+    {
+        call_done(soak, call, code < 300);
+    }
+}
+
+/* Value of the first header with this name, without the line break */
+pj_bool_t soak_header_get(const char *msg, const char *name, char *value, int size)
+{
+    const char *line = msg;
+    const char *end;
+    int name_len = (int)pj_ansi_strlen(name);
+    int len;
+
+    while ((line = strstr(line, "\r\n")) != NULL)
+    {
+        line += 2;
+
+        if (pj_ansi_strncmp(line, name, name_len) == 0 && line[name_len] == ':')
+        {
+            line += name_len + 1;
+            while (*line == ' ')
+            {
+                line++;
+            }
+
+            end = strstr(line, "\r\n");
+            len = end ? (int)(end - line) : (int)pj_ansi_strlen(line);
+            if (len >= size)
+            {
+                return PJ_FALSE;
+            }
+
+            pj_memcpy(value, line, len);
+            value[len] = '\0';
+            return PJ_TRUE;
+        }
+    }
+
+    return PJ_FALSE;
+}
+
+void soak_to_tag_get(const char *msg, char *tag, int size)
+{
+    char to[256];
+    const char *start;
+    int len = 0;
+
+    tag[0] = '\0';
+    if (!soak_header_get(msg, "To", to, sizeof(to)) || (start = strstr(to, ";tag=")) == NULL)
+    {
+        return;
+    }
+
+    start += 5;
+    while (start[len] && start[len] != ';' && start[len] != '>' && len < size - 1)
+    {
+        len++;
+    }
+
+    pj_memcpy(tag, start, len);
+    tag[len] = '\0';
+}
+
+static void sample_take(struct soak_t *soak, struct soak_sample_t *sample)
+{
+    struct metrics_t *metrics = metrics_get();
+    int i;
+
+    mem_stats_update();
+
+    sample->calls = soak->completed;
+    sample->rss_kb = metrics->rss_kb;
+    sample->cp_used_size = metrics->cp_used_size;
+    for (i = 0; i < MAX_TRACKED_POOLS; i++)
+    {
+        sample->pool_used[i] = metrics->pool_used[i];
+    }
+
+    PJ_LOG(3,
+           (THIS_FILE,
+            "Soak sample after %lu calls: rss=%lu kB caching pool=%lu bytes",
+            sample->calls,
+            (unsigned long)sample->rss_kb,
+            (unsigned long)sample->cp_used_size));
+}
+
+/* Steady state means no more than SOAK_GROWTH_PERCENT above the warmup baseline */
+static int samples_compare(const struct soak_t *soak, const struct soak_sample_t *sample)
+{
+    const struct soak_sample_t *baseline = &soak->baseline;
+    int result = 0;
+    int i;
+
+    if (!soak->has_baseline)
+    {
+        return 0;
+    }
+
+    if (sample->rss_kb > baseline->rss_kb * (100 + SOAK_GROWTH_PERCENT) / 100 + SOAK_RSS_SLACK_KB)
+    {
+        PJ_LOG(2,
+               (THIS_FILE,
+                "Soak: resident memory grew from %lu to %lu kB",
+                (unsigned long)baseline->rss_kb,
+                (unsigned long)sample->rss_kb));
+        result = 1;
+    }
+
+    if (sample->cp_used_size > baseline->cp_used_size * (100 + SOAK_GROWTH_PERCENT) / 100)
+    {
+        PJ_LOG(2,
+               (THIS_FILE,
+                "Soak: caching pool grew from %lu to %lu bytes",
+                (unsigned long)baseline->cp_used_size,
+                (unsigned long)sample->cp_used_size));
+        result = 1;
+    }
+
+    /* Anything a call takes from the machine pool stays there until the machine is gone */
+    if (soak->machine_pool >= 0 && sample->pool_used[soak->machine_pool] > baseline->pool_used[soak->machine_pool])
+    {
+        PJ_LOG(2,
+               (THIS_FILE,
+                "Soak: machine pool grew from %lu to %lu bytes",
+                (unsigned long)baseline->pool_used[soak->machine_pool],
+                (unsigned long)sample->pool_used[soak->machine_pool]));
+        result = 1;
+    }
+
+    for (i = 0; i < MAX_TRACKED_POOLS; i++)
+    {
+        if (sample->pool_used[i] > baseline->pool_used[i] * (100 + SOAK_GROWTH_PERCENT) / 100)
+        {
+            PJ_LOG(2,
+                   (THIS_FILE,
+                    "Soak: pool [%d] grew from %lu to %lu bytes",
+                    i,
+                    (unsigned long)baseline->pool_used[i],
+                    (unsigned long)sample->pool_used[i]));
+            result = 1;
+        }
+    }
+
+    return result;
+}
+
+/* Catch up with the flood rate since the start, the loop wakes up at least every 10 ms */
+static void flood_send(struct soak_t *soak, const pj_time_val *start)
+{
+    char msg[SOAK_MSG_SIZE];
+    pj_time_val elapsed;
+    pj_uint64_t due;
+    pj_bool_t options;
+    pj_ssize_t size;
+    int len;
+
+    pj_gettickcount(&elapsed);
+    PJ_TIME_VAL_SUB(elapsed, *start);
+    due = (pj_uint64_t)PJ_TIME_VAL_MSEC(elapsed) * soak->flood_rate / 1000;
+
+    while (soak->flood_sent < due)
+    {
+        options = soak->flood_sent % SOAK_FLOOD_OPTIONS_EVERY == 0;
+
+        len = pj_ansi_snprintf(msg,
+                               sizeof(msg),
+                               "%s sip:scan%lu@127.0.0.1:%d SIP/2.0\r\n"
+                               "Via: SIP/2.0/UDP %s;rport;branch=z9hG4bK-flood-%lu\r\n"
+                               "Max-Forwards: 70\r\n"
+                               "From: <sip:scanner@%s>;tag=flood%lu\r\n"
+                               "To: <sip:scan%lu@127.0.0.1:%d>\r\n"
+                               "Call-ID: flood-%lu@soak\r\n"
+                               "CSeq: 1 %s\r\n"
+                               "Content-Length: 0\r\n"
+                               "\r\n",
+                               options ? "OPTIONS" : "INVITE",
+                               soak->flood_sent,
+                               pj_sockaddr_get_port(&soak->server),
+                               SOAK_FLOOD_ADDR,
+                               soak->flood_sent,
+                               SOAK_FLOOD_ADDR,
+                               soak->flood_sent,
+                               soak->flood_sent,
+                               pj_sockaddr_get_port(&soak->server),
+                               soak->flood_sent,
+                               options ? "OPTIONS" : "INVITE");
+
+        size = len;
+        pj_sock_sendto(soak->flood_sock, msg, &size, 0, &soak->server, sizeof(soak->server.ipv4));
+        soak->flood_sent++;
+    }
+}
+
+/* Count the rejects that made it through the limiter */
+static void flood_drain(struct soak_t *soak)
+{
+    pj_time_val timeout = {0, 0};
+    pj_fd_set_t rset;
+    char msg[SOAK_MSG_SIZE];
+    pj_ssize_t len;
+
+    for (;;)
+    {
+        PJ_FD_ZERO(&rset);
+        PJ_FD_SET(soak->flood_sock, &rset);
+
+        if (pj_sock_select(soak->flood_sock + 1, &rset, NULL, NULL, &timeout) <= 0)
+        {
+            return;
+        }
+
+        len = sizeof(msg);
+        if (pj_sock_recvfrom(soak->flood_sock, msg, &len, 0, NULL, NULL) != PJ_SUCCESS)
+        {
+            return;
+        }
+
+        soak->flood_answered++;
+    }
+}
+
+/*
+ * Peak resident memory and CPU time per completed call. The client runs
+ * in the same process, so its share is included, which only makes the
+ * targets of the embedded profile stricter.
+ */
+static int footprint_check(const struct soak_t *soak)
+{
+    struct metrics_t *metrics = metrics_get();
+    unsigned long cpu_usec_per_call;
+    int result = 0;
+
+    metrics_cpu_update();
+
+    cpu_usec_per_call = (unsigned long)((metrics->cpu_user_msec + metrics->cpu_system_msec) * 1000 /
+                                        PJ_MAX(soak->completed, 1));
+
+    PJ_LOG(3,
+           (THIS_FILE,
+            "Soak footprint: peak rss=%lu kB, cpu=%lu us per call",
+            (unsigned long)metrics->rss_peak_kb,
+            cpu_usec_per_call));
+
+#if EMBEDDED_PROFILE
+    if (metrics->rss_peak_kb > EMBEDDED_RSS_TARGET_KB)
+    {
+        PJ_LOG(2,
+               (THIS_FILE,
+                "Soak: peak resident memory %lu kB is above the target of %d kB",
+                (unsigned long)metrics->rss_peak_kb,
+                EMBEDDED_RSS_TARGET_KB));
+        result = 1;
+    }
+
+    if (cpu_usec_per_call > EMBEDDED_CPU_TARGET_USEC_PER_CALL)
+    {
+        PJ_LOG(2,
+               (THIS_FILE,
+                "Soak: %lu us of CPU per call is above the target of %d us",
+                cpu_usec_per_call,
+                EMBEDDED_CPU_TARGET_USEC_PER_CALL));
+        result = 1;
+    }
+#endif
+
+    return result;
+}
+
+/* The ptime of the answer against the one expected for the maxptime of the offer */
+static void ptime_check(struct soak_t *soak, const struct soak_call_t *call, const char *msg)
+{
+    const char *attr = strstr(msg, "a=ptime:");
+    unsigned ptime = attr ? (unsigned)strtoul(attr + 8, NULL, 10) : 0;
+
+    if (ptime != soak_offers[call->offer].ptime)
+    {
+        PJ_LOG(2,
+               (THIS_FILE,
+                "Soak call %s: ptime %u answered to maxptime %u, expected %u",
+                call->call_id,
+                ptime,
+                soak_offers[call->offer].maxptime,
+                soak_offers[call->offer].ptime));
+        soak->ptime_mismatched++;
+    }
+}
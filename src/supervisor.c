@@ -0,0 +1,287 @@
+#include "../headers/supervisor.h"
+#include "../headers/shared_store.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define THIS_FILE "supervisor.c"
+
+static pid_t worker_spawn(int i);
+
+static void worker_exited(pid_t pid, int wstatus);
+
+static void workers_signal(int signo);
+
+static void metrics_report(void);
+
+static void on_supervisor_signal(int signo);
+
+struct supervisor_t
+{
+    pj_caching_pool cp;
+
+    struct supervisor_worker_t workers[SUPERVISOR_MAX_WORKERS];
+    int workers_count;
+
+    /* One metrics slot per worker in anonymous shared memory */
+    struct metrics_t *metrics;
+};
+
+static struct supervisor_t supervisor;
+
+static volatile sig_atomic_t reload_requested = 0;
+static volatile sig_atomic_t terminate_requested = 0;
+
+pj_status_t supervisor_run(const struct announcement_spec_t *specs,
+                           int specs_count,
+                           const struct route_spec_t *routes,
+                           int routes_count,
+                           int workers_count,
+                           int *worker)
+{
+    pj_status_t status;
+    pj_time_val now, next_report;
+    unsigned generation = 1;
+    pid_t pid;
+    int wstatus;
+    int i;
+
+    PJ_ASSERT_RETURN(workers_count > 0 && workers_count <= SUPERVISOR_MAX_WORKERS, PJ_EINVAL);
+
+    *worker = -1;
+
+    status = pj_init();
+    PJ_ASSERT_RETURN(status == PJ_SUCCESS, status);
+
+    pj_caching_pool_init(&supervisor.cp, &pj_pool_factory_default_policy, 0);
+
+    status = shared_store_build(
+        &supervisor.cp.factory, SUPERVISOR_STORE_PATH, generation, specs, specs_count, routes, routes_count);
+    if (status != PJ_SUCCESS)
+    {
+        app_perror(THIS_FILE, "Unable to build shared store", status);
+        return status;
+    }
+
+    supervisor.metrics = (struct metrics_t *)mmap(NULL,
+                                                  workers_count * sizeof(struct metrics_t),
+                                                  PROT_READ | PROT_WRITE,
+                                                  MAP_SHARED | MAP_ANONYMOUS,
+                                                  -1,
+                                                  0);
+    if (supervisor.metrics == MAP_FAILED)
+    {
+        status = PJ_RETURN_OS_ERROR(errno);
+        app_perror(THIS_FILE, "Unable to map shared metrics", status);
+        return status;
+    }
+    supervisor.workers_count = workers_count;
+
+    signal(SIGHUP, &on_supervisor_signal);
+    signal(SIGTERM, &on_supervisor_signal);
+    signal(SIGINT, &on_supervisor_signal);
+
+    for (i = 0; i < workers_count; i++)
+    {
+        pid = worker_spawn(i);
+        if (pid == 0)
+        {
+            *worker = i;
+            return PJ_SUCCESS;
+        }
+    }
+
+    PJ_LOG(3, (THIS_FILE, "Supervising %d workers", workers_count));
+
+    pj_gettickcount(&next_report);
+    next_report.sec += SUPERVISOR_METRICS_INTERVAL_SEC;
+
+    while (!terminate_requested)
+    {
+        while ((pid = waitpid(-1, &wstatus, WNOHANG)) > 0)
+        {
+            worker_exited(pid, wstatus);
+        }
+
+        pj_gettickcount(&now);
+
+        /* Restart crashed workers once their delay has passed */
+        for (i = 0; i < workers_count; i++)
+        {
+            if (supervisor.workers[i].pid != 0 || PJ_TIME_VAL_LT(now, supervisor.workers[i].restart_time))
+            {
+                continue;
+            }
+
+            supervisor.workers[i].restarts++;
+            pid = worker_spawn(i);
+            if (pid == 0)
+            {
+                *worker = i;
+                return PJ_SUCCESS;
+            }
+        }
+
+        /* Rebuild the store, workers remap it on their own SIGHUP */
+        if (reload_requested)
+        {
+            reload_requested = 0;
+
+            status = shared_store_build(&supervisor.cp.factory,
+                                        SUPERVISOR_STORE_PATH,
+                                        ++generation,
+                                        specs,
+                                        specs_count,
+                                        routes,
+                                        routes_count);
+            if (status == PJ_SUCCESS)
+            {
+                workers_signal(SIGHUP);
+            }
+            else
+            {
+                app_perror(THIS_FILE, "Unable to rebuild shared store, workers keep the old one", status);
+            }
+        }
+
+        if (PJ_TIME_VAL_GTE(now, next_report))
+        {
+            metrics_report();
+            next_report = now;
+            next_report.sec += SUPERVISOR_METRICS_INTERVAL_SEC;
+        }
+
+        pj_thread_sleep(SUPERVISOR_POLL_MSEC);
+    }
+
+    PJ_LOG(3, (THIS_FILE, "Terminating workers"));
+
+    workers_signal(SIGTERM);
+    while ((pid = waitpid(-1, &wstatus, 0)) > 0)
+    {
+        worker_exited(pid, wstatus);
+    }
+
+    metrics_report();
+
+    munmap(supervisor.metrics, workers_count * sizeof(struct metrics_t));
+    pj_caching_pool_destroy(&supervisor.cp);
+
+    return PJ_SUCCESS;
+}
+
+/* Fork one worker, returns 0 in the worker itself */
+static pid_t worker_spawn(int i)
+{
+    pid_t pid;
+
+    pid = fork();
+    if (pid < 0)
+    {
+        app_perror(THIS_FILE, "Unable to fork worker", PJ_RETURN_OS_ERROR(errno));
+        pj_gettickcount(&supervisor.workers[i].restart_time);
+        supervisor.workers[i].restart_time.msec += SUPERVISOR_RESTART_DELAY_MSEC;
+        pj_time_val_normalize(&supervisor.workers[i].restart_time);
+        return pid;
+    }
+
+    if (pid == 0)
+    {
+        /* The worker installs its own handlers and dies with the supervisor */
+        signal(SIGHUP, SIG_DFL);
+        signal(SIGTERM, SIG_DFL);
+        signal(SIGINT, SIG_DFL);
+        prctl(PR_SET_PDEATHSIG, SIGTERM);
+
+        metrics_attach(&supervisor.metrics[i]);
+
+        return 0;
+    }
+
+    supervisor.workers[i].pid = pid;
+
+    PJ_LOG(3, (THIS_FILE, "Worker %d started with pid %d", i, (int)pid));
+
+    return pid;
+}
+
+static void worker_exited(pid_t pid, int wstatus)
+{
+    int i;
+
+    for (i = 0; i < supervisor.workers_count; i++)
+    {
+        if (supervisor.workers[i].pid == pid)
+        {
+            break;
+        }
+    }
+
+    if (i == supervisor.workers_count)
+    {
+        return;
+    }
+
+    if (WIFSIGNALED(wstatus))
+    {
+        PJ_LOG(2, (THIS_FILE, "Worker %d (pid %d) killed by signal %d", i, (int)pid, WTERMSIG(wstatus)));
+    }
+    else
+    {
+        PJ_LOG(2, (THIS_FILE, "Worker %d (pid %d) exited with status %d", i, (int)pid, WEXITSTATUS(wstatus)));
+    }
+
+    supervisor.workers[i].pid = 0;
+
+    /* Delay the restart so a worker failing on start does not spin */
+    pj_gettickcount(&supervisor.workers[i].restart_time);
+    supervisor.workers[i].restart_time.msec += SUPERVISOR_RESTART_DELAY_MSEC;
+    pj_time_val_normalize(&supervisor.workers[i].restart_time);
+}
+
+static void workers_signal(int signo)
+{
+    int i;
+
+    for (i = 0; i < supervisor.workers_count; i++)
+    {
+        if (supervisor.workers[i].pid != 0)
+        {
+            kill(supervisor.workers[i].pid, signo);
+        }
+    }
+}
+
+static void metrics_report(void)
+{
+    struct metrics_t total;
+    unsigned restarts = 0;
+    int i;
+
+    pj_bzero(&total, sizeof(total));
+
+    for (i = 0; i < supervisor.workers_count; i++)
+    {
+        metrics_sum(&total, &supervisor.metrics[i]);
+        restarts += supervisor.workers[i].restarts;
+    }
+
+    metrics_dump(&total, "All workers");
+    PJ_LOG(3, (THIS_FILE, "Worker restarts: %u", restarts));
+}
+
+static void on_supervisor_signal(int signo)
+{
+    if (signo == SIGHUP)
+    {
+        reload_requested = 1;
+    }
+    else
+    {
+        terminate_requested = 1;
+    }
+}
@@ -0,0 +1,186 @@
+#include "../headers/trace.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#define THIS_FILE "trace.c"
+
+static struct trace_buffer_t *buffer_register(void);
+
+struct trace_t
+{
+    pj_pool_t *pool;
+    pj_mutex_t *lock;
+
+    struct trace_buffer_t *buffers[TRACE_MAX_THREADS];
+    int buffers_count;
+
+    /* Reference point of the timestamp counter */
+    pj_uint64_t tsc_start;
+    pj_timestamp time_start;
+};
+
+static struct trace_t trace;
+
+static __thread struct trace_buffer_t *thread_buffer;
+
+pj_status_t trace_init(pj_pool_factory *factory)
+{
+    trace.pool = pj_pool_create(factory, "trace", 4096, 4096, NULL);
+    if (!trace.pool)
+    {
+        return PJ_ENOMEM;
+    }
+
+    trace.tsc_start = trace_tsc();
+    pj_get_timestamp(&trace.time_start);
+
+    return pj_mutex_create_simple(trace.pool, "trace", &trace.lock);
+}
+
+/* Append one zone to the ring of the calling thread, the oldest zones are overwritten */
+void trace_record(const char *name, pj_uint64_t start, pj_uint64_t end)
+{
+    struct trace_buffer_t *buffer = thread_buffer;
+    struct trace_event_t *event;
+
+    if (buffer == NULL)
+    {
+        buffer = thread_buffer = buffer_register();
+        if (buffer == NULL)
+        {
+            return;
+        }
+    }
+
+    event = &buffer->events[buffer->head & (TRACE_THREAD_EVENTS - 1)];
+    event->name = name;
+    event->start = start;
+    event->end = end;
+
+    __atomic_store_n(&buffer->head, buffer->head + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Write the zones of the last seconds in Chrome trace event format.
+ * The newest zones of a busy thread may be overwritten while
+ * they are copied, those are skipped by comparing the head again.
+ */
+pj_status_t trace_dump(const char *path, unsigned seconds)
+{
+    struct trace_buffer_t *buffer;
+    struct trace_event_t event;
+    pj_uint64_t tsc_now, tsc_from;
+    pj_timestamp time_now;
+    double ticks_per_usec;
+    pj_uint32_t head, first, i;
+    unsigned long written = 0;
+    int buffers_count;
+    int pid = getpid();
+    int first_event = 1;
+    FILE *file;
+    int b;
+
+    if (!TRACE_ENABLED)
+    {
+        PJ_LOG(3, (THIS_FILE, "Tracing is compiled out, rebuild with TRACE=1"));
+        return PJ_EINVALIDOP;
+    }
+
+    tsc_now = trace_tsc();
+    pj_get_timestamp(&time_now);
+
+    ticks_per_usec = (double)(tsc_now - trace.tsc_start) / pj_elapsed_usec(&trace.time_start, &time_now);
+    if (ticks_per_usec <= 0)
+    {
+        return PJ_EINVALIDOP;
+    }
+    tsc_from = tsc_now - (pj_uint64_t)(ticks_per_usec * seconds * 1000000);
+
+    file = fopen(path, "w");
+    if (file == NULL)
+    {
+        return PJ_RETURN_OS_ERROR(errno);
+    }
+
+    fprintf(file, "{\"traceEvents\":[");
+
+    buffers_count = __atomic_load_n(&trace.buffers_count, __ATOMIC_ACQUIRE);
+    for (b = 0; b < buffers_count; b++)
+    {
+        buffer = trace.buffers[b];
+
+        fprintf(file,
+                "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+                first_event ? "" : ",",
+                pid,
+                buffer->tid,
+                buffer->thread_name);
+        first_event = 0;
+
+        head = __atomic_load_n(&buffer->head, __ATOMIC_ACQUIRE);
+        first = head > TRACE_THREAD_EVENTS ? head - TRACE_THREAD_EVENTS : 0;
+
+        for (i = first; i != head; i++)
+        {
+            event = buffer->events[i & (TRACE_THREAD_EVENTS - 1)];
+
+            /* Overwritten by the thread while being copied */
+            if (__atomic_load_n(&buffer->head, __ATOMIC_ACQUIRE) - i >= TRACE_THREAD_EVENTS)
+            {
+                continue;
+            }
+
+            if (event.start < tsc_from || event.start < trace.tsc_start)
+            {
+                continue;
+            }
+
+            fprintf(file,
+                    ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+                    event.name,
+                    pid,
+                    buffer->tid,
+                    (event.start - trace.tsc_start) / ticks_per_usec,
+                    (event.end - event.start) / ticks_per_usec);
+            written++;
+        }
+    }
+
+    fprintf(file, "\n]}\n");
+    fclose(file);
+
+    PJ_LOG(3, (THIS_FILE, "Dumped %lu trace zones of the last %u seconds to %s", written, seconds, path));
+
+    return PJ_SUCCESS;
+}
+
+static struct trace_buffer_t *buffer_register(void)
+{
+    struct trace_buffer_t *buffer;
+
+    if (trace.lock == NULL)
+    {
+        return NULL;
+    }
+
+    pj_mutex_lock(trace.lock);
+
+    if (trace.buffers_count == TRACE_MAX_THREADS)
+    {
+        pj_mutex_unlock(trace.lock);
+        return NULL;
+    }
+
+    buffer = PJ_POOL_ZALLOC_T(trace.pool, struct trace_buffer_t);
+    buffer->tid = trace.buffers_count;
+    pj_ansi_strncpy(buffer->thread_name, pj_thread_get_name(pj_thread_this()), sizeof(buffer->thread_name) - 1);
+
+    trace.buffers[trace.buffers_count] = buffer;
+    __atomic_store_n(&trace.buffers_count, trace.buffers_count + 1, __ATOMIC_RELEASE);
+
+    pj_mutex_unlock(trace.lock);
+
+    return buffer;
+}
@@ -0,0 +1,182 @@
+#include "../headers/cdr.h"
+
+#include <stdio.h>
+#include <string.h>
+
+/*
+ * Export binary CDR files written by the answering machine.
+ *
+ *   cdr_export [-j] file...
+ *
+ * Prints CSV by default, one JSON object per line with -j.
+ */
+
+static void print_string(const char *str, pj_bool_t json);
+
+static void print_csv_header(void);
+
+static void print_csv(const struct cdr_record_t *record);
+
+static void print_json(const struct cdr_record_t *record);
+
+static int export_file(const char *path, pj_bool_t json);
+
+int main(int argc, char *argv[])
+{
+    pj_bool_t json = PJ_FALSE;
+    int first = 1;
+    int rc = 0;
+    int i;
+
+    if (argc > 1 && strcmp(argv[1], "-j") == 0)
+    {
+        json = PJ_TRUE;
+        first = 2;
+    }
+
+    if (first >= argc)
+    {
+        fprintf(stderr, "Usage: %s [-j] file...\n", argv[0]);
+        return 1;
+    }
+
+    if (!json)
+    {
+        print_csv_header();
+    }
+
+    for (i = first; i < argc; i++)
+    {
+        rc |= export_file(argv[i], json);
+    }
+
+    return rc;
+}
+
+static int export_file(const char *path, pj_bool_t json)
+{
+    struct cdr_record_t record;
+    FILE *file;
+    unsigned long skipped = 0;
+
+    file = fopen(path, "rb");
+    if (file == NULL)
+    {
+        perror(path);
+        return 1;
+    }
+
+    while (fread(&record, sizeof(record), 1, file) == 1)
+    {
+        /* Records of another layout can not be read reliably */
+        if (record.magic != CDR_MAGIC || record.size != sizeof(record))
+        {
+            skipped++;
+            continue;
+        }
+
+        /* Strings are always terminated on output */
+        record.call_id[sizeof(record.call_id) - 1] = '\0';
+        record.username[sizeof(record.username) - 1] = '\0';
+        record.codec[sizeof(record.codec) - 1] = '\0';
+
+        if (json)
+        {
+            print_json(&record);
+        }
+        else
+        {
+            print_csv(&record);
+        }
+    }
+
+    fclose(file);
+
+    if (skipped > 0)
+    {
+        fprintf(stderr, "%s: skipped %lu invalid records\n", path, skipped);
+    }
+
+    return 0;
+}
+
+/* Call-IDs may contain quotes and backslashes */
+static void print_string(const char *str, pj_bool_t json)
+{
+    putchar('"');
+    for (; *str; str++)
+    {
+        if (*str == '"')
+        {
+            fputs(json ? "\\\"" : "\"\"", stdout);
+        }
+        else if (*str == '\\' && json)
+        {
+            fputs("\\\\", stdout);
+        }
+        else
+        {
+            putchar(*str);
+        }
+    }
+    putchar('"');
+}
+
+static void print_csv_header(void)
+{
+    printf("call_id,username,invite_msec,ringing_msec,answer_msec,bye_msec,cause,codec,rtp_port,"
+           "rx_packets,tx_packets,rx_lost,rx_jitter_usec,rtt_usec,rx_discarded,late_frames,rx_bytes,tx_bytes\n");
+}
+
+static void print_csv(const struct cdr_record_t *record)
+{
+    print_string(record->call_id, PJ_FALSE);
+    putchar(',');
+    print_string(record->username, PJ_FALSE);
+    printf(",%llu,%llu,%llu,%llu,%d,%s,%u,%u,%u,%u,%u,%u,%u,%u,%llu,%llu\n",
+           (unsigned long long)record->invite_msec,
+           (unsigned long long)record->ringing_msec,
+           (unsigned long long)record->answer_msec,
+           (unsigned long long)record->bye_msec,
+           record->cause,
+           record->codec,
+           record->rtp_port,
+           record->rx_packets,
+           record->tx_packets,
+           record->rx_lost,
+           record->rx_jitter_usec,
+           record->rtt_usec,
+           record->rx_discarded,
+           record->late_frames,
+           (unsigned long long)record->rx_bytes,
+           (unsigned long long)record->tx_bytes);
+}
+
+static void print_json(const struct cdr_record_t *record)
+{
+    fputs("{\"call_id\":", stdout);
+    print_string(record->call_id, PJ_TRUE);
+    fputs(",\"username\":", stdout);
+    print_string(record->username, PJ_TRUE);
+    printf(",\"invite_msec\":%llu,\"ringing_msec\":%llu,"
+           "\"answer_msec\":%llu,\"bye_msec\":%llu,\"cause\":%d,\"codec\":\"%s\",\"rtp_port\":%u,"
+           "\"rx_packets\":%u,\"tx_packets\":%u,\"rx_lost\":%u,\"rx_jitter_usec\":%u,"
+           "\"rtt_usec\":%u,\"rx_discarded\":%u,\"late_frames\":%u,"
+           "\"rx_bytes\":%llu,\"tx_bytes\":%llu}\n",
+           (unsigned long long)record->invite_msec,
+           (unsigned long long)record->ringing_msec,
+           (unsigned long long)record->answer_msec,
+           (unsigned long long)record->bye_msec,
+           record->cause,
+           record->codec,
+           record->rtp_port,
+           record->rx_packets,
+           record->tx_packets,
+           record->rx_lost,
+           record->rx_jitter_usec,
+           record->rtt_usec,
+           record->rx_discarded,
+           record->late_frames,
+           (unsigned long long)record->rx_bytes,
+           (unsigned long long)record->tx_bytes);
+}
@@ -0,0 +1,43 @@
+#!/bin/sh
+#
+# Aggregate calls per second of 1..N answering machines behind the
+# dispatcher, all on loopback. Every backend gets its own SIP port
+# and RTP range, the dispatcher soak drives calls through them.
+#
+# Usage: tools/dispatcher_bench.sh [max_backends] [calls] [concurrency]
+
+BIN=${BIN:-bin/answering_machine}
+MAX_BACKENDS=${1:-4}
+CALLS=${2:-20000}
+CONCURRENCY=${3:-64}
+
+DISPATCHER_PORT=6222
+BACKEND_PORT=6300
+RTP_PORT=10000
+RTP_RANGE=200
+
+n=1
+while [ $n -le $MAX_BACKENDS ]; do
+    backends=""
+    pids=""
+
+    i=0
+    while [ $i -lt $n ]; do
+        port=$((BACKEND_PORT + i))
+        $BIN -p $port -r $((RTP_PORT + i * RTP_RANGE)) > /dev/null 2>&1 &
+        pids="$pids $!"
+        backends="${backends:+$backends,}127.0.0.1:$port"
+        i=$((i + 1))
+    done
+
+    sleep 1
+
+    rate=$($BIN -p $DISPATCHER_PORT -d $backends -s $CALLS -c $CONCURRENCY 2>&1 |
+           sed -n 's/.*Soak .* \([0-9]*\) calls\/s.*/\1/p')
+    echo "$n backends: ${rate:-?} calls/s"
+
+    kill $pids
+    wait $pids 2> /dev/null
+
+    n=$((n + 1))
+done